@@ -1,8 +1,7 @@
 #import <Foundation/NSObject.h>
 #import <Foundation/NSRange.h>
 
-typedef struct RangeList RangeList;
-typedef struct NSIndexSetCache NSIndexSetCache;
+typedef struct NSIndexSetRanges NSIndexSetRanges;
 
 @interface NSIndexSet : NSObject <NSCopying, NSMutableCopying, NSCoding>
 {
@@ -10,7 +9,7 @@ typedef struct NSIndexSetCache NSIndexSetCache;
     struct {
         unsigned int _isEmpty:1;
         unsigned int _hasSingleRange:1;
-        unsigned int _cacheValid:1;
+        unsigned int _reserved:1;
         unsigned int _arrayBinderController:29;
     } _indexSetFlags;
     
@@ -19,8 +18,7 @@ typedef struct NSIndexSetCache NSIndexSetCache;
             NSRange _range;
         } _singleRange;
         struct {
-            RangeList *_data;
-            NSIndexSetCache *_cache;
+            NSIndexSetRanges *_data;
         } _multipleRanges;
     } _internal;
 }
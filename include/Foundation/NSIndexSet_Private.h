@@ -0,0 +1,34 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSINDEXSET_PRIVATE_H_
+#define _NSINDEXSET_PRIVATE_H_
+
+#import <Foundation/NSIndexSet.h>
+
+@interface NSIndexSet (NSIndexSetPrivate)
+- (NSUInteger)rangeCount;
+@end
+
+@interface NSMutableIndexSet (NSIndexSetPrivate)
+// Removes every index that is not also in indexSet.
+- (void)_intersectIndexes:(NSIndexSet *)indexSet;
+@end
+
+#endif // _NSINDEXSET_PRIVATE_H_
@@ -0,0 +1,46 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSJSONSERIALIZATION_PRIVATE_H_
+#define _NSJSONSERIALIZATION_PRIVATE_H_
+
+#import <Foundation/NSJSONSerialization.h>
+
+typedef NS_ENUM(NSUInteger, _NSJSONReadingEvent) {
+    _NSJSONReadingEventStartObject,
+    _NSJSONReadingEventEndObject,
+    _NSJSONReadingEventStartArray,
+    _NSJSONReadingEventEndArray,
+    _NSJSONReadingEventKey,   // value is the key string
+    _NSJSONReadingEventValue, // value is a string, number or NSNull
+};
+
+typedef void (^_NSJSONReadingEventHandler)(_NSJSONReadingEvent event, id value, BOOL *stop);
+
+@interface NSJSONSerialization (NSJSONSerializationPrivate)
+
+// Reads every top level value in the stream (e.g. newline delimited JSON)
+// and reports it as a sequence of events instead of building containers, so
+// memory use does not depend on the size of the document. Returns NO if the
+// stream could not be parsed; stopping from the handler is not an error.
++ (BOOL)_enumerateJSONEventsInStream:(NSInputStream *)stream options:(NSJSONReadingOptions)opt usingBlock:(_NSJSONReadingEventHandler)block error:(NSError **)error;
+
+@end
+
+#endif // _NSJSONSERIALIZATION_PRIVATE_H_
@@ -0,0 +1,40 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSKEYVALUEOBSERVING_PRIVATE_H_
+#define _NSKEYVALUEOBSERVING_PRIVATE_H_
+
+#import <Foundation/NSKeyValueObserving.h>
+
+@interface NSObject (NSKeyValueObservingCoalescing)
+
+// Between these calls, change notifications posted on the current thread are
+// held back and merged per observance (one addObserver: registration), then
+// delivered in order of first change when the outermost scope ends. A run of
+// settings becomes one change from the first old value to the last new one;
+// appended insertions, ascending replacements and back-to-front removals
+// merge into a single change over the union of their indexes. A change that
+// cannot be merged first delivers everything held so far, in order. Prior
+// notifications are only sent for the first change of each merged run.
++ (void)_beginCoalescingKeyValueNotifications;
++ (void)_endCoalescingKeyValueNotifications;
+
+@end
+
+#endif // _NSKEYVALUEOBSERVING_PRIVATE_H_
@@ -22,7 +22,14 @@ typedef NSString *NSNotificationName NS_EXTENSIBLE_STRING_ENUM;
 
 @interface NSNotificationCenter : NSObject
 {
-    NSMutableArray *_observers;
+    id volatile _buckets;
+    id _wildcard;
+    void *_registrations; // CFMutableDictionaryRef
+    NSUInteger _sequence;
+    volatile int32_t _epoch;
+    volatile int32_t _readers[2];
+    void *_retiring; // CFMutableArrayRef
+    void *_retired[2]; // CFMutableArrayRef
     pthread_mutex_t _observersLock;
 }
 
@@ -1,6 +1,6 @@
 #import <Foundation/NSObject.h>
 
-@class NSNotification, NSNotificationCenter, NSArray, NSMutableArray;
+@class NSNotification, NSNotificationCenter, NSArray;
 
 typedef NS_ENUM(NSUInteger, NSPostingStyle) {
     NSPostWhenIdle = 1,
@@ -17,10 +17,8 @@ typedef NS_ENUM(NSUInteger, NSNotificationCoalescing) {
 @interface NSNotificationQueue : NSObject
 {
     NSNotificationCenter *_notificationCenter;
-    NSMutableArray *_asapQueue;
-    NSMutableArray *_asapObs;
-    NSMutableArray *_idleQueue;
-    NSMutableArray *_idleObs;
+    id _asapQueue;
+    id _idleQueue;
 }
 
 + (id)defaultQueue;
@@ -78,7 +78,7 @@ FOUNDATION_EXPORT NSString * const NSInvocationOperationCancelledException;
 
 @end
 
-@class NSMutableArray, _NSOperationQueueInternal;
+@class NSMutableArray, NSMutableSet, _NSOperationQueueInternal;
 
 @interface NSOperationQueue : NSObject
 {
@@ -88,8 +88,8 @@ FOUNDATION_EXPORT NSString * const NSInvocationOperationCancelledException;
     pthread_mutex_t _queuelock;
     pthread_mutexattr_t _mta;
 
-    NSMutableArray *_pendingOperations;
-    NSMutableArray *_operations;
+    NSMutableSet *_pendingOperations;
+    NSMutableSet *_operations;
     NSMutableArray *_operationsToStart;
 
     _NSOperationQueueInternal *_internal;
@@ -0,0 +1,39 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSOPERATION_PRIVATE_H_
+#define _NSOPERATION_PRIVATE_H_
+
+#import <Foundation/NSOperation.h>
+
+@interface NSOperationQueue (NSOperationQueuePrivate)
+
+// Starts operations on a shared pool of worker threads per quality of
+// service, one per core, where idle workers steal queued operations from busy
+// ones. Operations that finish or add work on a worker start their successors
+// on that same worker, without a hop through the queue's scheduler, which
+// matters for short operations. A worker blocked in -waitUntilFinished is
+// stood in for by a new one. maxConcurrentOperationCount still applies. Has
+// no effect on the main queue.
+- (BOOL)_usesWorkStealingExecutor;
+- (void)_setUsesWorkStealingExecutor:(BOOL)usesWorkStealingExecutor;
+
+@end
+
+#endif // _NSOPERATION_PRIVATE_H_
@@ -0,0 +1,36 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSPREDICATE_PRIVATE_H_
+#define _NSPREDICATE_PRIVATE_H_
+
+#import <Foundation/NSPredicate.h>
+
+// With NSEnumerationConcurrent, large arrays are evaluated in chunks on
+// several threads; the result keeps the original order. The predicate (and
+// any key-value coding it does on the objects) must be thread safe.
+@interface NSArray (NSPredicateSupportPrivate)
+- (NSArray *)_filteredArrayUsingPredicate:(NSPredicate *)predicate options:(NSEnumerationOptions)opts;
+@end
+
+@interface NSMutableArray (NSPredicateSupportPrivate)
+- (void)_filterUsingPredicate:(NSPredicate *)predicate options:(NSEnumerationOptions)opts;
+@end
+
+#endif // _NSPREDICATE_PRIVATE_H_
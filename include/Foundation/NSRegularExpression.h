@@ -19,7 +19,7 @@ typedef NS_OPTIONS(NSUInteger, NSRegularExpressionOptions) {
     NSString *_pattern;
     NSRegularExpressionOptions _options;
     void *_internal;
-    id _reserved1;
+    void *_matchers;
     int _checkout;
     int _reserved2;
 }
@@ -0,0 +1,36 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSSORTDESCRIPTOR_PRIVATE_H_
+#define _NSSORTDESCRIPTOR_PRIVATE_H_
+
+#import <Foundation/NSSortDescriptor.h>
+
+// With NSSortConcurrent, large arrays are merge sorted on several threads.
+// Key values are still fetched on the calling thread, but the comparison
+// selectors and comparators must be safe to call concurrently.
+@interface NSArray (NSSortDescriptorSortingPrivate)
+- (NSArray *)_sortedArrayUsingDescriptors:(NSArray *)sortDescriptors options:(NSSortOptions)opts;
+@end
+
+@interface NSMutableArray (NSSortDescriptorSortingPrivate)
+- (void)_sortUsingDescriptors:(NSArray *)sortDescriptors options:(NSSortOptions)opts;
+@end
+
+#endif // _NSSORTDESCRIPTOR_PRIVATE_H_
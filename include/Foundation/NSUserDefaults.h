@@ -16,6 +16,16 @@ FOUNDATION_EXPORT NSString * const NSUserDefaultsDidChangeNotification;
     NSMutableDictionary *_volatileDomains;
 
     dispatch_source_t _synchronizeTimer;
+
+    // Values written directly through CFPreferences are not seen for keys
+    // already cached here until the next -synchronize or periodic sync.
+    NSMutableDictionary *_values;
+    int32_t _valuesGeneration;
+    BOOL _overridesObjectForKey;
+
+    dispatch_time_t _syncDeadline;
+    int32_t _changesPending;
+    int32_t _notificationScheduled;
 }
 
 #undef PREFS_TYPE
@@ -0,0 +1,33 @@
+/*
+ This file is part of Darling.
+
+ Copyright (C) 2020 Lubos Dolezel
+
+ Darling is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Darling is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Darling.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NSUSERDEFAULTS_PRIVATE_H_
+#define _NSUSERDEFAULTS_PRIVATE_H_
+
+#import <Foundation/NSUserDefaults.h>
+
+@interface NSUserDefaults (NSUserDefaultsPrivate)
+// Runs updates and posts a single NSUserDefaultsDidChangeNotification for
+// all the changes it made. Only changes made on the calling thread are
+// deferred; changes from other threads are announced as usual. Batches may
+// nest.
+- (void)_performBatchUpdates:(void (^)(void))updates;
+@end
+
+#endif // _NSUSERDEFAULTS_PRIVATE_H_
@@ -22,7 +22,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 #import <Foundation/NSString.h>
 
 @class NSURL, NSData, NSError, NSXMLParser, NSDictionary, NSMutableArray,
-        NSMutableDictionary;
+        NSMutableDictionary, NSInputStream;
 
 @protocol NSXMLParserDelegate
 
@@ -106,17 +106,38 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
     NSUInteger _length;
     NSRange _range;
 
+    // streaming state; _bytes points into _buffer while parsing a stream
+    NSInputStream *_stream;
+    uint8_t *_buffer;
+    NSUInteger _capacity;
+    BOOL _streamAtEnd;
+
     NSMutableDictionary *_entityRefContents;
 
     int _state;
     unichar _charRef;
     NSMutableArray *_elementNameStack;
     NSString *_currentAttributeName;
-    NSMutableDictionary *_currentAttributes;
+
+    // attributes of the start tag being parsed
+    id *_attributeNames;
+    id *_attributeValues;
+    NSUInteger _attributeCount;
+    NSUInteger _attributeCapacity;
+
+    // element and attribute names seen so far
+    void *_names;
+
+    // delegate methods, resolved in setDelegate:
+    IMP _foundCharacters;
+    IMP _foundIgnorableWhitespace;
+    IMP _didStartElement;
+    IMP _didEndElement;
 }
 
 - (instancetype) initWithData: (NSData *) data;
 - (instancetype) initWithContentsofURL: (NSURL *) url;
+- (instancetype) initWithStream: (NSInputStream *) stream;
 
 - (id) delegate;
 - (BOOL) shouldProcessNamespaces;
@@ -288,13 +288,26 @@ OBJC_PROTOCOL_IMPL_POP
         return [super valueForKeyPath:aKeyPath];
     }
 
-    __NSKeyPathComponents components = __NSGetComponentsFromKeyPath(aKeyPath);
-    NSString *key = components.key;
-    NSString *remainderPath = components.remainderPath;
+    NSString *key;
+    NSString *remainderPath;
+    __NSKVCOperatorType op;
+    const __NSKVCCompiledKeyPath *path = __NSKVCCompileKeyPath(aKeyPath);
+    if (path != NULL)
+    {
+        key = path->keys[0];
+        remainderPath = path->paths[1];
+        op = path->operators[0];
+    }
+    else
+    {
+        __NSKeyPathComponents components = __NSGetComponentsFromKeyPath(aKeyPath);
+        key = components.key;
+        remainderPath = components.remainderPath;
+        op = __NSKVCOperatorTypeFromKey(key);
+    }
 
     // handle @operators
 
-    __NSKVCOperatorType op = __NSKVCOperatorTypeFromKey(key);
     if ((op != NSCountKeyValueOperatorType) && !remainderPath)
     {
 #warning TODO FIXME it seems that sometimes userInfo is != self ...
@@ -22,4 +22,7 @@
 enum {
 	__CFTSDKeyNSXPCCurrentConnection = 34,
 	__CFTSDKeyNSXPCCurrentMessage    = 35,
+	__CFTSDKeyNSOperationQueueCurrentQueue = 36,
+	__CFTSDKeyNSKeyValueCodingAccessorCache = 37,
+	__CFTSDKeyNSPredicateRegexCache = 38,
 };
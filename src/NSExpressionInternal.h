@@ -63,6 +63,7 @@ CF_PRIVATE
 - (id)initWithSelector:(SEL)selector argumentArray:(NSArray *)argumentArray;
 - (id)initWithTarget:(id)target selectorName:(NSString *)selectorName arguments:(NSArray *)arguments;
 - (id)initWithExpressionType:(NSExpressionType)type operand:(id)operand selector:(SEL)selector argumentArray:(NSArray *)args;
+- (SEL)selector;
 @end
 
 @interface NSKeyPathExpression : NSFunctionExpression
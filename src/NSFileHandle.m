@@ -7,8 +7,10 @@
 
 #import <stdio.h>
 #import <sys/ioctl.h>
+#import <sys/mman.h>
 #import <sys/socket.h>
 #import <sys/stat.h>
+#import <Block.h>
 #import <dispatch/dispatch.h>
 #import <CoreFoundation/CFRunLoop.h>
 #import <Foundation/NSFileHandle.h>
@@ -19,6 +21,8 @@
 #import "NSObjectInternal.h"
 #import <Foundation/NSURL.h>
 #import <Foundation/NSData.h>
+#import <Foundation/NSData_Private.h>
+#import <Foundation/NSFileHandle_Private.h>
 #import <Foundation/NSError.h>
 #import <Foundation/NSProgress.h>
 
@@ -81,6 +85,10 @@ CF_PRIVATE
 @interface NSConcreteFileHandle ()
 @end
 
+@interface NSData (NSData)
+- (id)initWithBytes:(void *)bytes length:(NSUInteger)length copy:(BOOL)shouldCopy deallocator:(NSDataDeallocator)deallocator;
+@end
+
 CF_PRIVATE
 @interface NSConcreteFileHandleARCWeakRef : NSObject
 {
@@ -467,10 +475,173 @@ static NSError *_NSErrorWithFilePath(int code, id path)
 
 @end
 
+@implementation NSFileHandle (NSFileHandlePrivate)
+
+- (NSData *)_readDataOfLength:(NSUInteger)length options:(NSDataReadingOptions)options
+{
+    return [self readDataOfLength:length];
+}
+
+@end
+
 @implementation NSConcreteFileHandle
 
 #define FAIL() _NSFileHandleRaiseOperationException(self, _cmd)
 
+// Regular file reads at least this large are served from a private mapping
+// instead of being copied into a malloc'd buffer, when the caller asks for a
+// mapped read. A mapping is not a snapshot: it sees later writes to the
+// file, and touching it after the file shrinks raises SIGBUS.
+static const size_t NSFileHandleMappedReadThreshold = 1024 * 1024;
+
+// Pipes and sockets are read into a list of chunks whose size doubles
+// between these bounds, so a small response costs a single small read and
+// a multi-gigabyte one neither issues tiny reads nor reallocs (and copies)
+// its whole buffer each time it grows.
+static const size_t NSFileHandleMinimumStreamChunk = 64 * 1024;
+static const size_t NSFileHandleMaximumStreamChunk = 16 * 1024 * 1024;
+
+typedef struct NSFileHandleStreamChunk {
+    struct NSFileHandleStreamChunk *next;
+    size_t length;
+    size_t capacity;
+    char bytes[];
+} NSFileHandleStreamChunk;
+
+static NSData *_NSFileHandleMapData(int fd, off_t offset, size_t length)
+{
+    static size_t pageSize = 0;
+    if (pageSize == 0)
+    {
+        pageSize = (size_t)getpagesize();
+    }
+
+    // mmap wants a page aligned offset; map from the preceding page
+    // boundary and hand out the tail of the mapping.
+    size_t delta = (size_t)(offset % pageSize);
+    size_t mappedLength = length + delta;
+    void *base = mmap(NULL, mappedLength, PROT_READ, MAP_PRIVATE, fd, offset - delta);
+    if (base == MAP_FAILED)
+    {
+        return nil;
+    }
+
+    NSDataDeallocator deallocator = Block_copy(^(void *bytes, NSUInteger len) {
+        munmap(base, mappedLength);
+    });
+    NSData *data = [[NSData alloc] initWithBytes:(char *)base + delta length:length copy:NO deallocator:deallocator];
+    Block_release(deallocator);
+    return data;
+}
+
+static void _NSFileHandleFreeStreamChunks(NSFileHandleStreamChunk *chunk)
+{
+    while (chunk != NULL)
+    {
+        NSFileHandleStreamChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static NSData *_NSFileHandleReadStream(NSConcreteFileHandle *self, SEL _cmd, int fd, NSUInteger length)
+{
+    NSFileHandleStreamChunk *head = NULL;
+    NSFileHandleStreamChunk *tail = NULL;
+    size_t totalReadSize = 0;
+    size_t chunkSize = NSFileHandleMinimumStreamChunk;
+
+    int available = 0;
+    if (ioctl(fd, FIONREAD, &available) == 0 && available > 0)
+    {
+        // Size the first chunk to what is already buffered so a single
+        // read drains it.
+        chunkSize = MIN(MAX((size_t)available, chunkSize), NSFileHandleMaximumStreamChunk);
+    }
+
+    while (totalReadSize < length)
+    {
+        if (tail == NULL || tail->length == tail->capacity)
+        {
+            size_t capacity = MIN(chunkSize, length - totalReadSize);
+            NSFileHandleStreamChunk *chunk = malloc(sizeof(NSFileHandleStreamChunk) + capacity);
+            if (chunk == NULL)
+            {
+                _NSFileHandleFreeStreamChunks(head);
+                FAIL();
+                return nil;
+            }
+            chunk->next = NULL;
+            chunk->length = 0;
+            chunk->capacity = capacity;
+            if (tail == NULL)
+            {
+                head = chunk;
+            }
+            else
+            {
+                tail->next = chunk;
+            }
+            tail = chunk;
+            chunkSize = MIN(chunkSize * 2, NSFileHandleMaximumStreamChunk);
+        }
+
+        ssize_t readSize = _NSReadFromFileDescriptor(fd, tail->bytes + tail->length, tail->capacity - tail->length);
+        if (readSize < 0)
+        {
+            _NSFileHandleFreeStreamChunks(head);
+            FAIL();
+            return nil;
+        }
+        if (readSize == 0)
+        {
+            break;
+        }
+        tail->length += readSize;
+        totalReadSize += readSize;
+    }
+
+    if (totalReadSize == 0)
+    {
+        _NSFileHandleFreeStreamChunks(head);
+        return [NSData data];
+    }
+
+    if (head == tail)
+    {
+        // Everything landed in one chunk; slide it down over the header
+        // and hand the allocation to the data without another copy.
+        size_t len = head->length;
+        memmove(head, head->bytes, len);
+        char *buf = realloc(head, len);
+        if (buf == NULL)
+        {
+            buf = (char *)head;
+        }
+        return [NSData dataWithBytesNoCopy:buf length:len];
+    }
+
+    char *buf = malloc(totalReadSize);
+    if (buf == NULL)
+    {
+        _NSFileHandleFreeStreamChunks(head);
+        FAIL();
+        return nil;
+    }
+    size_t copied = 0;
+    NSFileHandleStreamChunk *chunk = head;
+    while (chunk != NULL)
+    {
+        NSFileHandleStreamChunk *next = chunk->next;
+        memcpy(buf + copied, chunk->bytes, chunk->length);
+        copied += chunk->length;
+        free(chunk);
+        chunk = next;
+    }
+    return [NSData dataWithBytesNoCopy:buf length:totalReadSize];
+}
+
+
 #define FAIL_IF_CLOSED(retval) \
 if ((_flags & NSConcreteFileHandleClosed) != 0) \
 { \
@@ -575,6 +746,11 @@ if ((_flags & NSConcreteFileHandleClosed) != 0) \
 }
 
 - (NSData *)readDataOfLength:(NSUInteger)length
+{
+    return [self _readDataOfLength:length options:0];
+}
+
+- (NSData *)_readDataOfLength:(NSUInteger)length options:(NSDataReadingOptions)options
 {
     FAIL_IF_CLOSED(nil);
 
@@ -603,64 +779,51 @@ if ((_flags & NSConcreteFileHandleClosed) != 0) \
         {
             return [NSData data];
         }
-        char *buf = malloc(dataSize);
-        if (buf == NULL)
+        if ((options & (NSDataReadingMappedIfSafe | NSDataReadingMappedAlways)) != 0 &&
+            dataSize >= NSFileHandleMappedReadThreshold)
         {
-            FAIL();
-            return nil;
-        }
-        size_t remainingSize = dataSize;
-        size_t totalReadSize = 0;
-        do {
-            ssize_t readSize = _NSReadFromFileDescriptor(_fd, buf + totalReadSize, remainingSize);
-            if (readSize < 0)
+            NSData *data = _NSFileHandleMapData(_fd, offset, dataSize);
+            if (data != nil)
             {
-                free(buf);
-                FAIL();
-                return nil;
+                if (lseek(_fd, offset + dataSize, SEEK_SET) < 0)
+                {
+                    [data release];
+                    FAIL();
+                    return nil;
+                }
+                return [data autorelease];
             }
-            totalReadSize += readSize;
-            remainingSize -= readSize;
-        } while (remainingSize > 0);
-        return [NSData dataWithBytesNoCopy:buf length:dataSize];
-    }
-    else
-    {
-        const size_t READ_SIZE = MIN(4096, length);
-        size_t totalReadSize = 0;
-        size_t bufSize = READ_SIZE;
-        char *buf = malloc(bufSize);
+            // Fall back to read() for files that cannot be mapped.
+        }
+        char *buf = malloc(dataSize);
         if (buf == NULL)
         {
             FAIL();
             return nil;
         }
-        ssize_t readSize;
-        do {
-            size_t maxReadSize = MIN(READ_SIZE, bufSize) - totalReadSize;
-            readSize = _NSReadFromFileDescriptor(_fd, buf + totalReadSize, maxReadSize);
+        size_t totalReadSize = 0;
+        while (totalReadSize < dataSize)
+        {
+            ssize_t readSize = _NSReadFromFileDescriptor(_fd, buf + totalReadSize, dataSize - totalReadSize);
             if (readSize < 0)
             {
                 free(buf);
                 FAIL();
                 return nil;
             }
-            totalReadSize += readSize;
-            if (totalReadSize + READ_SIZE > bufSize)
+            if (readSize == 0)
             {
-                char *oldBuf = buf;
-                bufSize *= 2;
-                buf = realloc(buf, bufSize);
-                if (buf == NULL)
-                {
-                    free(oldBuf);
-                    FAIL();
-                    return nil;
-                }
+                // The file was truncated underneath us.
+                break;
             }
-        } while (readSize > 0);
+            totalReadSize += readSize;
+        }
         return [NSData dataWithBytesNoCopy:buf length:totalReadSize];
     }
+    else
+    {
+        return _NSFileHandleReadStream(self, _cmd, _fd, length);
+    }
 }
 
 - (unsigned long long)offsetInFile
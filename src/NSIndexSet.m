@@ -6,26 +6,30 @@
 //
 
 #import <stdlib.h>
+#import <string.h>
 #import <Foundation/NSString.h>
 #import <Foundation/NSIndexSet.h>
+#import <Foundation/NSIndexSet_Private.h>
 #import <Foundation/NSException.h>
 #import <Foundation/NSCoder.h>
 #import <Foundation/NSMutableData.h>
-#import <CoreFoundation/CFArray.h>
 #import <dispatch/dispatch.h>
-#import "utlist.h"
-
-typedef struct RangeList {
-    NSRange range;
-    struct RangeList *next;
-    struct RangeList *prev;
-} RangeList;
-
-typedef struct NSIndexSetCache {
-    CFArrayRef ranges;
+#import <libkern/OSAtomic.h>
+#import <limits.h>
+
+// Sets with more than one range keep them in a sorted vector. Ranges never
+// overlap or touch, so lookups are binary searches over the vector and bulk
+// operations are linear merges of two vectors.
+typedef struct NSIndexSetRanges {
+    NSRange *ranges;
     NSUInteger count;
-    NSUInteger rangeCount;
-} NSIndexSetCache;
+    NSUInteger capacity;
+    NSUInteger indexCount;
+} NSIndexSetRanges;
+
+// Below this many ranges in the argument, addIndexes: and removeIndexes:
+// edit the receiver range by range instead of merging whole vectors.
+#define NSIndexSetMergeThreshold 8
 
 static BOOL NSContainsRange(NSRange haystack, NSRange needle)
 {
@@ -42,12 +46,6 @@ static BOOL NSContainsRange(NSRange haystack, NSRange needle)
 #define HAS_SINGLE_RANGE(set) (FLAGS(set)._hasSingleRange)
 #define SET_HAS_SINGLE_RANGE(set, val) (FLAGS(set)._hasSingleRange = val)
 
-#define CACHE_VALID(set) (FLAGS(set)._cacheValid)
-#define SET_CACHE_VALID(set, val) (FLAGS(set)._cacheValid = val)
-
-#define CACHE(set) (MULTIPLE_RANGES(set)._cache)
-#define SET_CACHE(set, value) MULTIPLE_RANGES(set)._cache = value
-
 #define MULTIPLE_RANGE_DATA(set) MULTIPLE_RANGES(set)._data
 #define SET_MULTIPLE_RANGE_DATA(set, val) MULTIPLE_RANGES(set)._data = val
 
@@ -55,250 +53,398 @@ static BOOL NSContainsRange(NSRange haystack, NSRange needle)
 
 #define SET_SINGLE_RANGE(set, range) SINGLE_RANGE(set) = range
 
-#define RESET_CACHE(set) \
-SET_CACHE_VALID(set, NO); \
-SET_CACHE(set, NULL)
+#define CLEAR_RANGES(set) NSIndexSetSetEmpty(set)
+
+
+@implementation NSIndexSet
+
+// Returns the ranges of set in ascending order, whichever way they are stored.
+static inline NSRange *NSIndexSetGetRanges(NSIndexSet *set, NSUInteger *count)
+{
+    if (IS_EMPTY(set))
+    {
+        *count = 0;
+        return NULL;
+    }
+    if (HAS_SINGLE_RANGE(set))
+    {
+        *count = 1;
+        return &SINGLE_RANGE(set);
+    }
+    *count = MULTIPLE_RANGE_DATA(set)->count;
+    return MULTIPLE_RANGE_DATA(set)->ranges;
+}
 
-#define CLEAR_CACHE(set) if (!HAS_SINGLE_RANGE(set) && CACHE_VALID(set)) { \
-    NSIndexSetPurgeCache((NSIndexSetCache *)CACHE(set)); \
-    RESET_CACHE(set); \
+// Index of the first range that ends after value: the range containing value
+// if there is one, otherwise the first range above it.
+static inline NSUInteger NSIndexSetFindRangeEndingAfter(const NSRange *ranges, NSUInteger count, NSUInteger value)
+{
+    NSUInteger lo = 0;
+    NSUInteger hi = count;
+    while (lo < hi)
+    {
+        NSUInteger mid = lo + (hi - lo) / 2;
+        if (NSMaxRange(ranges[mid]) <= value)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-#define CLEAR_RANGES(set) if (!IS_EMPTY(set)) { \
-    if (HAS_SINGLE_RANGE(set)) { \
-        SET_HAS_SINGLE_RANGE(set, NO); \
-    } else { \
-        CLEAR_CACHE(set); \
-    } \
-    SET_EMPTY(set, YES); \
+// Index of the first range that starts after value.
+static inline NSUInteger NSIndexSetFindRangeStartingAfter(const NSRange *ranges, NSUInteger count, NSUInteger value)
+{
+    NSUInteger lo = 0;
+    NSUInteger hi = count;
+    while (lo < hi)
+    {
+        NSUInteger mid = lo + (hi - lo) / 2;
+        if (ranges[mid].location <= value)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-#define BUILD_CACHE(set) ({ \
-    if (!HAS_SINGLE_RANGE(set) && !CACHE_VALID(set)) { \
-        NSIndexSetBuildCache(&CACHE(set), MULTIPLE_RANGE_DATA(set)); \
-    } \
-    BOOL __valid = !HAS_SINGLE_RANGE(set) && CACHE_VALID(set); \
-    __valid; \
-})
+static inline void NSIndexSetFreeRanges(NSIndexSet *set)
+{
+    if (!IS_EMPTY(set) && !HAS_SINGLE_RANGE(set))
+    {
+        NSIndexSetRanges *data = MULTIPLE_RANGE_DATA(set);
+        free(data->ranges);
+        free(data);
+        SET_MULTIPLE_RANGE_DATA(set, NULL);
+    }
+}
 
+static inline void NSIndexSetSetEmpty(NSIndexSet *set)
+{
+    NSIndexSetFreeRanges(set);
+    SET_HAS_SINGLE_RANGE(set, NO);
+    SET_EMPTY(set, YES);
+}
 
-@implementation NSIndexSet
+static inline void NSIndexSetSetSingleRange(NSIndexSet *set, NSRange range)
+{
+    NSIndexSetFreeRanges(set);
+    SET_EMPTY(set, NO);
+    SET_HAS_SINGLE_RANGE(set, YES);
+    SET_SINGLE_RANGE(set, range);
+}
 
-static inline void NSIndexSetPurgeCache(NSIndexSetCache *cache)
+// Takes ownership of ranges, which must be sorted and coalesced.
+static void NSIndexSetAdoptRanges(NSIndexSet *set, NSRange *ranges, NSUInteger count, NSUInteger capacity)
 {
-    if (cache == NULL)
+    if (count <= 1)
     {
+        if (count == 0)
+        {
+            NSIndexSetSetEmpty(set);
+        }
+        else
+        {
+            NSIndexSetSetSingleRange(set, ranges[0]);
+        }
+        free(ranges);
         return;
     }
-    
-    CFRelease(cache->ranges);
-    
-    free(cache);
+
+    NSIndexSetRanges *data = malloc(sizeof(NSIndexSetRanges));
+    if (data == NULL)
+    {
+        free(ranges);
+        [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+        return;
+    }
+    data->ranges = ranges;
+    data->count = count;
+    data->capacity = capacity;
+    data->indexCount = 0;
+    for (NSUInteger idx = 0; idx < count; idx++)
+    {
+        data->indexCount += ranges[idx].length;
+    }
+
+    NSIndexSetFreeRanges(set);
+    SET_EMPTY(set, NO);
+    SET_HAS_SINGLE_RANGE(set, NO);
+    SET_MULTIPLE_RANGE_DATA(set, data);
 }
 
-static inline void NSIndexSetBuildCache(NSIndexSetCache **cache, RangeList *ranges)
+// Replaces ranges [lo, hi) of set with the withCount ranges in with, which
+// must leave the set sorted and coalesced. with must not point into set.
+static void NSIndexSetReplaceRanges(NSIndexSet *set, NSUInteger lo, NSUInteger hi, const NSRange *with, NSUInteger withCount)
 {
-    *cache = malloc(sizeof(NSIndexSetCache));
-    if (*cache == NULL)
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(set, &count);
+    NSUInteger newCount = count - (hi - lo) + withCount;
+
+    if (newCount == 0)
     {
+        NSIndexSetSetEmpty(set);
         return;
     }
-    
-#define STACK_SIZE 32
-    
-    RangeList *stack_values[STACK_SIZE] = {0};
-    RangeList **values = &stack_values[0];
-    RangeList *entry = NULL;
-    NSUInteger rangeCount = 0;
-    NSUInteger count = 0;
-    NSUInteger capacity = 0;
-    
-    DL_FOREACH(ranges, entry)
+    if (newCount == 1)
+    {
+        NSRange only = withCount == 1 ? with[0] : ranges[lo == 0 ? hi : 0];
+        NSIndexSetSetSingleRange(set, only);
+        return;
+    }
+
+    NSIndexSetRanges *data = NULL;
+    if (IS_EMPTY(set) || HAS_SINGLE_RANGE(set))
     {
-        if (rangeCount > STACK_SIZE && values == &stack_values[0])
+        NSUInteger capacity = MAX(newCount, 4);
+        data = malloc(sizeof(NSIndexSetRanges));
+        NSRange *storage = malloc(capacity * sizeof(NSRange));
+        if (data == NULL || storage == NULL)
         {
-            values = malloc(capacity * sizeof(RangeList *));
-            if (values == NULL)
-            {
-                free(*cache);
-                *cache = NULL;
-                return;
-            }
+            free(data);
+            free(storage);
+            [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+            return;
+        }
+        data->ranges = storage;
+        data->capacity = capacity;
+        data->count = count;
+        data->indexCount = 0;
+        if (count == 1)
+        {
+            storage[0] = SINGLE_RANGE(set);
+            data->indexCount = storage[0].length;
         }
-        else if (rangeCount > STACK_SIZE && rangeCount + 1 > capacity)
+        SET_EMPTY(set, NO);
+        SET_HAS_SINGLE_RANGE(set, NO);
+        SET_MULTIPLE_RANGE_DATA(set, data);
+    }
+    else
+    {
+        data = MULTIPLE_RANGE_DATA(set);
+        if (newCount > data->capacity)
         {
-            capacity *= 2;
-            values = reallocf(values, capacity * sizeof(RangeList *));
-            if (values == NULL) // prev values cleaned up by reallocf
+            NSUInteger capacity = MAX(data->capacity * 2, newCount);
+            NSRange *storage = realloc(data->ranges, capacity * sizeof(NSRange));
+            if (storage == NULL)
             {
-                free(*cache);
-                *cache = NULL;
+                [NSException raise:NSMallocException format:@"Unable to grow index set storage"];
                 return;
             }
+            data->ranges = storage;
+            data->capacity = capacity;
         }
-        
-        values[rangeCount] = entry;
-        count += entry->range.length;
-        
-        rangeCount++;
     }
-    
-    static const CFArrayCallBacks callbacks = {
-        .retain = NULL,
-        .release = NULL,
-    };
-    
-    (*cache)->ranges = CFArrayCreate(kCFAllocatorDefault, (const void **)values, rangeCount, &callbacks);
-    (*cache)->rangeCount = rangeCount;
-    
-    if (values != &stack_values[0] && values != NULL)
+
+    for (NSUInteger idx = lo; idx < hi; idx++)
+    {
+        data->indexCount -= data->ranges[idx].length;
+    }
+    memmove(&data->ranges[lo + withCount], &data->ranges[hi], (count - hi) * sizeof(NSRange));
+    for (NSUInteger idx = 0; idx < withCount; idx++)
+    {
+        data->ranges[lo + idx] = with[idx];
+        data->indexCount += with[idx].length;
+    }
+    data->count = newCount;
+
+    if (data->capacity > 64 && newCount < data->capacity / 4)
     {
-        free(values);
+        NSRange *storage = realloc(data->ranges, (data->capacity / 2) * sizeof(NSRange));
+        if (storage != NULL)
+        {
+            data->ranges = storage;
+            data->capacity /= 2;
+        }
     }
 }
 
 static inline void addIndexesInRange(NSIndexSet *self, NSRange range)
 {
-    NSUInteger start = range.location;
-    NSUInteger end = start + range.length;
-    
     if (range.length == 0)
     {
         return;
     }
     else if (IS_EMPTY(self))
     {
-        SET_HAS_SINGLE_RANGE(self, YES);
-        SET_EMPTY(self, NO);
-        SET_SINGLE_RANGE(self, range);
+        NSIndexSetSetSingleRange(self, range);
         return;
     }
-    else if (HAS_SINGLE_RANGE(self))
+
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger end = NSMaxRange(range);
+
+    // Appending past the last range is the common case when building a set.
+    if (NSMaxRange(ranges[count - 1]) < range.location)
     {
-        NSUInteger rangeStart = SINGLE_RANGE(self).location;
-        NSUInteger rangeEnd = rangeStart + SINGLE_RANGE(self).length;
-        
-        if (rangeEnd == start) //adjoining, merge and extend
-        {
-            SET_SINGLE_RANGE(self, NSMakeRange(SINGLE_RANGE(self).location, SINGLE_RANGE(self).length + range.length));
-            return;
-        }
-        if ((start <= rangeStart && rangeEnd <= end) ||
-            (rangeStart <= start && start <= rangeEnd && rangeEnd <= end) ||
-            (start <= rangeStart && rangeStart <= end && end <= rangeEnd))
-        {
-            SET_SINGLE_RANGE(self, NSMakeRange(MIN(start, rangeStart), MAX(end, rangeEnd) - MIN(start, rangeStart)));
-            return;
-        }
-        RangeList *oldRange = malloc(sizeof(RangeList));
-        oldRange->range = SINGLE_RANGE(self);
-        
-        RangeList *newRange = malloc(sizeof(RangeList));
-        newRange->range = range;
-        
-        SET_HAS_SINGLE_RANGE(self, NO);
-        MULTIPLE_RANGE_DATA(self) = NULL;
-        
-        // set the cache to NULL so that it does not have junk data from the union
-        RESET_CACHE(self);
-        
-        if (oldRange->range.location < newRange->range.location)
-        {
-            DL_APPEND(MULTIPLE_RANGE_DATA(self), oldRange);
-            DL_APPEND(MULTIPLE_RANGE_DATA(self), newRange);
-        }
-        else
-        {
-            DL_APPEND(MULTIPLE_RANGE_DATA(self), newRange);
-            DL_APPEND(MULTIPLE_RANGE_DATA(self), oldRange);
-        }
+        NSIndexSetReplaceRanges(self, count, count, &range, 1);
+        return;
     }
-    else
+
+    // Ranges that overlap or touch the new one are folded into it.
+    NSUInteger lo = range.location == 0 ? 0 : NSIndexSetFindRangeEndingAfter(ranges, count, range.location - 1);
+    NSUInteger hi = NSIndexSetFindRangeStartingAfter(ranges, count, end);
+    if (lo < hi)
     {
-        // clear the cache
-        CLEAR_CACHE(self);
-        
-        RangeList *newRange = malloc(sizeof(RangeList));
-        newRange->range = range;
-        
-        RangeList *ptr = [self _pointerToRangeBeforeOrContainingIndex:range.location];
-        if (ptr == NULL)
-        {
-            DL_PREPEND(MULTIPLE_RANGE_DATA(self), newRange);
-        }
-        else if (NSContainsRange(ptr->range, range))
+        if (NSContainsRange(ranges[lo], range))
         {
             return;
         }
-        else
-        {
-            DL_INSERT(MULTIPLE_RANGE_DATA(self), ptr, newRange);
-        }
-        
-        [self _mergeOverlappingRangesStartingAtIndex:(ptr ?: MULTIPLE_RANGE_DATA(self))];
+        NSUInteger start = MIN(range.location, ranges[lo].location);
+        end = MAX(end, NSMaxRange(ranges[hi - 1]));
+        range = NSMakeRange(start, end - start);
     }
+    NSIndexSetReplaceRanges(self, lo, hi, &range, 1);
 }
 
-static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList *r2, RangeList *search)
+static inline void removeIndexesInRange(NSIndexSet *self, NSRange range)
 {
-    RangeList *needle = NULL;
-    RangeList *haystack = NULL;
-    
-    if (r1 == search)
+    if (range.length == 0 || IS_EMPTY(self))
+    {
+        return;
+    }
+
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger end = NSMaxRange(range);
+    NSUInteger lo = NSIndexSetFindRangeEndingAfter(ranges, count, range.location);
+    NSUInteger hi = NSIndexSetFindRangeStartingAfter(ranges, count, end - 1);
+    if (lo >= hi)
+    {
+        return;
+    }
+
+    // Keep whatever sticks out either side of the removed range.
+    NSRange remainder[2];
+    NSUInteger remainderCount = 0;
+    if (ranges[lo].location < range.location)
+    {
+        remainder[remainderCount++] = NSMakeRange(ranges[lo].location, range.location - ranges[lo].location);
+    }
+    if (NSMaxRange(ranges[hi - 1]) > end)
     {
-        needle = r1;
-        haystack = r2;
+        remainder[remainderCount++] = NSMakeRange(end, NSMaxRange(ranges[hi - 1]) - end);
     }
-    else if (r2 == search)
+    NSIndexSetReplaceRanges(self, lo, hi, remainder, remainderCount);
+}
+
+static inline void NSIndexSetAppendRange(NSRange *out, NSUInteger *count, NSRange range)
+{
+    if (*count > 0 && NSMaxRange(out[*count - 1]) >= range.location)
     {
-        needle = r2;
-        haystack = r1;
+        NSUInteger end = MAX(NSMaxRange(out[*count - 1]), NSMaxRange(range));
+        out[*count - 1].length = end - out[*count - 1].location;
     }
     else
     {
-        if (r1->range.location < r2->range.location)
-        {
-            return kCFCompareLessThan;
-        }
-        else if (r1->range.location > r2->range.location)
+        out[(*count)++] = range;
+    }
+}
+
+// The set operations below merge two sorted, coalesced range vectors into a
+// newly allocated one holding at most aCount + bCount ranges.
+static NSUInteger NSIndexSetUnionRanges(const NSRange *a, NSUInteger aCount, const NSRange *b, NSUInteger bCount, NSRange *out)
+{
+    NSUInteger count = 0;
+    NSUInteger i = 0;
+    NSUInteger j = 0;
+    while (i < aCount || j < bCount)
+    {
+        if (j == bCount || (i < aCount && a[i].location <= b[j].location))
         {
-            return kCFCompareGreaterThan;
+            NSIndexSetAppendRange(out, &count, a[i++]);
         }
         else
         {
-            return kCFCompareEqualTo;
+            NSIndexSetAppendRange(out, &count, b[j++]);
         }
     }
-    
-    if (haystack->range.location <= needle->range.location + needle->range.length && needle->range.location + needle->range.length <= haystack->range.location + haystack->range.length)
-    {
-        return kCFCompareEqualTo;
-    }
-    else if (needle->range.location < haystack->range.location)
+    return count;
+}
+
+static NSUInteger NSIndexSetIntersectRanges(const NSRange *a, NSUInteger aCount, const NSRange *b, NSUInteger bCount, NSRange *out)
+{
+    NSUInteger count = 0;
+    NSUInteger i = 0;
+    NSUInteger j = 0;
+    while (i < aCount && j < bCount)
     {
-        if (needle == r1)
+        NSUInteger start = MAX(a[i].location, b[j].location);
+        NSUInteger end = MIN(NSMaxRange(a[i]), NSMaxRange(b[j]));
+        if (start < end)
+        {
+            out[count++] = NSMakeRange(start, end - start);
+        }
+        if (NSMaxRange(a[i]) < NSMaxRange(b[j]))
         {
-            return kCFCompareLessThan;
+            i++;
         }
         else
         {
-            return kCFCompareGreaterThan;
+            j++;
         }
     }
-    else if (needle->range.location > haystack->range.location)
+    return count;
+}
+
+static NSUInteger NSIndexSetSubtractRanges(const NSRange *a, NSUInteger aCount, const NSRange *b, NSUInteger bCount, NSRange *out)
+{
+    NSUInteger count = 0;
+    NSUInteger j = 0;
+    for (NSUInteger i = 0; i < aCount; i++)
     {
-        if (needle == r1)
+        NSUInteger current = a[i].location;
+        NSUInteger end = NSMaxRange(a[i]);
+        while (j < bCount && NSMaxRange(b[j]) <= current)
         {
-            return kCFCompareGreaterThan;
+            j++;
         }
-        else
+        for (NSUInteger k = j; k < bCount && b[k].location < end; k++)
+        {
+            if (b[k].location > current)
+            {
+                out[count++] = NSMakeRange(current, b[k].location - current);
+            }
+            current = MAX(current, NSMaxRange(b[k]));
+            if (current >= end)
+            {
+                break;
+            }
+        }
+        if (current < end)
         {
-            return kCFCompareLessThan;
+            out[count++] = NSMakeRange(current, end - current);
         }
     }
-    
-    NSCAssert(0, @"Incorrect searching logic");
-    return kCFCompareEqualTo; // error in logic if we get to here?
+    return count;
+}
+
+typedef NSUInteger (*NSIndexSetMergeFunction)(const NSRange *, NSUInteger, const NSRange *, NSUInteger, NSRange *);
+
+static void NSIndexSetMergeRanges(NSIndexSet *self, NSIndexSet *other, NSIndexSetMergeFunction merge)
+{
+    NSUInteger count = 0;
+    NSUInteger otherCount = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSRange *otherRanges = NSIndexSetGetRanges(other, &otherCount);
+    NSUInteger capacity = MAX(count + otherCount, 4);
+    NSRange *out = malloc(capacity * sizeof(NSRange));
+    if (out == NULL)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+        return;
+    }
+    NSUInteger outCount = merge(ranges, count, otherRanges, otherCount, out);
+    NSIndexSetAdoptRanges(self, out, outCount, capacity);
 }
 
 - (BOOL)_isEmpty
@@ -316,11 +462,6 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     return SINGLE_RANGE(self);
 }
 
-- (RangeList *)_multipleRangeData
-{
-    return MULTIPLE_RANGE_DATA(self);
-}
-
 + (id)indexSet
 {
     return [[[self alloc] init] autorelease];
@@ -346,7 +487,8 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     self = [super init];
     if (self)
     {
-        CLEAR_RANGES(self);
+        SET_HAS_SINGLE_RANGE(self, NO);
+        SET_EMPTY(self, YES);
     }
     return self;
 }
@@ -383,7 +525,8 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
 {
     if ([aCoder allowsKeyedCoding])
     {
-        NSUInteger count = [self rangeCount];
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
         [aCoder encodeInt64:count forKey:@"NSRangeCount"];
         if (count == 1)
         {
@@ -393,13 +536,13 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
         else if (count > 1)
         {
             NSMutableData *data = [[NSMutableData alloc] init];
-            RangeList *ptr = NULL;
-            DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+            for (NSUInteger idx = 0; idx < count; idx++)
             {
-                [data appendBytes:&ptr->range.location length:sizeof(NSUInteger)];
-                [data appendBytes:&ptr->range.length length:sizeof(NSUInteger)];
+                [data appendBytes:&ranges[idx].location length:sizeof(NSUInteger)];
+                [data appendBytes:&ranges[idx].length length:sizeof(NSUInteger)];
             }
             [aCoder encodeObject:data forKey:@"NSRangeData"];
+            [data release];
         }
     }
     else 
@@ -423,15 +566,13 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
             if (self)
             {
                 NSData *data = [coder decodeObjectForKey:@"NSRangeData"];
-                // increase the by two since ranges always come in pair
-                for (int i = 1; i <= count; i = i+2)
+                const NSUInteger *values = [data bytes];
+                NSUInteger available = [data length] / (2 * sizeof(NSUInteger));
+                // ranges are stored as location, length pairs
+                for (NSUInteger idx = 0; idx < MIN(count, available); idx++)
                 {
-                    NSUInteger location;
-                    [data getBytes:&location length:sizeof(NSUInteger)];
-                    NSUInteger length;
-                    [data getBytes:&length length:sizeof(NSUInteger)];
-                    addIndexesInRange(self, NSMakeRange(location, length));
-                }  
+                    addIndexesInRange(self, NSMakeRange(values[2 * idx], values[2 * idx + 1]));
+                }
             }
             return self;
         }
@@ -462,20 +603,20 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
 
 - (BOOL)isEqualToIndexSet:(NSIndexSet *)indexSet
 {
-   
-    NSUInteger idx1 = [self firstIndex];
-    NSUInteger idx2 = [indexSet firstIndex];
-    
-    do {
-        if (idx1 != idx2)
-        {
-            return NO;
-        }
-        idx1 = [self indexGreaterThanIndex:idx1];
-        idx2 = [indexSet indexGreaterThanIndex:idx2];
-    } while (idx1 != NSNotFound && idx2 != NSNotFound);
-    
-    return idx1 == idx2;
+    if (indexSet == self)
+    {
+        return YES;
+    }
+    if (indexSet == nil)
+    {
+        return IS_EMPTY(self);
+    }
+
+    NSUInteger count = 0;
+    NSUInteger otherCount = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSRange *otherRanges = NSIndexSetGetRanges(indexSet, &otherCount);
+    return count == otherCount && (count == 0 || memcmp(ranges, otherRanges, count * sizeof(NSRange)) == 0);
 }
 
 - (NSUInteger)count
@@ -489,473 +630,150 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     {
         return SINGLE_RANGE(self).length;
     }
-    else if (!BUILD_CACHE(self))
-    {
-        RangeList *ptr = NULL;
-        NSUInteger count = 0;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-        {
-            count += ptr->range.length;
-        }
-        return count;
-    }
     else
     {
-        return CACHE(self)->count;
+        return MULTIPLE_RANGE_DATA(self)->indexCount;
     }
 }
 
 - (NSUInteger)rangeCount
 {
-    if (IS_EMPTY(self))
-    {
-        return 0;
-    }
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        return 1;
-    }
-    else if (!BUILD_CACHE(self))
-    {
-        NSUInteger sum = 0;
-        RangeList *ptr = NULL;
-        DL_COUNT(MULTIPLE_RANGE_DATA(self), ptr, sum);
-        return sum;
-    }
-    else
+    NSUInteger count = 0;
+    NSIndexSetGetRanges(self, &count);
+    return count;
+}
+
+- (NSUInteger)firstIndex
+{
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    if (count == 0)
     {
-        return CACHE(self)->rangeCount;
+        return NSNotFound;
     }
+    return ranges[0].location;
 }
 
-- (NSUInteger)firstIndex
+- (NSUInteger)lastIndex
 {
-    if (IS_EMPTY(self))
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    if (count == 0)
     {
         return NSNotFound;
     }
-    
-    if (HAS_SINGLE_RANGE(self))
+    return NSMaxRange(ranges[count - 1]) - 1;
+}
+
+- (NSUInteger)indexGreaterThanIndex:(NSUInteger)value
+{
+    if (value == NSUIntegerMax)
     {
-        return SINGLE_RANGE(self).location;
+        return NSNotFound;
     }
-    
-    return MULTIPLE_RANGE_DATA(self)->range.location;
+    return [self indexGreaterThanOrEqualToIndex:value + 1];
 }
 
-- (NSUInteger)lastIndex
+- (NSUInteger)indexGreaterThanOrEqualToIndex:(NSUInteger)value
 {
-    if (IS_EMPTY(self))
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger idx = NSIndexSetFindRangeEndingAfter(ranges, count, value);
+    if (idx == count)
     {
         return NSNotFound;
     }
-    
-    if (HAS_SINGLE_RANGE(self))
+    return MAX(value, ranges[idx].location);
+}
+
+- (NSUInteger)indexLessThanIndex:(NSUInteger)value
+{
+    if (value == 0)
     {
-        return SINGLE_RANGE(self).location + SINGLE_RANGE(self).length - 1;
+        return NSNotFound;
     }
-    
-    RangeList *last = DL_TAIL(MULTIPLE_RANGE_DATA(self));
-    return last->range.location + last->range.length - 1;
+    return [self indexLessThanOrEqualToIndex:value - 1];
 }
 
-- (NSUInteger)indexGreaterThanIndex:(NSUInteger)value
+- (NSUInteger)indexLessThanOrEqualToIndex:(NSUInteger)value
 {
-    if (IS_EMPTY(self))
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger idx = NSIndexSetFindRangeStartingAfter(ranges, count, value);
+    if (idx == 0)
     {
         return NSNotFound;
     }
-    
-    if (HAS_SINGLE_RANGE(self))
+    return MIN(value, NSMaxRange(ranges[idx - 1]) - 1);
+}
+
+- (NSUInteger)getIndexes:(NSUInteger *)indexBuffer maxCount:(NSUInteger)bufferSize inIndexRange:(NSRangePointer)range
+{
+    if (IS_EMPTY(self) || bufferSize == 0 || (range != NULL && range->length == 0))
     {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        if (value >= end)
-        {
-            return NSNotFound;
-        }
-        else if (value < start)
-        {
-            return start;
-        }
-        else
-        {
-            return value + 1;
-        }
-    }
-    else if (!BUILD_CACHE(self))
-    {
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-        {
-            NSUInteger start = ptr->range.location;
-            NSUInteger end = start + ptr->range.length - 1;
-            if (value < end)
-            {
-                if (value < start)
-                {
-                    return start;
-                }
-                else
-                {
-                    return value + 1;
-                }
-            }
-        }
-        return NSNotFound;
-    }
-    else
-    {
-        RangeList search = {
-            .range = {
-                .location = value,
-                .length = 0,
-            },
-        };
-        
-        CFIndex found = CFArrayBSearchValues(CACHE(self)->ranges, CFRangeMake(0, CACHE(self)->rangeCount), &search, (CFComparatorFunction)&NSIndexSetCompareEntry, &search);
-        if (found != kCFNotFound)
-        {
-            return value + 1;
-        }
-        
-        return NSNotFound;
+        return 0;
     }
-}
 
-- (NSUInteger)indexGreaterThanOrEqualToIndex:(NSUInteger)value
-{
-    if (IS_EMPTY(self))
-    {
-        return NSNotFound;
-    }
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        if (value > end)
-        {
-            return NSNotFound;
-        }
-        else if (value <= start)
-        {
-            return start;
-        }
-        else
-        {
-            return value;
-        }
-    }
-    else if (!BUILD_CACHE(self))
-    {
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-        {
-            NSUInteger start = ptr->range.location;
-            NSUInteger end = start + ptr->range.length - 1;
-            if (value < end)
-            {
-                if (value <= start)
-                {
-                    return start;
-                }
-                else
-                {
-                    return value;
-                }
-            }
-        }
-        return NSNotFound;
-    }
-    else
-    {
-        RangeList search = {
-            .range = {
-                .location = value,
-                .length = 0,
-            },
-        };
-        
-        CFIndex found = CFArrayBSearchValues(CACHE(self)->ranges, CFRangeMake(0, CACHE(self)->rangeCount), &search, (CFComparatorFunction)&NSIndexSetCompareEntry, &search);
-        if (found != kCFNotFound)
-        {
-            return value;
-        }
-        
-        return NSNotFound;
-    }
-}
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger startRange = range ? range->location : 0;
+    NSUInteger endRange = range ? NSMaxRange(*range) : NSUIntegerMax;
+    NSUInteger found = 0;
+    NSUInteger next = startRange;
 
-- (NSUInteger)indexLessThanIndex:(NSUInteger)value
-{
-    if (IS_EMPTY(self))
-    {
-        return NSNotFound;
-    }
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        if (value <= start)
-        {
-            return NSNotFound;
-        }
-        else if (value <= end)
-        {
-            return value - 1;
-        }
-        else
-        {
-            return end;
-        }
-    }
-    else if (!BUILD_CACHE(self))
-    {
-        RangeList *ptr = MULTIPLE_RANGE_DATA(self);
-        if (value <= ptr->range.location)
-        {
-            return NSNotFound;
-        }
-        for (;; ptr = ptr->next)
-        {
-            NSUInteger start = ptr->range.location;
-            NSUInteger end = start + ptr->range.length - 1;
-            if (value <= end)
-            {
-                return value - 1;
-            }
-            if (ptr->next == NULL || value <= ptr->next->range.location)
-            {
-                return end;
-            }
-        }
-    }
-    else
+    for (NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, startRange); r < count && ranges[r].location < endRange && found < bufferSize; r++)
     {
-        RangeList search = {
-            .range = {
-                .location = value,
-                .length = 1,
-            },
-        };
-        
-        CFIndex found = CFArrayBSearchValues(CACHE(self)->ranges, CFRangeMake(0, CACHE(self)->rangeCount), &search, (CFComparatorFunction)&NSIndexSetCompareEntry, &search);
-        if (found != kCFNotFound)
+        NSUInteger first = MAX(ranges[r].location, startRange);
+        NSUInteger last = MIN(NSMaxRange(ranges[r]), endRange);
+        for (NSUInteger i = first; i < last && found < bufferSize; i++)
         {
-            return value - 1;
+            indexBuffer[found++] = i;
+            next = i + 1;
         }
-        
-        return NSNotFound;
     }
-    
-}
 
-- (NSUInteger)indexLessThanOrEqualToIndex:(NSUInteger)value
-{
-    if (IS_EMPTY(self))
-    {
-        return NSNotFound;
-    }
-    
-    if (HAS_SINGLE_RANGE(self))
+    // On return the range covers the indexes not yet returned.
+    if (range != NULL)
     {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        if (value < start)
+        if (found == bufferSize)
         {
-            return NSNotFound;
-        }
-        else if (value <= end)
-        {
-            return value;
+            *range = NSMakeRange(next, endRange - next);
         }
         else
         {
-            return end;
-        }
-    }
-    else if (!BUILD_CACHE(self))
-    {
-        RangeList *ptr = MULTIPLE_RANGE_DATA(self);
-        if (value < ptr->range.location)
-        {
-            return NSNotFound;
-        }
-        for (;; ptr = ptr->next)
-        {
-            NSUInteger start = ptr->range.location;
-            NSUInteger end = start + ptr->range.length - 1;
-            if (value <= end)
-            {
-                return value;
-            }
-            if (ptr->next == NULL || value < ptr->next->range.location)
-            {
-                return end;
-            }
+            *range = NSMakeRange(endRange, 0);
         }
     }
-    else
-    {
-        RangeList search = {
-            .range = {
-                .location = value,
-                .length = 1,
-            },
-        };
-        
-        CFIndex found = CFArrayBSearchValues(CACHE(self)->ranges, CFRangeMake(0, CACHE(self)->rangeCount), &search, (CFComparatorFunction)&NSIndexSetCompareEntry, &search);
-        if (found != kCFNotFound)
-        {
-            return value;
-        }
-        
-        return NSNotFound;
-    }
-}
-
-- (NSUInteger)getIndexes:(NSUInteger *)indexBuffer maxCount:(NSUInteger)bufferSize inIndexRange:(NSRangePointer)range
-{
-    if (IS_EMPTY(self) || bufferSize == 0)
-    {
-        return 0;
-    }
-    
-    NSUInteger count = 0;
-    NSUInteger startRange = range ? range->location : 0;
-    NSUInteger endRange = range ? (startRange + range->length - 1) : NSUIntegerMax;
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        
-        if (endRange < start || startRange > end)
-        {
-            return 0;
-        }
-        NSUInteger first = MAX(start, startRange);
-        NSUInteger last = MIN(end, endRange);
-        for (NSUInteger i = first; i <= last; i++)
-        {
-            indexBuffer[count++] = i;
-            if (count == bufferSize)
-            {
-                break;
-            }
-        }
-        return count;
-    }
-    
-    RangeList *ptr = NULL;
-    DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-    {
-        NSUInteger start = ptr->range.location;
-        NSUInteger end = start + ptr->range.length - 1;
-        
-        if (endRange < start)
-        {
-            return count;
-        }
-        if (startRange > end)
-        {
-            continue;
-        }
-        NSUInteger first = MAX(start, startRange);
-        NSUInteger last = MIN(end, endRange);
-        for (NSUInteger i = first; i <= last; i++)
-        {
-            indexBuffer[count++] = i;
-            if (count == bufferSize)
-            {
-                return count;
-            }
-        }
-    }
-    return count;
+    return found;
 }
 
 - (NSUInteger)countOfIndexesInRange:(NSRange)range
 {
-    if (IS_EMPTY(self))
+    if (IS_EMPTY(self) || range.length == 0)
     {
         return 0;
     }
-    
-    NSUInteger startRange = range.location;
-    NSUInteger endRange = startRange + range.length - 1;
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        
-        if (endRange < start || startRange > end)
-        {
-            return 0;
-        }
-        
-        NSUInteger first = MAX(start, startRange);
-        NSUInteger last = MIN(end, endRange);
-        return last - first + 1;
-    }
-    
+
     NSUInteger count = 0;
-    
-    RangeList *ptr = NULL;
-    DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger end = NSMaxRange(range);
+    NSUInteger found = 0;
+
+    for (NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, range.location); r < count && ranges[r].location < end; r++)
     {
-        NSUInteger start = ptr->range.location;
-        NSUInteger end = start + ptr->range.length - 1;
-        
-        if (endRange < start)
-        {
-            return count;
-        }
-        if (startRange > end)
-        {
-            continue;
-        }
-        NSUInteger first = MAX(start, startRange);
-        NSUInteger last = MIN(end, endRange);
-        count += last - first + 1;
+        NSUInteger first = MAX(ranges[r].location, range.location);
+        NSUInteger last = MIN(NSMaxRange(ranges[r]), end);
+        found += last - first;
     }
-    
-    return count;
+    return found;
 }
 
 - (BOOL)containsIndex:(NSUInteger)value
 {
-    if (IS_EMPTY(self))
-    {
-        return NO;
-    }
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        return value >= start && value <= end;
-    }
-    
-    RangeList *ptr = NULL;
-    DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-    {
-        NSUInteger start = ptr->range.location;
-        NSUInteger end = start + ptr->range.length - 1;
-        
-        if (value < start)
-        {
-            return NO;
-        }
-        if (value <= end)
-        {
-            return YES;
-        }
-    }
-    return NO;
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger idx = NSIndexSetFindRangeEndingAfter(ranges, count, value);
+    return idx < count && ranges[idx].location <= value;
 }
 
 - (BOOL)containsIndexesInRange:(NSRange)range
@@ -964,33 +782,11 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     {
         return NO;
     }
-    
-    NSUInteger startRange = range.location;
-    NSUInteger endRange = startRange + range.length - 1;
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        return startRange >= start && endRange <= end;
-    }
-    
-    RangeList *ptr = NULL;
-    
-    DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-    {
-        NSUInteger start = ptr->range.location;
-        NSUInteger end = start + ptr->range.length - 1;
-        
-        if (start > endRange)
-        {
-            break;
-        }
-        if (startRange >= start && endRange <= end)
-        {
-            return YES;
-        }
-    }
-    return NO;
+
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger idx = NSIndexSetFindRangeEndingAfter(ranges, count, range.location);
+    return idx < count && NSContainsRange(ranges[idx], range);
 }
 
 - (BOOL)containsIndexes:(NSIndexSet *)indexSet
@@ -1004,15 +800,12 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     {
         return NO;
     }
-    
-    if ([indexSet _hasSingleRange])
-    {
-        return [self containsIndexesInRange:[indexSet _singleRange]];
-    }
-    
-    for (RangeList *ptr = [indexSet _multipleRangeData]; ptr != NULL; ptr = ptr->next)
+
+    NSUInteger otherCount = 0;
+    NSRange *otherRanges = NSIndexSetGetRanges(indexSet, &otherCount);
+    for (NSUInteger idx = 0; idx < otherCount; idx++)
     {
-        if (![self containsIndexesInRange:ptr->range])
+        if (![self containsIndexesInRange:otherRanges[idx]])
         {
             return NO;
         }
@@ -1020,42 +813,18 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     
     return YES;
 }
+
 - (BOOL)intersectsIndexesInRange:(NSRange)range
 {
-    if (IS_EMPTY(self))
+    if (IS_EMPTY(self) || range.length == 0)
     {
         return NO;
     }
-    
-    NSUInteger startRange = range.location;
-    NSUInteger endRange = startRange + range.length - 1;
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        NSUInteger start = SINGLE_RANGE(self).location;
-        NSUInteger end = start + SINGLE_RANGE(self).length - 1;
-        return (startRange <= end && endRange >= start);
-    }
-    
-    RangeList *ptr = NULL;
-    DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
-    {
-        NSUInteger start = ptr->range.location;
-        NSUInteger end = start + ptr->range.length - 1;
-        
-        if (start > endRange)
-        {
-            break;
-        }
-        if (startRange <= end)
-        {
-            if (endRange >= start)
-            {
-                return YES;
-            }
-        }
-    }
-    return NO;
+
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
+    NSUInteger idx = NSIndexSetFindRangeEndingAfter(ranges, count, range.location);
+    return idx < count && ranges[idx].location < NSMaxRange(range);
 }
 
 - (id)description
@@ -1080,16 +849,17 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
     {
         NSMutableString *description = [@"" mutableCopy];
 
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger idx = 0; idx < count; idx++)
         {
-            if (ptr->range.length == 1)
+            if (ranges[idx].length == 1)
             {
-                [description appendFormat:@"index %lu -- ", (unsigned long)ptr->range.location];
+                [description appendFormat:@"index %lu -- ", (unsigned long)ranges[idx].location];
             }
             else
             {
-                [description appendFormat:@"index range %lu through %lu -- ", (unsigned long)ptr->range.location, (unsigned long)(ptr->range.location + ptr->range.length - 1)];
+                [description appendFormat:@"index range %lu through %lu -- ", (unsigned long)ranges[idx].location, (unsigned long)(NSMaxRange(ranges[idx]) - 1)];
             }
         }
         return [description autorelease];
@@ -1110,95 +880,184 @@ static inline CFComparisonResult NSIndexSetCompareEntry(RangeList *r1, RangeList
 
 - (void)dealloc
 {
-    CLEAR_CACHE(self);
-    
-    if (!IS_EMPTY(self) && !HAS_SINGLE_RANGE(self))
+    NSIndexSetFreeRanges(self);
+    [super dealloc];
+}
+
+// Ranges are copied out of the set before enumerating with options, so
+// blocks may mutate the set while they run.
+static NSRange *__NSIndexSetCopyRanges(NSIndexSet *self, NSRange *range, NSUInteger *actualCount)
+{
+    NSUInteger count = 0;
+    NSRange *source = NSIndexSetGetRanges(self, &count);
+    NSUInteger first = 0;
+
+    *actualCount = count;
+    if (range)
     {
-        RangeList *ptr = NULL;
-        RangeList *tmp = NULL;
-        
-        DL_FOREACH_SAFE(MULTIPLE_RANGE_DATA(self), ptr, tmp)
+        if (range->length == 0)
         {
-            free(ptr);
+            *actualCount = 0;
+            return NULL;
         }
-        
-        MULTIPLE_RANGE_DATA(self) = NULL;
+        first = NSIndexSetFindRangeEndingAfter(source, count, range->location);
+        *actualCount = NSIndexSetFindRangeStartingAfter(source, count, NSMaxRange(*range) - 1) - first;
+    }
+    if (*actualCount == 0)
+    {
+        return NULL;
+    }
+
+    NSRange *ranges = (NSRange *)malloc(*actualCount * sizeof(NSRange));
+    if (ranges == NULL)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+        return NULL;
+    }
+    for (NSUInteger i = 0; i < *actualCount; i++)
+    {
+        ranges[i] = range ? NSIntersectionRange(*range, source[first + i]) : source[first + i];
+    }
+    return ranges;
+}
+
+// NSEnumerationConcurrent hands each worker a run of this many consecutive
+// indexes rather than one index at a time, so dispatch overhead is spread
+// over the run and each worker walks its own stretch of the ranges.
+#define NSIndexSetConcurrentChunk 4096
+
+typedef struct {
+    const NSRange *ranges;
+    NSUInteger count;
+    NSUInteger *starts; // position of each range's first index, then the total
+    size_t chunks;
+} __NSIndexSetChunks;
+
+static void __NSIndexSetChunksCreate(__NSIndexSetChunks *chunks, const NSRange *ranges, NSUInteger count)
+{
+    chunks->ranges = ranges;
+    chunks->count = count;
+    chunks->starts = (NSUInteger *)malloc((count + 1) * sizeof(NSUInteger));
+    if (chunks->starts == NULL)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+        return;
+    }
+
+    NSUInteger total = 0;
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        chunks->starts[i] = total;
+        total += ranges[i].length;
+    }
+    chunks->starts[count] = total;
+    chunks->chunks = (total + NSIndexSetConcurrentChunk - 1) / NSIndexSetConcurrentChunk;
+}
+
+static void __NSIndexSetChunksDestroy(__NSIndexSetChunks *chunks)
+{
+    free(chunks->starts);
+    chunks->starts = NULL;
+}
+
+typedef void (^ChunkPieceCallback)(NSRange piece, BOOL *stop);
+
+// Calls block with the pieces of the ranges that make up chunk, in ascending
+// order, until it sets *stop.
+static void __NSIndexSetChunkEnumeratePieces(const __NSIndexSetChunks *chunks, size_t chunk, ChunkPieceCallback block)
+{
+    NSUInteger position = chunk * NSIndexSetConcurrentChunk;
+    NSUInteger end = MIN(position + NSIndexSetConcurrentChunk, chunks->starts[chunks->count]);
+
+    // Last range starting at or before position.
+    NSUInteger lo = 0;
+    NSUInteger hi = chunks->count;
+    while (hi - lo > 1)
+    {
+        NSUInteger mid = lo + (hi - lo) / 2;
+        if (chunks->starts[mid] <= position)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    BOOL stop = NO;
+    for (NSUInteger r = lo; position < end && r < chunks->count && !stop; r++)
+    {
+        NSUInteger offset = position - chunks->starts[r];
+        NSUInteger length = MIN(chunks->ranges[r].length - offset, end - position);
+        block(NSMakeRange(chunks->ranges[r].location + offset, length), &stop);
+        position += length;
     }
-    
-    [super dealloc];
 }
 
 typedef void (^IndexCallback)(NSUInteger, BOOL *);
 
-static void __NSEnumerateSingleIndexRange(NSRange range, NSEnumerationOptions options, IndexCallback block)
+static void __NSEnumerateIndexRanges(const NSRange *ranges, NSUInteger count, NSEnumerationOptions options, IndexCallback block)
 {
     if (options & NSEnumerationConcurrent)
     {
+        __NSIndexSetChunks chunks;
+        __NSIndexSetChunksCreate(&chunks, ranges, count);
         __block BOOL stop = NO;
-        dispatch_apply(range.length, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iter){
-            if (!stop)
+        dispatch_apply(chunks.chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk){
+            if (stop)
             {
-                block(iter + range.location, &stop);
+                return;
             }
+            __NSIndexSetChunkEnumeratePieces(&chunks, chunk, ^(NSRange piece, BOOL *stopPieces) {
+                for (NSUInteger i = piece.location; i < NSMaxRange(piece) && !stop; i++)
+                {
+                    block(i, &stop);
+                }
+                *stopPieces = stop;
+            });
         });
+        __NSIndexSetChunksDestroy(&chunks);
     }
     else if (options & NSEnumerationReverse)
     {
         BOOL stop = NO;
         
-        NSUInteger i = range.location + range.length;
-        while (i > range.location && !stop)
+        for (NSUInteger r = count; r > 0 && !stop; r--)
         {
-            block(i - 1, &stop);
-            i--;
+            NSUInteger i = NSMaxRange(ranges[r - 1]);
+            while (i > ranges[r - 1].location && !stop)
+            {
+                block(i - 1, &stop);
+                i--;
+            }
         }
     }
     else
     {
         BOOL stop = NO;
         
-        for (NSUInteger i = range.location; i < range.location + range.length; i++)
+        for (NSUInteger r = 0; r < count && !stop; r++)
         {
-            block(i, &stop);
-            if (stop)
+            for (NSUInteger i = ranges[r].location; i < NSMaxRange(ranges[r]) && !stop; i++)
             {
-                return;
+                block(i, &stop);
             }
         }
     }
 }
 
+static void __NSEnumerateSingleIndexRange(NSRange range, NSEnumerationOptions options, IndexCallback block)
+{
+    __NSEnumerateIndexRanges(&range, 1, options, block);
+}
+
 static void __NSEnumerateMultipleIndexRangesWithNonZeroOptions(NSIndexSet *self, NSRange *range, NSEnumerationOptions options, IndexCallback block)
 {
-    NSUInteger count = [self count];
-    NSUInteger *indexes = (NSUInteger *)malloc(count * sizeof(NSUInteger));
-    NSUInteger actualCount = [self getIndexes:indexes maxCount:count inIndexRange:range];
-    
-    if (options & NSEnumerationConcurrent)
-    {
-        __block BOOL stop = NO;
-        dispatch_apply(actualCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iter){
-            if (!stop)
-            {
-                block(indexes[iter], &stop);
-            }
-        });
-    }
-    else // NSEnumerationReverse
-    {
-        BOOL stop = NO;
-        
-        for (NSInteger i = actualCount - 1; i >= 0; i--)
-        {
-            block(indexes[i], &stop);
-            
-            if (stop)
-            {
-                break;
-            }
-        }
-    }
-    free(indexes);
+    NSUInteger count = 0;
+    NSRange *ranges = __NSIndexSetCopyRanges(self, range, &count);
+    __NSEnumerateIndexRanges(ranges, count, options, block);
+    free(ranges);
 }
 
 - (void)enumerateIndexesUsingBlock:(void (^)(NSUInteger idx, BOOL *stop))block
@@ -1235,20 +1094,12 @@ static void __NSEnumerateMultipleIndexRangesWithNonZeroOptions(NSIndexSet *self,
     else // multiple ranges, zero options
     {
         BOOL stop = NO;
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
         
-        for (RangeList *ptr = MULTIPLE_RANGE_DATA(self); ptr != NULL; ptr = ptr->next)
+        for (NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, range.location); r < count && ranges[r].location < NSMaxRange(range); r++)
         {
-            if (range.location >= ptr->range.location + ptr->range.length)
-            {
-                continue;
-            }
-            
-            if (ptr->range.location >= range.location + range.length)
-            {
-                break;
-            }
-            
-            NSRange iRange = NSIntersectionRange(range, ptr->range);
+            NSRange iRange = NSIntersectionRange(range, ranges[r]);
             
             for (NSUInteger i = iRange.location; i < iRange.location + iRange.length; i++)
             {
@@ -1287,10 +1138,12 @@ static void __NSEnumerateMultipleIndexRangesWithNonZeroOptions(NSIndexSet *self,
     else // multiple ranges, zero options
     {
         BOOL stop = NO;
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
         
-        for (RangeList *ptr = MULTIPLE_RANGE_DATA(self); ptr != NULL; ptr = ptr->next)
+        for (NSUInteger r = 0; r < count; r++)
         {
-            for (NSUInteger i = ptr->range.location; i < ptr->range.location + ptr->range.length; i++)
+            for (NSUInteger i = ranges[r].location; i < NSMaxRange(ranges[r]); i++)
             {
                 block(i, &stop);
                 
@@ -1307,31 +1160,12 @@ typedef void (^RangeCallback)(NSRange, BOOL *);
 
 static void __NSEnumerateMultipleRangesWithNonZeroOptions(NSIndexSet *self, NSRange *range, NSEnumerationOptions options, RangeCallback block)
 {
-    NSUInteger count = [self rangeCount];
-    
-    if (count == 0)
-    {
-        return;
-    }
-    
     NSUInteger actualCount = 0;
-    NSRange *ranges = (NSRange *)malloc(count * sizeof(NSRange));
-    RangeList *ptr = MULTIPLE_RANGE_DATA(self);
+    NSRange *ranges = __NSIndexSetCopyRanges(self, range, &actualCount);
     
-    for (NSUInteger i = 0; i < count; i++, ptr = ptr->next)
+    if (actualCount == 0)
     {
-        if (range)
-        {
-            if (range->location >= ptr->range.location + ptr->range.length)
-            {
-                continue;
-            }
-            if (ptr->range.location >= range->location + range->length)
-            {
-                break;
-            }
-        }
-        ranges[actualCount++] = ptr->range;
+        return;
     }
     
     if (options & NSEnumerationConcurrent)
@@ -1395,19 +1229,11 @@ static void __NSEnumerateMultipleRangesWithNonZeroOptions(NSIndexSet *self, NSRa
     else // multiple ranges, zero options
     {
         BOOL stop = NO;
-        RangeList *ptr = NULL;
-        RangeList *tmp = NULL;
-        DL_FOREACH_SAFE(MULTIPLE_RANGE_DATA(self), ptr, tmp)
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, range.location); r < count && ranges[r].location < NSMaxRange(range); r++)
         {
-            if (range.location >= ptr->range.location + ptr->range.length)
-            {
-                continue;
-            }
-            if (ptr->range.location >= range.location + range.length)
-            {
-                break;
-            }
-            NSRange iRange = NSIntersectionRange(range, ptr->range); // only really necessary on first and last iteration
+            NSRange iRange = NSIntersectionRange(range, ranges[r]); // only really necessary on first and last iteration
             block(iRange, &stop);
             if (stop)
             {
@@ -1442,11 +1268,11 @@ static void __NSEnumerateMultipleRangesWithNonZeroOptions(NSIndexSet *self, NSRa
     else // multiple ranges, zero options
     {
         BOOL stop = NO;
-        RangeList *ptr = NULL;
-        RangeList *tmp = NULL;
-        DL_FOREACH_SAFE(MULTIPLE_RANGE_DATA(self), ptr, tmp)
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger r = 0; r < count; r++)
         {
-            block(ptr->range, &stop);
+            block(ranges[r], &stop);
             if (stop)
             {
                 return;
@@ -1457,36 +1283,72 @@ static void __NSEnumerateMultipleRangesWithNonZeroOptions(NSIndexSet *self, NSRa
 
 typedef BOOL (^IndexTest)(NSUInteger, BOOL *);
 
-static NSUInteger __NSEnumerateIndexSingleIndexRange(NSRange range, NSEnumerationOptions options, IndexTest block)
+static NSUInteger __NSEnumerateIndexInRanges(const NSRange *ranges, NSUInteger count, NSEnumerationOptions options, IndexTest block)
 {
     if (options & NSEnumerationConcurrent)
     {
+        // Each chunk stops at its first match and later chunks are skipped
+        // once an earlier one has matched, so the lowest match wins.
+        __NSIndexSetChunks chunks;
+        __NSIndexSetChunksCreate(&chunks, ranges, count);
+        NSUInteger *found = (NSUInteger *)malloc(MAX(chunks.chunks, 1) * sizeof(NSUInteger));
+        if (found == NULL)
+        {
+            __NSIndexSetChunksDestroy(&chunks);
+            [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+            return NSNotFound;
+        }
+        for (size_t chunk = 0; chunk < chunks.chunks; chunk++)
+        {
+            found[chunk] = NSNotFound;
+        }
+
         __block BOOL stop = NO;
-        __block NSUInteger found = NSNotFound;
-        dispatch_apply(range.length, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iter){
-            if (!stop)
+        __block volatile long firstMatch = LONG_MAX;
+        dispatch_apply(chunks.chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk){
+            if (stop || (long)chunk > firstMatch)
             {
-                if (block(iter + range.location, &stop))
+                return;
+            }
+            __NSIndexSetChunkEnumeratePieces(&chunks, chunk, ^(NSRange piece, BOOL *stopPieces) {
+                for (NSUInteger i = piece.location; i < NSMaxRange(piece) && !stop; i++)
                 {
-                    found = iter + range.location;
-                    stop = YES;
+                    if (block(i, &stop))
+                    {
+                        found[chunk] = i;
+                        long current = firstMatch;
+                        while ((long)chunk < current && !OSAtomicCompareAndSwapLongBarrier(current, chunk, &firstMatch))
+                        {
+                            current = firstMatch;
+                        }
+                        *stopPieces = YES;
+                        return;
+                    }
                 }
-            }
+                *stopPieces = stop;
+            });
         });
-        return found;
+
+        NSUInteger result = NSNotFound;
+        for (size_t chunk = 0; chunk < chunks.chunks && result == NSNotFound; chunk++)
+        {
+            result = found[chunk];
+        }
+        free(found);
+        __NSIndexSetChunksDestroy(&chunks);
+        return result;
     }
     else if (options & NSEnumerationReverse)
     {
         BOOL stop = NO;
-        for (NSInteger i = range.location + range.length - 1 ; i >= range.location; i--)
+        for (NSUInteger r = count; r > 0 && !stop; r--)
         {
-            if (block(i, &stop))
-            {
-                return i;
-            }
-            if (stop)
+            for (NSUInteger i = NSMaxRange(ranges[r - 1]); i > ranges[r - 1].location && !stop; i--)
             {
-                break;
+                if (block(i - 1, &stop))
+                {
+                    return i - 1;
+                }
             }
         }
         return NSNotFound;
@@ -1494,58 +1356,31 @@ static NSUInteger __NSEnumerateIndexSingleIndexRange(NSRange range, NSEnumeratio
     else
     {
         BOOL stop = NO;
-        for (NSUInteger i = range.location; i < range.location + range.length; i++)
+        for (NSUInteger r = 0; r < count && !stop; r++)
         {
-            if (block(i, &stop))
+            for (NSUInteger i = ranges[r].location; i < NSMaxRange(ranges[r]) && !stop; i++)
             {
-                return i;
-            }
-            if (stop)
-            {
-                break;
+                if (block(i, &stop))
+                {
+                    return i;
+                }
             }
         }
         return NSNotFound;
     }
 }
 
+static NSUInteger __NSEnumerateIndexSingleIndexRange(NSRange range, NSEnumerationOptions options, IndexTest block)
+{
+    return __NSEnumerateIndexInRanges(&range, 1, options, block);
+}
+
 static NSUInteger __NSEnumerateIndexMultipleIndexRangesWithNonZeroOptions(NSIndexSet *self, NSRange *range, NSEnumerationOptions options, IndexTest block)
 {
-    NSUInteger count = [self count];
-    NSUInteger *indexes = (NSUInteger *)malloc(count * sizeof(NSUInteger));
-    NSUInteger actualCount = [self getIndexes:indexes maxCount:count inIndexRange:range];
-    __block NSUInteger found = NSNotFound;
-    if (options & NSEnumerationConcurrent)
-    {
-        __block BOOL stop = NO;
-        dispatch_apply(actualCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iter){
-            if (!stop)
-            {
-                if (block(indexes[iter], &stop))
-                {
-                    found = indexes[iter];
-                    stop = YES;
-                }
-            }
-        });
-    }
-    else // NSEnumerationReverse
-    {
-        BOOL stop = NO;
-        for (NSInteger i = actualCount - 1; i >= 0; i--)
-        {
-            if (block(indexes[i], &stop))
-            {
-                found = indexes[i];
-                break;
-            }
-            if (stop)
-            {
-                break;
-            }
-        }
-    }
-    free(indexes);
+    NSUInteger count = 0;
+    NSRange *ranges = __NSIndexSetCopyRanges(self, range, &count);
+    NSUInteger found = __NSEnumerateIndexInRanges(ranges, count, options, block);
+    free(ranges);
     return found;
 }
 
@@ -1583,18 +1418,11 @@ static NSUInteger __NSEnumerateIndexMultipleIndexRangesWithNonZeroOptions(NSInde
     else // multiple ranges, zero options
     {
         BOOL stop = NO;
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, range.location); r < count && ranges[r].location < NSMaxRange(range); r++)
         {
-            if (range.location >= ptr->range.location + ptr->range.length)
-            {
-                continue;
-            }
-            if (ptr->range.location >= range.location + range.length)
-            {
-                break;
-            }
-            NSRange iRange = NSIntersectionRange(range, ptr->range);
+            NSRange iRange = NSIntersectionRange(range, ranges[r]);
             for (NSUInteger i = iRange.location; i < iRange.location + iRange.length; i++)
             {
                 if (predicate(i, &stop))
@@ -1630,117 +1458,191 @@ static NSUInteger __NSEnumerateIndexMultipleIndexRangesWithNonZeroOptions(NSInde
     {
         return __NSEnumerateIndexMultipleIndexRangesWithNonZeroOptions(self, nil, options, predicate);
     }
-    else // multiple ranges, zero options
+    else // multiple ranges, zero options
+    {
+        BOOL stop = NO;
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger r = 0; r < count; r++)
+        {
+            for (NSUInteger i = ranges[r].location; i < NSMaxRange(ranges[r]); i++)
+            {
+                if (predicate(i, &stop))
+                {
+                    return i;
+                }
+                if (stop)
+                {
+                    break;
+                }
+            }
+        }
+        return NSNotFound;
+    }
+}
+
+// Collects passing indexes as coalesced ranges, in whichever direction they
+// arrive.
+typedef struct {
+    NSRange *ranges;
+    NSUInteger count;
+    NSUInteger capacity;
+} __NSIndexSetBuilder;
+
+static void __NSIndexSetBuilderAdd(__NSIndexSetBuilder *builder, NSUInteger idx, BOOL descending)
+{
+    if (builder->count > 0)
+    {
+        NSRange *last = &builder->ranges[builder->count - 1];
+        if (!descending && idx == NSMaxRange(*last))
+        {
+            last->length++;
+            return;
+        }
+        if (descending && idx + 1 == last->location)
+        {
+            last->location--;
+            last->length++;
+            return;
+        }
+    }
+    if (builder->count == builder->capacity)
+    {
+        NSUInteger capacity = builder->capacity == 0 ? 16 : builder->capacity * 2;
+        NSRange *ranges = (NSRange *)realloc(builder->ranges, capacity * sizeof(NSRange));
+        if (ranges == NULL)
+        {
+            [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+            return;
+        }
+        builder->ranges = ranges;
+        builder->capacity = capacity;
+    }
+    builder->ranges[builder->count++] = NSMakeRange(idx, 1);
+}
+
+static NSIndexSet *__NSIndexSetBuilderCreateIndexSet(__NSIndexSetBuilder *builder, BOOL descending)
+{
+    if (descending)
     {
-        BOOL stop = NO;
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+        for (NSUInteger i = 0; i < builder->count / 2; i++)
         {
-            for (NSUInteger i = ptr->range.location; i < ptr->range.location + ptr->range.length; i++)
-            {
-                if (predicate(i, &stop))
-                {
-                    return i;
-                }
-                if (stop)
-                {
-                    break;
-                }
-            }
+            NSRange tmp = builder->ranges[i];
+            builder->ranges[i] = builder->ranges[builder->count - 1 - i];
+            builder->ranges[builder->count - 1 - i] = tmp;
         }
-        return NSNotFound;
     }
+    NSMutableIndexSet *indexSet = [[NSMutableIndexSet alloc] init];
+    NSIndexSetAdoptRanges(indexSet, builder->ranges, builder->count, builder->capacity);
+    builder->ranges = NULL;
+    builder->count = 0;
+    builder->capacity = 0;
+    return indexSet;
 }
 
-static NSIndexSet *__NSEnumerateIndexesSingleIndexRange(NSRange range, NSEnumerationOptions options, IndexTest block)
+static NSIndexSet *__NSEnumerateIndexesInRanges(const NSRange *ranges, NSUInteger count, NSEnumerationOptions options, IndexTest block)
 {
-    __block NSMutableIndexSet *indexSet = [[NSIndexSet indexSet] mutableCopy];
     if (options & NSEnumerationConcurrent)
     {
+        // Every chunk fills its own builder; they are concatenated in order
+        // afterwards, so no lock is shared between workers.
+        __NSIndexSetChunks chunks;
+        __NSIndexSetChunksCreate(&chunks, ranges, count);
+        __NSIndexSetBuilder *builders = (__NSIndexSetBuilder *)calloc(MAX(chunks.chunks, 1), sizeof(__NSIndexSetBuilder));
+        if (builders == NULL)
+        {
+            __NSIndexSetChunksDestroy(&chunks);
+            [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+            return nil;
+        }
+
         __block BOOL stop = NO;
-        dispatch_apply(range.length, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iter){
-            if (!stop)
+        dispatch_apply(chunks.chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk){
+            if (stop)
             {
-                if (block(iter + range.location, &stop))
+                return;
+            }
+            __NSIndexSetBuilder *builder = &builders[chunk];
+            __NSIndexSetChunkEnumeratePieces(&chunks, chunk, ^(NSRange piece, BOOL *stopPieces) {
+                for (NSUInteger i = piece.location; i < NSMaxRange(piece) && !stop; i++)
                 {
-                    [indexSet addIndex:iter + range.location];
+                    if (block(i, &stop))
+                    {
+                        __NSIndexSetBuilderAdd(builder, i, NO);
+                    }
                 }
-            }
+                *stopPieces = stop;
+            });
         });
-    }
-    else if (options & NSEnumerationReverse)
-    {
-        BOOL stop = NO;
-        for (NSInteger i = range.location + range.length - 1 ; i >= range.location; i--)
+
+        __NSIndexSetBuilder merged = { NULL, 0, 0 };
+        for (size_t chunk = 0; chunk < chunks.chunks; chunk++)
         {
-            if (block(i, &stop))
-            {
-                [indexSet addIndex:i];
-            }
-            if (stop)
-            {
-                break;
-            }
+            merged.capacity += builders[chunk].count;
         }
-    }
-    else
-    {
-        BOOL stop = NO;
-        for (NSUInteger i = range.location; i < range.location + range.length; i++)
+        merged.ranges = (NSRange *)malloc(MAX(merged.capacity, 1) * sizeof(NSRange));
+        for (size_t chunk = 0; chunk < chunks.chunks; chunk++)
         {
-            if (block(i, &stop))
-            {
-                [indexSet addIndex:i];
-            }
-            if (stop)
+            for (NSUInteger i = 0; merged.ranges != NULL && i < builders[chunk].count; i++)
             {
-                break;
+                NSIndexSetAppendRange(merged.ranges, &merged.count, builders[chunk].ranges[i]);
             }
+            free(builders[chunk].ranges);
+        }
+        free(builders);
+        __NSIndexSetChunksDestroy(&chunks);
+        if (merged.ranges == NULL)
+        {
+            [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+            return nil;
         }
+        return [__NSIndexSetBuilderCreateIndexSet(&merged, NO) autorelease];
     }
-    return [indexSet autorelease];
-}
 
-static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSIndexSet *self, NSRange *range, NSEnumerationOptions options, IndexTest block)
-{
-    NSUInteger count = [self count];
-    if (count == 0)
-    {
-        return [NSIndexSet indexSet];
-    }
-    NSUInteger *indexes = (NSUInteger *)malloc(count * sizeof(NSUInteger));
-    NSUInteger actualCount = [self getIndexes:indexes maxCount:count inIndexRange:range];
-    __block NSMutableIndexSet *indexSet = [[NSIndexSet indexSet] mutableCopy];
-    if (options & NSEnumerationConcurrent)
+    BOOL descending = (options & NSEnumerationReverse) != 0;
+    __NSIndexSetBuilder builder = { NULL, 0, 0 };
+    BOOL stop = NO;
+    if (descending)
     {
-        __block BOOL stop = NO;
-        dispatch_apply(actualCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iter){
-            if (!stop)
+        for (NSUInteger r = count; r > 0 && !stop; r--)
+        {
+            for (NSUInteger i = NSMaxRange(ranges[r - 1]); i > ranges[r - 1].location && !stop; i--)
             {
-                if (block(indexes[iter], &stop))
+                if (block(i - 1, &stop))
                 {
-                    [indexSet addIndex:indexes[iter]];
+                    __NSIndexSetBuilderAdd(&builder, i - 1, YES);
                 }
             }
-        });
+        }
     }
-    else // NSEnumerationReverse
+    else
     {
-        BOOL stop = NO;
-        for (NSInteger i = actualCount - 1; i >= 0; i--)
+        for (NSUInteger r = 0; r < count && !stop; r++)
         {
-            if (block(indexes[i], &stop))
-            {
-                [indexSet addIndex:indexes[i]];
-            }
-            if (stop)
+            for (NSUInteger i = ranges[r].location; i < NSMaxRange(ranges[r]) && !stop; i++)
             {
-                break;
+                if (block(i, &stop))
+                {
+                    __NSIndexSetBuilderAdd(&builder, i, NO);
+                }
             }
         }
     }
-    free(indexes);
-    return [indexSet autorelease];
+    return [__NSIndexSetBuilderCreateIndexSet(&builder, descending) autorelease];
+}
+
+static NSIndexSet *__NSEnumerateIndexesSingleIndexRange(NSRange range, NSEnumerationOptions options, IndexTest block)
+{
+    return __NSEnumerateIndexesInRanges(&range, 1, options, block);
+}
+
+static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSIndexSet *self, NSRange *range, NSEnumerationOptions options, IndexTest block)
+{
+    NSUInteger count = 0;
+    NSRange *ranges = __NSIndexSetCopyRanges(self, range, &count);
+    NSIndexSet *indexSet = __NSEnumerateIndexesInRanges(ranges, count, options, block);
+    free(ranges);
+    return indexSet;
 }
 
 - (NSIndexSet *)indexesPassingTest:(BOOL (^)(NSUInteger idx, BOOL *stop))predicate
@@ -1778,18 +1680,11 @@ static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSI
     {
         NSMutableIndexSet *indexSet = [[NSIndexSet indexSet] mutableCopy];
         BOOL stop = NO;
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, range.location); r < count && ranges[r].location < NSMaxRange(range); r++)
         {
-            if (range.location >= ptr->range.location + ptr->range.length)
-            {
-                continue;
-            }
-            if (ptr->range.location >= range.location + range.length)
-            {
-                break;
-            }
-            NSRange iRange = NSIntersectionRange(range, ptr->range);
+            NSRange iRange = NSIntersectionRange(range, ranges[r]);
             for (NSUInteger i = iRange.location; i < iRange.location + iRange.length; i++)
             {
                 if (predicate(i, &stop))
@@ -1830,10 +1725,11 @@ static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSI
     {
         NSMutableIndexSet *indexSet = [[NSIndexSet indexSet] mutableCopy];
         BOOL stop = NO;
-        RangeList *ptr = NULL;
-        DL_FOREACH(MULTIPLE_RANGE_DATA(self), ptr)
+        NSUInteger count = 0;
+        NSRange *ranges = NSIndexSetGetRanges(self, &count);
+        for (NSUInteger r = 0; r < count; r++)
         {
-            for (NSUInteger i = ptr->range.location; i < ptr->range.location + ptr->range.length; i++)
+            for (NSUInteger i = ranges[r].location; i < NSMaxRange(ranges[r]); i++)
             {
                 if (predicate(i, &stop))
                 {
@@ -1849,82 +1745,29 @@ static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSI
     }
 }
 
-- (RangeList *)_pointerToRangeBeforeOrContainingIndex:(NSUInteger)index
-{
-    RangeList *ptr = MULTIPLE_RANGE_DATA(self);
-    if (ptr == NULL)
-    {
-        return NULL;
-    }
-    
-    if (ptr->range.location > index)
-    {
-        return NULL; // insert at beginning
-    }
-    while (ptr->next && ptr->next->range.location <= index)
-    {
-        ptr = ptr->next;
-    }
-    return ptr;
-}
-
-- (void)_mergeOverlappingRangesStartingAtIndex:(RangeList *)ptr
-{
-    if (ptr == NULL)
-    {
-        return;
-    }
-    NSUInteger start = ptr->range.location;
-    while (YES)
-    {
-        RangeList *next = ptr->next;
-        if (next)
-        {
-            NSUInteger endAnd1 = start + ptr->range.length;
-            NSUInteger nextStart = next->range.location;
-            if (endAnd1 >= nextStart)
-            {
-                NSUInteger nextEndAnd1 = nextStart + next->range.length;
-                DL_DELETE(MULTIPLE_RANGE_DATA(self), next);
-                ptr->range.length = MAX(endAnd1, nextEndAnd1) - start;
-                free(next);
-                continue;
-            }
-        }
-        break;
-    }
-    if (MULTIPLE_RANGE_DATA(self)->next == NULL)
-    {
-        CLEAR_CACHE(self);
-        SET_HAS_SINGLE_RANGE(self, YES);
-        SET_EMPTY(self, NO);
-        SET_SINGLE_RANGE(self, ptr->range);
-        free(ptr);
-    }
-}
-
 - (void)_setContentToContentFromIndexSet:(NSIndexSet *)other
 {
-    if ([other _isEmpty])
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(other, &count);
+    if (count == 0)
     {
+        NSIndexSetSetEmpty(self);
         return;
     }
-    
-    SET_EMPTY(self, NO);
-    
-    if ([other _hasSingleRange])
+    if (count == 1)
     {
-        SET_HAS_SINGLE_RANGE(self, YES);
-        SET_SINGLE_RANGE(self, [other _singleRange]);
+        NSIndexSetSetSingleRange(self, ranges[0]);
         return;
     }
 
-    for (RangeList *ptr = [other _multipleRangeData]; ptr != NULL; ptr = ptr->next)
+    NSRange *copy = malloc(count * sizeof(NSRange));
+    if (copy == NULL)
     {
-        RangeList *to = (RangeList *)malloc(sizeof(RangeList));
-        to->range = ptr->range;
-        DL_APPEND(MULTIPLE_RANGE_DATA(self), to);
+        [NSException raise:NSMallocException format:@"Unable to allocate index set storage"];
+        return;
     }
+    memcpy(copy, ranges, count * sizeof(NSRange));
+    NSIndexSetAdoptRanges(self, copy, count, count);
 }
 
 @end
@@ -1933,68 +1776,80 @@ static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSI
 
 - (void)addIndexes:(NSIndexSet *)indexSet
 {
-    if (indexSet == nil || [indexSet _isEmpty])
+    if (indexSet == nil || indexSet == self || [indexSet _isEmpty])
     {
         return;
     }
-    if ([indexSet _hasSingleRange])
+
+    NSUInteger otherCount = 0;
+    NSRange *otherRanges = NSIndexSetGetRanges(indexSet, &otherCount);
+    if (otherCount < NSIndexSetMergeThreshold)
     {
-        [self addIndexesInRange:[indexSet _singleRange]];
+        for (NSUInteger idx = 0; idx < otherCount; idx++)
+        {
+            addIndexesInRange(self, otherRanges[idx]);
+        }
     }
     else
     {
-        NSUInteger currentIndex = [indexSet firstIndex];
-        while (currentIndex != NSNotFound)
-        {
-            [self addIndex:currentIndex];
-            currentIndex = [indexSet indexGreaterThanIndex:currentIndex];
-        }
+        NSIndexSetMergeRanges(self, indexSet, &NSIndexSetUnionRanges);
     }
 }
 
 - (void)removeIndexes:(NSIndexSet *)indexSet
 {
-    if ([indexSet _isEmpty])
+    if (indexSet == nil || [indexSet _isEmpty])
     {
         return;
     }
-    if ([indexSet _hasSingleRange])
+    if (indexSet == self)
     {
-        [self removeIndexesInRange:[indexSet _singleRange]];
+        NSIndexSetSetEmpty(self);
+        return;
     }
-    else
+
+    NSUInteger otherCount = 0;
+    NSRange *otherRanges = NSIndexSetGetRanges(indexSet, &otherCount);
+    if (otherCount < NSIndexSetMergeThreshold)
     {
-        for (RangeList *ptr = [indexSet _multipleRangeData]; ptr != NULL; ptr = ptr->next)
+        for (NSUInteger idx = 0; idx < otherCount; idx++)
         {
-            [self removeIndexesInRange:ptr->range];
+            removeIndexesInRange(self, otherRanges[idx]);
         }
     }
+    else
+    {
+        NSIndexSetMergeRanges(self, indexSet, &NSIndexSetSubtractRanges);
+    }
 }
 
-- (void)removeAllIndexes
+- (void)_intersectIndexes:(NSIndexSet *)indexSet
 {
-    if (!IS_EMPTY(self) && !HAS_SINGLE_RANGE(self))
+    if (indexSet == self)
     {
-        RangeList *ptr = NULL;
-        RangeList *tmp = NULL;
-        
-        DL_FOREACH_SAFE(MULTIPLE_RANGE_DATA(self), ptr, tmp)
-        {
-            free(ptr);
-        }
+        return;
     }
+    if (indexSet == nil || [indexSet _isEmpty])
+    {
+        NSIndexSetSetEmpty(self);
+        return;
+    }
+    NSIndexSetMergeRanges(self, indexSet, &NSIndexSetIntersectRanges);
+}
 
+- (void)removeAllIndexes
+{
     CLEAR_RANGES(self);
 }
 
 - (void)addIndex:(NSUInteger)value
 {
-    [self addIndexesInRange:NSMakeRange(value, 1)];
+    addIndexesInRange(self, NSMakeRange(value, 1));
 }
 
 - (void)removeIndex:(NSUInteger)value
 {
-    [self removeIndexesInRange:NSMakeRange(value, 1)];
+    removeIndexesInRange(self, NSMakeRange(value, 1));
 }
 
 - (void)addIndexesInRange:(NSRange)range
@@ -2004,260 +1859,82 @@ static NSIndexSet *__NSEnumerateIndexesMultipleIndexRangesWithNonZeroOptions(NSI
 
 - (void)removeIndexesInRange:(NSRange)range
 {
-    if (range.length == 0 || [self _isEmpty])
-    {
-        return;
-    }
-    
-    NSUInteger start = range.location;
-    NSUInteger end = start + range.length - 1;
-    
-    if (HAS_SINGLE_RANGE(self))
-    {
-        if (NSIntersectionRange(SINGLE_RANGE(self), range).length == 0)
-        {
-            return;
-        }
-
-        NSUInteger rangeStart = SINGLE_RANGE(self).location;
-        NSUInteger rangeEnd = rangeStart + SINGLE_RANGE(self).length - 1;
-        
-        if (start <= rangeStart && (end >= rangeEnd))  // remove everything
-        {
-            CLEAR_RANGES(self);
-            return;
-        }
-        else if (start <= rangeStart)
-        {
-            SET_SINGLE_RANGE(self, NSMakeRange(end + 1, rangeEnd - end));
-            return;
-        }
-        else if (end >= rangeEnd)
-        {
-            SET_SINGLE_RANGE(self, NSMakeRange(SINGLE_RANGE(self).location, start - rangeStart));
-            return;
-        }
-        else // Need to split
-        {
-            SET_HAS_SINGLE_RANGE(self, NO);
-            SET_EMPTY(self, NO);
-            // set the cache to NULL so that it does not have junk data from the union
-            RESET_CACHE(self);
-            
-            RangeList *first = (RangeList *)malloc(sizeof(RangeList));
-            first->range.location = rangeStart;
-            first->range.length = start - rangeStart;
-            
-            RangeList *second = (RangeList *)malloc(sizeof(RangeList));
-            second->range.location = end + 1;
-            second->range.length = rangeEnd - end;
-            
-            MULTIPLE_RANGE_DATA(self) = NULL;
-            DL_APPEND(MULTIPLE_RANGE_DATA(self), first);
-            DL_APPEND(MULTIPLE_RANGE_DATA(self), second);
-            return;
-        }
-    }
-    else
-    {
-        CLEAR_CACHE(self);
-        
-        RangeList *tmp;
-        RangeList *ptr = [self _pointerToRangeBeforeOrContainingIndex:start];
-        if (ptr == NULL)
-        {
-            ptr = MULTIPLE_RANGE_DATA(self); // start at beginning
-        }
-        
-        DL_FOREACH_SAFE(ptr, ptr, tmp)
-        {
-            NSUInteger rangeStart = ptr->range.location;
-            NSUInteger rangeEnd = rangeStart + ptr->range.length - 1;
-            if (start > rangeEnd)
-            {
-                continue;
-            }
-            else if (start <= rangeStart && (end >= rangeEnd)) // remove whole range
-            {
-                DL_DELETE(MULTIPLE_RANGE_DATA(self), ptr);
-                free(ptr);
-                continue;
-            }
-            else if (rangeStart > end) // passed relevant ranges
-            {
-                break;
-            }
-            else if (start <= rangeStart)
-            {
-                ptr->range.location = end + 1;
-                ptr->range.length = rangeEnd - end;
-                break;  // Cannot be any more relevant ranges
-            }
-            else if (end >= rangeEnd)
-            {
-                ptr->range.length = start - rangeStart;
-                continue;
-            }
-            else // Need to split
-            {
-                ptr->range.length = start - rangeStart;
-                
-                RangeList *second = (RangeList *)malloc(sizeof(RangeList));
-                second->range.location = end + 1;
-                second->range.length = rangeEnd - end;
-                
-                DL_INSERT(MULTIPLE_RANGE_DATA(self), ptr, second);
-                break;
-            }
-        }
-        
-        [self _mergeOverlappingRangesStartingAtIndex:ptr != NULL ? ptr->prev : MULTIPLE_RANGE_DATA(self)];
-    }
-}
-
-// Shift a range, possibly truncating at 0
-static inline void _shiftRange(NSRange *range, NSInteger delta)
-{
-    if (delta < 0 && -delta > range->location)
-    {
-        if (-delta > NSMaxRange(*range))
-        {
-            range->length = 0;
-        }
-        else
-        {
-            range->length = NSMaxRange(*range) + delta;
-        }
-        range->location = 0;
-    }
-    else
-    {
-        range->location += delta;
-    }
+    removeIndexesInRange(self, range);
 }
 
+/*!
+ Replicated behavior:
+ @note  Shifting left removes the indexes in [index + delta, index) first, as
+        well as any that would end up below zero.
+ */
 - (void)shiftIndexesStartingAtIndex:(NSUInteger)index by:(NSInteger)delta
 {
-    if (IS_EMPTY(self))
+    if (IS_EMPTY(self) || delta == 0)
     {
         return;
     }
 
-    if (delta == 0)
-    {
-        return;
-    }
+    NSUInteger count = 0;
+    NSRange *ranges = NSIndexSetGetRanges(self, &count);
 
-    if (HAS_SINGLE_RANGE(self))
+    if (delta > 0)
     {
-        // Index past range results in no change
-        if(NSMaxRange(SINGLE_RANGE(self)) <= index)
+        // Index past the last range results in no change
+        if (NSMaxRange(ranges[count - 1]) <= index)
         {
             return;
         }
 
         // Overflow
-        if ((delta > 0) && (NSMaxRange(SINGLE_RANGE(self)) > (NSNotFound - delta - 1)))
+        if (NSMaxRange(ranges[count - 1]) > (NSNotFound - delta - 1))
         {
             [NSException raise:NSRangeException format:@"shift would push range past NSNotFound - 1"];
             return;
         }
 
-        // Overlapping negative shift results in one range
-        if ((delta < 0) && -delta <= SINGLE_RANGE(self).length)
-        {
-            _shiftRange(&SINGLE_RANGE(self), delta);
-            return;
-        }
-
-        // Index before single range results in one range (or zero if shifted left too far)
-        if (index <= SINGLE_RANGE(self).location)
-        {
-            _shiftRange(&SINGLE_RANGE(self), delta);
-            if (SINGLE_RANGE(self).length == 0)
-            {
-                CLEAR_RANGES(self);
-            }
-            return;
-        }
-
-        // Otherwise, index inside single range splits into two ranges
-        RangeList *firstRange = malloc(sizeof(RangeList));
-        RangeList *secondRange = malloc(sizeof(RangeList));
-
-        NSRange currentRange = SINGLE_RANGE(self);
-
-        CLEAR_CACHE(self);
-        SET_HAS_SINGLE_RANGE(self, NO);
-        MULTIPLE_RANGE_DATA(self) = NULL;
-
-        firstRange->range = NSMakeRange(currentRange.location, index - currentRange.location);
-        secondRange->range = NSMakeRange(index, NSMaxRange(currentRange) - index);
-
-        if (delta > 0)
+        // A range straddling index splits in two, which the shift separates
+        NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, index);
+        if (ranges[r].location < index)
         {
-            _shiftRange(&secondRange->range, delta);
+            NSRange split[2] = {
+                NSMakeRange(ranges[r].location, index - ranges[r].location),
+                NSMakeRange(index, NSMaxRange(ranges[r]) - index),
+            };
+            NSIndexSetReplaceRanges(self, r, r + 1, split, 2);
+            ranges = NSIndexSetGetRanges(self, &count);
+            r++;
         }
-        else
+        for (; r < count; r++)
         {
-            _shiftRange(&firstRange->range, delta);
+            ranges[r].location += delta;
         }
-
-        DL_APPEND(MULTIPLE_RANGE_DATA(self), firstRange);
-        DL_APPEND(MULTIPLE_RANGE_DATA(self), secondRange);
-
-        return;
     }
     else
     {
-        CLEAR_CACHE(self);
+        NSUInteger shift = -delta;
+        NSUInteger start = index > shift ? index - shift : 0;
+        removeIndexesInRange(self, NSMakeRange(start, MAX(index, shift) - start));
+        if (IS_EMPTY(self))
+        {
+            return;
+        }
 
-        RangeList *ptr = [self _pointerToRangeBeforeOrContainingIndex:index];
-        if (ptr == NULL)
+        ranges = NSIndexSetGetRanges(self, &count);
+        NSUInteger r = NSIndexSetFindRangeEndingAfter(ranges, count, index);
+        if (r == count)
         {
-            ptr = MULTIPLE_RANGE_DATA(self); // start at beginning
+            return;
         }
-        if (NSLocationInRange(index, ptr->range) && ptr->range.location != index)
+        for (NSUInteger i = r; i < count; i++)
         {
-            //Break the range up
-            RangeList *second = (RangeList *)malloc(sizeof(RangeList));
-            second->range.location = index;
-            second->range.length = (ptr->range.location + ptr->range.length) - index;
-            second->next = ptr->next;
-
-            ptr->next = second;
-            ptr->range.length = index - ptr->range.location;
-
-            ptr = second;
+            ranges[i].location -= shift;
         }
-        for (; ptr != NULL; ptr = ptr->next)
+
+        // The first shifted range may now touch the one before it
+        if (r > 0 && NSMaxRange(ranges[r - 1]) == ranges[r].location)
         {
-            if(NSMaxRange(ptr->range) <= index)
-            {
-                continue;
-            }
-            else if ((delta > 0) && ((ptr->range.location + ptr->range.length) > (NSNotFound - delta - 1)))
-            {
-                [NSException raise:NSRangeException format:@"shift would push range past NSNotFound - 1"];
-                return;
-            }
-            else if ((delta < 0) && (ptr->range.location < -delta))
-            {
-                if (ptr->range.location + ptr->range.length <= -delta)
-                {
-                    [self removeIndexesInRange: NSMakeRange(ptr->range.location, ptr->range.length)];
-                }
-                else
-                {
-                    NSUInteger oldLocation = ptr->range.location;
-                    ptr->range.location = 0;
-                    ptr->range.length += (oldLocation + delta);
-                }
-            }
-            else
-            {
-                ptr->range.location += delta;
-            }
+            NSRange merged = NSMakeRange(ranges[r - 1].location, ranges[r - 1].length + ranges[r].length);
+            NSIndexSetReplaceRanges(self, r - 1, r + 1, &merged, 1);
         }
     }
 }
@@ -7,6 +7,7 @@
 
 #import <Foundation/NSJSONSerialization.h>
 #import <Foundation/NSArray.h>
+#import <Foundation/NSAutoreleasePool.h>
 #import <Foundation/NSData.h>
 #import <Foundation/NSDecimalNumber.h>
 #import <Foundation/NSDictionary.h>
@@ -16,6 +17,13 @@
 #import <Foundation/NSString.h>
 #import "NSObjectInternal.h"
 #import "NSBOMEncoding.h"
+#include <float.h>
+#include <math.h>
+#import <Foundation/NSJSONSerialization_Private.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 @interface _NSJSONReader : NSObject
 {
@@ -27,6 +35,7 @@
 
 @interface _NSJSONWriter : NSObject
 {
+@public
     NSOutputStream *outputStream;
     NSJSONWritingOptions kind;
     char *dataBuffer;
@@ -38,6 +47,7 @@
     NSInteger totalDataWritten;
 }
 - (int)appendString:(NSString *)string range:(NSRange)range;
+- (void)resizeTemporaryBuffer:(size_t)size;
 @end
 
 @implementation _NSJSONReader
@@ -109,44 +119,6 @@
     [super dealloc];
 }
 
-- (id)parseStream:(NSInputStream *)stream options:(NSJSONReadingOptions)opts
-{
-    id parsed = nil;
-    if (kind == 0)
-    {
-        NSMutableData *data = [[NSMutableData alloc] init];
-
-        while ([stream hasBytesAvailable])
-        {
-            uint8_t *buffer = NULL;
-            NSUInteger len = 0;
-            BOOL needsFree = NO;
-            if (![stream getBuffer:&buffer length:&len])
-            {
-                len = 1024;
-                buffer = malloc(len);
-                needsFree = YES;
-                len = [stream read:buffer maxLength:len];
-            }
-
-            [data appendBytes:buffer length:len];
-
-            if (needsFree)
-            {
-                free(buffer);
-            }
-        }
-        NSStreamStatus status = [stream streamStatus];
-        if (status == NSStreamStatusError)
-        {
-            [self setError:[stream streamError]];
-        }
-        parsed = [self parseData:data options:opts];
-        [data release];
-    }
-    return parsed;
-}
-
 - (id)parseData:(NSData *)data options:(NSJSONReadingOptions)opts
 {
     id parsed = nil;
@@ -185,39 +157,54 @@
     return encoding;
 }
 
-static inline unichar incrementBuffer(unichar **buffer) {
-    *buffer = *buffer + 1;
-    return **buffer;
+#define JSON_STREAM_BUFFER_SIZE (64 * 1024)
+
+// The reader walks the UTF-8 bytes of the input in place; peeking past the
+// end of the buffer yields '\0' so the parsers below can treat it the same way
+// a NUL terminated buffer would be treated. When reading from a stream the
+// buffer is a fixed size window that is refilled once it has been consumed,
+// so nothing may hold on to bytes across a call that advances the buffer.
+typedef struct {
+    const uint8_t *cur;
+    const uint8_t *end;
+    NSInputStream *stream;
+    uint8_t *storage;
+    NSUInteger storageSize;
+} JSONBuffer;
+
+static BOOL refillBuffer(JSONBuffer *buffer) {
+    if (buffer->stream == nil) {
+        return NO;
+    }
+    NSInteger len = [buffer->stream read:buffer->storage maxLength:buffer->storageSize];
+    if (len <= 0) {
+        // end of stream or a stream error; the caller inspects the stream status
+        buffer->stream = nil;
+        return NO;
+    }
+    buffer->cur = buffer->storage;
+    buffer->end = buffer->storage + len;
+    return YES;
 }
 
-static inline BOOL is_utf8_whitespace(unichar *buffer) {
-    if (isspace(*buffer)) {
-        return YES;
+static inline uint8_t currentByte(JSONBuffer *buffer) {
+    if (LIKELY(buffer->cur < buffer->end)) {
+        return *buffer->cur;
     }
-    // TODO: does JSON support other whitespace characters other than 0x20, 0x09, 0x0a, 0x0b, 0x0c, and 0x0d?
-    /*
-     U+0020  SPACE
-     U+00A0  NO-BREAK SPACE
-     U+1680  OGHAM SPACE MARK
-     U+180E  MONGOLIAN VOWEL SEPARATOR
-     U+2000  EN QUAD
-     U+2001  EM QUAD
-     U+2002  EN SPACE
-     U+2003  EM SPACE
-     U+2004  THREE-PER-EM SPACE
-     U+2005  FOUR-PER-EM SPACE
-     U+2006  SIX-PER-EM SPACE
-     U+2007  FIGURE SPACE
-     U+2008  PUNCTUATION SPACE
-     U+2009  THIN SPACE
-     U+200A  HAIR SPACE
-     U+200B  ZERO WIDTH SPACE
-     U+202F  NARROW NO-BREAK SPACE
-     U+205F  MEDIUM MATHEMATICAL SPACE
-     U+3000  IDEOGRAPHIC SPACE
-     U+FEFF  ZERO WIDTH NO-BREAK SPACE
-     */
-    return NO;
+    return refillBuffer(buffer) ? *buffer->cur : '\0';
+}
+
+static inline uint8_t incrementBuffer(JSONBuffer *buffer) {
+    if (buffer->cur < buffer->end) {
+        buffer->cur++;
+    }
+    return currentByte(buffer);
+}
+
+static inline BOOL is_utf8_whitespace(uint8_t c) {
+    // same set as isspace(); unicode spaces beyond ASCII are multi-byte
+    // sequences in UTF-8 and are not treated as whitespace
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
 }
 
 static inline BOOL is_surrogate_lead(unichar c)
@@ -230,12 +217,11 @@ static inline BOOL is_surrogate_trail(unichar c)
     return 0xDC00 <= c && c <= 0xDFFF;
 }
 
-static inline BOOL skipWhitespace(_NSJSONReader *reader, unichar **buffer) {
-    unichar *data = *buffer;
+static inline BOOL skipWhitespace(_NSJSONReader *reader, JSONBuffer *buffer) {
     BOOL success = YES;
 
-    while (is_utf8_whitespace(data)) {
-        if (!incrementBuffer(&data)) {
+    while (is_utf8_whitespace(currentByte(buffer))) {
+        if (!incrementBuffer(buffer)) {
             success = NO;
             [reader setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
                 NSLocalizedDescriptionKey: @"unexpected end of document"
@@ -244,19 +230,39 @@ static inline BOOL skipWhitespace(_NSJSONReader *reader, unichar **buffer) {
         }
     }
 
-    *buffer = data;
     return success;
 }
 
-static inline NSDictionary *parseDictionary(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
-static inline NSArray *parseArray(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
-static inline NSString *parseString(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
-static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
-static inline NSNumber *parseBoolean(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
-static inline NSNull *parseNull(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
-static inline id parseObject(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth);
+// Finds the next '"' or '\\' in [bytes, end), or end if there is none.
+static inline const uint8_t *scanStringSpecial(const uint8_t *bytes, const uint8_t *end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (end - bytes >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)bytes);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask != 0) {
+            return bytes + __builtin_ctz(mask);
+        }
+        bytes += 16;
+    }
+#endif
+    while (bytes < end && *bytes != '"' && *bytes != '\\') {
+        bytes++;
+    }
+    return bytes;
+}
+
+static inline NSDictionary *parseDictionary(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+static inline NSArray *parseArray(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+static inline NSString *parseString(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+static inline NSNumber *parseNumber(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+static inline NSNumber *parseBoolean(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+static inline NSNull *parseNull(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+static inline id parseObject(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
 
 #define STACK_SIZE 31
+#define STRING_STACK_SIZE 256
 
 typedef enum {
     JSONErrorNone = 0,
@@ -265,11 +271,12 @@ typedef enum {
     JSONErrorMalformedArray,
     JSONErrorMalformedStringEscaping,
     JSONErrorUnterminatedString,
+    JSONErrorInvalidUTF8,
     JSONErrorData, // NOTE: pass-through, handled by non-collection element's parser, e.g. parseNumber
     JSONErrorCatastrophic,
 } JSONError;
 
-static inline NSDictionary *parseDictionary(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth)
+static inline NSDictionary *parseDictionary(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth)
 {
     NSDictionary *dictionary = nil;
     id stack_keys[STACK_SIZE];
@@ -282,12 +289,12 @@ static inline NSDictionary *parseDictionary(_NSJSONReader *reader, unichar **buf
 
     incrementBuffer(buffer); //skip '{'
 
-    while (**buffer != '}') {
+    while (currentByte(buffer) != '}') {
         if (!skipWhitespace(reader, buffer)) {
             failure = JSONErrorData;
             break;
         }
-        if (**buffer == '}') {
+        if (currentByte(buffer) == '}') {
             failure = JSONErrorNone;
             break;
         }
@@ -303,7 +310,7 @@ static inline NSDictionary *parseDictionary(_NSJSONReader *reader, unichar **buf
             break;
         }
 
-        if (**buffer != ':') {
+        if (currentByte(buffer) != ':') {
             failure = JSONErrorMalformedDictionary;
             break;
         } else if (!incrementBuffer(buffer)) {
@@ -327,12 +334,12 @@ static inline NSDictionary *parseDictionary(_NSJSONReader *reader, unichar **buf
             break;
         }
 
-        if (**buffer == ',') {
+        if (currentByte(buffer) == ',') {
             incrementBuffer(buffer);
-        } else if (**buffer == '}') {
+        } else if (currentByte(buffer) == '}') {
             failure = JSONErrorNone;
         } else {
-            if (**buffer == '\0') {
+            if (currentByte(buffer) == '\0') {
                 failure = JSONErrorEOF;
             } else {
                 failure = JSONErrorMalformedDictionary;
@@ -421,7 +428,7 @@ static inline NSDictionary *parseDictionary(_NSJSONReader *reader, unichar **buf
     return dictionary;
 }
 
-static inline NSArray *parseArray(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+static inline NSArray *parseArray(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
     NSArray *array = nil;
     id stack_values[STACK_SIZE];
     id *values = &stack_values[0];
@@ -431,12 +438,12 @@ static inline NSArray *parseArray(_NSJSONReader *reader, unichar **buffer, NSJSO
 
     incrementBuffer(buffer); //skip '['
 
-    while (**buffer != ']') {
+    while (currentByte(buffer) != ']') {
         if (!skipWhitespace(reader, buffer)) {
             failure = JSONErrorData;
             break;
         }
-        if (**buffer == ']') {
+        if (currentByte(buffer) == ']') {
             failure = JSONErrorNone;
             break;
         }
@@ -452,12 +459,12 @@ static inline NSArray *parseArray(_NSJSONReader *reader, unichar **buffer, NSJSO
             break;
         }
 
-        if (**buffer == ',') {
+        if (currentByte(buffer) == ',') {
             incrementBuffer(buffer);
-        } else if (**buffer == ']') {
+        } else if (currentByte(buffer) == ']') {
             failure = JSONErrorNone;
         } else {
-            if (**buffer == '\0') {
+            if (currentByte(buffer) == '\0') {
                 failure = JSONErrorEOF;
             } else {
                 failure = JSONErrorMalformedArray;
@@ -548,6 +555,11 @@ static inline void handleParseFailure(_NSJSONReader *reader, JSONError failure)
                 NSLocalizedDescriptionKey: @"unterminated string literal"
             }]];
             break;
+        case JSONErrorInvalidUTF8:
+            [reader setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
+                NSLocalizedDescriptionKey: @"unable to convert data to a string using the detected encoding"
+            }]];
+            break;
         case JSONErrorCatastrophic:
             [reader setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
                 NSLocalizedDescriptionKey: @"unable to parse document; out of memory"
@@ -560,7 +572,7 @@ static inline void handleParseFailure(_NSJSONReader *reader, JSONError failure)
     }
 }
 
-static inline unichar parseUnicode(_NSJSONReader *reader, unichar **buffer, BOOL *success) {
+static inline unichar parseUnicode(_NSJSONReader *reader, JSONBuffer *buffer, BOOL *success) {
     unichar num = 0;
     if (success) {
         *success = NO;
@@ -568,11 +580,11 @@ static inline unichar parseUnicode(_NSJSONReader *reader, unichar **buffer, BOOL
     NSUInteger idx;
     for (idx = 0; idx < 4; idx++) {
         num *= 16;
-        char ch = **buffer;
+        uint8_t ch = currentByte(buffer);
         if (ch == '\0') {
             return 0;
         }
-        *buffer = *buffer + 1;
+        incrementBuffer(buffer);
         if ('0' <= ch && ch <= '9') {
             num += ch - '0' + 0x00;
         } else if ('a' <= ch && ch <= 'f') {
@@ -589,57 +601,79 @@ static inline unichar parseUnicode(_NSJSONReader *reader, unichar **buffer, BOOL
     return num;
 }
 
-static inline NSUInteger parseEscape(_NSJSONReader *reader, unichar **buffer, unichar *characters, NSUInteger idx) {
+static inline NSUInteger encodeUTF8(UTF32Char c, uint8_t *bytes) {
+    if (c < 0x80) {
+        bytes[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        bytes[0] = 0xC0 | (c >> 6);
+        bytes[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        bytes[0] = 0xE0 | (c >> 12);
+        bytes[1] = 0x80 | ((c >> 6) & 0x3F);
+        bytes[2] = 0x80 | (c & 0x3F);
+        return 3;
+    } else {
+        bytes[0] = 0xF0 | (c >> 18);
+        bytes[1] = 0x80 | ((c >> 12) & 0x3F);
+        bytes[2] = 0x80 | ((c >> 6) & 0x3F);
+        bytes[3] = 0x80 | (c & 0x3F);
+        return 4;
+    }
+}
+
+// Decodes the escape sequence at the buffer into UTF-8, returning the number of
+// bytes written to `bytes` (at most 4) or 0 if the escape is malformed.
+static inline NSUInteger parseEscape(_NSJSONReader *reader, JSONBuffer *buffer, uint8_t *bytes) {
     switch (incrementBuffer(buffer)) {
         case '\\':
-            characters[idx] = '\\';
+            bytes[0] = '\\';
             incrementBuffer(buffer);
             return 1;
         case '"':
-            characters[idx] = '"';
+            bytes[0] = '"';
             incrementBuffer(buffer);
             return 1;
         case '/':
-            characters[idx] = '/';
+            bytes[0] = '/';
             incrementBuffer(buffer);
             return 1;
         case 'b':
-            characters[idx] = '\b';
+            bytes[0] = '\b';
             incrementBuffer(buffer);
             return 1;
         case 'f':
-            characters[idx] = '\f';
+            bytes[0] = '\f';
             incrementBuffer(buffer);
             return 1;
         case 'n':
-            characters[idx] = '\n';
+            bytes[0] = '\n';
             incrementBuffer(buffer);
             return 1;
         case 'r':
-            characters[idx] = '\r';
+            bytes[0] = '\r';
             incrementBuffer(buffer);
             return 1;
         case 't':
-            characters[idx] = '\t';
+            bytes[0] = '\t';
             incrementBuffer(buffer);
             return 1;
         case 'u':
-            if (*(*buffer + 1) == 0) {
+            if (incrementBuffer(buffer) == '\0') {
                 return 0;
             }
-            incrementBuffer(buffer);
             BOOL success = NO;
             unichar c = parseUnicode(reader, buffer, &success);
             if (success)
             {
                 if (is_surrogate_lead(c))
                 {
-                    if (**buffer != '\\')
+                    if (currentByte(buffer) != '\\')
                     {
                         return 0;
                     }
-                    incrementBuffer(buffer);
-                    if (**buffer != 'u')
+                    if (incrementBuffer(buffer) != 'u')
                     {
                         return 0;
                     }
@@ -649,9 +683,7 @@ static inline NSUInteger parseEscape(_NSJSONReader *reader, unichar **buffer, un
                     {
                         return 0;
                     }
-                    characters[idx] = c;
-                    characters[idx + 1] = c2;
-                    return 2;
+                    return encodeUTF8(0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00), bytes);
                 }
                 else if (is_surrogate_trail(c))
                 {
@@ -661,8 +693,7 @@ static inline NSUInteger parseEscape(_NSJSONReader *reader, unichar **buffer, un
                     return 0;
                 }
                 else {
-                    characters[idx] = c;
-                    return 1;
+                    return encodeUTF8(c, bytes);
                 }
             }
             else
@@ -674,13 +705,27 @@ static inline NSUInteger parseEscape(_NSJSONReader *reader, unichar **buffer, un
     }
 }
 
-static inline NSString *parseString(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+static inline NSString *createString(const uint8_t *bytes, NSUInteger length, NSJSONReadingOptions opts) {
+    if ((opts & NSJSONReadingMutableLeaves) != 0) {
+        NSMutableString *string = (NSMutableString *)CFStringCreateMutable(kCFAllocatorDefault, 0);
+        CFStringRef contents = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, length, kCFStringEncodingUTF8, false);
+        if (contents == NULL) {
+            CFRelease((CFMutableStringRef)string);
+            return nil;
+        }
+        CFStringAppend((CFMutableStringRef)string, contents);
+        CFRelease(contents);
+        return string;
+    }
+    return (NSString *)CFStringCreateWithBytes(kCFAllocatorDefault, bytes, length, kCFStringEncodingUTF8, false);
+}
+
+static inline NSString *parseString(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
     NSString *string = nil;
-    unichar stack_characters[STACK_SIZE];
-    unichar *characters = stack_characters;
+    uint8_t stack_bytes[STRING_STACK_SIZE];
+    uint8_t *bytes = stack_bytes;
     NSUInteger count = 0;
-    NSUInteger capacity = STACK_SIZE;
-    BOOL escaped = NO;
+    NSUInteger capacity = STRING_STACK_SIZE;
     JSONError failure = JSONErrorNone;
 
     if (depth <= 1 && (opts & NSJSONReadingAllowFragments) == 0) {
@@ -689,68 +734,84 @@ static inline NSString *parseString(_NSJSONReader *reader, unichar **buffer, NSJ
 
     incrementBuffer(buffer); // skip "
 
-    while (**buffer != '\0' && **buffer != '"' && !escaped) {
-        if (**buffer == '\\') {
-            escaped = YES;
+    const uint8_t *start = buffer->cur;
+    const uint8_t *stop = scanStringSpecial(start, buffer->end);
+
+    if (stop < buffer->end && *stop == '"') {
+        // no escapes; the string can be created straight from the input
+        buffer->cur = stop;
+        incrementBuffer(buffer); // consume the "
+        string = createString(start, stop - start, opts);
+        if (string == nil) {
+            handleParseFailure(reader, JSONErrorInvalidUTF8);
         }
+        return string;
+    }
 
-        if (count + 1 > STACK_SIZE &&
-            characters == stack_characters) {
-            capacity *= 2;
-            characters = malloc(sizeof(unichar) * capacity);
-            if (characters == NULL) {
-                failure = JSONErrorCatastrophic;
-                break;
+    while (YES) {
+        // escapes expand to at most 4 bytes of UTF-8
+        NSUInteger needed = count + (stop - start) + 4;
+        if (needed > capacity) {
+            while (needed > capacity) {
+                capacity *= 2;
             }
-            memcpy(characters, stack_characters, sizeof(unichar) * count);
-        } else if (count + 1 > capacity) {
-            capacity *= 2;
-            characters = realloc(characters, sizeof(unichar) * capacity);
-            if (characters == NULL) {
-                failure = JSONErrorCatastrophic;
-                break;
+            if (bytes == stack_bytes) {
+                bytes = malloc(capacity);
+                if (bytes == NULL) {
+                    failure = JSONErrorCatastrophic;
+                    break;
+                }
+                memcpy(bytes, stack_bytes, count);
+            } else {
+                uint8_t *grown = realloc(bytes, capacity);
+                if (grown == NULL) {
+                    failure = JSONErrorCatastrophic;
+                    break;
+                }
+                bytes = grown;
             }
         }
 
-        if (escaped) {
-            NSUInteger written = parseEscape(reader, buffer, characters, count);
-            if (written)
-            {
-                escaped = NO;
-                count += written;
-            } else {
-                failure = JSONErrorMalformedStringEscaping;
+        memcpy(bytes + count, start, stop - start);
+        count += stop - start;
+        buffer->cur = stop;
+
+        if (stop == buffer->end) {
+            if (!refillBuffer(buffer)) {
+                failure = JSONErrorUnterminatedString;
                 break;
             }
-        } else {
-            characters[count++] = **buffer;
-            incrementBuffer(buffer);
+            start = buffer->cur;
+            stop = scanStringSpecial(start, buffer->end);
+            continue;
+        }
+        if (*stop == '"') {
+            incrementBuffer(buffer); // consume the "
+            break;
         }
-    }
 
-    if (**buffer == '\0')
-    {
-        failure = JSONErrorUnterminatedString;
+        NSUInteger written = parseEscape(reader, buffer, bytes + count);
+        if (written == 0) {
+            failure = JSONErrorMalformedStringEscaping;
+            break;
+        }
+        count += written;
+
+        start = buffer->cur;
+        stop = scanStringSpecial(start, buffer->end);
     }
 
     if (!failure) {
-        incrementBuffer(buffer); // consume the "
-        if ((opts & NSJSONReadingMutableLeaves) != 0) {
-            string = [[NSMutableString alloc] initWithCharacters:characters length:count];
-        } else {
-            if (characters != stack_characters) {
-                string = [[NSString alloc] initWithCharactersNoCopy:characters length:count freeWhenDone:YES];
-                characters = NULL;
-            } else {
-                string = [[NSString alloc] initWithCharacters:characters length:count];
-            }
+        string = createString(bytes, count, opts);
+        if (string == nil) {
+            handleParseFailure(reader, JSONErrorInvalidUTF8);
         }
     } else {
         handleParseFailure(reader, failure);
     }
 
-    if (characters != stack_characters && characters != NULL) {
-        free(characters);
+    if (bytes != stack_bytes && bytes != NULL) {
+        free(bytes);
     }
 
     return string;
@@ -770,13 +831,12 @@ typedef enum {
     JSONNumberPhaseEnd,
 } JSONNumberPhase;
 
-static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+static inline NSNumber *parseNumber(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
     if (depth <= 1 && (opts & NSJSONReadingAllowFragments) == 0) {
         return nil;
     }
 
     JSONNumberPhase phase = JSONNumberPhaseStart;
-    unichar *last = NULL;
     BOOL negativeMantissa = NO;
     uint64_t mantissa = 0;
     BOOL negativeExponent = NO;
@@ -789,20 +849,20 @@ static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJ
         switch (phase) {
 
             case JSONNumberPhaseStart:
-                if (**buffer == '-') {
+                if (currentByte(buffer) == '-') {
                     phase = JSONNumberPhaseWholeNumberMinus;
                     negativeMantissa = YES;
                     break;
                 }
                 // FALL THROUGH!
             case JSONNumberPhaseWholeNumberMinus:
-                if (**buffer == '0') {
+                if (currentByte(buffer) == '0') {
                     phase = JSONNumberPhaseWholeNumberZero;
                     break;
-                } else if ('1' <= **buffer && **buffer <= '9') {
+                } else if ('1' <= currentByte(buffer) && currentByte(buffer) <= '9') {
                     phase = JSONNumberPhaseWholeNumber;
                     mantissa *= 10;
-                    mantissa += **buffer - '0';
+                    mantissa += currentByte(buffer) - '0';
                     break;
                 } else {
                     [reader setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
@@ -814,16 +874,16 @@ static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJ
 
 
             case JSONNumberPhaseExponentStart:
-                if (**buffer == '+' || **buffer == '-') {
+                if (currentByte(buffer) == '+' || currentByte(buffer) == '-') {
                     phase = JSONNumberPhaseExponentPlusMinus;
-                    negativeExponent = (**buffer == '-');
+                    negativeExponent = (currentByte(buffer) == '-');
                     break;
                 }
                 // FALL THROUGH!
             case JSONNumberPhaseFractionalNumberStart:
                 // FALL THROUGH!
             case JSONNumberPhaseExponentPlusMinus:
-                if (!('0' <= **buffer && **buffer <= '9')) {
+                if (!('0' <= currentByte(buffer) && currentByte(buffer) <= '9')) {
                     [reader setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
                         NSLocalizedDescriptionKey: @"unable to parse number"
                     }]];
@@ -834,7 +894,7 @@ static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJ
                     } else {
                         phase = JSONNumberPhaseExponent;
                         exponent *= 10;
-                        exponent += **buffer - '0';
+                        exponent += currentByte(buffer) - '0';
                         break;
                     }
                 }
@@ -843,37 +903,37 @@ static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJ
 
             case JSONNumberPhaseWholeNumberZero:
             case JSONNumberPhaseWholeNumber:
-                if (**buffer == '.') {
+                if (currentByte(buffer) == '.') {
                     phase = JSONNumberPhaseFractionalNumberStart;
                     break;
                 }
                 // FALL THROUGH!
             case JSONNumberPhaseFractionalNumber:
-                if (**buffer == 'e' || **buffer == 'E') {
+                if (currentByte(buffer) == 'e' || currentByte(buffer) == 'E') {
                     phase = JSONNumberPhaseExponentStart;
                     break;
                 }
                 // FALL THROUGH!
             case JSONNumberPhaseExponent:
-                if (!('0' <= **buffer && **buffer <= '9') ||
+                if (!('0' <= currentByte(buffer) && currentByte(buffer) <= '9') ||
                     phase == JSONNumberPhaseWholeNumberZero) {
+                    // the terminating character stays in the buffer
                     phase = JSONNumberPhaseEnd;
-                    *buffer = last;
-                } else if (('0' <= **buffer && **buffer <= '9') &&
+                } else if (('0' <= currentByte(buffer) && currentByte(buffer) <= '9') &&
                            phase == JSONNumberPhaseExponent) {
                     exponent *= 10;
-                    exponent += **buffer - '0';
+                    exponent += currentByte(buffer) - '0';
                     hasExponent = YES;
-                } else if (('0' <= **buffer && **buffer <= '9') &&
+                } else if (('0' <= currentByte(buffer) && currentByte(buffer) <= '9') &&
                            phase == JSONNumberPhaseFractionalNumber) {
                     mantissa *= 10;
-                    mantissa += **buffer - '0';
+                    mantissa += currentByte(buffer) - '0';
                     fraction ++;
                     floatingPoint = YES;
-                } else if (('0' <= **buffer && **buffer <= '9') &&
+                } else if (('0' <= currentByte(buffer) && currentByte(buffer) <= '9') &&
                            phase == JSONNumberPhaseWholeNumber) {
                     mantissa *= 10;
-                    mantissa += **buffer - '0';
+                    mantissa += currentByte(buffer) - '0';
                 }
                 // FALL THROUGH!
             case JSONNumberPhaseEnd:
@@ -886,11 +946,10 @@ static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJ
                 }]];
                 return nil;
         }
-        last = *buffer;
-        incrementBuffer(buffer);
         if (phase == JSONNumberPhaseEnd) {
             break;
         }
+        incrementBuffer(buffer);
     }
     if (hasExponent || floatingPoint) {
         return [[NSDecimalNumber alloc] initWithMantissa:mantissa exponent:exponent * (negativeExponent ? -1 : 1) - fraction isNegative:negativeMantissa];
@@ -901,34 +960,32 @@ static inline NSNumber *parseNumber(_NSJSONReader *reader, unichar **buffer, NSJ
     }
 }
 
-static inline int unichar_strncasecmp(const char *str, unichar *ustr, int len) {
-    for (int i = 0; i < len; i++)
-    {
-        if (*ustr == 0) {
-            return -1;
-        }
-        if (str[i] > ustr[i])
-        {
-            return -1;
+static inline BOOL matchLiteral(JSONBuffer *buffer, const char *literal, NSUInteger len) {
+    if ((NSUInteger)(buffer->end - buffer->cur) >= len) {
+        if (memcmp(buffer->cur, literal, len) != 0) {
+            return NO;
         }
-        else if (str[i] < ustr[i])
-        {
-            return 1;
+        buffer->cur += len;
+        return YES;
+    }
+    // the literal may straddle a refill
+    for (NSUInteger idx = 0; idx < len; idx++) {
+        if (currentByte(buffer) != (uint8_t)literal[idx]) {
+            return NO;
         }
+        incrementBuffer(buffer);
     }
-    return 0;
+    return YES;
 }
 
-static inline NSNumber *parseBoolean(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+static inline NSNumber *parseBoolean(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
     if (depth <= 1 && (opts & NSJSONReadingAllowFragments) == 0) {
         return nil;
     }
 
-    if (unichar_strncasecmp("true", *buffer, 4) == 0) {
-        *buffer = *buffer + 4;
+    if (matchLiteral(buffer, "true", 4)) {
         return @YES;
-    } else if (unichar_strncasecmp("false", *buffer, 5) == 0) {
-        *buffer = *buffer + 5;
+    } else if (matchLiteral(buffer, "false", 5)) {
         return @NO;
     }
 
@@ -938,13 +995,12 @@ static inline NSNumber *parseBoolean(_NSJSONReader *reader, unichar **buffer, NS
     return nil;
 }
 
-static inline NSNull *parseNull(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+static inline NSNull *parseNull(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
     if (depth <= 1 && (opts & NSJSONReadingAllowFragments) == 0) {
         return nil;
     }
 
-    if (unichar_strncasecmp("null", *buffer, 4) == 0) {
-        *buffer = *buffer + 4;
+    if (matchLiteral(buffer, "null", 4)) {
         return [NSNull null];
     }
 
@@ -954,9 +1010,9 @@ static inline NSNull *parseNull(_NSJSONReader *reader, unichar **buffer, NSJSONR
     return nil;
 }
 
-static inline id parseObject(_NSJSONReader *reader, unichar **buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+static inline id parseObject(_NSJSONReader *reader, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
     id obj = nil;
-    switch (**buffer) {
+    switch (currentByte(buffer)) {
         case '[':
             obj = parseArray(reader, buffer, opts, depth + 1);
             break;
@@ -983,50 +1039,359 @@ static inline id parseObject(_NSJSONReader *reader, unichar **buffer, NSJSONRead
     return obj;
 }
 
+typedef struct {
+    _NSJSONReader *reader;
+    _NSJSONReadingEventHandler handler;
+    BOOL stop;
+} JSONEventContext;
+
+static inline BOOL emitEvent(JSONEventContext *context, _NSJSONReadingEvent event, id value) {
+    context->handler(event, value, &context->stop);
+    return !context->stop;
+}
+
+static BOOL emitObject(JSONEventContext *context, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth);
+
+static BOOL emitDictionary(JSONEventContext *context, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+    _NSJSONReader *reader = context->reader;
+    JSONError failure = JSONErrorNone;
+
+    incrementBuffer(buffer); //skip '{'
+
+    if (!emitEvent(context, _NSJSONReadingEventStartObject, nil)) {
+        return NO;
+    }
+
+    while (currentByte(buffer) != '}') {
+        if (!skipWhitespace(reader, buffer)) {
+            return NO;
+        }
+        if (currentByte(buffer) == '}') {
+            break;
+        }
+
+        if (currentByte(buffer) != '"') {
+            failure = JSONErrorMalformedDictionary;
+            break;
+        }
+        NSString *key = parseString(reader, buffer, opts, depth + 1);
+        if (key == nil) {
+            return NO;
+        }
+        BOOL proceed = emitEvent(context, _NSJSONReadingEventKey, key);
+        [key release];
+        if (!proceed) {
+            return NO;
+        }
+
+        if (!skipWhitespace(reader, buffer)) {
+            return NO;
+        }
+
+        if (currentByte(buffer) != ':') {
+            failure = JSONErrorMalformedDictionary;
+            break;
+        } else if (!incrementBuffer(buffer)) {
+            failure = JSONErrorEOF;
+            break;
+        }
+
+        if (!skipWhitespace(reader, buffer)) {
+            return NO;
+        }
+
+        if (!emitObject(context, buffer, opts, depth)) {
+            return NO;
+        }
+
+        if (!skipWhitespace(reader, buffer)) {
+            return NO;
+        }
+
+        if (currentByte(buffer) == ',') {
+            incrementBuffer(buffer);
+        } else if (currentByte(buffer) != '}') {
+            if (currentByte(buffer) == '\0') {
+                failure = JSONErrorEOF;
+            } else {
+                failure = JSONErrorMalformedDictionary;
+            }
+            break;
+        }
+    }
+
+    if (failure) {
+        handleParseFailure(reader, failure);
+        return NO;
+    }
+
+    incrementBuffer(buffer); // consume }
+    return emitEvent(context, _NSJSONReadingEventEndObject, nil);
+}
+
+static BOOL emitArray(JSONEventContext *context, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+    _NSJSONReader *reader = context->reader;
+    JSONError failure = JSONErrorNone;
+
+    incrementBuffer(buffer); //skip '['
+
+    if (!emitEvent(context, _NSJSONReadingEventStartArray, nil)) {
+        return NO;
+    }
+
+    while (currentByte(buffer) != ']') {
+        if (!skipWhitespace(reader, buffer)) {
+            return NO;
+        }
+        if (currentByte(buffer) == ']') {
+            break;
+        }
+
+        if (!emitObject(context, buffer, opts, depth)) {
+            return NO;
+        }
+
+        if (!skipWhitespace(reader, buffer)) {
+            return NO;
+        }
+
+        if (currentByte(buffer) == ',') {
+            incrementBuffer(buffer);
+        } else if (currentByte(buffer) != ']') {
+            if (currentByte(buffer) == '\0') {
+                failure = JSONErrorEOF;
+            } else {
+                failure = JSONErrorMalformedArray;
+            }
+            break;
+        }
+    }
+
+    if (failure) {
+        handleParseFailure(reader, failure);
+        return NO;
+    }
+
+    incrementBuffer(buffer); // consume ]
+    return emitEvent(context, _NSJSONReadingEventEndArray, nil);
+}
+
+static BOOL emitObject(JSONEventContext *context, JSONBuffer *buffer, NSJSONReadingOptions opts, NSUInteger depth) {
+    id obj = nil;
+    switch (currentByte(buffer)) {
+        case '[':
+            return emitArray(context, buffer, opts, depth + 1);
+        case '{':
+            return emitDictionary(context, buffer, opts, depth + 1);
+        case '\0':
+            handleParseFailure(context->reader, JSONErrorEOF);
+            return NO;
+        default:
+            obj = parseObject(context->reader, buffer, opts, depth);
+            break;
+    }
+    if (obj == nil) {
+        return NO;
+    }
+    BOOL proceed = emitEvent(context, _NSJSONReadingEventValue, obj);
+    [obj release];
+    return proceed;
+}
+
 - (id)parseUTF8JSONData:(NSData *)data skipBytes:(NSUInteger)skip options:(NSJSONReadingOptions)opts
 {
     id jsonObject = nil;
-    unichar *jsonBuffer = NULL;
-    unichar *jsonData = NULL;
-    NSString *str = nil;
     if (kind == 0)
     {
         do {
             kind = opts;
             input = [data retain];
-            str = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-            jsonBuffer = (unichar *)malloc(sizeof(unichar) * ([str length] + 1));
-            if (jsonBuffer == NULL)
+            const uint8_t *bytes = (const uint8_t *)[data bytes];
+            NSUInteger length = [data length];
+            if (skip > length)
             {
-                break;
+                skip = length;
             }
-            jsonData = jsonBuffer;
-
-            [str getCharacters:jsonData range:NSMakeRange(0, [str length])];
-            jsonData[[str length]] = '\0';
-            jsonData += skip;
-            if (!skipWhitespace(self, &jsonData))
+            JSONBuffer buffer = {
+                .cur = bytes + skip,
+                .end = bytes + length,
+            };
+            if (!skipWhitespace(self, &buffer))
             {
                 break;
             }
             if ((opts & NSJSONReadingAllowFragments) == 0 &&
-                *jsonData != '[' &&
-                *jsonData != '{')
+                currentByte(&buffer) != '[' &&
+                currentByte(&buffer) != '{')
             {
                 [self setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
                     NSLocalizedDescriptionKey: @"expected object or array when NSJSONReadingAllowFragments is not set"
                 }]];
             }
-            jsonObject = parseObject(self, &jsonData, opts, 0);
+            jsonObject = parseObject(self, &buffer, opts, 0);
 
         } while (0);
     }
-    if (jsonBuffer != NULL)
+    return jsonObject;
+}
+
+// Reads from the stream until at least `minimum` bytes are buffered or the
+// stream ends, so the encoding can be detected from the leading bytes.
+static void fillBuffer(JSONBuffer *buffer, NSUInteger minimum) {
+    uint8_t *fill = buffer->storage;
+    while (buffer->stream != nil && (NSUInteger)(fill - buffer->storage) < minimum) {
+        NSInteger len = [buffer->stream read:fill maxLength:buffer->storageSize - (fill - buffer->storage)];
+        if (len <= 0) {
+            buffer->stream = nil;
+            break;
+        }
+        fill += len;
+    }
+    buffer->cur = buffer->storage;
+    buffer->end = fill;
+}
+
+- (NSStringEncoding)primeBuffer:(JSONBuffer *)buffer fromStream:(NSInputStream *)stream
+{
+    buffer->stream = stream;
+    buffer->storageSize = JSON_STREAM_BUFFER_SIZE;
+    buffer->storage = malloc(buffer->storageSize);
+    if (buffer->storage == NULL)
+    {
+        handleParseFailure(self, JSONErrorCatastrophic);
+        return 0;
+    }
+    fillBuffer(buffer, 4);
+
+    NSUInteger bom = 0;
+    NSData *leading = [[NSData alloc] initWithBytesNoCopy:buffer->storage length:buffer->end - buffer->cur freeWhenDone:NO];
+    NSStringEncoding encoding = [self findEncodingFromData:leading withBOMSkipLength:&bom];
+    [leading release];
+    if (encoding == NSUTF8StringEncoding)
     {
-        free(jsonBuffer);
+        buffer->cur += bom;
     }
-    [str release];
-    return jsonObject;
+    return encoding;
+}
+
+- (void)checkStreamStatus:(NSInputStream *)stream
+{
+    NSStreamStatus status = [stream streamStatus];
+    if (status == NSStreamStatusError)
+    {
+        [self setError:[stream streamError]];
+    }
+}
+
+- (id)parseStream:(NSInputStream *)stream options:(NSJSONReadingOptions)opts
+{
+    id parsed = nil;
+    if (kind == 0)
+    {
+        JSONBuffer buffer = { 0 };
+        NSStringEncoding encoding = [self primeBuffer:&buffer fromStream:stream];
+        if (encoding == NSUTF8StringEncoding)
+        {
+            kind = opts;
+            input = [stream retain];
+            do {
+                if (!skipWhitespace(self, &buffer))
+                {
+                    break;
+                }
+                if ((opts & NSJSONReadingAllowFragments) == 0 &&
+                    currentByte(&buffer) != '[' &&
+                    currentByte(&buffer) != '{')
+                {
+                    [self setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
+                        NSLocalizedDescriptionKey: @"expected object or array when NSJSONReadingAllowFragments is not set"
+                    }]];
+                }
+                parsed = parseObject(self, &buffer, opts, 0);
+            } while (0);
+            [self checkStreamStatus:stream];
+        }
+        else if (encoding != 0)
+        {
+            // other unicode encodings are transcoded as a whole document
+            NSMutableData *data = [[NSMutableData alloc] initWithBytes:buffer.cur length:buffer.end - buffer.cur];
+            while (refillBuffer(&buffer))
+            {
+                [data appendBytes:buffer.cur length:buffer.end - buffer.cur];
+            }
+            [self checkStreamStatus:stream];
+            parsed = [self parseData:data options:opts];
+            [data release];
+        }
+        free(buffer.storage);
+    }
+    return parsed;
+}
+
+- (BOOL)enumerateEventsInStream:(NSInputStream *)stream options:(NSJSONReadingOptions)opts usingBlock:(_NSJSONReadingEventHandler)block
+{
+    if (kind != 0)
+    {
+        return NO;
+    }
+
+    JSONBuffer buffer = { 0 };
+    NSStringEncoding encoding = [self primeBuffer:&buffer fromStream:stream];
+    BOOL success = NO;
+    if (encoding == NSUTF8StringEncoding)
+    {
+        kind = opts;
+        input = [stream retain];
+        JSONEventContext context = {
+            .reader = self,
+            .handler = block,
+            .stop = NO,
+        };
+        success = YES;
+        while (!context.stop)
+        {
+            // whitespace (including newlines) separates top level values
+            while (is_utf8_whitespace(currentByte(&buffer)))
+            {
+                incrementBuffer(&buffer);
+            }
+            if (currentByte(&buffer) == '\0')
+            {
+                break;
+            }
+            if ((opts & NSJSONReadingAllowFragments) == 0 &&
+                currentByte(&buffer) != '[' &&
+                currentByte(&buffer) != '{')
+            {
+                [self setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
+                    NSLocalizedDescriptionKey: @"expected object or array when NSJSONReadingAllowFragments is not set"
+                }]];
+                success = NO;
+                break;
+            }
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            BOOL emitted = emitObject(&context, &buffer, opts, 0);
+            [pool drain];
+            if (!emitted && !context.stop)
+            {
+                success = NO;
+                break;
+            }
+        }
+        [self checkStreamStatus:stream];
+        if (error != nil)
+        {
+            success = NO;
+        }
+    }
+    else if (encoding != 0)
+    {
+        [self setError:[NSError errorWithDomain:NSCocoaErrorDomain code:-1 userInfo:@{
+            NSLocalizedDescriptionKey: @"JSON event streams must be UTF-8 encoded"
+        }]];
+    }
+    free(buffer.storage);
+    return success;
 }
 
 - (void)setError:(NSError *)err
@@ -1053,132 +1418,384 @@ static inline BOOL writeBoolean(_NSJSONWriter *writer, NSNumber *object, NSJSONW
 static inline BOOL writeNumber(_NSJSONWriter *writer, NSNumber *object, NSJSONWritingOptions opt, NSUInteger depth);
 static inline BOOL writeObject(_NSJSONWriter *writer, id object, NSJSONWritingOptions opts, NSUInteger depth);
 
-static NSString *escapeString(NSString *string) {
-    NSString *result = [string stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"];
-    return [result stringByReplacingOccurrencesOfString:@"\"" withString:@"\\\""];
+#define JSON_WRITER_BUFFER_SIZE (16 * 1024)
+// characters escaped per pass; each one expands to at most 6 bytes (\uXXXX)
+#define JSON_WRITER_ESCAPE_CHUNK 512
+#define JSON_WRITER_ESCAPE_MAX 6
+
+// Writes out everything buffered so far. When writing to memory (no output
+// stream) the buffer simply grows instead. If the stream stops accepting
+// bytes, whatever it did not take stays at the front of the buffer and the
+// write fails.
+static BOOL flushBuffer(_NSJSONWriter *writer) {
+    NSUInteger offset = 0;
+    while (offset < writer->dataLen) {
+        NSInteger written = [writer->outputStream write:(const uint8_t *)writer->dataBuffer + offset maxLength:writer->dataLen - offset];
+        if (written <= 0) {
+            break;
+        }
+        offset += written;
+    }
+    writer->totalDataWritten += offset;
+    BOOL complete = offset == writer->dataLen;
+    if (!complete) {
+        memmove(writer->dataBuffer, writer->dataBuffer + offset, writer->dataLen - offset);
+    }
+    writer->dataLen -= offset;
+    return complete;
+}
+
+// Makes sure `length` contiguous bytes are available at the end of the buffer.
+static inline char *reserveBytes(_NSJSONWriter *writer, NSUInteger length) {
+    if (LIKELY(writer->dataLen + length <= writer->dataBufferLen)) {
+        return writer->dataBuffer + writer->dataLen;
+    }
+    if (writer->outputStream != nil) {
+        if (!flushBuffer(writer)) {
+            return NULL;
+        }
+        if (length <= writer->dataBufferLen) {
+            return writer->dataBuffer;
+        }
+    }
+    NSUInteger capacity = writer->dataBufferLen;
+    while (writer->dataLen + length > capacity) {
+        capacity *= 2;
+    }
+    char *grown = realloc(writer->dataBuffer, capacity);
+    if (grown == NULL) {
+        return NULL;
+    }
+    writer->dataBuffer = grown;
+    writer->dataBufferLen = capacity;
+    return writer->dataBuffer + writer->dataLen;
+}
+
+static inline BOOL appendBytes(_NSJSONWriter *writer, const char *bytes, NSUInteger length) {
+    char *out = reserveBytes(writer, length);
+    if (out == NULL) {
+        return NO;
+    }
+    memcpy(out, bytes, length);
+    writer->dataLen += length;
+    return YES;
+}
+
+#define appendLiteral(writer, literal) appendBytes(writer, literal, sizeof(literal) - 1)
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static inline char *escapeASCII(char *out, uint8_t c) {
+    switch (c) {
+        case '"':  *out++ = '\\'; *out++ = '"'; break;
+        case '\\': *out++ = '\\'; *out++ = '\\'; break;
+        case '\b': *out++ = '\\'; *out++ = 'b'; break;
+        case '\f': *out++ = '\\'; *out++ = 'f'; break;
+        case '\n': *out++ = '\\'; *out++ = 'n'; break;
+        case '\r': *out++ = '\\'; *out++ = 'r'; break;
+        case '\t': *out++ = '\\'; *out++ = 't'; break;
+        default:
+            if (c < 0x20) {
+                *out++ = '\\';
+                *out++ = 'u';
+                *out++ = '0';
+                *out++ = '0';
+                *out++ = hexDigits[c >> 4];
+                *out++ = hexDigits[c & 0xF];
+            } else {
+                *out++ = c;
+            }
+            break;
+    }
+    return out;
+}
+
+static BOOL appendEscapedASCII(_NSJSONWriter *writer, const uint8_t *bytes, NSUInteger length) {
+    while (length > 0) {
+        NSUInteger chunk = MIN(length, JSON_WRITER_ESCAPE_CHUNK);
+        char *start = reserveBytes(writer, chunk * JSON_WRITER_ESCAPE_MAX);
+        if (start == NULL) {
+            return NO;
+        }
+        char *out = start;
+        for (NSUInteger idx = 0; idx < chunk; idx++) {
+            uint8_t c = bytes[idx];
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                *out++ = c;
+            } else {
+                out = escapeASCII(out, c);
+            }
+        }
+        writer->dataLen += out - start;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return YES;
+}
+
+static BOOL appendEscapedCharacters(_NSJSONWriter *writer, const unichar *characters, NSUInteger length) {
+    char *start = reserveBytes(writer, length * JSON_WRITER_ESCAPE_MAX);
+    if (start == NULL) {
+        return NO;
+    }
+    char *out = start;
+    for (NSUInteger idx = 0; idx < length; idx++) {
+        unichar c = characters[idx];
+        if (c < 0x80) {
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                *out++ = c;
+            } else {
+                out = escapeASCII(out, c);
+            }
+        } else if (c < 0x800) {
+            *out++ = 0xC0 | (c >> 6);
+            *out++ = 0x80 | (c & 0x3F);
+        } else if (is_surrogate_lead(c) && idx + 1 < length && is_surrogate_trail(characters[idx + 1])) {
+            UTF32Char scalar = 0x10000 + ((c - 0xD800) << 10) + (characters[++idx] - 0xDC00);
+            *out++ = 0xF0 | (scalar >> 18);
+            *out++ = 0x80 | ((scalar >> 12) & 0x3F);
+            *out++ = 0x80 | ((scalar >> 6) & 0x3F);
+            *out++ = 0x80 | (scalar & 0x3F);
+        } else {
+            if (is_surrogate_lead(c) || is_surrogate_trail(c)) {
+                // unpaired surrogates have no UTF-8 representation
+                c = 0xFFFD;
+            }
+            *out++ = 0xE0 | (c >> 12);
+            *out++ = 0x80 | ((c >> 6) & 0x3F);
+            *out++ = 0x80 | (c & 0x3F);
+        }
+    }
+    writer->dataLen += out - start;
+    return YES;
 }
 
 static inline BOOL writeString(_NSJSONWriter *writer, NSString *object, NSJSONWritingOptions opts, NSUInteger depth) {
-    NSString *escaped = escapeString(object);
-    if (escaped != nil) {
-        [writer appendString:[NSString stringWithFormat:@"\"%@\"", escaped] range:NSMakeRange(0, 0)];
-        return YES;
+    CFStringRef string = (CFStringRef)object;
+    CFIndex length = CFStringGetLength(string);
+
+    if (!appendLiteral(writer, "\"")) {
+        return NO;
     }
-    return NO;
+
+    const char *ascii = CFStringGetCStringPtr(string, kCFStringEncodingASCII);
+    if (ascii != NULL) {
+        if (!appendEscapedASCII(writer, (const uint8_t *)ascii, length)) {
+            return NO;
+        }
+    } else {
+        const unichar *characters = CFStringGetCharactersPtr(string);
+        CFIndex location = 0;
+        while (location < length) {
+            CFIndex chunk = MIN(length - location, JSON_WRITER_ESCAPE_CHUNK);
+            const unichar *run;
+            if (characters != NULL) {
+                run = characters + location;
+            } else {
+                [writer resizeTemporaryBuffer:JSON_WRITER_ESCAPE_CHUNK * sizeof(unichar)];
+                CFStringGetCharacters(string, CFRangeMake(location, chunk), (UniChar *)writer->tempBuffer);
+                run = (const unichar *)writer->tempBuffer;
+            }
+            // keep surrogate pairs within a single pass
+            if (chunk > 1 && location + chunk < length && is_surrogate_lead(run[chunk - 1])) {
+                chunk--;
+            }
+            if (!appendEscapedCharacters(writer, run, chunk)) {
+                return NO;
+            }
+            location += chunk;
+        }
+    }
+
+    return appendLiteral(writer, "\"");
+}
+
+static inline BOOL appendIndentation(_NSJSONWriter *writer, NSUInteger depth) {
+    char *out = reserveBytes(writer, depth);
+    if (out == NULL) {
+        return NO;
+    }
+    memset(out, '\t', depth);
+    writer->dataLen += depth;
+    return YES;
 }
 
 static inline BOOL writeDictionary(_NSJSONWriter *writer, NSDictionary *object, NSJSONWritingOptions opts, NSUInteger depth) {
     BOOL pretty = (opts & NSJSONWritingPrettyPrinted) != 0;
-    if (pretty) {
-        [writer appendString:@"{\n" range:NSMakeRange(0, 0)];
-    } else {
-        [writer appendString:@"{" range:NSMakeRange(0, 0)];
+    if (!(pretty ? appendLiteral(writer, "{\n") : appendLiteral(writer, "{"))) {
+        return NO;
     }
     NSUInteger count = [object count];
     NSUInteger idx = 0;
 
     for (id key in object) {
         id value = object[key];
-        if (pretty) {
-            for (NSUInteger i = 0; i < depth; i++) {
-                [writer appendString:@"\t" range:NSMakeRange(0, 0)];
-            }
+        if (pretty && !appendIndentation(writer, depth)) {
+            return NO;
         }
 
         if (!writeObject(writer, key, (opts | ~(NSJSONWritingPrettyPrinted)), depth)) {
             return NO;
         }
 
-        [writer appendString:@":" range:NSMakeRange(0, 0)];
+        if (!appendLiteral(writer, ":")) {
+            return NO;
+        }
         if (!writeObject(writer, value, opts, depth)) {
             return NO;
         }
 
-        if (idx + 1 < count) {
-            [writer appendString:@"," range:NSMakeRange(0, 0)];
+        if (idx + 1 < count && !appendLiteral(writer, ",")) {
+            return NO;
         }
-        if (pretty) {
-            [writer appendString:@"\n" range:NSMakeRange(0, 0)];
+        if (pretty && !appendLiteral(writer, "\n")) {
+            return NO;
         }
         idx++;
     }
 
-    [writer appendString:@"}" range:NSMakeRange(0, 0)];
-    return YES;
+    return appendLiteral(writer, "}");
 }
 
 static inline BOOL writeArray(_NSJSONWriter *writer, id object, NSJSONWritingOptions opts, NSUInteger depth) {
     BOOL pretty = (opts & NSJSONWritingPrettyPrinted) != 0;
-    if (pretty) {
-        [writer appendString:@"[\n" range:NSMakeRange(0, 0)];
-    } else {
-        [writer appendString:@"[" range:NSMakeRange(0, 0)];
+    if (!(pretty ? appendLiteral(writer, "[\n") : appendLiteral(writer, "["))) {
+        return NO;
     }
     NSUInteger count = [object count];
     NSUInteger idx = 0;
 
     for (id value in object) {
-        if (pretty) {
-            for (NSUInteger i = 0; i < depth; i++) {
-                [writer appendString:@"\t" range:NSMakeRange(0, 0)];
-            }
+        if (pretty && !appendIndentation(writer, depth)) {
+            return NO;
         }
 
         if (!writeObject(writer, value, opts, depth)) {
             return NO;
         }
 
-        if (idx + 1 < count) {
-            [writer appendString:@"," range:NSMakeRange(0, 0)];
+        if (idx + 1 < count && !appendLiteral(writer, ",")) {
+            return NO;
         }
-        if (pretty) {
-            [writer appendString:@"\n" range:NSMakeRange(0, 0)];
+        if (pretty && !appendLiteral(writer, "\n")) {
+            return NO;
         }
         idx++;
     }
 
-    [writer appendString:@"]" range:NSMakeRange(0, 0)];
-    return YES;
+    return appendLiteral(writer, "]");
 }
 
 static inline BOOL writeNull(_NSJSONWriter *writer, NSNull *object, NSJSONWritingOptions opts, NSUInteger depth) {
-    [writer appendString:@"null" range:NSMakeRange(0, 0)];
-    return YES;
+    return appendLiteral(writer, "null");
 }
 
 static inline BOOL writeBoolean(_NSJSONWriter *writer, NSNumber *object, NSJSONWritingOptions opts, NSUInteger depth) {
     if ((CFBooleanRef)object == kCFBooleanTrue) {
-        [writer appendString:@"true" range:NSMakeRange(0, 0)];
+        return appendLiteral(writer, "true");
     } else if ((CFBooleanRef)object == kCFBooleanFalse) {
-        [writer appendString:@"false" range:NSMakeRange(0, 0)];
+        return appendLiteral(writer, "false");
     }
     return YES;
 }
 
+static inline BOOL writeUnsignedInteger(_NSJSONWriter *writer, unsigned long long value, BOOL negative) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *out = end;
+    do {
+        *--out = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    if (negative) {
+        *--out = '-';
+    }
+    return appendBytes(writer, out, end - out);
+}
+
+static inline BOOL writeDouble(_NSJSONWriter *writer, double value) {
+    // the shortest representation that reads back as the same double
+    char digits[32];
+    int length = 0;
+    for (int precision = DBL_DIG; precision <= DBL_DIG + 2; precision++) {
+        length = snprintf(digits, sizeof(digits), "%.*g", precision, value);
+        if (strtod(digits, NULL) == value) {
+            break;
+        }
+    }
+    return appendBytes(writer, digits, length);
+}
+
+static inline BOOL writeFloat(_NSJSONWriter *writer, float value) {
+    // the shortest representation that reads back as the same float
+    char digits[32];
+    int length = 0;
+    for (int precision = FLT_DIG; precision <= FLT_DIG + 3; precision++) {
+        length = snprintf(digits, sizeof(digits), "%.*g", precision, value);
+        if (strtof(digits, NULL) == value) {
+            break;
+        }
+    }
+    return appendBytes(writer, digits, length);
+}
+
 static inline BOOL writeNumber(_NSJSONWriter *writer, NSNumber *object, NSJSONWritingOptions opts, NSUInteger depth) {
+    switch (*[object objCType]) {
+        case _C_CHR:
+        case _C_SHT:
+        case _C_INT:
+        case _C_LNG:
+        case _C_LNG_LNG: {
+            long long value = [object longLongValue];
+            if (value < 0) {
+                return writeUnsignedInteger(writer, -(unsigned long long)value, YES);
+            }
+            return writeUnsignedInteger(writer, value, NO);
+        }
+        case _C_UCHR:
+        case _C_USHT:
+        case _C_UINT:
+        case _C_ULNG:
+        case _C_ULNG_LNG:
+            return writeUnsignedInteger(writer, [object unsignedLongLongValue], NO);
+        case _C_FLT: {
+            float value = [object floatValue];
+            if (isfinite(value)) {
+                return writeFloat(writer, value);
+            }
+            break;
+        }
+        case _C_DBL: {
+            // decimal numbers carry more precision than a double
+            if ([object isKindOfClass:[NSDecimalNumber class]]) {
+                break;
+            }
+            double value = [object doubleValue];
+            if (isfinite(value)) {
+                return writeDouble(writer, value);
+            }
+            break;
+        }
+    }
+
     NSString *value = [object stringValue];
-    [writer appendString:value range:NSMakeRange(0, 0)];
-    return YES;
+    const char *utf8 = [value UTF8String];
+    return appendBytes(writer, utf8, strlen(utf8));
 }
 
 static inline BOOL writeObject(_NSJSONWriter *writer, id object, NSJSONWritingOptions opts, NSUInteger depth) {
-    BOOL allowFragments = (opts & NSJSONReadingAllowFragments) != 0;
-    if (![_NSJSONReader validForJSON:object depth:depth + 1 allowFragments:allowFragments]) {
-        // TODO populate error here
-        return NO;
-    }
-
-    if ([object isKindOfClass:[NSString class]]) {
+    // the whole tree is validated once up front in -writeRootObject:...
+    if ([object isNSString__]) {
         return writeString(writer, object, opts, depth + 1);
-    } else if ([object isKindOfClass:[NSDictionary class]]) {
+    } else if ([object isNSDictionary__]) {
         return writeDictionary(writer, object, opts, depth + 1);
-    } else if ([object isKindOfClass:[NSArray class]]) {
+    } else if ([object isNSArray__]) {
         return writeArray(writer, object, opts, depth + 1);
     } else if (object == [NSNull null]) {
         return writeNull(writer, object, opts, depth + 1);
     } else if ((CFBooleanRef)object == kCFBooleanTrue || (CFBooleanRef)object == kCFBooleanFalse) {
         return writeBoolean(writer, object, opts, depth + 1);
-    } else if ([object isKindOfClass:[NSNumber class]]) {
+    } else if ([object isNSNumber__]) {
         return writeNumber(writer, object, opts, depth + 1);
     } else {
         // TODO how did we even get to here?!
@@ -1200,6 +1817,11 @@ static inline BOOL writeObject(_NSJSONWriter *writer, id object, NSJSONWritingOp
 
 - (void)dealloc
 {
+    if (freeDataBuffer)
+    {
+        free(dataBuffer);
+    }
+    free(tempBuffer);
     [outputStream release];
     [super dealloc];
 }
@@ -1207,23 +1829,29 @@ static inline BOOL writeObject(_NSJSONWriter *writer, id object, NSJSONWritingOp
 - (NSInteger)appendString:(NSString *)string range:(NSRange)range
 {
     const char *buffer = [string UTF8String];
-    NSUInteger length = [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
-
-    NSInteger written = 0;
-    while ([outputStream hasSpaceAvailable] && length > written) {
-        written += [outputStream write:buffer + written maxLength:length];
-    }
-
-    if (length < written) {
-        #warning TODO: handle incomplete writes w/ buffering
+    NSUInteger length = strlen(buffer);
+    NSUInteger before = dataLen;
+    if (!appendBytes(self, buffer, length))
+    {
+        return -1;
     }
-    totalDataWritten += written;
-    return written;
+    return dataLen - before;
 }
 
 - (void)resizeTemporaryBuffer:(size_t)size
 {
-
+    if (tempBufferLen >= size)
+    {
+        return;
+    }
+    char *grown = realloc(tempBuffer, size);
+    if (grown == NULL)
+    {
+        [NSException raise:NSMallocException format:@"unable to allocate JSON writer buffer"];
+        return;
+    }
+    tempBuffer = grown;
+    tempBufferLen = size;
 }
 
 - (NSInteger)writeRootObject:(id)object toStream:(NSOutputStream *)stream options:(NSJSONWritingOptions)opts error:(NSError **)error
@@ -1233,18 +1861,74 @@ static inline BOOL writeObject(_NSJSONWriter *writer, id object, NSJSONWritingOp
         [outputStream release];
         outputStream = [stream retain];
     }
+    kind = opts;
     totalDataWritten = 0;
-    writeObject(self, object, opts, 0);
+    dataLen = 0;
+    if (dataBuffer == NULL)
+    {
+        dataBuffer = malloc(JSON_WRITER_BUFFER_SIZE);
+        if (dataBuffer == NULL)
+        {
+            [NSException raise:NSMallocException format:@"unable to allocate JSON writer buffer"];
+            return 0;
+        }
+        dataBufferLen = JSON_WRITER_BUFFER_SIZE;
+        freeDataBuffer = YES;
+    }
+
+    BOOL allowFragments = (opts & NSJSONReadingAllowFragments) != 0;
+    if (![_NSJSONReader validForJSON:object depth:1 allowFragments:allowFragments])
+    {
+        // TODO populate error here
+        return 0;
+    }
+
+    BOOL success = writeObject(self, object, opts, 0);
+    if (outputStream != nil)
+    {
+        success = flushBuffer(self) && success;
+    }
+    else
+    {
+        totalDataWritten = dataLen;
+    }
+    if (!success)
+    {
+        if (error != NULL)
+        {
+            *error = [outputStream streamError] ?: [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{
+                NSLocalizedDescriptionKey: @"unable to write JSON data"
+            }];
+        }
+        return 0;
+    }
     return totalDataWritten;
 }
 
 - (NSData *)dataWithRootObject:(id)object options:(NSJSONWritingOptions)options error:(NSError **)error
 {
-    NSOutputStream *stream = [[NSOutputStream alloc] initToMemory];
-    [stream open];
-    [self writeRootObject:object toStream:stream options:options error:error];
-    NSData *data = [[stream propertyForKey:NSStreamDataWrittenToMemoryStreamKey] retain];
-    [stream release];
+    // writing without a stream accumulates the whole document in dataBuffer,
+    // which is then trimmed to size and handed to the NSData
+    if ([self writeRootObject:object toStream:nil options:options error:error] == 0)
+    {
+        dataLen = 0;
+        return nil;
+    }
+    if (dataLen < dataBufferLen)
+    {
+        // keep the full buffer if it cannot be shrunk
+        char *trimmed = realloc(dataBuffer, dataLen);
+        if (trimmed != NULL)
+        {
+            dataBuffer = trimmed;
+            dataBufferLen = dataLen;
+        }
+    }
+    NSData *data = [[NSData alloc] initWithBytesNoCopy:dataBuffer length:dataLen freeWhenDone:YES];
+    freeDataBuffer = NO;
+    dataBuffer = NULL;
+    dataBufferLen = 0;
+    dataLen = 0;
     return [data autorelease];
 }
 
@@ -1317,4 +2001,21 @@ static inline BOOL writeObject(_NSJSONWriter *writer, id object, NSJSONWritingOp
     return parsed;
 }
 
++ (BOOL)_enumerateJSONEventsInStream:(NSInputStream *)stream options:(NSJSONReadingOptions)opt usingBlock:(_NSJSONReadingEventHandler)block error:(NSError **)error
+{
+    if ([stream streamStatus] < NSStreamStatusOpen)
+    {
+        [NSException raise:NSInvalidArgumentException format:@"stream must be open before usage"];
+        return NO;
+    }
+    _NSJSONReader *reader = [[_NSJSONReader alloc] init];
+    BOOL success = [reader enumerateEventsInStream:stream options:opt usingBlock:block];
+    if (error != NULL && !success)
+    {
+        *error = [[[reader error] retain] autorelease];
+    }
+    [reader release];
+    return success;
+}
+
 @end
@@ -11,11 +11,93 @@
 #import "NSKeyValueAccessor.h"
 #import <Foundation/NSSet.h>
 #import <Foundation/NSString.h>
+#import <CoreFoundation/CFDictionary.h>
 #import <libkern/OSAtomic.h>
 #import <objc/runtime.h>
+#import <stdlib.h>
+#import "NSCFTSDKeys.h"
 
 static int32_t NSKVOLock;
 
+// Accessors are never evicted from NSKVOGetters/NSKVOSetters once created,
+// so each thread keeps a small direct-mapped front cache of them keyed by
+// container class and key. A hit costs a hash and a compare and takes no
+// lock; only a miss falls back to the shared sets under NSKVOLock.
+#define NSKVCAccessorCacheSize 256
+#define NSKVCKeyPathCacheSize 64
+
+// Compiled key paths are interned in NSKVCKeyPaths and never freed, up to
+// this many distinct paths; past that they are split on every call again.
+#define NSKVCKeyPathLimit 4096
+
+static int32_t NSKVCKeyPathLock;
+static CFMutableDictionaryRef NSKVCKeyPaths = NULL;
+
+typedef struct {
+    Class cls;
+    NSString *key; // the accessor's own copy of the key
+    NSUInteger hash;
+    id accessor;
+} NSKVCAccessorCacheEntry;
+
+typedef struct {
+    NSUInteger hash;
+    const __NSKVCCompiledKeyPath *path;
+} NSKVCKeyPathCacheEntry;
+
+typedef struct {
+    NSKVCAccessorCacheEntry getters[NSKVCAccessorCacheSize];
+    NSKVCAccessorCacheEntry setters[NSKVCAccessorCacheSize];
+    NSKVCKeyPathCacheEntry keyPaths[NSKVCKeyPathCacheSize];
+} NSKVCAccessorCache;
+
+static void NSKVCAccessorCacheDestroy(void *cache)
+{
+    free(cache);
+}
+
+static inline NSKVCAccessorCache *NSKVCGetAccessorCache(void)
+{
+    NSKVCAccessorCache *cache = (NSKVCAccessorCache *)_CFGetTSD(__CFTSDKeyNSKeyValueCodingAccessorCache);
+    if (cache == NULL)
+    {
+        cache = calloc(1, sizeof(NSKVCAccessorCache));
+        if (cache != NULL)
+        {
+            _CFSetTSD(__CFTSDKeyNSKeyValueCodingAccessorCache, cache, &NSKVCAccessorCacheDestroy);
+        }
+    }
+    return cache;
+}
+
+static inline NSKVCAccessorCacheEntry *NSKVCAccessorCacheSlot(NSKVCAccessorCacheEntry *entries, Class cls, NSUInteger hash)
+{
+    uintptr_t mix = ((uintptr_t)cls >> 4) ^ hash;
+    mix ^= mix >> 11;
+    return &entries[mix & (NSKVCAccessorCacheSize - 1)];
+}
+
+static inline id NSKVCAccessorCacheLookup(NSKVCAccessorCacheEntry *entry, Class cls, NSString *key, NSUInteger hash)
+{
+    if (entry->cls != cls || entry->accessor == nil)
+    {
+        return nil;
+    }
+    if (entry->key == key || (entry->hash == hash && [entry->key isEqualToString:key]))
+    {
+        return entry->accessor;
+    }
+    return nil;
+}
+
+static inline void NSKVCAccessorCacheStore(NSKVCAccessorCacheEntry *entry, Class cls, NSUInteger hash, NSKeyValueAccessor *accessor)
+{
+    entry->cls = cls;
+    entry->key = accessor->_key;
+    entry->hash = hash;
+    entry->accessor = accessor;
+}
+
 NSString *const NSUnknownKeyException = @"NSUnknownKeyException";
 NSString *const NSUndefinedKeyException = @"NSUnknownKeyException";
 NSString *const NSAverageKeyValueOperator = @"avg";
@@ -32,6 +114,131 @@ NSString *const NSUnionOfSetsKeyValueOperator = @"unionOfSets";
 static NSString *const NSTargetObjectUserInfoKey = @"NSTargetObjectUserInfoKey";
 static NSString *const NSUnknownUserInfoKey = @"NSUnknownUserInfoKey";
 
+static __NSKVCCompiledKeyPath *NSKVCCreateCompiledKeyPath(NSString *keyPath)
+{
+    NSUInteger length = [keyPath length];
+    NSUInteger count = 1;
+    NSRange searchRange = NSMakeRange(0, length);
+    NSRange dot;
+    while ((dot = [keyPath rangeOfString:@"." options:NSLiteralSearch range:searchRange]).location != NSNotFound)
+    {
+        count++;
+        searchRange.location = dot.location + 1;
+        searchRange.length = length - searchRange.location;
+    }
+
+    __NSKVCCompiledKeyPath *path = malloc(sizeof(__NSKVCCompiledKeyPath));
+    NSString **keys = malloc(sizeof(NSString *) * count);
+    NSString **paths = malloc(sizeof(NSString *) * (count + 1));
+    __NSKVCOperatorType *operators = malloc(sizeof(__NSKVCOperatorType) * count);
+    if (path == NULL || keys == NULL || paths == NULL || operators == NULL)
+    {
+        free(path);
+        free(keys);
+        free(paths);
+        free(operators);
+        return NULL;
+    }
+
+    path->keyPath = keyPath;
+    path->hash = [keyPath hash];
+    path->count = count;
+    path->keys = keys;
+    path->paths = paths;
+    path->operators = operators;
+
+    NSUInteger start = 0;
+    for (NSUInteger idx = 0; idx < count; idx++)
+    {
+        NSUInteger end = length;
+        if (idx + 1 < count)
+        {
+            end = [keyPath rangeOfString:@"." options:NSLiteralSearch range:NSMakeRange(start, length - start)].location;
+        }
+        paths[idx] = [(idx == 0 ? keyPath : [keyPath substringFromIndex:start]) retain];
+        keys[idx] = [(count == 1 ? keyPath : [keyPath substringWithRange:NSMakeRange(start, end - start)]) retain];
+        operators[idx] = __NSKVCOperatorTypeFromKey(keys[idx]);
+        start = end + 1;
+    }
+    paths[count] = nil;
+    return path;
+}
+
+const __NSKVCCompiledKeyPath *__NSKVCCompileKeyPath(NSString *keyPath)
+{
+    if (keyPath == nil)
+    {
+        return NULL;
+    }
+
+    NSUInteger hash = [keyPath hash];
+    NSKVCAccessorCache *cache = NSKVCGetAccessorCache();
+    NSKVCKeyPathCacheEntry *entry = NULL;
+    if (cache != NULL)
+    {
+        entry = &cache->keyPaths[(hash ^ (hash >> 7)) & (NSKVCKeyPathCacheSize - 1)];
+        const __NSKVCCompiledKeyPath *path = entry->path;
+        if (path != NULL && (path->keyPath == keyPath || (entry->hash == hash && [path->keyPath isEqualToString:keyPath])))
+        {
+            return path;
+        }
+    }
+
+    OSSpinLockLock(&NSKVCKeyPathLock);
+    if (NSKVCKeyPaths == NULL)
+    {
+        NSKVCKeyPaths = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+    }
+    const __NSKVCCompiledKeyPath *path = CFDictionaryGetValue(NSKVCKeyPaths, keyPath);
+    OSSpinLockUnlock(&NSKVCKeyPathLock);
+
+    if (path == NULL)
+    {
+        NSString *key = [keyPath copy];
+        __NSKVCCompiledKeyPath *compiled = NSKVCCreateCompiledKeyPath(key);
+        [key release];
+        if (compiled == NULL)
+        {
+            return NULL;
+        }
+
+        OSSpinLockLock(&NSKVCKeyPathLock);
+        path = CFDictionaryGetValue(NSKVCKeyPaths, keyPath);
+        if (path == NULL && CFDictionaryGetCount(NSKVCKeyPaths) < NSKVCKeyPathLimit)
+        {
+            CFDictionarySetValue(NSKVCKeyPaths, compiled->keyPath, compiled);
+            path = compiled;
+            compiled = NULL;
+        }
+        OSSpinLockUnlock(&NSKVCKeyPathLock);
+
+        if (compiled != NULL)
+        {
+            // Lost a race, or the table is full.
+            for (NSUInteger idx = 0; idx < compiled->count; idx++)
+            {
+                [compiled->keys[idx] release];
+                [compiled->paths[idx] release];
+            }
+            free(compiled->keys);
+            free(compiled->paths);
+            free(compiled->operators);
+            free(compiled);
+        }
+        if (path == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    if (entry != NULL)
+    {
+        entry->hash = hash;
+        entry->path = path;
+    }
+    return path;
+}
+
 @implementation NSObject (NSKeyValueCoding)
 
 + (BOOL)accessInstanceVariablesDirectly
@@ -42,9 +249,25 @@ static NSString *const NSUnknownUserInfoKey = @"NSUnknownUserInfoKey";
 - (void)setValue:(id)value forKey:(NSString *)key
 {
     Class cls = object_getClass(self);
-    OSSpinLockLock(&NSKVOLock);
-    NSKeyValueSetter *setter = [NSObject _createValueSetterWithContainerClassID:cls key:key];
-    OSSpinLockUnlock(&NSKVOLock);
+    NSUInteger hash = [key hash];
+    NSKVCAccessorCache *cache = NSKVCGetAccessorCache();
+    NSKVCAccessorCacheEntry *entry = NULL;
+    NSKeyValueSetter *setter = nil;
+    if (cache != NULL)
+    {
+        entry = NSKVCAccessorCacheSlot(cache->setters, cls, hash);
+        setter = NSKVCAccessorCacheLookup(entry, cls, key, hash);
+    }
+    if (setter == nil)
+    {
+        OSSpinLockLock(&NSKVOLock);
+        setter = [NSObject _createValueSetterWithContainerClassID:cls key:key];
+        OSSpinLockUnlock(&NSKVOLock);
+        if (entry != NULL)
+        {
+            NSKVCAccessorCacheStore(entry, cls, hash, setter);
+        }
+    }
     _NSSetUsingKeyValueSetter(self, setter, value);
 }
 
@@ -56,9 +279,25 @@ static NSString *const NSUnknownUserInfoKey = @"NSUnknownUserInfoKey";
 - (id)valueForKey:(id)key
 {
     Class cls = object_getClass(self);
-    OSSpinLockLock(&NSKVOLock);
-    NSKeyValueGetter *getter = [NSObject _createValueGetterWithContainerClassID:cls key:key];
-    OSSpinLockUnlock(&NSKVOLock);
+    NSUInteger hash = [key hash];
+    NSKVCAccessorCache *cache = NSKVCGetAccessorCache();
+    NSKVCAccessorCacheEntry *entry = NULL;
+    NSKeyValueGetter *getter = nil;
+    if (cache != NULL)
+    {
+        entry = NSKVCAccessorCacheSlot(cache->getters, cls, hash);
+        getter = NSKVCAccessorCacheLookup(entry, cls, key, hash);
+    }
+    if (getter == nil)
+    {
+        OSSpinLockLock(&NSKVOLock);
+        getter = [NSObject _createValueGetterWithContainerClassID:cls key:key];
+        OSSpinLockUnlock(&NSKVOLock);
+        if (entry != NULL)
+        {
+            NSKVCAccessorCacheStore(entry, cls, hash, getter);
+        }
+    }
     return _NSGetUsingKeyValueGetter(self, getter);
 }
 
@@ -93,6 +332,29 @@ static NSString *const NSUnknownUserInfoKey = @"NSUnknownUserInfoKey";
 
 - (id)valueForKeyPath:(id)keyPath
 {
+    const __NSKVCCompiledKeyPath *path = __NSKVCCompileKeyPath(keyPath);
+    if (path != NULL)
+    {
+        static IMP NSObjectValueForKeyPath = NULL;
+        if (NSObjectValueForKeyPath == NULL)
+        {
+            NSObjectValueForKeyPath = class_getMethodImplementation([NSObject class], _cmd);
+        }
+
+        id value = [self valueForKey:path->keys[0]];
+        for (NSUInteger idx = 1; idx < path->count && value != nil; idx++)
+        {
+            // Collections interpret the rest of the path themselves
+            // (operators like @sum, or mapping over their elements).
+            if (class_getMethodImplementation(object_getClass(value), _cmd) != NSObjectValueForKeyPath)
+            {
+                return [value valueForKeyPath:path->paths[idx]];
+            }
+            value = [value valueForKey:path->keys[idx]];
+        }
+        return value;
+    }
+
     NSRange remainderRange = [keyPath rangeOfString:@"."];
     if (remainderRange.location != NSNotFound)
     {
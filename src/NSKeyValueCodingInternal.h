@@ -71,6 +71,18 @@ typedef struct {
     NSString *remainderPath;
 } __NSKeyPathComponents;
 
+// A key path split on '.' once and kept for the life of the process.
+// paths[i] is the key path starting at keys[i]; paths[count] is nil, so the
+// remainder after keys[i] is always paths[i + 1].
+typedef struct {
+    NSString *keyPath;
+    NSUInteger hash;
+    NSUInteger count;
+    NSString **keys;
+    NSString **paths;
+    __NSKVCOperatorType *operators;
+} __NSKVCCompiledKeyPath;
+
 const void *NSKVOSetterRetain(CFAllocatorRef allocator, const void *value);
 void NSKVOSetterRelease(CFAllocatorRef allocator, const void *value);
 Boolean NSKVOSetterEqual(const void *value1, const void *value2);
@@ -82,3 +94,8 @@ id __NSSumForKeyPath(id keyPath, NSUInteger *countPtr, NSEnumerator *enumerator)
 const NSString *__NSKVCKeyFromOperatorType(__NSKVCOperatorType op);
 __NSKVCOperatorType __NSKVCOperatorTypeFromKey(const NSString *key);
 __NSKeyPathComponents __NSGetComponentsFromKeyPath(NSString *key);
+
+// Returns NULL when the path cannot be cached; callers fall back to
+// splitting it themselves.
+CF_PRIVATE
+const __NSKVCCompiledKeyPath *__NSKVCCompileKeyPath(NSString *keyPath);
@@ -13,6 +13,7 @@ CF_PRIVATE
 	void* _context;
 	NSKeyValueSetter* _setter;
 	NSKeyValueObservingOptions _options;
+	BOOL _removed;
 }
 
 @property (assign) NSObject *observer;
@@ -22,6 +23,9 @@ CF_PRIVATE
 @property (assign) void *context;
 @property (retain) NSKeyValueSetter *setter;
 @property (assign) NSKeyValueObservingOptions options;
+// Set once the observance is unregistered, so notifications still held by a
+// coalescing scope on some thread are dropped instead of delivered.
+@property (assign, getter=isRemoved) BOOL removed;
 - (instancetype)initWithObserver:(NSObject *)observer forKeyPath:(NSString *)keyPath ofObject:(NSObject *)object withContext:(void *)context options:(NSKeyValueObservingOptions)options;
 - (instancetype)initWithObserver:(NSObject *)observer forProperty:(NSKeyValueProperty *)property ofObject:(NSObject *)object context:(void *)context options:(NSKeyValueObservingOptions)options;
 @end
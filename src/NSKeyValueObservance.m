@@ -18,6 +18,7 @@
 @synthesize context = _context;
 @synthesize setter = _setter;
 @synthesize options = _options;
+@synthesize removed = _removed;
 
 - (instancetype)initWithObserver:(NSObject *)observer forKeyPath:(NSString *)keyPath ofObject:(NSObject *)object withContext:(void *)context options:(NSKeyValueObservingOptions)options
 {
@@ -6,6 +6,7 @@
 //
 
 #import <Foundation/NSKeyValueObserving.h>
+#import <Foundation/NSKeyValueObserving_Private.h>
 #import <Foundation/NSRange.h>
 #import <objc/runtime.h>
 #import <objc/message.h>
@@ -34,6 +35,8 @@
 #import <Foundation/NSException.h>
 #import <Foundation/NSLock.h>
 #import <Foundation/NSIndexSet.h>
+#import <Foundation/NSArray.h>
+#import <Foundation/NSSet.h>
 #import <CoreGraphics/CoreGraphics.h>
 #include <os/lock.h>
 
@@ -49,6 +52,63 @@ static OSSpinLock _NSKeyValueObservationInfoCreationSpinLock = OS_SPINLOCK_INIT;
 static NSRecursiveLock *__NSKeyValueObserverRegisterationLock = nil;
 static dispatch_once_t __NSKeyValueObserverRegistrationLockCreationToken;
 
+// Observation info for objects using NSObject's own -observationInfo storage
+// lives in a side table split into shards by object address, so unrelated
+// objects do not contend on one lock. Setting info for an object also marks
+// a bit in a never-cleared filter; an object whose bit is clear has never
+// been observed and is answered without touching the table at all.
+#define NSKeyValueObservationInfoShardCount 64
+#define NSKeyValueObservedFilterBits (1 << 16)
+
+typedef struct {
+    os_unfair_lock lock;
+    CFMutableDictionaryRef table;
+} __attribute__((aligned(64))) NSKeyValueObservationInfoShard;
+
+static NSKeyValueObservationInfoShard _NSKeyValueObservationInfoShards[NSKeyValueObservationInfoShardCount];
+static volatile uint32_t _NSKeyValueObservedFilter[NSKeyValueObservedFilterBits / 32];
+static IMP _NSKeyValueDefaultObservationInfoImplementation = NULL;
+
+static inline uintptr_t _NSKeyValueObservationInfoHash(id object)
+{
+    uintptr_t hash = (uintptr_t)object >> 4;
+    return hash ^ (hash >> 17);
+}
+
+static inline NSKeyValueObservationInfoShard *_NSKeyValueObservationInfoShardForObject(id object)
+{
+    return &_NSKeyValueObservationInfoShards[_NSKeyValueObservationInfoHash(object) & (NSKeyValueObservationInfoShardCount - 1)];
+}
+
+static inline BOOL _NSKeyValueObjectMayBeObserved(id object)
+{
+    uintptr_t bit = (_NSKeyValueObservationInfoHash(object) >> 6) & (NSKeyValueObservedFilterBits - 1);
+    return (_NSKeyValueObservedFilter[bit / 32] & (1U << (bit % 32))) != 0;
+}
+
+static inline void _NSKeyValueMarkObjectObserved(id object)
+{
+    uintptr_t bit = (_NSKeyValueObservationInfoHash(object) >> 6) & (NSKeyValueObservedFilterBits - 1);
+    OSAtomicOr32Barrier(1U << (bit % 32), &_NSKeyValueObservedFilter[bit / 32]);
+}
+
+static id _NSKeyValueRetainedObservationInfoFromTable(id object)
+{
+    if (!_NSKeyValueObjectMayBeObserved(object))
+    {
+        return nil;
+    }
+    NSKeyValueObservationInfoShard *shard = _NSKeyValueObservationInfoShardForObject(object);
+    id observationInfo = nil;
+    os_unfair_lock_lock(&shard->lock);
+    if (shard->table != NULL)
+    {
+        observationInfo = [(id)CFDictionaryGetValue(shard->table, object) retain];
+    }
+    os_unfair_lock_unlock(&shard->lock);
+    return observationInfo;
+}
+
 static const char *kOriginalImplementationMethodNamePrefix = "_original_";
 
 static pthread_key_t _NSKVOPthreadKey;
@@ -478,17 +538,28 @@ static NSKeyValueProperty *_NSKeyValuePropertyForIsaAndKeyPath(Class isa, NSStri
 
 id __NSKeyValueRetainedObservationInfoForObject(NSObject *object, NSKeyValueContainerClass *containerClass)
 {
-    id observationInfo = nil;
-    OSSpinLockLock(&_NSKeyValueObservationInfoSpinLock);
+    IMP observationInfoIMP;
     if (containerClass != nil)
     {
-        IMP cachedIMP = containerClass.cachedObservationInfoImplementation;
-        observationInfo = cachedIMP(object, @selector(observationInfo));
+        observationInfoIMP = containerClass.cachedObservationInfoImplementation;
     }
     else
     {
-        observationInfo = [object observationInfo];
+        observationInfoIMP = class_getMethodImplementation(object_getClass(object), @selector(observationInfo));
     }
+    if (_NSKeyValueDefaultObservationInfoImplementation == NULL)
+    {
+        _NSKeyValueDefaultObservationInfoImplementation = class_getMethodImplementation([NSObject class], @selector(observationInfo));
+    }
+    if (observationInfoIMP == _NSKeyValueDefaultObservationInfoImplementation)
+    {
+        // The side table retains under its shard lock; no global lock needed.
+        return _NSKeyValueRetainedObservationInfoFromTable(object);
+    }
+
+    id observationInfo = nil;
+    OSSpinLockLock(&_NSKeyValueObservationInfoSpinLock);
+    observationInfo = observationInfoIMP(object, @selector(observationInfo));
     if (observationInfo != nil)
     {
         [observationInfo retain];
@@ -514,7 +585,7 @@ id __NSKeyValueRetainedObservationInfoForObject(NSObject *object, NSKeyValueCont
         NSKeyValueChangeDetails changeDetails = {0};
         changeDetails.kind = NSKeyValueChangeSetting;
         changeDetails.newValue = newValue;
-        _NSKeyValueNotifyObserver(observer, self, nil, keyPath, changeDetails, context, NO);
+        _NSKeyValueNotifyObserver(nil, observer, self, nil, keyPath, changeDetails, context, NO);
         [__NSKeyValueObserverRegisterationLock lock];
     }
     OSSpinLockLock(&_NSKeyValueObservationInfoCreationSpinLock);
@@ -550,8 +621,254 @@ id __NSKeyValueRetainedObservationInfoForObject(NSObject *object, NSKeyValueCont
     [observationInfo release];
 }
 
-static void _NSKeyValueNotifyObserver(NSObject *observer, NSObject *observable, NSObject *originalObservable, NSString *keyPath, NSKeyValueChangeDetails detailsForDictionary, void *context, BOOL isPriorNotification)
+typedef struct {
+    NSKeyValueObservance *observance;
+    NSObject *observer;
+    NSObject *observable;
+    NSObject *originalObservable;
+    NSString *keyPath;
+    void *context;
+    NSKeyValueChangeDetails details;
+} NSKVOCoalescedNotification;
+
+static void _NSKVOCoalescedNotificationFree(NSKVOCoalescedNotification *notification)
+{
+    [notification->observance release];
+    [notification->observer release];
+    [notification->observable release];
+    [notification->originalObservable release];
+    [notification->keyPath release];
+    [notification->details.oldValue release];
+    [notification->details.newValue release];
+    [notification->details.indexes release];
+    [notification->details.extraData release];
+    free(notification);
+}
+
+static void _NSKVOCoalescedNotificationDeliver(NSKVOCoalescedNotification *notification)
+{
+    if ([notification->observance isRemoved])
+    {
+        // The observer unregistered after the change; it must not hear of it.
+        return;
+    }
+    NSKeyValueChangeDictionary *kvChangeDict = [[NSKeyValueChangeDictionary alloc] initWithDetailsNoCopy:notification->details originalObservable:notification->originalObservable isPriorNotification:NO];
+    [kvChangeDict retainObjects];
+    [notification->observer observeValueForKeyPath:notification->keyPath ofObject:notification->observable change:kvChangeDict context:notification->context];
+    [kvChangeDict release];
+}
+
+static id _NSKVOCoalescedArrayByAppending(id first, id second)
+{
+    if (first == nil || second == nil)
+    {
+        return nil;
+    }
+    return [[first arrayByAddingObjectsFromArray:second] retain];
+}
+
+static id _NSKVOCoalescedSetByAdding(id first, id second)
+{
+    if (first == nil || second == nil)
+    {
+        return nil;
+    }
+    return [[first setByAddingObjectsFromSet:second] retain];
+}
+
+// Whether a change with details can be folded into pending so that the
+// result describes exactly the same overall change. Only runs whose indexes
+// do not move each other are merged, so the union of their indexes is still
+// correct. Prior notifications carry the kind and indexes of the change to
+// come, so this can be decided before the change happens.
+static BOOL _NSKVOCoalescedNotificationCanMerge(NSKVOCoalescedNotification *pending, NSKeyValueChangeDetails details)
+{
+    NSKeyValueChangeDetails *merged = &pending->details;
+    if (merged->kind != details.kind)
+    {
+        return NO;
+    }
+    if (details.kind == NSKeyValueChangeSetting)
+    {
+        return YES;
+    }
+    if ((merged->indexes == nil) != (details.indexes == nil))
+    {
+        return NO;
+    }
+    if (merged->indexes == nil)
+    {
+        return YES;
+    }
+    if (details.kind == NSKeyValueChangeRemoval)
+    {
+        return [details.indexes lastIndex] < [merged->indexes firstIndex];
+    }
+    return [details.indexes firstIndex] > [merged->indexes lastIndex];
+}
+
+// Folds the change in details into pending, which must be able to take it.
+static void _NSKVOCoalescedNotificationMerge(NSKVOCoalescedNotification *pending, NSKeyValueChangeDetails details)
+{
+    NSKeyValueChangeDetails *merged = &pending->details;
+    if (details.kind == NSKeyValueChangeSetting)
+    {
+        [merged->newValue release];
+        merged->newValue = [details.newValue retain];
+        return;
+    }
+
+    id oldValue = nil;
+    id newValue = nil;
+    if (merged->indexes == nil)
+    {
+        // Unordered to-many mutations carry their objects as sets.
+        oldValue = _NSKVOCoalescedSetByAdding(merged->oldValue, details.oldValue);
+        newValue = _NSKVOCoalescedSetByAdding(merged->newValue, details.newValue);
+    }
+    else if (details.kind == NSKeyValueChangeRemoval)
+    {
+        oldValue = _NSKVOCoalescedArrayByAppending(details.oldValue, merged->oldValue);
+        newValue = _NSKVOCoalescedArrayByAppending(details.newValue, merged->newValue);
+    }
+    else
+    {
+        oldValue = _NSKVOCoalescedArrayByAppending(merged->oldValue, details.oldValue);
+        newValue = _NSKVOCoalescedArrayByAppending(merged->newValue, details.newValue);
+    }
+
+    if (merged->indexes != nil)
+    {
+        NSMutableIndexSet *indexes = [merged->indexes mutableCopy];
+        [indexes addIndexes:details.indexes];
+        [merged->indexes release];
+        merged->indexes = indexes;
+    }
+    [merged->oldValue release];
+    merged->oldValue = oldValue;
+    [merged->newValue release];
+    merged->newValue = newValue;
+}
+
+static void _NSKVOCoalescedNotificationDeliverAndFree(NSKVOCoalescedNotification *notification)
+{
+    @try
+    {
+        _NSKVOCoalescedNotificationDeliver(notification);
+    }
+    @finally
+    {
+        _NSKVOCoalescedNotificationFree(notification);
+    }
+}
+
+// Delivers everything the current scope holds, in order of first change,
+// leaving the scope open and empty. If an observer throws, the remaining
+// changes are released undelivered.
+static void _NSKeyValueFlushCoalescedNotifications(NSKeyValueObservingTSD *kvoTSD)
+{
+    // Observers may change observed objects again while we deliver; those
+    // changes start a fresh list.
+    CFMutableArrayRef notifications = kvoTSD->coalescedNotifications;
+    kvoTSD->coalescedNotifications = CFArrayCreateMutable(NULL, 0, NULL);
+    CFDictionaryRemoveAllValues(kvoTSD->coalescedNotificationIndex);
+
+    CFIndex count = CFArrayGetCount(notifications);
+    CFIndex idx = 0;
+    @try
+    {
+        while (idx < count)
+        {
+            _NSKVOCoalescedNotificationDeliverAndFree((NSKVOCoalescedNotification *)CFArrayGetValueAtIndex(notifications, idx++));
+        }
+    }
+    @finally
+    {
+        for (; idx < count; idx++)
+        {
+            _NSKVOCoalescedNotificationFree((NSKVOCoalescedNotification *)CFArrayGetValueAtIndex(notifications, idx));
+        }
+        CFRelease(notifications);
+    }
+}
+
+// Pending changes are keyed by observance, so two registrations of the same
+// observer, key path and context each get their own notification.
+static BOOL _NSKeyValueCoalesceNotification(NSKeyValueObservance *observance, NSObject *observer, NSObject *observable, NSObject *originalObservable, NSString *keyPath, NSKeyValueChangeDetails details, void *context, BOOL isPriorNotification)
+{
+    NSKeyValueObservingTSD *kvoTSD = pthread_getspecific(_NSGetKVOPthreadKey());
+    if (kvoTSD == NULL || kvoTSD->coalescingLevel == 0 || observance == nil)
+    {
+        return NO;
+    }
+
+    NSKVOCoalescedNotification *pending = (NSKVOCoalescedNotification *)CFDictionaryGetValue(kvoTSD->coalescedNotificationIndex, observance);
+    if (pending != NULL)
+    {
+        if (_NSKVOCoalescedNotificationCanMerge(pending, details))
+        {
+            // Only the first change of a run announces itself.
+            if (!isPriorNotification)
+            {
+                _NSKVOCoalescedNotificationMerge(pending, details);
+            }
+            return YES;
+        }
+        // The runs cannot be expressed as one change. Deliver everything held
+        // so far, keeping the order of first change, and start over; the
+        // prior notification of the new run goes out as usual.
+        _NSKeyValueFlushCoalescedNotifications(kvoTSD);
+    }
+
+    if (isPriorNotification)
+    {
+        return NO;
+    }
+
+    pending = malloc(sizeof(NSKVOCoalescedNotification));
+    pending->observance = [observance retain];
+    pending->observer = [observer retain];
+    pending->observable = [observable retain];
+    pending->originalObservable = [originalObservable retain];
+    pending->keyPath = [keyPath copy];
+    pending->context = context;
+    pending->details.kind = details.kind;
+    pending->details.oldValue = [details.oldValue retain];
+    pending->details.newValue = [details.newValue retain];
+    pending->details.indexes = [details.indexes copy];
+    pending->details.extraData = [details.extraData retain];
+    CFArrayAppendValue(kvoTSD->coalescedNotifications, pending);
+    CFDictionarySetValue(kvoTSD->coalescedNotificationIndex, observance, pending);
+    return YES;
+}
+
+// Drops what this thread's coalescing scope still holds for an observance
+// that is being removed. Scopes on other threads skip it when they deliver.
+static void _NSKeyValueDiscardCoalescedNotifications(NSKeyValueObservance *observance)
+{
+    NSKeyValueObservingTSD *kvoTSD = pthread_getspecific(_NSGetKVOPthreadKey());
+    if (kvoTSD == NULL || kvoTSD->coalescedNotificationIndex == NULL)
+    {
+        return;
+    }
+    NSKVOCoalescedNotification *pending = (NSKVOCoalescedNotification *)CFDictionaryGetValue(kvoTSD->coalescedNotificationIndex, observance);
+    if (pending == NULL)
+    {
+        return;
+    }
+    CFDictionaryRemoveValue(kvoTSD->coalescedNotificationIndex, observance);
+    CFIndex idx = CFArrayGetFirstIndexOfValue(kvoTSD->coalescedNotifications, CFRangeMake(0, CFArrayGetCount(kvoTSD->coalescedNotifications)), pending);
+    CFArrayRemoveValueAtIndex(kvoTSD->coalescedNotifications, idx);
+    _NSKVOCoalescedNotificationFree(pending);
+}
+
+static void _NSKeyValueNotifyObserver(NSKeyValueObservance *observance, NSObject *observer, NSObject *observable, NSObject *originalObservable, NSString *keyPath, NSKeyValueChangeDetails detailsForDictionary, void *context, BOOL isPriorNotification)
 {
+    if (_NSKeyValueCoalesceNotification(observance, observer, observable, originalObservable, keyPath, detailsForDictionary, context, isPriorNotification))
+    {
+        return;
+    }
+
     NSKeyValueChangeDictionary *kvChangeDict = [[NSKeyValueChangeDictionary alloc] initWithDetailsNoCopy:detailsForDictionary originalObservable:originalObservable isPriorNotification:isPriorNotification];
     [kvChangeDict retainObjects];
     [observer observeValueForKeyPath:keyPath ofObject:observable change:kvChangeDict context:context];
@@ -624,6 +941,8 @@ static void NSKeyValueRaiseUnregistered(NSObject *receiver, NSObject *observer,
         }
     }
     [observationInfo removeObservance:observance];
+    observance.removed = YES;
+    _NSKeyValueDiscardCoalescedNotifications(observance);
     [property object:self didRemoveObservance:observance recurse:YES];
     // release to match original allocation of NSKeyValueObservance object
     [observance release];
@@ -941,36 +1260,57 @@ static os_unfair_lock kvoLegacyDependentKeysLock = OS_UNFAIR_LOCK_INIT;
     os_unfair_lock_unlock(&kvoLegacyDependentKeysLock);
 }
 
-static CFMutableDictionaryRef _NSKeyValueGlobalObservationInfo = NULL;
-
 - (void *)observationInfo NS_RETURNS_INNER_POINTER
 {
-    if (_NSKeyValueGlobalObservationInfo == NULL)
+    if (!_NSKeyValueObjectMayBeObserved(self))
     {
         return nil;
     }
-    return (void *)CFDictionaryGetValue(_NSKeyValueGlobalObservationInfo, self);
+    NSKeyValueObservationInfoShard *shard = _NSKeyValueObservationInfoShardForObject(self);
+    void *observationInfo = NULL;
+    os_unfair_lock_lock(&shard->lock);
+    if (shard->table != NULL)
+    {
+        observationInfo = (void *)CFDictionaryGetValue(shard->table, self);
+    }
+    os_unfair_lock_unlock(&shard->lock);
+    return observationInfo;
 }
 
 - (void)setObservationInfo:(void *)observationInfo
 {
-    static dispatch_once_t once;
-    if (_NSKeyValueGlobalObservationInfo == NULL)
-    {
-        dispatch_once(&once, 
-        ^{
-            _NSKeyValueGlobalObservationInfo = CFDictionaryCreateMutable(NULL, 0, NULL, &sNSCFDictionaryValueCallBacks);
-        });        
-    }
-    NSKeyValueObservationInfo *realInfoPtr = (NSKeyValueObservationInfo *)observationInfo;
+    NSKeyValueObservationInfoShard *shard = _NSKeyValueObservationInfoShardForObject(self);
+    // The previous info is released only after the shard lock is dropped:
+    // its dealloc may reach -setObservationInfo: for another object in the
+    // same shard, and the lock is not recursive.
+    id previous = nil;
     if (observationInfo == nil)
     {
-        CFDictionaryRemoveValue(_NSKeyValueGlobalObservationInfo, self);
+        if (!_NSKeyValueObjectMayBeObserved(self))
+        {
+            return;
+        }
+        os_unfair_lock_lock(&shard->lock);
+        if (shard->table != NULL)
+        {
+            previous = [(id)CFDictionaryGetValue(shard->table, self) retain];
+            CFDictionaryRemoveValue(shard->table, self);
+        }
+        os_unfair_lock_unlock(&shard->lock);
     }
     else
     {
-        CFDictionarySetValue(_NSKeyValueGlobalObservationInfo, self, (CFTypeRef)realInfoPtr);
+        _NSKeyValueMarkObjectObserved(self);
+        os_unfair_lock_lock(&shard->lock);
+        if (shard->table == NULL)
+        {
+            shard->table = CFDictionaryCreateMutable(NULL, 0, NULL, &sNSCFDictionaryValueCallBacks);
+        }
+        previous = [(id)CFDictionaryGetValue(shard->table, self) retain];
+        CFDictionarySetValue(shard->table, self, (CFTypeRef)observationInfo);
+        os_unfair_lock_unlock(&shard->lock);
     }
+    [previous release];
 }
 
 @end
@@ -1248,7 +1588,7 @@ void _NSKeyValueWillChange(id self, id keyOrKeys, BOOL keyOrKeysIsASet, NSKeyVal
                         pushFn(self, keyOrKeys, observance, forwardingValues, kvoTSD, changeResult);
                         if (observance.options & NSKeyValueObservingOptionPrior)
                         {
-                            _NSKeyValueNotifyObserver(observance.observer, self, observance.originalObservable, relevantKeyPath, changeResult, observance.context, YES);
+                            _NSKeyValueNotifyObserver(observance, observance.observer, self, observance.originalObservable, relevantKeyPath, changeResult, observance.context, YES);
                         }
                         if (reatinedDetails)
                         {
@@ -1267,6 +1607,18 @@ void _NSKeyValueWillChange(id self, id keyOrKeys, BOOL keyOrKeysIsASet, NSKeyVal
 
 static void NSKeyValueObservingTSDDestroy(void *mem)
 {
+    NSKeyValueObservingTSD *kvoTSD = mem;
+    if (kvoTSD->coalescedNotifications != NULL)
+    {
+        // The thread exited inside a coalescing scope; drop what was pending.
+        CFIndex count = CFArrayGetCount(kvoTSD->coalescedNotifications);
+        for (CFIndex idx = 0; idx < count; idx++)
+        {
+            _NSKVOCoalescedNotificationFree((NSKVOCoalescedNotification *)CFArrayGetValueAtIndex(kvoTSD->coalescedNotifications, idx));
+        }
+        CFRelease(kvoTSD->coalescedNotifications);
+        CFRelease(kvoTSD->coalescedNotificationIndex);
+    }
     free(mem);
 }
 
@@ -1529,7 +1881,7 @@ void _NSKeyValueDidChange(NSObject *observable, id keyOrKeys, BOOL keyOrKeysIsAS
         }
         NSKeyValueChangeDetails appliedDetails = {0}; // possibly the wrong struct here. 
         apply(&appliedDetails, observable, keyPath, isDifferent, outObservance.options, fillDetails);
-        _NSKeyValueNotifyObserver(outObservance.observer, observable, outObservance.originalObservable, keyPath, appliedDetails, outObservance.context, NO);
+        _NSKeyValueNotifyObserver(outObservance, outObservance.observer, observable, outObservance.originalObservable, keyPath, appliedDetails, outObservance.context, NO);
     }
 }
 
@@ -1687,3 +2039,36 @@ NSKeyValueImplicitObservanceRemovalInfo *_NSKeyValueGetImplicitObservanceRemoval
     NSKeyValueObservingTSD *threadSpecificKVOStruct = NSGetOrCreateThreadSpecificKVOStruct();
     return &(threadSpecificKVOStruct->implicitObservanceRemovalInfo);
 }
+
+@implementation NSObject (NSKeyValueObservingCoalescing)
+
++ (void)_beginCoalescingKeyValueNotifications
+{
+    NSKeyValueObservingTSD *kvoTSD = NSGetOrCreateThreadSpecificKVOStruct();
+    if (kvoTSD->coalescedNotifications == NULL)
+    {
+        kvoTSD->coalescedNotifications = CFArrayCreateMutable(NULL, 0, NULL);
+        kvoTSD->coalescedNotificationIndex = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+    }
+    ++kvoTSD->coalescingLevel;
+}
+
++ (void)_endCoalescingKeyValueNotifications
+{
+    NSKeyValueObservingTSD *kvoTSD = pthread_getspecific(_NSGetKVOPthreadKey());
+    if (kvoTSD == NULL || kvoTSD->coalescingLevel == 0)
+    {
+        [NSException raise:NSInternalInconsistencyException format:@"+[NSObject _endCoalescingKeyValueNotifications] called without a matching begin"];
+        return;
+    }
+    if (--kvoTSD->coalescingLevel != 0)
+    {
+        return;
+    }
+
+    // Changes made by observers while we deliver go out immediately now
+    // that the scope is closed.
+    _NSKeyValueFlushCoalescedNotifications(kvoTSD);
+}
+
+@end
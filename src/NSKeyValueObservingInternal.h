@@ -67,6 +67,9 @@ typedef struct {
     } implicitObservanceAdditionInfoOrObservationInfo;
     NSKeyValueImplicitObservanceRemovalInfo implicitObservanceRemovalInfo;
     NSInteger recursionLevel;
+    NSInteger coalescingLevel;
+    CFMutableArrayRef coalescedNotifications;
+    CFMutableDictionaryRef coalescedNotificationIndex;
 } NSKeyValueObservingTSD;
 
 typedef struct {
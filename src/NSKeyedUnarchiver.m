@@ -23,17 +23,45 @@
 #import <dispatch/dispatch.h>
 #import <objc/runtime.h>
 #import <stdlib.h>
+#import <string.h>
 
 static NSMutableDictionary *archiverClasses = nil;
 
 NSString *const NSInvalidUnarchiveOperationException = @"NSInvalidUnarchiveOperationException";
 
+// Keys every binary archive looks up for each object it decodes.
+enum {
+    NSKeyedUnarchiverKeyClass,
+    NSKeyedUnarchiverKeyClassName,
+    NSKeyedUnarchiverKeyClasses,
+    NSKeyedUnarchiverKeyClassHints,
+    NSKeyedUnarchiverKeyCount
+};
+
+static const struct {
+    const char *string;
+    uint8_t length;
+} NSKeyedUnarchiverKeys[NSKeyedUnarchiverKeyCount] = {
+    { "$class", 6 },
+    { "$classname", 10 },
+    { "$classes", 8 },
+    { "$classhints", 11 },
+};
+
 @interface _NSKeyedUnarchiverHelper : NSObject
 {
 @public
     NSArray *_white;
     NSUInteger _lastRef;
     NSMutableArray *_allowedClasses;
+    // object reference of each well known key string; archivers write each
+    // string once, so every dictionary refers to it by the same reference
+    uint64_t _keyRefs[NSKeyedUnarchiverKeyCount];
+    // $objects index of a class dictionary -> resolved Class
+    CFMutableDictionaryRef _classCache;
+    // classes already checked against _checkedAllowedClasses
+    NSSet *_checkedAllowedClasses;
+    CFMutableSetRef _checkedClasses;
 }
 - (BOOL)classNameAllowed:(Class)class;
 - (void)setAllowedClassNames:(NSArray *)classNames;
@@ -51,6 +79,9 @@ NSString *const NSInvalidUnarchiveOperationException = @"NSInvalidUnarchiveOpera
         [_white release];
     }
     [_allowedClasses release];
+    CFRelease(_classCache);
+    [_checkedAllowedClasses release];
+    CFRelease(_checkedClasses);
 
     [super dealloc];
 }
@@ -61,6 +92,12 @@ NSString *const NSInvalidUnarchiveOperationException = @"NSInvalidUnarchiveOpera
     if (self != nil)
     {
         _allowedClasses = [[NSMutableArray alloc] init];
+        for (NSUInteger idx = 0; idx < NSKeyedUnarchiverKeyCount; idx++)
+        {
+            _keyRefs[idx] = UINT64_MAX;
+        }
+        _classCache = CFDictionaryCreateMutable(kCFAllocatorSystemDefault, 0, NULL, NULL);
+        _checkedClasses = CFSetCreateMutable(kCFAllocatorSystemDefault, 0, NULL);
     }
     return self;
 }
@@ -433,6 +470,205 @@ static BOOL _getUIDFromData(uint8_t *ptr, NSUInteger *returnVal)
     return YES;
 }
 
+static BOOL _getObjectOffset(NSKeyedUnarchiver *unarchiver, uint64_t ref, uint64_t *offsetPtr)
+{
+    CFBinaryPlistTrailer *trailer = &unarchiver->_offsetData->trailer;
+    if (ref >= trailer->_numObjects)
+    {
+        return NO;
+    }
+    uint64_t entry = trailer->_offsetTableOffset + ref * trailer->_offsetIntSize;
+    if (entry + trailer->_offsetIntSize > unarchiver->_len)
+    {
+        return NO;
+    }
+    uint64_t offset = _getSizedInt((const uint8_t *)unarchiver->_bytes + entry, trailer->_offsetIntSize);
+    if (offset >= unarchiver->_len)
+    {
+        return NO;
+    }
+    *offsetPtr = offset;
+    return YES;
+}
+
+static BOOL _keyObjectMatches(NSKeyedUnarchiver *unarchiver, uint64_t ref, NSUInteger key)
+{
+    uint64_t offset;
+    if (!_getObjectOffset(unarchiver, ref, &offset))
+    {
+        return NO;
+    }
+    uint8_t length = NSKeyedUnarchiverKeys[key].length;
+    if (offset + 1 + length > unarchiver->_len)
+    {
+        return NO;
+    }
+    const uint8_t *ptr = (const uint8_t *)unarchiver->_bytes + offset;
+    return *ptr == (kCFBinaryPlistMarkerASCIIString | length) &&
+           memcmp(ptr + 1, NSKeyedUnarchiverKeys[key].string, length) == 0;
+}
+
+// Equivalent to _getOffsetForNestedValueWrap for one of the well known keys,
+// but matches keys by object reference instead of creating and comparing
+// strings. Falls back to comparing the raw key bytes when the reference
+// differs, e.g. for archivers that do not unique their strings.
+static BOOL _getOffsetForKnownKey(NSKeyedUnarchiver *unarchiver, NSUInteger key, uint64_t offset, uint64_t *offsetPtr)
+{
+    const uint8_t *ptr = (const uint8_t *)unarchiver->_bytes + offset;
+    const uint8_t *end = (const uint8_t *)unarchiver->_bytes + unarchiver->_len;
+    if ((*ptr & 0xf0) != kCFBinaryPlistMarkerDict)
+    {
+        return NO;
+    }
+    uint64_t count = *ptr++ & 0x0f;
+    if (count == 0xf)
+    {
+        if (ptr >= end || (*ptr & 0xf0) != kCFBinaryPlistMarkerInt)
+        {
+            return NO;
+        }
+        uint8_t size = 1 << (*ptr & 0x0f);
+        if (size > end - ptr - 1)
+        {
+            return NO;
+        }
+        count = _getSizedInt(ptr + 1, size);
+        ptr += 1 + size;
+    }
+
+    uint8_t refSize = unarchiver->_offsetData->trailer._objectRefSize;
+    if (refSize == 0 || count > (uint64_t)(end - ptr) / (2 * refSize))
+    {
+        return NO;
+    }
+
+    uint64_t *keyRef = &unarchiver->_helper->_keyRefs[key];
+    for (uint64_t idx = 0; idx < count; idx++)
+    {
+        uint64_t ref = _getSizedInt(ptr + idx * refSize, refSize);
+        if (ref != *keyRef)
+        {
+            if (!_keyObjectMatches(unarchiver, ref, key))
+            {
+                continue;
+            }
+            *keyRef = ref;
+        }
+        return _getObjectOffset(unarchiver, _getSizedInt(ptr + (count + idx) * refSize, refSize), offsetPtr);
+    }
+    return NO;
+}
+
+static CFStringRef _copyClassNameBinary(NSKeyedUnarchiver *unarchiver, NSUInteger uid2) CF_RETURNS_RETAINED
+{
+    uint64_t classOffset;
+    if (!__CFBinaryPlistGetOffsetForValueFromArray2(unarchiver->_bytes, unarchiver->_len, unarchiver->_offsetData->valueOffset, &unarchiver->_offsetData->trailer, uid2, &classOffset, unarchiver->_reservedDictionary))
+    {
+        return NULL;
+    }
+    uint64_t voffset2;
+    if (!_getOffsetForKnownKey(unarchiver, NSKeyedUnarchiverKeyClassName, classOffset, &voffset2))
+    {
+        return NULL;
+    }
+
+    CFPropertyListRef className;
+    if (!__CFBinaryPlistCreateObject(unarchiver->_bytes, unarchiver->_len, voffset2, &unarchiver->_offsetData->trailer, NULL, 0, unarchiver->_reservedDictionary, &className))
+    {
+        return NULL;
+    }
+    uint64_t unused;
+    if (_getOffsetForKnownKey(unarchiver, NSKeyedUnarchiverKeyClassHints, classOffset, &unused))
+    {
+        #warning TODO Unimplemented $classhints https://code.google.com/p/apportable/issues/detail?id=153
+    }
+    if (!_getOffsetForKnownKey(unarchiver, NSKeyedUnarchiverKeyClasses, classOffset, &unused))
+    {
+        CFRelease(className);
+        return NULL;
+    }
+    return className;
+}
+
+// Resolves the class dictionary at $objects[uid2] once per unarchiver.
+static Class _decodeClassBinary(NSKeyedUnarchiver *unarchiver, NSUInteger uid2)
+{
+    Class class = Nil;
+    if (CFDictionaryGetValueIfPresent(unarchiver->_helper->_classCache, (const void *)uid2, (const void **)&class))
+    {
+        return class;
+    }
+
+    NSString *className = (NSString *)_copyClassNameBinary(unarchiver, uid2);
+    if (className == nil)
+    {
+        return Nil;
+    }
+    class = [unarchiver classForClassName:className];
+    if (class == nil)
+    {
+        class = [[unarchiver class] classForClassName:className];
+    }
+    if (class == nil)
+    {
+        class = NSClassFromString(className);
+    }
+    if (class == nil)
+    {
+        NSLog(@"Failed to decode an instance of class %@: class not found", className);
+        [className release];
+        return Nil;
+    }
+#warning TODO implement classNameAllowed https://code.google.com/p/apportable/issues/detail?id=153
+    // if (![helper classNameAllowed:class])
+    // {
+    //     return nil;
+    // }
+    class = [class classForKeyedUnarchiver];
+    if (class == nil)
+    {
+        [className autorelease];
+        @throw [NSException exceptionWithName:NSInvalidUnarchiveOperationException reason:[NSString stringWithFormat:@"No classForKeyedUnarchiver class:%@", className] userInfo:nil];
+        return Nil;
+    }
+    [className release];
+
+    CFDictionarySetValue(unarchiver->_helper->_classCache, (const void *)uid2, class);
+    return class;
+}
+
+static void _checkAllowedClassBinary(NSKeyedUnarchiver *unarchiver, Class class, NSUInteger uid2)
+{
+    if (![unarchiver requiresSecureCoding])
+    {
+        return;
+    }
+
+    _NSKeyedUnarchiverHelper *helper = unarchiver->_helper;
+    NSSet *allowedClassSet = [unarchiver allowedClasses];
+    if (allowedClassSet != helper->_checkedAllowedClasses)
+    {
+        // retained so that a new set can never show up at the same address
+        [helper->_checkedAllowedClasses release];
+        helper->_checkedAllowedClasses = [allowedClassSet retain];
+        CFSetRemoveAllValues(helper->_checkedClasses);
+    }
+    if (CFSetContainsValue(helper->_checkedClasses, class))
+    {
+        return;
+    }
+    if ([allowedClassSet containsObject:class])
+    {
+        CFSetAddValue(helper->_checkedClasses, class);
+        return;
+    }
+
+    NSString *className = [(NSString *)_copyClassNameBinary(unarchiver, uid2) autorelease];
+    [[NSException exceptionWithName:NSInvalidUnarchiveOperationException
+                             reason:[NSString stringWithFormat:@"%@ was unexpected. The expected classes are %@", className ?: NSStringFromClass(class), allowedClassSet]
+                           userInfo:@{@"__NSCoderInternalErrorCode" : @4864}] raise];
+}
+
 static id _decodeObjectBinary(NSKeyedUnarchiver *unarchiver, NSUInteger uid1) NS_RETURNS_RETAINED
 {
     uint64_t voffset = unarchiver->_offsetData->valueOffset;
@@ -496,7 +732,7 @@ static id _decodeObjectBinary(NSKeyedUnarchiver *unarchiver, NSUInteger uid1) NS
             return nil;
         }
         uint64_t doffset;
-        if (!_getOffsetForNestedValueWrap(unarchiver, @"$class", nestOffset, &doffset))
+        if (!_getOffsetForKnownKey(unarchiver, NSKeyedUnarchiverKeyClass, nestOffset, &doffset))
         {
             return nil;
         }
@@ -505,73 +741,12 @@ static id _decodeObjectBinary(NSKeyedUnarchiver *unarchiver, NSUInteger uid1) NS
         {
             return nil;
         }
-        uint64_t classOffset;
-        if (!__CFBinaryPlistGetOffsetForValueFromArray2(unarchiver->_bytes, unarchiver->_len, voffset, &unarchiver->_offsetData->trailer, uid2, &classOffset, unarchiver->_reservedDictionary))
-        {
-            return nil;
-        }
-        uint64_t voffset2;
-        if (!_getOffsetForNestedValueWrap(unarchiver, @"$classname", classOffset, &voffset2))
+        Class class = _decodeClassBinary(unarchiver, uid2);
+        if (class == Nil)
         {
             return nil;
         }
-
-        CFPropertyListRef className;
-        if (!__CFBinaryPlistCreateObject(unarchiver->_bytes, unarchiver->_len, voffset2, &unarchiver->_offsetData->trailer, NULL, 0, unarchiver->_reservedDictionary, &className))
-        {
-            return nil;
-        }
-        uint64_t unused;
-        if (_getOffsetForNestedValueWrap(unarchiver, @"$classhints", classOffset, &unused))
-        {
-            #warning TODO Unimplemented $classhints https://code.google.com/p/apportable/issues/detail?id=153
-        }
-        if (!_getOffsetForNestedValueWrap(unarchiver, @"$classes", classOffset, &unused))
-        {
-            return nil;
-        }
-        Class class = [unarchiver classForClassName:className];
-        if (class == nil)
-        {
-            class = [[unarchiver class] classForClassName:className];
-        }
-        if (class == nil)
-        {
-            class = NSClassFromString(className);
-        }
-        if (class == nil)
-        {
-            NSLog(@"Failed to decode an instance of class %@: class not found", className);
-            return nil;
-        }
-#warning TODO implement classNameAllowed https://code.google.com/p/apportable/issues/detail?id=153
-        // if (![helper classNameAllowed:class])
-        // {
-        //     return nil;
-        // }
-        class = [class classForKeyedUnarchiver];
-        if (class == nil)
-        {
-            @throw [NSException exceptionWithName:NSInvalidUnarchiveOperationException reason:[NSString stringWithFormat:@"No classForKeyedUnarchiver class:%@", className] userInfo:nil];
-            return nil;
-        }
-        NSException *exception = nil;
-        if ([unarchiver requiresSecureCoding])
-        {
-            NSSet *allowedClassSet = [unarchiver allowedClasses];
-            if (![allowedClassSet containsObject:class]) {
-                exception = [NSException exceptionWithName:NSInvalidUnarchiveOperationException
-                                        reason:[NSString stringWithFormat:@"%@ was unexpected. The expected classes are %@", className, allowedClassSet]
-                                      userInfo: @{@"__NSCoderInternalErrorCode" : @4864}];
-            }
-        }
-        if (className != nil)
-        {
-            CFRelease(className); 
-        }
-        if (exception != nil) {
-            [exception raise];
-        }
+        _checkAllowedClassBinary(unarchiver, class, uid2);
 
         uint64_t pushOldOffset = unarchiver->_offsetData->offset;
         unarchiver->_offsetData->offset = nestOffset;
@@ -1755,6 +1930,10 @@ static CFDictionaryValueCallBacks sNSCFDictionaryValueCallBacks = {
 - (void)setClass:(Class)cls forClassName:(NSString *)name
 {
     CFDictionarySetValue(_nameClassMap, name, cls);
+    if (_helper != nil)
+    {
+        CFDictionaryRemoveAllValues(_helper->_classCache);
+    }
 }
 
 - (id)delegate
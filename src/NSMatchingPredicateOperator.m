@@ -8,32 +8,85 @@
 #import "NSMatchingPredicateOperator.h"
 
 #import "_NSPredicateOperatorUtilities.h"
+#import "NSCFTSDKeys.h"
 
-#import <libkern/OSAtomic.h>
 #import <stdlib.h>
 
-@implementation NSMatchingPredicateOperator
+// Compiled patterns are kept per thread, so evaluating a shared predicate
+// from several threads needs no lock, and a few patterns used in turn do not
+// evict each other. A URegularExpression must not be used by two threads at
+// once, which per-thread ownership also guarantees.
+#define NSMatchingPredicateRegexCacheSize 16
+
+typedef struct {
+    NSString *pattern;
+    URegularExpression *regex;
+    NSComparisonPredicateOptions flags;
+    BOOL likeProtect;
+} NSMatchingPredicateRegexCacheEntry;
+
+typedef struct {
+    NSMatchingPredicateRegexCacheEntry entries[NSMatchingPredicateRegexCacheSize];
+    NSUInteger nextVictim;
+} NSMatchingPredicateRegexCache;
+
+static void NSMatchingPredicateRegexCacheEntryClear(NSMatchingPredicateRegexCacheEntry *entry)
+{
+    if (entry->regex != NULL)
+    {
+        uregex_close(entry->regex);
+        entry->regex = NULL;
+    }
+    if (entry->pattern != nil)
+    {
+        CFRelease(entry->pattern);
+        entry->pattern = nil;
+    }
+}
 
-- (void)dealloc
+static void NSMatchingPredicateRegexCacheDestroy(void *value)
 {
-    if (_regexContext != NULL)
+    NSMatchingPredicateRegexCache *cache = value;
+    for (NSUInteger idx = 0; idx < NSMatchingPredicateRegexCacheSize; idx++)
     {
-        [self _clearContext];
-        free(_regexContext);
+        NSMatchingPredicateRegexCacheEntryClear(&cache->entries[idx]);
     }
-    [super dealloc];
+    free(cache);
 }
 
-- (id)initWithOperatorType:(NSPredicateOperatorType)type modifier:(NSComparisonPredicateModifier)modifier variant:(NSUInteger)variant
+static NSMatchingPredicateRegexCacheEntry *NSMatchingPredicateRegexCacheEntryFor(NSString *pattern, NSComparisonPredicateOptions flags, BOOL likeProtect)
 {
-    self = [super initWithOperatorType:type modifier:modifier variant:variant];
-    if (self != nil)
+    NSMatchingPredicateRegexCache *cache = _CFGetTSD(__CFTSDKeyNSPredicateRegexCache);
+    if (cache == NULL)
     {
-        _regexContext = NULL;
+        cache = calloc(1, sizeof(NSMatchingPredicateRegexCache));
+        if (cache == NULL)
+        {
+            return NULL;
+        }
+        _CFSetTSD(__CFTSDKeyNSPredicateRegexCache, cache, &NSMatchingPredicateRegexCacheDestroy);
     }
-    return self;
+
+    for (NSUInteger idx = 0; idx < NSMatchingPredicateRegexCacheSize; idx++)
+    {
+        NSMatchingPredicateRegexCacheEntry *entry = &cache->entries[idx];
+        if (entry->regex != NULL && entry->flags == flags && entry->likeProtect == likeProtect &&
+            (entry->pattern == pattern || [entry->pattern isEqualToString:pattern]))
+        {
+            return entry;
+        }
+    }
+
+    NSMatchingPredicateRegexCacheEntry *entry = &cache->entries[cache->nextVictim];
+    cache->nextVictim = (cache->nextVictim + 1) % NSMatchingPredicateRegexCacheSize;
+    NSMatchingPredicateRegexCacheEntryClear(entry);
+    entry->flags = flags;
+    entry->likeProtect = likeProtect;
+    return entry;
 }
 
+@implementation NSMatchingPredicateOperator
+
 - (BOOL)performPrimitiveOperationUsingObject:(id)string andObject:(id)pattern
 {
     if (string == nil || pattern == nil)
@@ -58,31 +111,32 @@
         return NO;
     }
 
-    BOOL result = NO;
-
-    @try {
-        OSSpinLockLock(&_contextLock);
+    NSComparisonPredicateOptions flags = [self flags];
+    BOOL escapeForLike = [self _shouldEscapeForLike];
 
-        if (_regexContext == NULL)
-        {
-            _regexContext = calloc(sizeof(*_regexContext), 1);
-        }
-        else if (_regexContext->_field1 != nil && ![_regexContext->_field1 isEqualToString:pattern])
-        {
-            [self _clearContext];
-        }
+    NSMatchingPredicateRegexCacheEntry *entry = NSMatchingPredicateRegexCacheEntryFor(pattern, flags, escapeForLike);
+    if (entry == NULL)
+    {
+        return NO;
+    }
 
-        NSComparisonPredicateOptions flags = [self flags];
-        BOOL escapeForLike = [self _shouldEscapeForLike];
+    BOOL result = NO;
+    struct regexContext context = { entry->pattern, entry->regex };
 
-        result = [_NSPredicateOperatorUtilities doRegexForString:string pattern:pattern likeProtect:escapeForLike flags:flags context:_regexContext];
+    @try {
+        result = [_NSPredicateOperatorUtilities doRegexForString:string pattern:pattern likeProtect:escapeForLike flags:flags context:&context];
     }
     @catch (id e) {
-        [self _clearContext];
-        @throw;
+        result = NO;
     }
     @finally {
-        OSSpinLockUnlock(&_contextLock);
+        entry->pattern = context._field1;
+        entry->regex = context._field2;
+        if (entry->pattern == nil)
+        {
+            // The pattern failed to compile; do not keep a half-built entry.
+            NSMatchingPredicateRegexCacheEntryClear(entry);
+        }
         return result;
     }
 }
@@ -102,18 +156,4 @@
     return [@"MATCHES" stringByAppendingString:[self _modifierString]];
 }
 
-- (void)_clearContext
-{
-    if (_regexContext->_field2 != NULL)
-    {
-        uregex_close(_regexContext->_field2);
-        _regexContext->_field2 = NULL;
-    }
-    if (_regexContext->_field1 != nil)
-    {
-        CFRelease(_regexContext->_field1);
-        _regexContext->_field1 = nil;
-    }
-}
-
 @end
@@ -8,10 +8,16 @@
 #import <Foundation/NSNotification.h>
 #import <Foundation/NSArray.h>
 #import <Foundation/NSString.h>
+#import <Foundation/NSException.h>
 #import <Foundation/NSOperation.h>
 #import "NSNotificationInternal.h"
+#import <CoreFoundation/CFArray.h>
+#import <CoreFoundation/CFDictionary.h>
+#import <libkern/OSAtomic.h>
 #import <dispatch/dispatch.h>
 #import <pthread.h>
+#import <stdlib.h>
+#import <string.h>
 
 @interface _NSNotificationObserver : NSObject
 {
@@ -21,6 +27,9 @@
 	id _object;
 	NSOperationQueue* _queue;
 	void (^_block)(NSNotification *note);
+@public
+	NSUInteger _sequence;
+	volatile BOOL _removed;
 }
 
 @property (nonatomic, readonly) id observer;
@@ -89,8 +98,517 @@
 
 @end
 
+// Posting threads reach observers without taking a lock. Each notification
+// name maps to a bucket which splits its observers into those registered for
+// any sender and those registered for a particular sender, so a post only
+// visits observers that can match it.
+//
+// Writers hold _observersLock and change these structures in place, but only
+// in ways a concurrent reader can tolerate. A list publishes immutable views,
+// each a prefix of a shared store, so adding an observer usually just fills
+// the next free slot of the store. Removing one only flags it; the list is
+// copied once most of it is dead. Tables only ever fill empty slots and are
+// replaced as a whole when they grow. Anything a reader may still be looking
+// at is retired instead of released, and a later writer releases it once no
+// reader from that epoch remains.
+//
+// Every list is kept in registration order, and _sequence lets observers
+// from different lists be merged back into that order on delivery.
+
+@interface _NSNotificationObserverStore : NSObject
+{
+@public
+    _NSNotificationObserver **_items;
+    NSUInteger _used;
+    NSUInteger _capacity;
+}
+- (id)initWithCapacity:(NSUInteger)capacity;
+@end
+
+@implementation _NSNotificationObserverStore
+
+- (id)initWithCapacity:(NSUInteger)capacity
+{
+    self = [super init];
+    if (self)
+    {
+        _items = malloc(capacity * sizeof(_NSNotificationObserver *));
+        if (_items == NULL)
+        {
+            [self release];
+            [NSException raise:NSMallocException format:@"Unable to allocate notification observer list"];
+            return nil;
+        }
+        _capacity = capacity;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger idx = 0; idx < _used; idx++)
+    {
+        [_items[idx] release];
+    }
+    free(_items);
+    [super dealloc];
+}
+
+@end
+
+@interface _NSNotificationObserverView : NSObject
+{
+@public
+    _NSNotificationObserverStore *_store;
+    NSUInteger _count;
+}
+- (id)initWithStore:(_NSNotificationObserverStore *)store count:(NSUInteger)count;
+@end
+
+@implementation _NSNotificationObserverView
+
+- (id)initWithStore:(_NSNotificationObserverStore *)store count:(NSUInteger)count
+{
+    self = [super init];
+    if (self)
+    {
+        _store = [store retain];
+        _count = count;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_store release];
+    [super dealloc];
+}
+
+@end
+
+@interface _NSNotificationObserverList : NSObject
+{
+@public
+    _NSNotificationObserverView * volatile _view;
+    NSUInteger _live;
+}
+@end
+
+@implementation _NSNotificationObserverList
+
+- (void)dealloc
+{
+    [_view release];
+    [super dealloc];
+}
+
+@end
+
+typedef struct {
+    id key; // a retained name, or an unretained sender
+    id value;
+} NSNotificationTableEntry;
+
+// Open addressing with linear probing, kept at most half full so a probe
+// always reaches an empty slot.
+@interface _NSNotificationTable : NSObject
+{
+@public
+    NSNotificationTableEntry * volatile *_slots;
+    NSUInteger _capacity;
+    NSUInteger _used;
+    BOOL _namesAsKeys;
+}
+- (id)initWithCapacity:(NSUInteger)capacity namesAsKeys:(BOOL)namesAsKeys;
+@end
+
+@implementation _NSNotificationTable
+
+- (id)initWithCapacity:(NSUInteger)capacity namesAsKeys:(BOOL)namesAsKeys
+{
+    self = [super init];
+    if (self)
+    {
+        _slots = calloc(capacity, sizeof(NSNotificationTableEntry *));
+        if (_slots == NULL)
+        {
+            [self release];
+            [NSException raise:NSMallocException format:@"Unable to allocate notification observer table"];
+            return nil;
+        }
+        _capacity = capacity;
+        _namesAsKeys = namesAsKeys;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger idx = 0; idx < _capacity; idx++)
+    {
+        NSNotificationTableEntry *entry = _slots[idx];
+        if (entry != NULL)
+        {
+            if (_namesAsKeys)
+            {
+                [entry->key release];
+            }
+            [entry->value release];
+            free(entry);
+        }
+    }
+    free(_slots);
+    [super dealloc];
+}
+
+@end
+
+static inline NSUInteger tableSlotForKey(_NSNotificationTable *table, id key)
+{
+    NSUInteger hash;
+    if (table->_namesAsKeys)
+    {
+        hash = CFHash(key);
+    }
+    else
+    {
+        hash = (uintptr_t)key >> 4;
+    }
+    hash ^= hash >> 16;
+    return (hash * 0x9E3779B1) & (table->_capacity - 1);
+}
+
+static id tableGetValue(_NSNotificationTable *table, id key)
+{
+    if (table == nil)
+    {
+        return nil;
+    }
+    NSUInteger mask = table->_capacity - 1;
+    for (NSUInteger idx = tableSlotForKey(table, key);; idx = (idx + 1) & mask)
+    {
+        NSNotificationTableEntry *entry = table->_slots[idx];
+        if (entry == NULL)
+        {
+            return nil;
+        }
+        if (entry->key == key || (table->_namesAsKeys && CFEqual(entry->key, key)))
+        {
+            return entry->value;
+        }
+    }
+}
+
+// Must be called with _observersLock held; key must not be in the table yet.
+// Readers may be probing the table meanwhile, so the entry is complete before
+// it is stored.
+static void tableInsertValue(_NSNotificationTable *table, id key, id value)
+{
+    NSNotificationTableEntry *entry = malloc(sizeof(NSNotificationTableEntry));
+    if (entry == NULL)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate notification observer table"];
+        return;
+    }
+    entry->key = table->_namesAsKeys ? [key copy] : key;
+    entry->value = [value retain];
+
+    NSUInteger mask = table->_capacity - 1;
+    NSUInteger idx = tableSlotForKey(table, key);
+    while (table->_slots[idx] != NULL)
+    {
+        idx = (idx + 1) & mask;
+    }
+    OSMemoryBarrier();
+    table->_slots[idx] = entry;
+    table->_used++;
+}
+
+@interface _NSNotificationBucket : NSObject
+{
+@public
+    _NSNotificationObserverList *_anyObject;
+    _NSNotificationTable * volatile _byObject; // sender -> list, made on demand
+    NSUInteger _count;
+}
+@end
+
+@implementation _NSNotificationBucket
+
+- (id)init
+{
+    self = [super init];
+    if (self)
+    {
+        _anyObject = [[_NSNotificationObserverList alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_anyObject release];
+    [_byObject release];
+    [super dealloc];
+}
+
+@end
+
+static id newBucket(void)
+{
+    return [[_NSNotificationBucket alloc] init];
+}
+
+static id newList(void)
+{
+    return [[_NSNotificationObserverList alloc] init];
+}
+
+static BOOL bucketIsEmpty(id value)
+{
+    return ((_NSNotificationBucket *)value)->_count == 0;
+}
+
+static BOOL listIsEmpty(id value)
+{
+    return ((_NSNotificationObserverList *)value)->_live == 0;
+}
+
+#define MATCHING_LISTS_INLINE 8
+#define MATCHING_OBSERVERS_STACK 32
+
+typedef struct {
+    _NSNotificationObserverView **views;
+    NSUInteger count;
+    NSUInteger capacity;
+    NSUInteger observerCount;
+    id object;
+    _NSNotificationObserverView *inlineViews[MATCHING_LISTS_INLINE];
+} NSNotificationMatches;
+
+// Called by a reader inside its epoch; the view is retained so it outlives
+// the epoch for delivery.
+static void addMatchingList(NSNotificationMatches *matches, _NSNotificationObserverList *list)
+{
+    _NSNotificationObserverView *view = list != nil ? list->_view : nil;
+    if (view == nil)
+    {
+        return;
+    }
+    if (matches->count == matches->capacity)
+    {
+        NSUInteger capacity = matches->capacity * 2;
+        if (matches->views == matches->inlineViews)
+        {
+            matches->views = malloc(capacity * sizeof(_NSNotificationObserverView *));
+            memcpy(matches->views, matches->inlineViews, matches->count * sizeof(_NSNotificationObserverView *));
+        }
+        else
+        {
+            matches->views = realloc(matches->views, capacity * sizeof(_NSNotificationObserverView *));
+        }
+        matches->capacity = capacity;
+    }
+    matches->views[matches->count++] = [view retain];
+    matches->observerCount += view->_count;
+}
+
+static void addBucketMatches(NSNotificationMatches *matches, _NSNotificationBucket *bucket)
+{
+    if (bucket == nil)
+    {
+        return;
+    }
+    addMatchingList(matches, bucket->_anyObject);
+    _NSNotificationTable *byObject = bucket->_byObject;
+    if (byObject == nil)
+    {
+        return;
+    }
+    if (matches->object != nil)
+    {
+        addMatchingList(matches, tableGetValue(byObject, matches->object));
+        return;
+    }
+    for (NSUInteger idx = 0; idx < byObject->_capacity; idx++)
+    {
+        NSNotificationTableEntry *entry = byObject->_slots[idx];
+        if (entry != NULL)
+        {
+            addMatchingList(matches, entry->value);
+        }
+    }
+}
+
+static int compareObserverSequence(const void *a, const void *b)
+{
+    NSUInteger seqA = (*(_NSNotificationObserver **)a)->_sequence;
+    NSUInteger seqB = (*(_NSNotificationObserver **)b)->_sequence;
+    if (seqA < seqB)
+    {
+        return -1;
+    }
+    return seqA > seqB ? 1 : 0;
+}
+
 @implementation NSNotificationCenter
 
+// Must be called with _observersLock held. The caller's reference to object
+// is handed over; it is released once no reader can still be using it.
+static void retireObject(NSNotificationCenter *self, id object)
+{
+    if (object == nil)
+    {
+        return;
+    }
+    CFArrayAppendValue(self->_retiring, object);
+    [object release];
+}
+
+// Must be called with _observersLock held, once a writer is done. Whatever
+// was retired is tagged with the epoch that is now closed. A batch is
+// released once no reader of its epoch is left; readers that come along
+// later re-check the epoch and only see what is currently published.
+static void reclaimRetired(NSNotificationCenter *self)
+{
+    CFMutableArrayRef retiring = self->_retiring;
+    int32_t epoch = self->_epoch;
+    if (CFArrayGetCount(retiring) != 0)
+    {
+        CFMutableArrayRef retired = self->_retired[epoch & 1];
+        CFArrayAppendArray(retired, retiring, CFRangeMake(0, CFArrayGetCount(retiring)));
+        CFArrayRemoveAllValues(retiring);
+    }
+    OSAtomicIncrement32Barrier(&self->_epoch);
+
+    for (int parity = 0; parity < 2; parity++)
+    {
+        CFMutableArrayRef retired = self->_retired[parity];
+        if (CFArrayGetCount(retired) != 0 && self->_readers[parity] == 0)
+        {
+            // Releasing may run arbitrary deallocs that call back in.
+            self->_retired[parity] = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+            CFRelease(retired);
+        }
+    }
+}
+
+// Must be called with _observersLock held. Returns the value for key, adding
+// one made by create() if there is none. Growing the table drops entries
+// whose value has become empty.
+static id tableValueForKey(NSNotificationCenter *self, _NSNotificationTable * volatile *tableRef, BOOL namesAsKeys, id key, id (*create)(void), BOOL (*isEmpty)(id))
+{
+    _NSNotificationTable *table = *tableRef;
+    id value = tableGetValue(table, key);
+    if (value != nil)
+    {
+        return value;
+    }
+
+    if (table == nil || (table->_used + 1) * 2 > table->_capacity)
+    {
+        NSUInteger live = 0;
+        for (NSUInteger idx = 0; table != nil && idx < table->_capacity; idx++)
+        {
+            NSNotificationTableEntry *entry = table->_slots[idx];
+            if (entry != NULL && !isEmpty(entry->value))
+            {
+                live++;
+            }
+        }
+        NSUInteger capacity = 8;
+        while ((live + 1) * 4 > capacity)
+        {
+            capacity *= 2;
+        }
+
+        _NSNotificationTable *grown = [[_NSNotificationTable alloc] initWithCapacity:capacity namesAsKeys:namesAsKeys];
+        for (NSUInteger idx = 0; table != nil && idx < table->_capacity; idx++)
+        {
+            NSNotificationTableEntry *entry = table->_slots[idx];
+            if (entry != NULL && !isEmpty(entry->value))
+            {
+                tableInsertValue(grown, entry->key, entry->value);
+            }
+        }
+        OSMemoryBarrier();
+        *tableRef = grown;
+        retireObject(self, table);
+        table = grown;
+    }
+
+    value = create();
+    tableInsertValue(table, key, value);
+    [value release];
+    return value;
+}
+
+// Must be called with _observersLock held. Publishes a new view of list.
+static void listPublish(NSNotificationCenter *self, _NSNotificationObserverList *list, _NSNotificationObserverView *view)
+{
+    _NSNotificationObserverView *oldView = list->_view;
+    OSMemoryBarrier();
+    list->_view = view;
+    retireObject(self, oldView);
+}
+
+// Returns a new store holding the observers of view that are still
+// registered, with room for at least capacity observers.
+static _NSNotificationObserverStore *newCompactedStore(_NSNotificationObserverView *view, NSUInteger capacity)
+{
+    _NSNotificationObserverStore *store = [[_NSNotificationObserverStore alloc] initWithCapacity:capacity];
+    for (NSUInteger idx = 0; view != nil && idx < view->_count; idx++)
+    {
+        _NSNotificationObserver *observer = view->_store->_items[idx];
+        if (!observer->_removed)
+        {
+            store->_items[store->_used++] = [observer retain];
+        }
+    }
+    return store;
+}
+
+// Must be called with _observersLock held. Views only ever cover a prefix of
+// their store, so the slot past the last view is free to fill in place.
+static void listAddObserver(NSNotificationCenter *self, _NSNotificationObserverList *list, _NSNotificationObserver *observer)
+{
+    _NSNotificationObserverView *view = list->_view;
+    _NSNotificationObserverStore *store = view != nil ? view->_store : nil;
+    if (store == nil || store->_used == store->_capacity)
+    {
+        store = newCompactedStore(view, MAX(4, (list->_live + 1) * 2));
+    }
+    else
+    {
+        [store retain];
+    }
+    store->_items[store->_used++] = [observer retain];
+    list->_live++;
+
+    _NSNotificationObserverView *newView = [[_NSNotificationObserverView alloc] initWithStore:store count:store->_used];
+    [store release];
+    listPublish(self, list, newView);
+}
+
+// Must be called with _observersLock held, after observer was flagged as
+// removed. The list is copied once more than half of it is dead.
+static void listRemoveObserver(NSNotificationCenter *self, _NSNotificationObserverList *list)
+{
+    list->_live--;
+    _NSNotificationObserverView *view = list->_view;
+    if (list->_live == 0)
+    {
+        listPublish(self, list, nil);
+    }
+    else if (view->_count > list->_live * 2)
+    {
+        _NSNotificationObserverStore *store = newCompactedStore(view, list->_live * 2);
+        _NSNotificationObserverView *newView = [[_NSNotificationObserverView alloc] initWithStore:store count:store->_used];
+        [store release];
+        listPublish(self, list, newView);
+    }
+}
+
 + (id)defaultCenter
 {
     static NSNotificationCenter *defaultCenter = nil;
@@ -112,47 +630,197 @@
         pthread_mutex_init(&_observersLock, &attrs);
         pthread_mutexattr_destroy(&attrs);
 
-        _observers = [[NSMutableArray alloc] init];
+        _wildcard = [[_NSNotificationBucket alloc] init];
+        _retiring = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        _retired[0] = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        _retired[1] = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+        // Keyed by observer identity; for block observers the key is the
+        // returned _NSNotificationObserver itself.
+        _registrations = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
     }
     return self;
 }
 
 - (void)dealloc
 {
-    [_observers release];
+    [_buckets release];
+    [_wildcard release];
+    CFRelease(_retiring);
+    CFRelease(_retired[0]);
+    CFRelease(_retired[1]);
+    CFRelease(_registrations);
+    pthread_mutex_destroy(&_observersLock);
     [super dealloc];
 }
 
-- (void)addObserver:(id)observer selector:(SEL)aSelector name:(NSString *)aName object:(id)anObject
+// Posting never takes _observersLock. A reader announces itself in the
+// counter for the current epoch while it looks observers up; writers never
+// release what they replace until the counter of its epoch has drained.
+static int32_t enterReader(NSNotificationCenter *self)
+{
+    for (;;)
+    {
+        int32_t epoch = self->_epoch;
+        OSAtomicIncrement32Barrier(&self->_readers[epoch & 1]);
+        if (epoch == self->_epoch)
+        {
+            return epoch;
+        }
+        OSAtomicDecrement32Barrier(&self->_readers[epoch & 1]);
+    }
+}
+
+static void exitReader(NSNotificationCenter *self, int32_t epoch)
+{
+    OSAtomicDecrement32Barrier(&self->_readers[epoch & 1]);
+}
+
+// Must be called with _observersLock held.
+static void registerObserver(NSNotificationCenter *self, _NSNotificationObserver *observer)
+{
+    NSString *name = observer.name;
+    _NSNotificationBucket *bucket = self->_wildcard;
+    if (name != nil)
+    {
+        bucket = tableValueForKey(self, (_NSNotificationTable * volatile *)&self->_buckets, YES, name, &newBucket, &bucketIsEmpty);
+    }
+
+    id object = observer.object;
+    _NSNotificationObserverList *list = bucket->_anyObject;
+    if (object != nil)
+    {
+        list = tableValueForKey(self, &bucket->_byObject, NO, object, &newList, &listIsEmpty);
+    }
+    listAddObserver(self, list, observer);
+    bucket->_count++;
+}
+
+// Must be called with _observersLock held.
+static void unregisterObserver(NSNotificationCenter *self, _NSNotificationObserver *observer)
+{
+    NSString *name = observer.name;
+    _NSNotificationBucket *bucket = name != nil ? tableGetValue(self->_buckets, name) : self->_wildcard;
+    id object = observer.object;
+    _NSNotificationObserverList *list = object != nil ? tableGetValue(bucket->_byObject, object) : bucket->_anyObject;
+
+    observer->_removed = YES;
+    listRemoveObserver(self, list);
+    bucket->_count--;
+}
+
+- (void)_addNotificationObserver:(_NSNotificationObserver *)notifObserver forKey:(id)key
 {
-    _NSNotificationObserver *notifObserver = [[_NSNotificationObserver alloc] initWithObserver:observer selector:aSelector name:aName object:anObject queue:nil block:NULL];
     pthread_mutex_lock(&_observersLock);
-    [_observers addObject:notifObserver];
+    notifObserver->_sequence = ++_sequence;
+
+    CFMutableArrayRef registrations = (CFMutableArrayRef)CFDictionaryGetValue(_registrations, key);
+    if (registrations == NULL)
+    {
+        registrations = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        CFDictionarySetValue(_registrations, key, registrations);
+        CFRelease(registrations);
+    }
+    CFArrayAppendValue(registrations, notifObserver);
+
+    registerObserver(self, notifObserver);
+    reclaimRetired(self);
     pthread_mutex_unlock(&_observersLock);
+}
+
+- (void)addObserver:(id)observer selector:(SEL)aSelector name:(NSString *)aName object:(id)anObject
+{
+    _NSNotificationObserver *notifObserver = [[_NSNotificationObserver alloc] initWithObserver:observer selector:aSelector name:aName object:anObject queue:nil block:NULL];
+    [self _addNotificationObserver:notifObserver forKey:observer];
     [notifObserver release];
 }
 
 - (void)postNotification:(NSNotification *)notification
 {
     NSString *name = [notification name];
-    id object = [notification object];
-    
-    pthread_mutex_lock(&_observersLock);
-    NSArray *observers = [_observers copy];
-    pthread_mutex_unlock(&_observersLock);
 
-    for (_NSNotificationObserver *observer in observers)
+    NSNotificationMatches matches;
+    matches.views = matches.inlineViews;
+    matches.count = 0;
+    matches.capacity = MATCHING_LISTS_INLINE;
+    matches.observerCount = 0;
+    matches.object = [notification object];
+
+    int32_t epoch = enterReader(self);
+    _NSNotificationTable *buckets = _buckets;
+    if (name != nil)
+    {
+        addBucketMatches(&matches, tableGetValue(buckets, name));
+    }
+    else
+    {
+        for (NSUInteger idx = 0; buckets != nil && idx < buckets->_capacity; idx++)
+        {
+            NSNotificationTableEntry *entry = buckets->_slots[idx];
+            if (entry != NULL)
+            {
+                addBucketMatches(&matches, entry->value);
+            }
+        }
+    }
+    addBucketMatches(&matches, _wildcard);
+    exitReader(self, epoch);
+
+    // The retained views keep every matched observer alive for the duration
+    // of delivery. Observers removed meanwhile, even by one of the callbacks,
+    // are skipped.
+    if (matches.count == 1)
     {
-        if (name == nil || observer.name == nil || [observer.name isEqualToString:name])
+        _NSNotificationObserverView *view = matches.views[0];
+        for (NSUInteger idx = 0; idx < view->_count; idx++)
         {
-            id obj = observer.object;
-            if (object == nil || obj == nil || object == obj)
+            _NSNotificationObserver *observer = view->_store->_items[idx];
+            if (!observer->_removed)
             {
                 [observer postNotification:notification];
             }
         }
     }
-    [observers release];
+    else if (matches.count > 1)
+    {
+        _NSNotificationObserver *stackObservers[MATCHING_OBSERVERS_STACK];
+        _NSNotificationObserver **observers = stackObservers;
+        if (matches.observerCount > MATCHING_OBSERVERS_STACK)
+        {
+            observers = malloc(matches.observerCount * sizeof(_NSNotificationObserver *));
+        }
+
+        NSUInteger total = 0;
+        for (NSUInteger viewIdx = 0; viewIdx < matches.count; viewIdx++)
+        {
+            _NSNotificationObserverView *view = matches.views[viewIdx];
+            memcpy(&observers[total], view->_store->_items, view->_count * sizeof(_NSNotificationObserver *));
+            total += view->_count;
+        }
+        qsort(observers, total, sizeof(_NSNotificationObserver *), &compareObserverSequence);
+
+        for (NSUInteger idx = 0; idx < total; idx++)
+        {
+            if (!observers[idx]->_removed)
+            {
+                [observers[idx] postNotification:notification];
+            }
+        }
+
+        if (observers != stackObservers)
+        {
+            free(observers);
+        }
+    }
+
+    for (NSUInteger viewIdx = 0; viewIdx < matches.count; viewIdx++)
+    {
+        [matches.views[viewIdx] release];
+    }
+    if (matches.views != matches.inlineViews)
+    {
+        free(matches.views);
+    }
 }
 
 - (void)postNotificationName:(NSString *)aName object:(id)anObject
@@ -169,37 +837,76 @@
 
 - (void)removeObserver:(id)observer
 {
+    if (observer == nil)
+    {
+        return;
+    }
+
+    // observer may be a user controlled object, or an instance of _NSNotificationObserver if the block version of
+    // addObserverForName was used
     pthread_mutex_lock(&_observersLock);
-    NSIndexSet *indicies = [_observers indexesOfObjectsPassingTest:^BOOL(_NSNotificationObserver *notifObserver, NSUInteger idx, BOOL *stop) {
-        // observer may be a user controlled object, or an instance of _NSNotificationObserver if the block version of 
-        // addObserverForName was used
-        return notifObserver == observer || notifObserver.observer == observer;
-    }];
-    [_observers removeObjectsAtIndexes:indicies];
+    CFArrayRef registrations = CFDictionaryGetValue(_registrations, observer);
+    if (registrations != NULL)
+    {
+        CFRetain(registrations);
+        CFDictionaryRemoveValue(_registrations, observer);
+        CFIndex count = CFArrayGetCount(registrations);
+        for (CFIndex idx = 0; idx < count; idx++)
+        {
+            unregisterObserver(self, (_NSNotificationObserver *)CFArrayGetValueAtIndex(registrations, idx));
+        }
+        reclaimRetired(self);
+        CFRelease(registrations);
+    }
     pthread_mutex_unlock(&_observersLock);
 }
 
 - (void)removeObserver:(id)observer name:(NSString *)aName object:(id)anObject
 {
+    if (observer == nil)
+    {
+        return;
+    }
+
     pthread_mutex_lock(&_observersLock);
-    NSIndexSet *indicies = [_observers indexesOfObjectsPassingTest:^BOOL(_NSNotificationObserver *notifObserver, NSUInteger idx, BOOL *stop) {
-        BOOL matchesObject = YES;
-        if (anObject != nil)
+    CFMutableArrayRef registrations = (CFMutableArrayRef)CFDictionaryGetValue(_registrations, observer);
+    if (registrations != NULL)
+    {
+        CFRetain(registrations);
+        BOOL removed = NO;
+        for (CFIndex idx = CFArrayGetCount(registrations) - 1; idx >= 0; idx--)
+        {
+            _NSNotificationObserver *notifObserver = (_NSNotificationObserver *)CFArrayGetValueAtIndex(registrations, idx);
+            if (anObject != nil && notifObserver.object != anObject)
+            {
+                continue;
+            }
+            if (aName != nil && ![notifObserver.name isEqualToString:aName])
+            {
+                continue;
+            }
+            unregisterObserver(self, notifObserver);
+            CFArrayRemoveValueAtIndex(registrations, idx);
+            removed = YES;
+        }
+
+        if (removed)
         {
-            matchesObject = notifObserver.object == anObject;
+            if (CFArrayGetCount(registrations) == 0)
+            {
+                CFDictionaryRemoveValue(_registrations, observer);
+            }
+            reclaimRetired(self);
         }
-        return notifObserver.observer == observer && matchesObject && [notifObserver.name isEqualToString:aName];
-    }];
-    [_observers removeObjectsAtIndexes:indicies];
+        CFRelease(registrations);
+    }
     pthread_mutex_unlock(&_observersLock);
 }
 
 - (id)addObserverForName:(NSString *)name object:(id)obj queue:(NSOperationQueue *)queue usingBlock:(void (^)(NSNotification *note))block
 {
     _NSNotificationObserver *notifObserver = [[_NSNotificationObserver alloc] initWithObserver:nil selector:NULL name:name object:obj queue:queue block:block];
-    pthread_mutex_lock(&_observersLock);
-    [_observers addObject:notifObserver];
-    pthread_mutex_unlock(&_observersLock);
+    [self _addNotificationObserver:notifObserver forKey:notifObserver];
     [notifObserver release];
     return notifObserver;
 }
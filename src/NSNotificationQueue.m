@@ -12,98 +12,443 @@
 #import <Foundation/NSString.h>
 #import <Foundation/NSDictionary.h>
 #import <Foundation/NSNotification.h>
+#import <CoreFoundation/CFRunLoop.h>
+#import <stdlib.h>
 
 static NSString *NSDefaultNotificationQueue = @"NSDefaultNotificationQueue";
 
-@implementation NSNotificationQueue
+// Stands in for a nil sender in the sender indexes, which use pointer keys.
+static const char NSNotificationQueueNilSender = 0;
 
-+ (id)defaultQueue
+@class _NSNotificationQueueRecord;
+
+typedef struct {
+    NSNotification *notification; // nil once coalesced away
+    _NSNotificationQueueRecord *nameRecord;
+    _NSNotificationQueueRecord *senderRecord;
+    _NSNotificationQueueRecord *pairRecord;
+} NSNotificationQueueEntry;
+
+// All queued entries sharing a name, a sender, or a (name, sender) pair.
+// _entries is in queue order and may still hold entries that have been
+// coalesced away; they are popped off the front as the queue drains.
+// A record is dropped from its index as soon as _liveCount reaches zero,
+// so a lookup that finds one always has something to coalesce with.
+@interface _NSNotificationQueueRecord : NSObject
 {
-    NSMutableDictionary *tls = [[NSThread currentThread] threadDictionary];
-    NSNotificationQueue *queue = [tls objectForKey:NSDefaultNotificationQueue];
-    if (queue == nil)
+@public
+    CFMutableArrayRef _entries;
+    NSUInteger _liveCount;
+    CFMutableDictionaryRef _senders;
+    CFMutableDictionaryRef _owner;
+    const void *_key;
+}
+- (id)initWithOwner:(CFMutableDictionaryRef)owner key:(const void *)key;
+@end
+
+@implementation _NSNotificationQueueRecord
+
+- (id)initWithOwner:(CFMutableDictionaryRef)owner key:(const void *)key
+{
+    self = [super init];
+    if (self)
     {
-        queue = [[NSNotificationQueue alloc] init];
-        [tls setObject:queue forKey:NSDefaultNotificationQueue];
-        [queue release];
+        _entries = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+        _owner = owner;
+        _key = key;
     }
-    return queue;
+    return self;
 }
 
-- (id)init
+- (void)dealloc
 {
-    return [self initWithNotificationCenter:[NSNotificationCenter defaultCenter]];
+    CFRelease(_entries);
+    if (_senders != NULL)
+    {
+        CFRelease(_senders);
+    }
+    [super dealloc];
 }
 
-- (id)initWithNotificationCenter:(NSNotificationCenter *)notificationCenter
+@end
+
+static CFMutableDictionaryRef createSenderIndex(void)
+{
+    return CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+}
+
+static _NSNotificationQueueRecord *indexRecord(CFMutableDictionaryRef index, const void *key)
+{
+    _NSNotificationQueueRecord *record = (_NSNotificationQueueRecord *)CFDictionaryGetValue(index, key);
+    if (record == nil)
+    {
+        record = [[_NSNotificationQueueRecord alloc] initWithOwner:index key:key];
+        CFDictionarySetValue(index, key, record);
+        [record release];
+    }
+    return record;
+}
+
+static void attachEntry(_NSNotificationQueueRecord *record, NSNotificationQueueEntry *entry)
+{
+    [record retain];
+    record->_liveCount++;
+    CFArrayAppendValue(record->_entries, entry);
+}
+
+static void releaseLiveEntry(_NSNotificationQueueRecord *record)
+{
+    if (--record->_liveCount == 0)
+    {
+        CFDictionaryRemoveValue(record->_owner, record->_key);
+    }
+}
+
+static void detachEntry(_NSNotificationQueueRecord *record, NSNotificationQueueEntry *entry, BOOL live)
+{
+    if (CFArrayGetCount(record->_entries) != 0 &&
+        CFArrayGetValueAtIndex(record->_entries, 0) == entry)
+    {
+        CFArrayRemoveValueAtIndex(record->_entries, 0);
+    }
+    if (live)
+    {
+        releaseLiveEntry(record);
+    }
+    [record release];
+}
+
+static void coalesceEntry(NSNotificationQueueEntry *entry)
+{
+    [entry->notification release];
+    entry->notification = nil;
+    // the pair record must leave its name record's index before the name
+    // record itself can be dropped
+    releaseLiveEntry(entry->pairRecord);
+    releaseLiveEntry(entry->senderRecord);
+    releaseLiveEntry(entry->nameRecord);
+}
+
+static void postNotifications(CFRunLoopObserverRef observer, CFRunLoopActivity activity, void *info);
+
+// One posting style's pending notifications: a ring buffer in posting order
+// plus hashed indexes by name, by sender and by both for coalescing.
+@interface _NSNotificationQueueList : NSObject
+{
+    NSNotificationCenter *_center;
+    NSNotificationQueueEntry **_ring;
+    NSUInteger _head;
+    NSUInteger _count;
+    NSUInteger _capacity;
+    CFMutableDictionaryRef _names;
+    CFMutableDictionaryRef _senders;
+    CFMutableDictionaryRef _observers;
+    CFRunLoopRef _runLoop;
+}
+- (id)initWithNotificationCenter:(NSNotificationCenter *)center;
+- (BOOL)coalesceNotification:(NSNotification *)notification coalesceMask:(NSUInteger)coalesceMask remove:(BOOL)remove;
+- (void)addNotification:(NSNotification *)notification;
+- (void)scheduleInModes:(NSArray *)modes activities:(CFOptionFlags)activities;
+- (void)observerDidFire:(CFRunLoopObserverRef)observer;
+- (void)invalidateObservers;
+- (void)postNotifications;
+- (void)invalidate;
+@end
+
+@implementation _NSNotificationQueueList
+
+- (id)initWithNotificationCenter:(NSNotificationCenter *)center
 {
     self = [super init];
     if (self)
     {
-        _notificationCenter = [notificationCenter retain];
-        _asapQueue = [[NSMutableArray alloc] init];
-        _asapObs = nil;
-        _idleQueue = [[NSMutableArray alloc] init];
-        _idleObs = nil;
+        _center = [center retain];
+        _names = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        _senders = createSenderIndex();
+        _observers = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
     }
     return self;
 }
 
 - (void)dealloc
 {
-    [self _flushNotificationQueue];
-    [_notificationCenter release];
+    [self invalidate];
+    free(_ring);
+    CFRelease(_names);
+    CFRelease(_senders);
+    CFRelease(_observers);
+    if (_runLoop != NULL)
+    {
+        CFRelease(_runLoop);
+    }
+    [_center release];
     [super dealloc];
 }
 
-- (void)enqueueNotification:(NSNotification *)notification postingStyle:(NSPostingStyle)postingStyle
+- (_NSNotificationQueueRecord *)recordMatching:(NSNotification *)notification coalesceMask:(NSUInteger)coalesceMask
 {
-    [self enqueueNotification:notification postingStyle:postingStyle coalesceMask:NSNotificationCoalescingOnName | NSNotificationCoalescingOnSender forModes:@[NSDefaultRunLoopMode]];
+    id name = notification.name ?: (id)kCFNull;
+    const void *sender = notification.object ?: (id)&NSNotificationQueueNilSender;
+    _NSNotificationQueueRecord *nameRecord;
+
+    switch (coalesceMask & (NSNotificationCoalescingOnName | NSNotificationCoalescingOnSender))
+    {
+        case NSNotificationCoalescingOnName:
+            return (_NSNotificationQueueRecord *)CFDictionaryGetValue(_names, name);
+        case NSNotificationCoalescingOnSender:
+            return (_NSNotificationQueueRecord *)CFDictionaryGetValue(_senders, sender);
+        case NSNotificationCoalescingOnName | NSNotificationCoalescingOnSender:
+            nameRecord = (_NSNotificationQueueRecord *)CFDictionaryGetValue(_names, name);
+            if (nameRecord == nil || nameRecord->_senders == NULL)
+            {
+                return nil;
+            }
+            return (_NSNotificationQueueRecord *)CFDictionaryGetValue(nameRecord->_senders, sender);
+        default:
+            return nil;
+    }
 }
 
-static BOOL coalesceNotification(NSNotification *notification, NSUInteger coalesceMask, NSMutableArray *array, BOOL remove)
+- (BOOL)coalesceNotification:(NSNotification *)notification coalesceMask:(NSUInteger)coalesceMask remove:(BOOL)remove
 {
-    if (coalesceMask == NSNotificationNoCoalescing)
+    _NSNotificationQueueRecord *record = [self recordMatching:notification coalesceMask:coalesceMask];
+    if (record == nil)
     {
         return NO;
     }
 
-    NSString *name = notification.name;
-    id object = notification.object;
-    for (NSNotification *notif in array)
+    if (remove)
     {
-        if ((coalesceMask & NSNotificationCoalescingOnName) &&
-            ![notif.name isEqualToString:name])
+        [record retain];
+        CFIndex count = CFArrayGetCount(record->_entries);
+        for (CFIndex idx = 0; idx < count && record->_liveCount != 0; idx++)
         {
-            continue;
+            NSNotificationQueueEntry *entry = (NSNotificationQueueEntry *)CFArrayGetValueAtIndex(record->_entries, idx);
+            if (entry->notification != nil)
+            {
+                coalesceEntry(entry);
+            }
         }
-        if ((coalesceMask & NSNotificationCoalescingOnSender) &&
-            notif.object != object) // not-a-bug: no isEqual is called here.
+        [record release];
+    }
+    return YES;
+}
+
+- (void)addNotification:(NSNotification *)notification
+{
+    if (_count == _capacity)
+    {
+        NSUInteger capacity = _capacity != 0 ? _capacity * 2 : 16;
+        NSNotificationQueueEntry **ring = malloc(capacity * sizeof(NSNotificationQueueEntry *));
+        for (NSUInteger idx = 0; idx < _count; idx++)
+        {
+            ring[idx] = _ring[(_head + idx) % _capacity];
+        }
+        free(_ring);
+        _ring = ring;
+        _head = 0;
+        _capacity = capacity;
+    }
+
+    id name = notification.name ?: (id)kCFNull;
+    const void *sender = notification.object ?: (id)&NSNotificationQueueNilSender;
+
+    NSNotificationQueueEntry *entry = malloc(sizeof(NSNotificationQueueEntry));
+    entry->notification = [notification retain];
+    entry->nameRecord = indexRecord(_names, name);
+    entry->senderRecord = indexRecord(_senders, sender);
+    if (entry->nameRecord->_senders == NULL)
+    {
+        entry->nameRecord->_senders = createSenderIndex();
+    }
+    entry->pairRecord = indexRecord(entry->nameRecord->_senders, sender);
+
+    attachEntry(entry->nameRecord, entry);
+    attachEntry(entry->senderRecord, entry);
+    attachEntry(entry->pairRecord, entry);
+
+    _ring[(_head + _count) % _capacity] = entry;
+    _count++;
+}
+
+// Pops the oldest entry. Returns NO once the queue is empty; *notification
+// is set to the retained notification, or nil if it was coalesced away.
+- (BOOL)dequeueNotification:(NSNotification **)notification
+{
+    if (_count == 0)
+    {
+        return NO;
+    }
+
+    NSNotificationQueueEntry *entry = _ring[_head];
+    _head = (_head + 1) % _capacity;
+    _count--;
+
+    BOOL live = entry->notification != nil;
+    *notification = entry->notification;
+    detachEntry(entry->pairRecord, entry, live);
+    detachEntry(entry->senderRecord, entry, live);
+    detachEntry(entry->nameRecord, entry, live);
+    free(entry);
+    return YES;
+}
+
+- (void)scheduleInModes:(NSArray *)modes activities:(CFOptionFlags)activities
+{
+    CFRunLoopRef rl = CFRunLoopGetCurrent();
+    if (rl != _runLoop)
+    {
+        if (_runLoop != NULL)
+        {
+            CFRelease(_runLoop);
+        }
+        _runLoop = (CFRunLoopRef)CFRetain(rl);
+        // observers left on the old run loop would drain from its thread
+        [self invalidateObservers];
+    }
+
+    // a single pending observer per mode drains everything queued so far
+    CFRunLoopObserverRef observer = NULL;
+    for (NSString *mode in modes)
+    {
+        CFRunLoopObserverRef scheduled = (CFRunLoopObserverRef)CFDictionaryGetValue(_observers, mode);
+        if (scheduled != NULL && CFRunLoopObserverIsValid(scheduled))
         {
             continue;
         }
+        if (observer == NULL)
+        {
+            CFRunLoopObserverContext ctx = {
+                .version = 0,
+                .info = self,
+                .retain = &CFRetain,
+                .release = &CFRelease,
+                .copyDescription = &CFCopyDescription
+            };
+            observer = CFRunLoopObserverCreate(kCFAllocatorDefault, activities, false, 0, &postNotifications, &ctx);
+        }
+        CFRunLoopAddObserver(rl, observer, (CFStringRef)mode);
+        CFDictionarySetValue(_observers, mode, observer);
+    }
+    if (observer != NULL)
+    {
+        CFRelease(observer);
+    }
+}
+
+- (void)observerDidFire:(CFRunLoopObserverRef)observer
+{
+    CFIndex count = CFDictionaryGetCount(_observers);
+    if (count != 0)
+    {
+        const void **modes = malloc(count * 2 * sizeof(void *));
+        const void **observers = modes + count;
+        CFDictionaryGetKeysAndValues(_observers, modes, observers);
+        for (CFIndex idx = 0; idx < count; idx++)
+        {
+            if (observers[idx] == observer)
+            {
+                CFDictionaryRemoveValue(_observers, modes[idx]);
+            }
+        }
+        free(modes);
+    }
+    [self postNotifications];
+}
+
+- (void)postNotifications
+{
+    [self retain];
+    NSNotification *notification = nil;
+    while ([self dequeueNotification:&notification])
+    {
+        if (notification != nil)
+        {
+            [_center postNotification:notification];
+            [notification release];
+        }
+    }
+    [self release];
+}
 
-        if (remove)
+- (void)invalidateObservers
+{
+    CFIndex count = CFDictionaryGetCount(_observers);
+    if (count != 0)
+    {
+        const void **observers = malloc(count * sizeof(void *));
+        CFDictionaryGetKeysAndValues(_observers, NULL, observers);
+        CFArrayRef scheduled = CFArrayCreate(kCFAllocatorDefault, observers, count, &kCFTypeArrayCallBacks);
+        free(observers);
+        CFDictionaryRemoveAllValues(_observers);
+        for (CFIndex idx = 0; idx < count; idx++)
         {
-            [array removeObject:notif];
+            CFRunLoopObserverInvalidate((CFRunLoopObserverRef)CFArrayGetValueAtIndex(scheduled, idx));
         }
-        return YES;
+        CFRelease(scheduled);
     }
+}
+
+- (void)invalidate
+{
+    [self invalidateObservers];
 
-    return NO;
+    NSNotification *notification = nil;
+    while ([self dequeueNotification:&notification])
+    {
+        [notification release];
+    }
 }
 
+@end
+
 static void postNotifications(CFRunLoopObserverRef observer, CFRunLoopActivity activity, void *info)
 {
-    NSMutableArray *queue = (NSMutableArray *)info;
-    while ([queue count])
+    [(_NSNotificationQueueList *)info observerDidFire:observer];
+}
+
+@implementation NSNotificationQueue
+
++ (id)defaultQueue
+{
+    NSMutableDictionary *tls = [[NSThread currentThread] threadDictionary];
+    NSNotificationQueue *queue = [tls objectForKey:NSDefaultNotificationQueue];
+    if (queue == nil)
+    {
+        queue = [[NSNotificationQueue alloc] init];
+        [tls setObject:queue forKey:NSDefaultNotificationQueue];
+        [queue release];
+    }
+    return queue;
+}
+
+- (id)init
+{
+    return [self initWithNotificationCenter:[NSNotificationCenter defaultCenter]];
+}
+
+- (id)initWithNotificationCenter:(NSNotificationCenter *)notificationCenter
+{
+    self = [super init];
+    if (self)
     {
-        // Investigate: where is the _notificationCenter used?
-        // it does not seem to be referenced out side of init/dealloc...
-        // would have expected it to be used here
-        [[NSNotificationCenter defaultCenter] postNotification:[queue firstObject]];
-        [queue removeObjectAtIndex:0];
+        _notificationCenter = [notificationCenter retain];
+        _asapQueue = [[_NSNotificationQueueList alloc] initWithNotificationCenter:_notificationCenter];
+        _idleQueue = [[_NSNotificationQueueList alloc] initWithNotificationCenter:_notificationCenter];
     }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self _flushNotificationQueue];
+    [_notificationCenter release];
+    [super dealloc];
+}
+
+- (void)enqueueNotification:(NSNotification *)notification postingStyle:(NSPostingStyle)postingStyle
+{
+    [self enqueueNotification:notification postingStyle:postingStyle coalesceMask:NSNotificationCoalescingOnName | NSNotificationCoalescingOnSender forModes:@[NSDefaultRunLoopMode]];
 }
 
 - (void)enqueueNotification:(NSNotification *)notification postingStyle:(NSPostingStyle)postingStyle coalesceMask:(NSUInteger)coalesceMask forModes:(NSArray *)modes
@@ -115,83 +460,53 @@ static void postNotifications(CFRunLoopObserverRef observer, CFRunLoopActivity a
 
     if (_asapQueue == nil)
     {
-        _asapQueue = [[NSMutableArray alloc] init];
+        _asapQueue = [[_NSNotificationQueueList alloc] initWithNotificationCenter:_notificationCenter];
     }
 
     if (_idleQueue == nil)
     {
-        _idleQueue = [[NSMutableArray alloc] init];
+        _idleQueue = [[_NSNotificationQueueList alloc] initWithNotificationCenter:_notificationCenter];
     }
 
     switch (postingStyle)
     {
         case NSPostWhenIdle:
-            if (coalesceNotification(notification, coalesceMask, _asapQueue, NO) ||
-                coalesceNotification(notification, coalesceMask, _idleQueue, NO))
+            if ([_asapQueue coalesceNotification:notification coalesceMask:coalesceMask remove:NO] ||
+                [_idleQueue coalesceNotification:notification coalesceMask:coalesceMask remove:NO])
             {
                 return;
             }
+            [_idleQueue addNotification:notification];
+            [_idleQueue scheduleInModes:modes activities:kCFRunLoopBeforeWaiting];
             break;
         case NSPostASAP:
-            coalesceNotification(notification, coalesceMask, _idleQueue, YES);
-            if (coalesceNotification(notification, coalesceMask, _asapQueue, NO))
+            [_idleQueue coalesceNotification:notification coalesceMask:coalesceMask remove:YES];
+            if ([_asapQueue coalesceNotification:notification coalesceMask:coalesceMask remove:NO])
             {
                 return;
             }
+            [_asapQueue addNotification:notification];
+            [_asapQueue scheduleInModes:modes activities:kCFRunLoopAllActivities];
             break;
         case NSPostNow:
-            coalesceNotification(notification, coalesceMask, _asapQueue, YES);
-            coalesceNotification(notification, coalesceMask, _idleQueue, YES);
+            [_asapQueue coalesceNotification:notification coalesceMask:coalesceMask remove:YES];
+            [_idleQueue coalesceNotification:notification coalesceMask:coalesceMask remove:YES];
+            [_notificationCenter postNotification:notification];
             break;
     }
-
-    CFRunLoopObserverRef observer = NULL;
-    CFRunLoopRef rl = CFRunLoopGetCurrent();
-    CFRunLoopObserverContext ctx = {
-        .version = 0,
-        .retain = &CFRetain,
-        .release = &CFRelease,
-        .copyDescription = &CFCopyDescription
-    };
-    switch (postingStyle)
-    {
-        case NSPostWhenIdle:
-            ctx.info = _idleQueue;
-            [_idleQueue addObject:notification];
-            observer = CFRunLoopObserverCreate(kCFAllocatorDefault, kCFRunLoopBeforeWaiting, false, 0, &postNotifications, &ctx);
-            for (NSString *mode in modes)
-            {
-                CFRunLoopAddObserver(rl, observer, (CFStringRef)mode);
-            }
-            break;
-        case NSPostASAP:
-            ctx.info = _asapQueue;
-            [_asapQueue addObject:notification];
-            observer = CFRunLoopObserverCreate(kCFAllocatorDefault, kCFRunLoopAllActivities, false, 0, &postNotifications, &ctx);
-            for (NSString *mode in modes)
-            {
-                CFRunLoopAddObserver(rl, observer, (CFStringRef)mode);
-            }
-            break;
-        case NSPostNow:
-            postNotifications(NULL, 0, [NSMutableArray arrayWithObject:notification]);
-            break;
-    }
-    if (observer != NULL)
-    {
-        CFRelease(observer);
-    }
 }
 
 - (void)dequeueNotificationsMatching:(NSNotification *)notification coalesceMask:(NSUInteger)coalesceMask
 {
-    coalesceNotification(notification, coalesceMask, _asapQueue, YES);
-    coalesceNotification(notification, coalesceMask, _idleQueue, YES);
+    [_asapQueue coalesceNotification:notification coalesceMask:coalesceMask remove:YES];
+    [_idleQueue coalesceNotification:notification coalesceMask:coalesceMask remove:YES];
 }
 
 
 - (void)_flushNotificationQueue
 {
+    [_asapQueue invalidate];
+    [_idleQueue invalidate];
     [_asapQueue release];
     [_idleQueue release];
     _asapQueue = nil;
@@ -16,12 +16,15 @@
 #import <Foundation/NSInvocation.h>
 #import <Foundation/NSException.h>
 #import <Foundation/NSMethodSignature.h>
+#import <Foundation/NSOperation_Private.h>
+#import <CoreFoundation/CFSet.h>
 #import <pthread.h>
 #import <dispatch/dispatch.h>
 #import <libkern/OSAtomic.h>
 
-#import "CFSortFunctions.h"
 #import "ForFoundationOnly.h"
+#import "NSCFTSDKeys.h"
+#import "NSOperationExecutor.h"
 
 enum __NSOperationState {
     NSOperationStateReady,
@@ -42,6 +45,12 @@ typedef NSUInteger _NSOperationState;
 @package
     dispatch_queue_t _schedule_queue;
     NSString *_name;
+    _NSOperationInternal **_readyHeap;
+    NSUInteger _readyCount;
+    NSUInteger _readyCapacity;
+    NSUInteger _nextSequence;
+    NSUInteger _readyTick;
+    BOOL _usesWorkStealingExecutor;
 }
 
 @end
@@ -66,6 +75,8 @@ typedef NSUInteger _NSOperationState;
     int _waiting_deps;
     NSInteger _effectivePriorityValue;
     NSQualityOfService _qualityOfService;
+    NSUInteger _heapIndex;
+    NSUInteger _sequence;
 }
 
 @property (readonly) NSArray *dependencies;
@@ -80,6 +91,7 @@ static volatile int32_t _NSOperationQueueID = 0;
 @interface NSOperationQueue()
 
 - (void)_removeFinishedOperation:(_NSOperationInternal *)opi;
+- (void)_operationBecameReady:(_NSOperationInternal *)opi;
 - (void)_queueSchedulerRun;
 
 @end
@@ -91,7 +103,6 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 
 @synthesize dependencies=_dependencies;
 
-// TODO: do something with the value
 @synthesize qualityOfService = _qualityOfService;
 
 - (id)initWithOperation:(NSOperation *)operation
@@ -114,6 +125,8 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
         _queuePriority = NSOperationQueuePriorityNormal;
         _waiting_deps = 0;
         _effectivePriorityValue = 0;
+        _heapIndex = NSNotFound;
+        _sequence = 0;
         _queue = nil;
     }
     return self;
@@ -340,8 +353,18 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
                         if (!_opi->_cancelled && _opi->_waiting_deps > 0) {
                             _opi->_waiting_deps--;
                         }
+                        //the last dependency is gone, hand it straight to its queue's ready heap.
+                        BOOL becameReady = _opi->_waiting_deps == 0 && _opi->_state == NSOperationStateNotReady;
+                        if (becameReady)
+                        {
+                            _opi->_state = NSOperationStateReady;
+                        }
                         pthread_mutex_unlock(&_NSOperationLock);
                         [_opi->_operation didChangeValueForKey:@"isReady"];
+                        if (becameReady)
+                        {
+                            [_opi->_queue _operationBecameReady:_opi];
+                        }
                     });
                 }
             }
@@ -371,9 +394,12 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
             }
             dispatch_time_t val = dispatch_time(DISPATCH_TIME_NOW, 6 * NSEC_PER_MSEC);
             [_queue retain];
+            //keep the operation alive so its address cannot be reused by a newer one before it is removed.
+            NSOperation *operation = [_operation retain];
             dispatch_after(val, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT,0), ^{
                 [_queue _removeFinishedOperation:self];
                 [_queue release];
+                [operation release];
                 //TODO: make call to remove this operation from the dispatch queue and re-run the queue scheduler.
             });
 
@@ -389,14 +415,14 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
         }
         else if ([keyPath isEqualToString:@"isReady"])
         {
+            BOOL becameReady = NO;
             pthread_mutex_lock(&_NSOperationLock);
             if (_state < NSOperationStateExecuting)
             {
                 if ([_operation isReady])
                 {
                     _state = NSOperationStateReady;
-
-                    [_queue _queueSchedulerRun];
+                    becameReady = YES;
                 }
                 else
                 {
@@ -404,6 +430,10 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
                 }
             }
             pthread_mutex_unlock(&_NSOperationLock);
+            if (becameReady)
+            {
+                [_queue _operationBecameReady:self];
+            }
         }
         [_operation release];
     }
@@ -466,6 +496,13 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 {
     if (_operation)
     {
+        if ([_operation isFinished])
+        {
+            return;
+        }
+
+        //a worker of the executor that waits here gets a stand-in, so what it waits on can still run.
+        _NSOperationExecutorWorkerWillBlock();
         pthread_mutex_lock(&_waitlock);
 
         // Ensures thread actually waits
@@ -475,14 +512,13 @@ static pthread_mutex_t _NSOperationLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
         }
 
         pthread_mutex_unlock(&_waitlock);
+        _NSOperationExecutorWorkerDidUnblock();
         return;
     }
 }
 
 @end
 
-static NSString const *NSOperationQueueKey = @"NSOperationQueue";
-
 @implementation NSOperation
 
 @synthesize _internal=_internal;
@@ -667,15 +703,135 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
     _schedule_queue = NULL;
     [_name release];
     _name = nil;
+    free(_readyHeap);
+    _readyHeap = NULL;
     [super dealloc];
 }
 
 @end
 
+// Operations are tracked by identity, the way the old arrays did it, so a
+// subclass overriding -isEqual:/-hash cannot make distinct operations
+// collapse or remove the wrong one.
+static NSMutableSet *NSOperationQueueCreateIdentitySet(void)
+{
+    CFSetCallBacks callbacks = kCFTypeSetCallBacks;
+    callbacks.equal = NULL;
+    callbacks.hash = NULL;
+    return (NSMutableSet *)CFSetCreateMutable(kCFAllocatorDefault, 0, &callbacks);
+}
+
+/*
+ Ready operations wait in a binary max-heap ordered by an effective priority
+ fixed when they become ready, then by the order they were added to the queue.
+ The effective priority is the queue priority scaled by
+ NSOperationQueueAgingWindow, less the number of operations that became ready
+ before it. Later work therefore only overtakes an operation a bounded number of
+ times: a very low priority operation runs after at most 16 windows' worth of
+ very high priority ones become ready behind it, so a steady stream of high
+ priority work cannot starve it.
+ Operations that are still waiting on dependencies stay out of the heap until
+ their last dependency finishes, so a scheduling pass only pops what it is going
+ to start. The heap does not retain; every entry is also in the queue's
+ _pendingOperations.
+ */
+
+#define NSOperationQueueAgingWindow 16
+
+static inline BOOL readyOperationPrecedes(_NSOperationInternal *opi1, _NSOperationInternal *opi2)
+{
+    if (opi1->_effectivePriorityValue != opi2->_effectivePriorityValue)
+    {
+        return opi1->_effectivePriorityValue > opi2->_effectivePriorityValue;
+    }
+    return opi1->_sequence < opi2->_sequence;
+}
+
+static inline void readyHeapSet(_NSOperationQueueInternal *qi, NSUInteger idx, _NSOperationInternal *opi)
+{
+    qi->_readyHeap[idx] = opi;
+    opi->_heapIndex = idx;
+}
+
+static void readyHeapSiftUp(_NSOperationQueueInternal *qi, NSUInteger idx)
+{
+    _NSOperationInternal *opi = qi->_readyHeap[idx];
+    while (idx > 0)
+    {
+        NSUInteger parent = (idx - 1) / 2;
+        if (!readyOperationPrecedes(opi, qi->_readyHeap[parent]))
+        {
+            break;
+        }
+        readyHeapSet(qi, idx, qi->_readyHeap[parent]);
+        idx = parent;
+    }
+    readyHeapSet(qi, idx, opi);
+}
+
+static void readyHeapSiftDown(_NSOperationQueueInternal *qi, NSUInteger idx)
+{
+    _NSOperationInternal *opi = qi->_readyHeap[idx];
+    for (;;)
+    {
+        NSUInteger child = idx * 2 + 1;
+        if (child >= qi->_readyCount)
+        {
+            break;
+        }
+        if (child + 1 < qi->_readyCount && readyOperationPrecedes(qi->_readyHeap[child + 1], qi->_readyHeap[child]))
+        {
+            child++;
+        }
+        if (!readyOperationPrecedes(qi->_readyHeap[child], opi))
+        {
+            break;
+        }
+        readyHeapSet(qi, idx, qi->_readyHeap[child]);
+        idx = child;
+    }
+    readyHeapSet(qi, idx, opi);
+}
+
+static void readyHeapPush(_NSOperationQueueInternal *qi, _NSOperationInternal *opi)
+{
+    if (qi->_readyCount == qi->_readyCapacity)
+    {
+        qi->_readyCapacity = qi->_readyCapacity != 0 ? qi->_readyCapacity * 2 : 16;
+        qi->_readyHeap = realloc(qi->_readyHeap, qi->_readyCapacity * sizeof(_NSOperationInternal *));
+    }
+    readyHeapSet(qi, qi->_readyCount++, opi);
+    readyHeapSiftUp(qi, opi->_heapIndex);
+}
+
+static void readyHeapRemove(_NSOperationQueueInternal *qi, _NSOperationInternal *opi)
+{
+    NSUInteger idx = opi->_heapIndex;
+    opi->_heapIndex = NSNotFound;
+    qi->_readyCount--;
+    if (idx == qi->_readyCount)
+    {
+        return;
+    }
+    _NSOperationInternal *moved = qi->_readyHeap[qi->_readyCount];
+    readyHeapSet(qi, idx, moved);
+    readyHeapSiftDown(qi, idx);
+    if (moved->_heapIndex == idx)
+    {
+        readyHeapSiftUp(qi, idx);
+    }
+}
+
+static _NSOperationInternal *readyHeapPop(_NSOperationQueueInternal *qi)
+{
+    _NSOperationInternal *opi = qi->_readyHeap[0];
+    readyHeapRemove(qi, opi);
+    return opi;
+}
+
 
 @implementation NSOperationQueue
 
-// TODO: do something with the value
 @synthesize qualityOfService = _qualityOfService;
 
 + (BOOL)automaticallyNotifiesObserversForKey:(NSString *)key
@@ -692,37 +848,29 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
 }
 
 
-+ (NSOperationQueue *)queueForThread:(NSThread *)thread
+/** specifics */
++ (NSOperationQueue *)currentQueue
 {
-    NSMutableDictionary *threadDictionary = [thread threadDictionary];
-    NSOperationQueue *queue = [threadDictionary objectForKey:NSOperationQueueKey];
-
-    //Should not automagically create a new operation queue unless it's the mainQueue
-    if (!queue && [thread isMainThread])
+    NSOperationQueue *queue = (NSOperationQueue *)_CFGetTSD(__CFTSDKeyNSOperationQueueCurrentQueue);
+    if (queue == nil && [NSThread isMainThread])
     {
-        queue = [[NSOperationQueue alloc] init];
-        if (queue)
-        {
-            //main queue is special. it runs it's ops on the main thread
-            [threadDictionary setObject:queue forKey:NSOperationQueueKey];
-            queue->_isMainQueue = YES;
-            [queue setMaxConcurrentOperationCount:1];
-            [queue setName:@"Main Operation Queue"];
-        }
-        [queue release];
+        queue = [self mainQueue];
     }
     return queue;
 }
 
-/** specifics */
-+ (NSOperationQueue *)currentQueue
-{
-    return [self queueForThread:[NSThread currentThread]];
-}
-
 + (NSOperationQueue *)mainQueue
 {
-    return [self queueForThread:[NSThread mainThread]];
+    static NSOperationQueue *mainQueue = nil;
+    static dispatch_once_t once = 0L;
+    dispatch_once(&once, ^{
+        //main queue is special. it runs it's ops on the main thread
+        mainQueue = [[NSOperationQueue alloc] init];
+        mainQueue->_isMainQueue = YES;
+        [mainQueue setMaxConcurrentOperationCount:1];
+        [mainQueue setName:@"Main Operation Queue"];
+    });
+    return mainQueue;
 }
 
 - (id)init
@@ -736,9 +884,9 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
         pthread_mutexattr_settype(&_mta, PTHREAD_MUTEX_RECURSIVE);
         pthread_mutex_init(&_queuelock, &_mta);
         _suspended = NO;
-        _pendingOperations = [[NSMutableArray alloc] initWithCapacity:5];
+        _pendingOperations = NSOperationQueueCreateIdentitySet();
         _operationsToStart = [[NSMutableArray alloc] initWithCapacity:5];
-        _operations = [[NSMutableArray alloc] initWithCapacity:5];
+        _operations = NSOperationQueueCreateIdentitySet();
         _maxConcurrentOperationCount = NSOperationQueueDefaultMaxConcurrentOperationCount;
         _isMainQueue = NO;
     }
@@ -751,6 +899,7 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
     for (NSOperation *op in _pendingOperations)
     {
         op._internal->_queue = nil;
+        op._internal->_heapIndex = NSNotFound;
     }
     for (NSOperation *op in _operations)
     {
@@ -790,7 +939,7 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
 
     [op retain];
     pthread_mutex_lock(&_queuelock);
-    if ([_pendingOperations indexOfObjectIdenticalTo:op] != NSNotFound)
+    if ([_pendingOperations containsObject:op])
     {
         pthread_mutex_unlock(&_queuelock);
         [op autorelease]; //Auto releasing so we can put the op in the log message but still raise from here.
@@ -814,8 +963,12 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
         pthread_mutex_lock(&(otherQueue->_queuelock));
         [otherQueue willChangeValueForKey:@"operationCount"];
         [otherQueue willChangeValueForKey:@"operations"];
-        [otherQueue->_operations removeObjectIdenticalTo:op];
-        [otherQueue->_pendingOperations removeObjectIdenticalTo:op];
+        if (op._internal->_heapIndex != NSNotFound)
+        {
+            readyHeapRemove(otherQueue->_internal, op._internal);
+        }
+        [otherQueue->_operations removeObject:op];
+        [otherQueue->_pendingOperations removeObject:op];
         [otherQueue didChangeValueForKey:@"operations"];
         [otherQueue didChangeValueForKey:@"operationCount"];
         pthread_mutex_unlock(&(otherQueue->_queuelock));
@@ -825,16 +978,18 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
     pthread_mutex_lock(&_queuelock);
     [self willChangeValueForKey:@"operationCount"];
     [self willChangeValueForKey:@"operations"];
+    op._internal->_sequence = _internal->_nextSequence++;
     [_pendingOperations addObject:op];
     [self didChangeValueForKey:@"operations"];
     [self didChangeValueForKey:@"operationCount"];
     pthread_mutex_unlock(&_queuelock);
-    [op release];
 
-    if ([op isReady] && !_suspended)
+    //operations that are not ready yet are pushed to the ready heap once their last dependency finishes.
+    if ([op isReady])
     {
-        [self _queueSchedulerRun];
+        [self _operationBecameReady:op._internal];
     }
+    [op release];
 }
 
 - (void)addOperations:(NSArray *)ops waitUntilFinished:(BOOL)wait
@@ -863,12 +1018,25 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
     [self addOperation:[NSBlockOperation blockOperationWithBlock:block]];
 }
 
+static NSComparisonResult compareOperationSequence(id obj1, id obj2, void *context)
+{
+    NSUInteger seq1 = ((NSOperation *)obj1)._internal->_sequence;
+    NSUInteger seq2 = ((NSOperation *)obj2)._internal->_sequence;
+    if (seq1 < seq2)
+    {
+        return NSOrderedAscending;
+    }
+    return seq1 > seq2 ? NSOrderedDescending : NSOrderedSame;
+}
+
 - (NSArray *)operations
 {
     pthread_mutex_lock(&_queuelock);
-    NSMutableArray *operations = [NSMutableArray arrayWithArray:_operations];
-    [operations addObjectsFromArray:_pendingOperations];
+    NSMutableArray *operations = [NSMutableArray arrayWithArray:[_operations allObjects]];
+    [operations addObjectsFromArray:[_pendingOperations allObjects]];
     pthread_mutex_unlock(&_queuelock);
+    //report them in the order they were added
+    [operations sortUsingFunction:&compareOperationSequence context:NULL];
     return operations;
 }
 
@@ -910,11 +1078,13 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
 - (void)setMaxConcurrentOperationCount:(NSInteger)count
 {
     [self willChangeValueForKey:@"maxConcurrentOperationCount"];
-    if (_maxConcurrentOperationCount > count)
+    BOOL changed = _maxConcurrentOperationCount != count;
+    _maxConcurrentOperationCount = count;
+    if (changed)
     {
+        //a higher limit may let waiting operations start right away.
         [self _queueSchedulerRun];
     }
-    _maxConcurrentOperationCount = count;
     [self didChangeValueForKey:@"maxConcurrentOperationCount"];
 }
 
@@ -966,20 +1136,35 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
     }
     //just incase some takes an operation out of being finished after we queue up doing this.
 
+    //executor queues already removed it as soon as it finished.
     pthread_mutex_lock(&_queuelock);
-    [self willChangeValueForKey:@"operationCount"];
-    [self willChangeValueForKey:@"operations"];
-    [_operations removeObjectIdenticalTo:opi->_operation];
-    [self didChangeValueForKey:@"operations"];
-    [self didChangeValueForKey:@"operationCount"];
+    BOOL removed = [_operations containsObject:opi->_operation];
+    if (removed)
+    {
+        [self willChangeValueForKey:@"operationCount"];
+        [self willChangeValueForKey:@"operations"];
+        [_operations removeObject:opi->_operation];
+        [self didChangeValueForKey:@"operations"];
+        [self didChangeValueForKey:@"operationCount"];
+    }
     pthread_mutex_unlock(&_queuelock);
-    [self _queueSchedulerRun];
+    if (removed)
+    {
+        [self _queueSchedulerRun];
+    }
 }
 
 //called when things need to happen.
 
 - (void)_queueSchedulerRun
 {
+    //on an executor worker, schedule right here so what gets started lands on this worker's own deque.
+    if (_internal->_usesWorkStealingExecutor && _NSOperationExecutorIsWorkerThread())
+    {
+        [self _schedulerRun];
+        return;
+    }
+
     [self retain];
     dispatch_async(_internal->_schedule_queue, ^{
         [self _schedulerRun];
@@ -987,54 +1172,39 @@ static NSString const *NSOperationQueueKey = @"NSOperationQueue";
     });
 }
 
-static NSComparisonResult compareOperationEffectivePriorities(id obj1, id obj2, void *context)
+- (void)_operationBecameReady:(_NSOperationInternal *)opi
 {
-    NSOperation *op1 = (NSOperation *)obj1;
-    NSOperation *op2 = (NSOperation *)obj2;
-    NSArray *pendingOperations = (NSArray *)context;
-    NSUInteger weightFactor = [pendingOperations count];
-    NSInteger weight1 = op1._internal->_effectivePriorityValue + op1._internal->_queuePriority * weightFactor;
-    NSInteger weight2 = op2._internal->_effectivePriorityValue + op2._internal->_queuePriority * weightFactor;
-    if (weight1 < weight2)
+    BOOL queued = NO;
+    pthread_mutex_lock(&_queuelock);
+    if (opi->_heapIndex == NSNotFound &&
+        opi->_state == NSOperationStateReady &&
+        [_pendingOperations containsObject:opi->_operation])
     {
-        return NSOrderedDescending;
+        //the priority is sampled when the operation becomes ready, and ages against everything that becomes ready after it.
+        opi->_effectivePriorityValue = opi->_queuePriority * NSOperationQueueAgingWindow - (NSInteger)_internal->_readyTick++;
+        readyHeapPush(_internal, opi);
+        queued = YES;
     }
-    else if (weight1 > weight2)
-    {
-        return NSOrderedAscending;
-    }
-    else
+    pthread_mutex_unlock(&_queuelock);
+
+    if (queued && !_suspended)
     {
-        return NSOrderedSame;
+        [self _queueSchedulerRun];
     }
 }
 
-- (void)_sortPendingOperations {
-    // _pendingOperations is assumed to be locked already
-    const NSUInteger kMaxCount = 512;
-    NSUInteger count = [_pendingOperations count];
-    if (count <= 1) {
-        return;
-    }
-    if (count > kMaxCount) {
-        [_pendingOperations sortUsingFunction:&compareOperationEffectivePriorities context:_pendingOperations];
-        return;
-    }
-    [_pendingOperations _mutate];
-    NSRange range = NSMakeRange(0, count);
-    id objs[kMaxCount];
-    CFIndex indexes[kMaxCount];
-    [_pendingOperations getObjects:objs range:range];
-    id *pobjs = objs;
-    CFSortIndexes(indexes, count, 0, ^(CFIndex i1, CFIndex i2) {
-        return (CFComparisonResult)compareOperationEffectivePriorities(pobjs[i1], pobjs[i2], _pendingOperations);
-    });
-    assert(sizeof(id) == sizeof(CFIndex));
-    for (int i = 0; i < count; i++) {
-        indexes[i] = (CFIndex)objs[indexes[i]]; // re-use indexes allocation
+static NSQualityOfService effectiveQualityOfService(NSOperation *op, NSQualityOfService queueQualityOfService)
+{
+    switch (op._internal->_qualityOfService)
+    {
+        case NSQualityOfServiceUserInteractive:
+        case NSQualityOfServiceUserInitiated:
+        case NSQualityOfServiceUtility:
+        case NSQualityOfServiceBackground:
+            return op._internal->_qualityOfService;
+        default:
+            return queueQualityOfService;
     }
-    [_pendingOperations replaceObjectsInRange:range withObjects:(id *)indexes count:count];
-    return;
 }
 
 - (void)_schedulerRun {
@@ -1053,32 +1223,28 @@ static NSComparisonResult compareOperationEffectivePriorities(id obj1, id obj2,
 
     if (operationsToAdd > 0)
     {
-        [self _sortPendingOperations];
-        for (NSOperation *op in _pendingOperations)
+        while (operationsToAdd > 0 && _internal->_readyCount > 0)
         {
-            if (operationsToAdd > 0 && op._internal->_state == NSOperationStateReady)
+            _NSOperationInternal *opi = readyHeapPop(_internal);
+            if (opi->_state != NSOperationStateReady)
             {
-                operationsToAdd--;
-                [_operationsToStart addObject:op];
-            }
-            else if (operationsToAdd <= 0)
-            {
-                if (op._internal->_state == NSOperationStateReady)
-                {
-                    op._internal->_effectivePriorityValue++;
-                }
+                //it picked up a dependency since it was queued; it comes back once that finishes.
+                continue;
             }
+            NSOperation *op = opi->_operation;
+            operationsToAdd--;
+            [_operationsToStart addObject:op];
+            [_operations addObject:op];
+            [_pendingOperations removeObject:op];
         }
 
+        BOOL usesExecutor = _internal->_usesWorkStealingExecutor && !_isMainQueue;
         for (NSOperation *op in _operationsToStart)
         {
-            [_pendingOperations removeObjectIdenticalTo:op];
-            [_operations addObject:op];
             void (^start)(void) = ^{
                 NSOperation *o = [op retain];
-                NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
-                NSOperationQueue *previousValue = [threadDictionary objectForKey:NSOperationQueueKey];
-                [threadDictionary setObject:self forKey:NSOperationQueueKey];
+                void *previousValue = _CFGetTSD(__CFTSDKeyNSOperationQueueCurrentQueue);
+                _CFSetTSD(__CFTSDKeyNSOperationQueueCurrentQueue, self, NULL);
                 //Lets get to work.
                 [o start];
                 //if the operation is not finished then they must have subclassed and replaced start. Finish will come later.
@@ -1087,15 +1253,13 @@ static NSComparisonResult compareOperationEffectivePriorities(id obj1, id obj2,
                 {
                     [o._internal observeValueForKeyPath:@"isFinished" ofObject:o change:nil context:nil];
                 }
-                
-                if (!previousValue)
+                //short operations are done by now; free their slot and start the next ones from this worker.
+                if (usesExecutor && o._internal->_state == NSOperationStateFinished)
                 {
-                    [threadDictionary removeObjectForKey:NSOperationQueueKey];
-                }
-                else
-                {
-                    [threadDictionary setObject:previousValue forKey:NSOperationQueueKey];
+                    [self _removeFinishedOperation:o._internal];
                 }
+
+                _CFSetTSD(__CFTSDKeyNSOperationQueueCurrentQueue, previousValue, NULL);
                 [op release];
             };
 
@@ -1103,9 +1267,13 @@ static NSComparisonResult compareOperationEffectivePriorities(id obj1, id obj2,
             {
                 dispatch_async(dispatch_get_main_queue(), start);
             }
+            else if (usesExecutor)
+            {
+                _NSOperationExecutorSubmit(effectiveQualityOfService(op, _qualityOfService), start);
+            }
             else
             {
-                dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), start);
+                dispatch_async(dispatch_get_global_queue(_NSOperationQualityOfServiceClass(effectiveQualityOfService(op, _qualityOfService)), 0), start);
             }
         }
         [_operationsToStart removeAllObjects];
@@ -1114,6 +1282,16 @@ static NSComparisonResult compareOperationEffectivePriorities(id obj1, id obj2,
     pthread_mutex_unlock(&_queuelock);
 }
 
+- (BOOL)_usesWorkStealingExecutor
+{
+    return _internal->_usesWorkStealingExecutor;
+}
+
+- (void)_setUsesWorkStealingExecutor:(BOOL)usesWorkStealingExecutor
+{
+    _internal->_usesWorkStealingExecutor = usesWorkStealingExecutor;
+}
+
 - (dispatch_queue_t)underlyingQueue
 {
     return _internal->_schedule_queue;
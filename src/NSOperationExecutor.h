@@ -0,0 +1,27 @@
+//
+//  NSOperationExecutor.h
+//  Foundation
+//
+
+#import <Foundation/NSObjCRuntime.h>
+#import <dispatch/dispatch.h>
+#import <pthread/qos.h>
+#import "NSObjectInternal.h"
+
+// Maps an NSQualityOfService to the class of the global queue or worker
+// pool that should run it.
+CF_PRIVATE qos_class_t _NSOperationQualityOfServiceClass(NSQualityOfService qualityOfService);
+
+// Runs work on a process-wide pool of worker threads for the given quality
+// of service. Each worker owns a deque; idle workers steal from the others.
+// Work submitted from one of the pool's own workers stays on its deque.
+CF_PRIVATE void _NSOperationExecutorSubmit(NSQualityOfService qualityOfService, dispatch_block_t work);
+
+// Whether the calling thread is one of the executor's workers.
+CF_PRIVATE BOOL _NSOperationExecutorIsWorkerThread(void);
+
+// Bracket a wait that may block the calling worker on other queued work.
+// While a worker is blocked its pool starts another worker, so the work it
+// waits on can still run. Both do nothing off the executor's workers.
+CF_PRIVATE void _NSOperationExecutorWorkerWillBlock(void);
+CF_PRIVATE void _NSOperationExecutorWorkerDidUnblock(void);
@@ -0,0 +1,346 @@
+//
+//  NSOperationExecutor.m
+//  Foundation
+//
+
+#import "NSOperationExecutor.h"
+#import <Foundation/NSProcessInfo.h>
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
+#import <Block.h>
+#import <stdlib.h>
+
+// Upper bound on threads per pool, including the ones started to stand in
+// for blocked workers.
+#define NSOperationExecutorMaxWorkers 255
+#define NSOperationWorkDequeInitialCapacity 64
+
+// Workers push and pop at the bottom of their own deque; thieves take the
+// oldest item from the top.
+typedef struct {
+    OSSpinLock lock;
+    dispatch_block_t *items;
+    NSUInteger head;
+    volatile NSUInteger count;
+    NSUInteger capacity;
+} NSOperationWorkDeque;
+
+// A pool starts with one worker per core. Whenever fewer than that are left
+// unblocked, it starts another. Workers are never torn down, so a deque slot
+// below workerCount always stays valid.
+typedef struct {
+    qos_class_t qos;
+    int32_t targetWorkers;
+    volatile int32_t workerCount;
+    volatile int32_t blocked;
+    volatile int32_t pending;
+    volatile int32_t sleepers;
+    volatile int32_t nextDeque;
+    pthread_mutex_t growLock;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCondition;
+    NSOperationWorkDeque deques[NSOperationExecutorMaxWorkers];
+} NSOperationExecutor;
+
+typedef struct {
+    NSOperationExecutor *executor;
+    NSUInteger index;
+} NSOperationWorker;
+
+enum {
+    NSOperationExecutorUserInteractive,
+    NSOperationExecutorUserInitiated,
+    NSOperationExecutorDefault,
+    NSOperationExecutorUtility,
+    NSOperationExecutorBackground,
+    NSOperationExecutorCount
+};
+
+static pthread_key_t NSOperationWorkerKey;
+static NSOperationExecutor *NSOperationExecutors[NSOperationExecutorCount];
+
+qos_class_t _NSOperationQualityOfServiceClass(NSQualityOfService qualityOfService)
+{
+    switch (qualityOfService)
+    {
+        case NSQualityOfServiceUserInteractive:
+            return QOS_CLASS_USER_INTERACTIVE;
+        case NSQualityOfServiceUserInitiated:
+            return QOS_CLASS_USER_INITIATED;
+        case NSQualityOfServiceUtility:
+            return QOS_CLASS_UTILITY;
+        case NSQualityOfServiceBackground:
+            return QOS_CLASS_BACKGROUND;
+        default:
+            return QOS_CLASS_DEFAULT;
+    }
+}
+
+static NSOperationWorker *currentWorker(void)
+{
+    static dispatch_once_t keyOnce = 0L;
+    dispatch_once(&keyOnce, ^{
+        pthread_key_create(&NSOperationWorkerKey, NULL);
+    });
+    return (NSOperationWorker *)pthread_getspecific(NSOperationWorkerKey);
+}
+
+static void pushBottom(NSOperationWorkDeque *deque, dispatch_block_t work)
+{
+    OSSpinLockLock(&deque->lock);
+    if (deque->count == deque->capacity)
+    {
+        NSUInteger capacity = deque->capacity * 2;
+        dispatch_block_t *items = malloc(capacity * sizeof(dispatch_block_t));
+        for (NSUInteger idx = 0; idx < deque->count; idx++)
+        {
+            items[idx] = deque->items[(deque->head + idx) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = work;
+    deque->count++;
+    OSSpinLockUnlock(&deque->lock);
+}
+
+static dispatch_block_t popBottom(NSOperationWorkDeque *deque)
+{
+    if (deque->count == 0)
+    {
+        return NULL;
+    }
+
+    dispatch_block_t work = NULL;
+    OSSpinLockLock(&deque->lock);
+    if (deque->count != 0)
+    {
+        deque->count--;
+        work = deque->items[(deque->head + deque->count) % deque->capacity];
+    }
+    OSSpinLockUnlock(&deque->lock);
+    return work;
+}
+
+static dispatch_block_t stealTop(NSOperationWorkDeque *deque)
+{
+    if (deque->count == 0)
+    {
+        return NULL;
+    }
+
+    dispatch_block_t work = NULL;
+    OSSpinLockLock(&deque->lock);
+    if (deque->count != 0)
+    {
+        work = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    OSSpinLockUnlock(&deque->lock);
+    return work;
+}
+
+static dispatch_block_t takeWork(NSOperationExecutor *executor, NSUInteger index)
+{
+    dispatch_block_t work = popBottom(&executor->deques[index]);
+    NSUInteger workerCount = executor->workerCount;
+    for (NSUInteger offset = 1; work == NULL && offset < workerCount; offset++)
+    {
+        work = stealTop(&executor->deques[(index + offset) % workerCount]);
+    }
+    return work;
+}
+
+static void wakeWorker(NSOperationExecutor *executor)
+{
+    pthread_mutex_lock(&executor->idleLock);
+    pthread_cond_signal(&executor->idleCondition);
+    pthread_mutex_unlock(&executor->idleLock);
+}
+
+static void *workerMain(void *arg)
+{
+    NSOperationWorker *worker = (NSOperationWorker *)arg;
+    NSOperationExecutor *executor = worker->executor;
+    currentWorker();
+    pthread_setspecific(NSOperationWorkerKey, worker);
+
+    for (;;)
+    {
+        dispatch_block_t work = takeWork(executor, worker->index);
+        if (work != NULL)
+        {
+            OSAtomicDecrement32Barrier(&executor->pending);
+            @autoreleasepool {
+                work();
+            }
+            Block_release(work);
+            continue;
+        }
+
+        // Announce ourselves before checking pending; submitters bump pending
+        // before checking sleepers, so one side always sees the other.
+        OSAtomicIncrement32Barrier(&executor->sleepers);
+        pthread_mutex_lock(&executor->idleLock);
+        while (executor->pending == 0)
+        {
+            pthread_cond_wait(&executor->idleCondition, &executor->idleLock);
+        }
+        pthread_mutex_unlock(&executor->idleLock);
+        OSAtomicDecrement32Barrier(&executor->sleepers);
+    }
+    return NULL;
+}
+
+// Must be called with growLock held.
+static BOOL startWorker(NSOperationExecutor *executor)
+{
+    int32_t index = executor->workerCount;
+    if (index == NSOperationExecutorMaxWorkers)
+    {
+        return NO;
+    }
+
+    NSOperationWorkDeque *deque = &executor->deques[index];
+    deque->lock = OS_SPINLOCK_INIT;
+    deque->capacity = NSOperationWorkDequeInitialCapacity;
+    deque->items = malloc(deque->capacity * sizeof(dispatch_block_t));
+
+    NSOperationWorker *worker = malloc(sizeof(NSOperationWorker));
+    worker->executor = executor;
+    worker->index = index;
+
+    // the deque has to be in place before thieves and submitters can pick it
+    OSMemoryBarrier();
+    executor->workerCount = index + 1;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_set_qos_class_np(&attr, executor->qos, 0);
+    pthread_t thread;
+    pthread_create(&thread, &attr, &workerMain, worker);
+    pthread_attr_destroy(&attr);
+    return YES;
+}
+
+static NSOperationExecutor *createExecutor(qos_class_t qos)
+{
+    NSOperationExecutor *executor = calloc(1, sizeof(NSOperationExecutor));
+    NSUInteger targetWorkers = [[NSProcessInfo processInfo] activeProcessorCount];
+    if (targetWorkers < 1)
+    {
+        targetWorkers = 1;
+    }
+    else if (targetWorkers > NSOperationExecutorMaxWorkers)
+    {
+        targetWorkers = NSOperationExecutorMaxWorkers;
+    }
+
+    executor->qos = qos;
+    executor->targetWorkers = (int32_t)targetWorkers;
+    pthread_mutex_init(&executor->growLock, NULL);
+    pthread_mutex_init(&executor->idleLock, NULL);
+    pthread_cond_init(&executor->idleCondition, NULL);
+
+    pthread_mutex_lock(&executor->growLock);
+    for (NSUInteger idx = 0; idx < targetWorkers; idx++)
+    {
+        startWorker(executor);
+    }
+    pthread_mutex_unlock(&executor->growLock);
+    return executor;
+}
+
+static NSOperationExecutor *executorForQualityOfService(NSQualityOfService qualityOfService)
+{
+    static dispatch_once_t executorOnce[NSOperationExecutorCount];
+
+    NSUInteger slot;
+    switch (qualityOfService)
+    {
+        case NSQualityOfServiceUserInteractive:
+            slot = NSOperationExecutorUserInteractive;
+            break;
+        case NSQualityOfServiceUserInitiated:
+            slot = NSOperationExecutorUserInitiated;
+            break;
+        case NSQualityOfServiceUtility:
+            slot = NSOperationExecutorUtility;
+            break;
+        case NSQualityOfServiceBackground:
+            slot = NSOperationExecutorBackground;
+            break;
+        default:
+            slot = NSOperationExecutorDefault;
+            break;
+    }
+
+    dispatch_once(&executorOnce[slot], ^{
+        NSOperationExecutors[slot] = createExecutor(_NSOperationQualityOfServiceClass(qualityOfService));
+    });
+    return NSOperationExecutors[slot];
+}
+
+void _NSOperationExecutorSubmit(NSQualityOfService qualityOfService, dispatch_block_t work)
+{
+    NSOperationExecutor *executor = executorForQualityOfService(qualityOfService);
+
+    // work submitted from one of our own workers stays local to it
+    NSOperationWorker *worker = currentWorker();
+    NSUInteger index;
+    if (worker != NULL && worker->executor == executor)
+    {
+        index = worker->index;
+    }
+    else
+    {
+        index = (uint32_t)OSAtomicIncrement32(&executor->nextDeque) % (uint32_t)executor->workerCount;
+    }
+
+    pushBottom(&executor->deques[index], Block_copy(work));
+    OSAtomicIncrement32Barrier(&executor->pending);
+
+    if (executor->sleepers != 0)
+    {
+        wakeWorker(executor);
+    }
+}
+
+BOOL _NSOperationExecutorIsWorkerThread(void)
+{
+    return currentWorker() != NULL;
+}
+
+void _NSOperationExecutorWorkerWillBlock(void)
+{
+    NSOperationWorker *worker = currentWorker();
+    if (worker == NULL)
+    {
+        return;
+    }
+
+    NSOperationExecutor *executor = worker->executor;
+    OSAtomicIncrement32Barrier(&executor->blocked);
+    pthread_mutex_lock(&executor->growLock);
+    if (executor->workerCount - executor->blocked < executor->targetWorkers && !startWorker(executor))
+    {
+        // out of threads; the best we can do is make sure nobody sleeps on queued work
+        wakeWorker(executor);
+    }
+    pthread_mutex_unlock(&executor->growLock);
+}
+
+void _NSOperationExecutorWorkerDidUnblock(void)
+{
+    NSOperationWorker *worker = currentWorker();
+    if (worker == NULL)
+    {
+        return;
+    }
+
+    OSAtomicDecrement32Barrier(&worker->executor->blocked);
+}
@@ -6,8 +6,13 @@
 //
 
 #import "NSPredicateInternal.h"
+#import "NSExpressionInternal.h"
+#import "NSPredicateOperator.h"
 #import "_NSPredicateOperatorUtilities.h"
 #import <Foundation/NSArray.h>
+#import <Foundation/NSCompoundPredicate.h>
+#import <Foundation/NSComparisonPredicate.h>
+#import <Foundation/NSPredicate_Private.h>
 #import <Foundation/NSDictionary.h>
 #import "NSObjectInternal.h"
 #import <Foundation/NSOrderedSet.h>
@@ -16,6 +21,9 @@
 #import "_NSPredicateOperatorUtilities.h"
 
 #import <CoreFoundation/CFLocale.h>
+#import <dispatch/dispatch.h>
+#import <objc/message.h>
+#import <objc/runtime.h>
 
 @implementation NSPredicate
 
@@ -147,23 +155,355 @@
 
 @end
 
+// Filtering lowers the predicate once into a flat program in prefix order.
+// Comparisons of plain key paths and constants read their operands with a
+// single valueForKey:/valueForKeyPath: send and call the operator through a
+// cached IMP, instead of going through NSExpression evaluation (which builds
+// an NSInvocation per key path, per object). Anything the program does not
+// understand is kept as a node that calls -evaluateWithObject: as before.
+typedef enum {
+    NSPredicateProgramEvaluate,
+    NSPredicateProgramTrue,
+    NSPredicateProgramFalse,
+    NSPredicateProgramNot,
+    NSPredicateProgramAnd,
+    NSPredicateProgramOr,
+    NSPredicateProgramCompare,
+} NSPredicateProgramOpcode;
+
+typedef enum {
+    NSPredicateProgramValueExpression,
+    NSPredicateProgramValueConstant,
+    NSPredicateProgramValueSelf,
+    NSPredicateProgramValueKey,
+} NSPredicateProgramValueKind;
+
+typedef struct {
+    NSPredicateProgramValueKind kind;
+    id object; // the expression, the constant, or the key (path)
+    SEL selector;
+} NSPredicateProgramValue;
+
+typedef struct {
+    NSPredicateProgramOpcode opcode;
+    NSUInteger childCount;
+    NSUInteger end; // index just past this node's subtree
+    id object;
+    IMP implementation;
+    NSPredicateProgramValue lhs;
+    NSPredicateProgramValue rhs;
+} NSPredicateProgramNode;
+
+typedef struct {
+    NSPredicateProgramNode *nodes;
+    NSUInteger count;
+    NSUInteger capacity;
+} NSPredicateProgram;
+
+static NSUInteger __predicateProgramAppend(NSPredicateProgram *program)
+{
+    if (program->count == program->capacity)
+    {
+        NSUInteger capacity = program->capacity ? program->capacity * 2 : 8;
+        NSPredicateProgramNode *nodes = realloc(program->nodes, sizeof(NSPredicateProgramNode) * capacity);
+        if (nodes == NULL)
+        {
+            [NSException raise:NSMallocException format:@"unable to allocate predicate program"];
+            return NSNotFound;
+        }
+        program->nodes = nodes;
+        program->capacity = capacity;
+    }
+    NSUInteger idx = program->count++;
+    memset(&program->nodes[idx], 0, sizeof(NSPredicateProgramNode));
+    return idx;
+}
+
+static void __predicateProgramCompileValue(NSPredicateProgramValue *value, NSExpression *expression)
+{
+    value->kind = NSPredicateProgramValueExpression;
+    value->object = expression;
+
+    if (![expression _allowsEvaluation])
+    {
+        return;
+    }
+
+    Class cls = object_getClass(expression);
+    if (cls == [NSConstantValueExpression class])
+    {
+        value->kind = NSPredicateProgramValueConstant;
+        value->object = [expression constantValue];
+    }
+    else if (cls == [NSSelfExpression class])
+    {
+        value->kind = NSPredicateProgramValueSelf;
+        value->object = nil;
+    }
+    else if (cls == [NSKeyPathExpression class])
+    {
+        NSKeyPathExpression *keyPathExpression = (NSKeyPathExpression *)expression;
+        NSExpression *operand = [keyPathExpression operand];
+        NSArray *arguments = [keyPathExpression arguments];
+        SEL selector = [keyPathExpression selector];
+        if (object_getClass(operand) != [NSSelfExpression class] || [arguments count] != 1 ||
+            (selector != @selector(valueForKey:) && selector != @selector(valueForKeyPath:)))
+        {
+            return;
+        }
+        NSExpression *path = [arguments objectAtIndex:0];
+        if (object_getClass(path) != [NSKeyPathSpecifierExpression class] || ![path _allowsEvaluation])
+        {
+            return;
+        }
+        value->kind = NSPredicateProgramValueKey;
+        value->object = [path expressionValueWithObject:nil context:nil];
+        value->selector = selector;
+    }
+}
+
+static void __predicateProgramCompile(NSPredicateProgram *program, NSPredicate *predicate)
+{
+    NSUInteger idx = __predicateProgramAppend(program);
+    program->nodes[idx].opcode = NSPredicateProgramEvaluate;
+    program->nodes[idx].object = predicate;
+    program->nodes[idx].implementation = class_getMethodImplementation(object_getClass(predicate), @selector(evaluateWithObject:));
+
+    Class cls = object_getClass(predicate);
+    if (![predicate _allowsEvaluation])
+    {
+        // Let -evaluateWithObject: raise.
+    }
+    else if (cls == [NSTruePredicate class])
+    {
+        program->nodes[idx].opcode = NSPredicateProgramTrue;
+    }
+    else if (cls == [NSFalsePredicate class])
+    {
+        program->nodes[idx].opcode = NSPredicateProgramFalse;
+    }
+    else if (cls == [NSCompoundPredicate class])
+    {
+        NSCompoundPredicate *compound = (NSCompoundPredicate *)predicate;
+        NSArray *subpredicates = [compound subpredicates];
+        NSPredicateProgramOpcode opcode = NSPredicateProgramEvaluate;
+        switch ([compound compoundPredicateType])
+        {
+            case NSNotPredicateType:
+                if ([subpredicates count] > 0)
+                {
+                    opcode = NSPredicateProgramNot;
+                    subpredicates = [subpredicates subarrayWithRange:NSMakeRange(0, 1)];
+                }
+                break;
+            case NSAndPredicateType:
+                opcode = subpredicates != nil ? NSPredicateProgramAnd : NSPredicateProgramEvaluate;
+                break;
+            case NSOrPredicateType:
+                opcode = subpredicates != nil ? NSPredicateProgramOr : NSPredicateProgramEvaluate;
+                break;
+        }
+        if (opcode != NSPredicateProgramEvaluate)
+        {
+            program->nodes[idx].opcode = opcode;
+            program->nodes[idx].childCount = [subpredicates count];
+            for (NSPredicate *subpredicate in subpredicates)
+            {
+                __predicateProgramCompile(program, subpredicate);
+            }
+        }
+    }
+    else if (cls == [NSComparisonPredicate class])
+    {
+        NSComparisonPredicate *comparison = (NSComparisonPredicate *)predicate;
+        NSPredicateOperator *op = [comparison predicateOperator];
+        NSPredicateProgramNode *node = &program->nodes[idx];
+        node->opcode = NSPredicateProgramCompare;
+        node->object = op;
+        node->implementation = class_getMethodImplementation(object_getClass(op), @selector(performOperationUsingObject:andObject:));
+        __predicateProgramCompileValue(&node->lhs, [comparison leftExpression]);
+        __predicateProgramCompileValue(&node->rhs, [comparison rightExpression]);
+    }
+
+    program->nodes[idx].end = program->count;
+}
+
+static inline id __predicateProgramValue(const NSPredicateProgramValue *value, id object)
+{
+    switch (value->kind)
+    {
+        case NSPredicateProgramValueConstant:
+            return value->object;
+        case NSPredicateProgramValueSelf:
+            return object;
+        case NSPredicateProgramValueKey:
+            return ((id (*)(id, SEL, id))objc_msgSend)(object, value->selector, value->object);
+        case NSPredicateProgramValueExpression:
+        default:
+            return [value->object expressionValueWithObject:object context:nil];
+    }
+}
+
+static BOOL __predicateProgramEvaluate(const NSPredicateProgram *program, NSUInteger idx, id object)
+{
+    const NSPredicateProgramNode *node = &program->nodes[idx];
+    switch (node->opcode)
+    {
+        case NSPredicateProgramTrue:
+            return YES;
+        case NSPredicateProgramFalse:
+            return NO;
+        case NSPredicateProgramNot:
+            return !__predicateProgramEvaluate(program, idx + 1, object);
+        case NSPredicateProgramAnd:
+        {
+            NSUInteger child = idx + 1;
+            for (NSUInteger i = 0; i < node->childCount; i++)
+            {
+                if (!__predicateProgramEvaluate(program, child, object))
+                {
+                    return NO;
+                }
+                child = program->nodes[child].end;
+            }
+            return YES;
+        }
+        case NSPredicateProgramOr:
+        {
+            NSUInteger child = idx + 1;
+            for (NSUInteger i = 0; i < node->childCount; i++)
+            {
+                if (__predicateProgramEvaluate(program, child, object))
+                {
+                    return YES;
+                }
+                child = program->nodes[child].end;
+            }
+            return NO;
+        }
+        case NSPredicateProgramCompare:
+        {
+            id leftValue = __predicateProgramValue(&node->lhs, object);
+            id rightValue = __predicateProgramValue(&node->rhs, object);
+            return ((BOOL (*)(id, SEL, id, id))node->implementation)(node->object, @selector(performOperationUsingObject:andObject:), leftValue, rightValue);
+        }
+        case NSPredicateProgramEvaluate:
+        default:
+            return ((BOOL (*)(id, SEL, id))node->implementation)(node->object, @selector(evaluateWithObject:), object);
+    }
+}
+
+static NSPredicateProgram __predicateProgramCreate(NSPredicate *predicate)
+{
+    NSPredicateProgram program = { NULL, 0, 0 };
+    __predicateProgramCompile(&program, predicate);
+    return program;
+}
+
+static void __predicateProgramDestroy(NSPredicateProgram *program)
+{
+    free(program->nodes);
+}
+
 static NSUInteger __filterObjectsUsingPredicate(id container, id *objects, NSPredicate *predicate)
 {
+    NSPredicateProgram program = __predicateProgramCreate(predicate);
     NSUInteger count = 0;
     for (id object in container)
     {
-        if ([predicate evaluateWithObject:object])
+        if (__predicateProgramEvaluate(&program, 0, object))
         {
             objects[count] = object;
             count++;
         }
     }
+    __predicateProgramDestroy(&program);
     return count;
 }
 
+// Below this many objects, farming out chunks costs more than it saves.
+#define NSPredicateConcurrentFilterThreshold 4096
+#define NSPredicateConcurrentFilterChunk 1024
+
+// Filters array into objects, keeping the array's order. With
+// NSEnumerationConcurrent, large arrays are split into chunks evaluated in
+// parallel, so the predicate must be safe to evaluate on other threads.
+static NSUInteger __filterArrayUsingPredicate(NSArray *array, id *objects, NSPredicate *predicate, NSEnumerationOptions opts)
+{
+    NSUInteger count = [array count];
+    if ((opts & NSEnumerationConcurrent) == 0 || count < NSPredicateConcurrentFilterThreshold)
+    {
+        return __filterObjectsUsingPredicate(array, objects, predicate);
+    }
+
+    id *candidates = malloc(sizeof(id) * count);
+    BOOL *matches = malloc(sizeof(BOOL) * count);
+    if (candidates == NULL || matches == NULL)
+    {
+        free(candidates);
+        free(matches);
+        [NSException raise:NSMallocException format:@"unable to allocate object buffer"];
+        return 0;
+    }
+    [array getObjects:candidates range:NSMakeRange(0, count)];
+
+    NSPredicateProgram program = __predicateProgramCreate(predicate);
+    NSPredicateProgram *programPtr = &program;
+    __block NSException *failure = nil;
+    size_t chunks = (count + NSPredicateConcurrentFilterChunk - 1) / NSPredicateConcurrentFilterChunk;
+    dispatch_apply(chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+        NSUInteger start = chunk * NSPredicateConcurrentFilterChunk;
+        NSUInteger end = MIN(start + NSPredicateConcurrentFilterChunk, count);
+        @autoreleasepool {
+            @try {
+                for (NSUInteger idx = start; idx < end; idx++)
+                {
+                    matches[idx] = __predicateProgramEvaluate(programPtr, 0, candidates[idx]);
+                }
+            }
+            @catch (NSException *exception) {
+                for (NSUInteger idx = start; idx < end; idx++)
+                {
+                    matches[idx] = NO;
+                }
+                @synchronized (array) {
+                    if (failure == nil)
+                    {
+                        failure = [exception retain];
+                    }
+                }
+            }
+        }
+    });
+    __predicateProgramDestroy(&program);
+
+    NSUInteger matched = 0;
+    for (NSUInteger idx = 0; idx < count; idx++)
+    {
+        if (matches[idx])
+        {
+            objects[matched++] = candidates[idx];
+        }
+    }
+    free(candidates);
+    free(matches);
+
+    if (failure != nil)
+    {
+        [failure autorelease];
+        @throw failure;
+    }
+    return matched;
+}
+
 @implementation NSArray (NSPredicateSupport)
 
 - (NSArray *)filteredArrayUsingPredicate:(NSPredicate *)predicate
+{
+    return [self _filteredArrayUsingPredicate:predicate options:0];
+}
+
+- (NSArray *)_filteredArrayUsingPredicate:(NSPredicate *)predicate options:(NSEnumerationOptions)opts
 {
     if (predicate == nil)
     {
@@ -179,7 +519,7 @@ static NSUInteger __filterObjectsUsingPredicate(id container, id *objects, NSPre
         return nil;
     }
 
-    count = __filterObjectsUsingPredicate(self, objects, predicate);
+    count = __filterArrayUsingPredicate(self, objects, predicate, opts);
     NSArray *results = [[NSArray alloc] initWithObjects:objects count:count];
     free(objects);
     return [results autorelease];
@@ -190,6 +530,11 @@ static NSUInteger __filterObjectsUsingPredicate(id container, id *objects, NSPre
 @implementation NSMutableArray (NSPredicateSupport)
 
 - (void)filterUsingPredicate:(NSPredicate *)predicate
+{
+    [self _filterUsingPredicate:predicate options:0];
+}
+
+- (void)_filterUsingPredicate:(NSPredicate *)predicate options:(NSEnumerationOptions)opts
 {
     if (predicate == nil)
     {
@@ -205,7 +550,7 @@ static NSUInteger __filterObjectsUsingPredicate(id container, id *objects, NSPre
         return;
     }
 
-    count = __filterObjectsUsingPredicate(self, objects, predicate);
+    count = __filterArrayUsingPredicate(self, objects, predicate, opts);
     NSArray *results = [[NSArray alloc] initWithObjects:objects count:count];
     [self setArray:results];
     [results release];
@@ -14,12 +14,134 @@
 #import <Foundation/NSException.h>
 #import "NSErrorInternal.h"
 #import "NSRegularExpressionCheckingResult.h"
+#import <Foundation/NSRegularExpression_Private.h>
 #import <dispatch/dispatch.h>
+#import <libkern/OSAtomic.h>
 #import <unicode/uregex.h>
 #import <unicode/uclean.h>
 #import <unicode/udata.h>
 #import <CoreFoundation/CFString.h>
 
+// _internal holds the compiled pattern and is never matched against
+// directly. Each match checks out a clone from a small pool kept in
+// _matchers, so one expression can be used from many threads at once; the
+// clone also owns the UTF-16 buffer that non-contiguous strings are copied
+// into, so that buffer is reused rather than allocated per call.
+#define NSRegularExpressionSpareMatcherCount 8
+
+typedef struct {
+    URegularExpression *regex;
+    UChar *buffer;
+    int32_t capacity;
+    BOOL hasCallbacks;
+} NSRegularExpressionMatcher;
+
+typedef struct {
+    OSSpinLock lock;
+    NSUInteger count;
+    NSRegularExpressionMatcher *spares[NSRegularExpressionSpareMatcherCount];
+} NSRegularExpressionMatcherPool;
+
+static void NSRegularExpressionMatcherDestroy(NSRegularExpressionMatcher *matcher)
+{
+    uregex_close(matcher->regex);
+    free(matcher->buffer);
+    free(matcher);
+}
+
+static NSRegularExpressionMatcher *NSRegularExpressionCheckoutMatcher(NSRegularExpression *self)
+{
+    NSRegularExpressionMatcherPool *pool = self->_matchers;
+    if (pool == NULL)
+    {
+        NSRegularExpressionMatcherPool *newPool = calloc(1, sizeof(NSRegularExpressionMatcherPool));
+        if (newPool == NULL)
+        {
+            return NULL;
+        }
+        if (!OSAtomicCompareAndSwapPtrBarrier(NULL, newPool, &self->_matchers))
+        {
+            free(newPool);
+        }
+        pool = self->_matchers;
+    }
+
+    NSRegularExpressionMatcher *matcher = NULL;
+    OSSpinLockLock(&pool->lock);
+    if (pool->count > 0)
+    {
+        matcher = pool->spares[--pool->count];
+    }
+    OSSpinLockUnlock(&pool->lock);
+    if (matcher != NULL)
+    {
+        return matcher;
+    }
+
+    matcher = calloc(1, sizeof(NSRegularExpressionMatcher));
+    if (matcher == NULL)
+    {
+        return NULL;
+    }
+    UErrorCode status = U_ZERO_ERROR;
+    matcher->regex = uregex_clone((URegularExpression *)self->_internal, &status);
+    if (U_FAILURE(status) || matcher->regex == NULL)
+    {
+        free(matcher);
+        return NULL;
+    }
+    return matcher;
+}
+
+static void NSRegularExpressionCheckinMatcher(NSRegularExpression *self, NSRegularExpressionMatcher *matcher)
+{
+    UErrorCode status = U_ZERO_ERROR;
+    if (matcher->hasCallbacks)
+    {
+        uregex_setFindProgressCallback(matcher->regex, NULL, NULL, &status);
+        uregex_setMatchCallback(matcher->regex, NULL, NULL, &status);
+        matcher->hasCallbacks = NO;
+    }
+    // Do not keep a pointer into the caller's string around.
+    static const UChar empty[1] = { 0 };
+    uregex_setText(matcher->regex, empty, 0, &status);
+
+    NSRegularExpressionMatcherPool *pool = self->_matchers;
+    OSSpinLockLock(&pool->lock);
+    if (pool->count < NSRegularExpressionSpareMatcherCount)
+    {
+        pool->spares[pool->count++] = matcher;
+        matcher = NULL;
+    }
+    OSSpinLockUnlock(&pool->lock);
+    if (matcher != NULL)
+    {
+        NSRegularExpressionMatcherDestroy(matcher);
+    }
+}
+
+static const UChar *NSRegularExpressionMatcherText(NSRegularExpressionMatcher *matcher, NSString *string, int32_t len)
+{
+    const UChar *text = CFStringGetCharactersPtr((CFStringRef)string);
+    if (text != NULL)
+    {
+        return text;
+    }
+    if (matcher->capacity < len || matcher->buffer == NULL)
+    {
+        int32_t capacity = MAX(len, 64);
+        UChar *buffer = realloc(matcher->buffer, sizeof(UChar) * capacity);
+        if (buffer == NULL)
+        {
+            return NULL;
+        }
+        matcher->buffer = buffer;
+        matcher->capacity = capacity;
+    }
+    [string getCharacters:(unichar *)matcher->buffer range:NSMakeRange(0, len)];
+    return matcher->buffer;
+}
+
 @implementation NSRegularExpression
 
 + (NSRegularExpression *)regularExpressionWithPattern:(NSString *)pattern options:(NSRegularExpressionOptions)options error:(NSError **)error
@@ -140,6 +262,15 @@
 
 - (void)dealloc
 {
+    NSRegularExpressionMatcherPool *pool = _matchers;
+    if (pool != NULL)
+    {
+        for (NSUInteger idx = 0; idx < pool->count; idx++)
+        {
+            NSRegularExpressionMatcherDestroy(pool->spares[idx]);
+        }
+        free(pool);
+    }
     if (_internal)
     {
         uregex_close(_internal);
@@ -177,6 +308,27 @@ static UBool enumerateFindProgressCallback(const void *context, int64_t matchInd
     return ((findProgressBlock)context)(matchIndex);
 }
 
+static NSTextCheckingResult *NSRegularExpressionCurrentResult(NSRegularExpression *self, URegularExpression *regexp, NSUInteger captureGroups, UErrorCode *error)
+{
+    NSUInteger rangeCount = captureGroups + 1;
+    NSRange ranges[rangeCount];
+    for (int i = 0; U_SUCCESS(*error) && i < rangeCount; i++)
+    {
+        int64_t location = uregex_start64(regexp, i, error);
+        if (U_SUCCESS(*error))
+        {
+            ranges[i].location = location == -1 ? NSNotFound : location;
+            ranges[i].length = uregex_end64(regexp, i, error) - location;
+        }
+    }
+
+    if (U_FAILURE(*error))
+    {
+        return nil;
+    }
+    return [NSTextCheckingResult regularExpressionCheckingResultWithRanges:ranges count:rangeCount regularExpression:self];
+}
+
 - (void)enumerateMatchesInString:(NSString *)string options:(NSMatchingOptions)options range:(NSRange)range usingBlock:(void (^)(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop))block
 {
     if (string == nil)
@@ -185,154 +337,354 @@ static UBool enumerateFindProgressCallback(const void *context, int64_t matchInd
         return;
     }
 
-    URegularExpression *regexp = (URegularExpression *)_internal;
-    const UChar *text = CFStringGetCharactersPtr((CFStringRef)string);
+    NSRegularExpressionMatcher *matcher = NSRegularExpressionCheckoutMatcher(self);
+    if (matcher == NULL)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate regular expression matcher"];
+        return;
+    }
+    URegularExpression *regexp = matcher->regex;
     NSUInteger captureGroups = [self numberOfCaptureGroups];
     int32_t len = (int32_t)[string length];
-    BOOL needsFree = NO;
+    const UChar *text = NSRegularExpressionMatcherText(matcher, string, len);
     if (text == NULL)
     {
-        text = malloc(sizeof(UChar) * len);
-        [string getCharacters:(unichar *)text range:NSMakeRange(0, len)];
-        needsFree = YES;
+        NSRegularExpressionCheckinMatcher(self, matcher);
+        [NSException raise:NSMallocException format:@"Unable to allocate regular expression text buffer"];
+        return;
     }
 
-    UErrorCode error = U_ZERO_ERROR;
-    uregex_setText(regexp, text, len, &error);
-    matchBlock match = ^UBool(int32_t matchIndex) {
-        UBool shouldStop = FALSE;
-        NSTextCheckingResult *result = nil;
-        NSMatchingFlags flags = 0;
-        block(result, flags, &shouldStop);
-        return (UBool)!shouldStop;
-    };
-    findProgressBlock findProgress = ^UBool(int64_t matchIndex) {
-        UBool shouldStop = TRUE;
-        NSMatchingFlags flags = NSMatchingProgress;
-        NSTextCheckingResult *result = nil;
-        block(result, flags, &shouldStop);
-        return (UBool)!shouldStop;
-    };
-
-    if (U_SUCCESS(error))
+    @try
     {
-        if ((options & NSMatchingWithoutAnchoringBounds) != 0)
+        UErrorCode error = U_ZERO_ERROR;
+        uregex_setText(regexp, text, len, &error);
+        matchBlock match = ^UBool(int32_t matchIndex) {
+            UBool shouldStop = FALSE;
+            NSTextCheckingResult *result = nil;
+            NSMatchingFlags flags = 0;
+            block(result, flags, &shouldStop);
+            return (UBool)!shouldStop;
+        };
+        findProgressBlock findProgress = ^UBool(int64_t matchIndex) {
+            UBool shouldStop = TRUE;
+            NSMatchingFlags flags = NSMatchingProgress;
+            NSTextCheckingResult *result = nil;
+            block(result, flags, &shouldStop);
+            return (UBool)!shouldStop;
+        };
+
+        if (U_SUCCESS(error))
         {
-            uregex_useAnchoringBounds(regexp, NO, &error);
+            // Matchers are reused, so always set the bounds mode explicitly.
+            uregex_useAnchoringBounds(regexp, (options & NSMatchingWithoutAnchoringBounds) == 0, &error);
         }
-        else if ((options & NSMatchingAnchored) != 0)
+
+        if (U_SUCCESS(error))
         {
-            uregex_useAnchoringBounds(regexp, YES, &error);
+            if ((options & NSMatchingWithTransparentBounds) != 0)
+            {
+                uregex_useTransparentBounds(regexp, YES, &error);
+            }
+            else
+            {
+                uregex_useTransparentBounds(regexp, NO, &error);
+            }
         }
-    }
 
-    if (U_SUCCESS(error))
-    {
-        if ((options & NSMatchingWithTransparentBounds) != 0)
+        if (U_SUCCESS(error))
         {
-            uregex_useTransparentBounds(regexp, YES, &error);
+            if ((options & NSMatchingReportProgress) != 0)
+            {
+                uregex_setFindProgressCallback(regexp, &enumerateFindProgressCallback, findProgress, &error);
+                matcher->hasCallbacks = YES;
+            }
         }
-        else
+
+        if (U_SUCCESS(error))
         {
-            uregex_useTransparentBounds(regexp, NO, &error);
+            if ((options & NSMatchingReportCompletion) != 0)
+            {
+                uregex_setMatchCallback(regexp, &enumerateMatchCallback, match, &error);
+                matcher->hasCallbacks = YES;
+            }
         }
-    }
 
-    if (U_SUCCESS(error))
-    {
-        if ((options & NSMatchingReportProgress) != 0)
+        if (U_SUCCESS(error))
         {
-            uregex_setFindProgressCallback(regexp, &enumerateFindProgressCallback, findProgress, &error);
+            uregex_setRegion64(regexp, range.location, range.length, &error);
         }
-    }
 
-    if (U_SUCCESS(error))
-    {
-        if ((options & NSMatchingReportCompletion) != 0)
+        BOOL shouldStop = NO;
+        while (U_SUCCESS(error) && !shouldStop && uregex_findNext(regexp, &error))
         {
-            uregex_setMatchCallback(regexp, &enumerateMatchCallback, match, &error);
-        }
-    }
+            NSTextCheckingResult *result = NSRegularExpressionCurrentResult(self, regexp, captureGroups, &error);
 
-    if (U_SUCCESS(error))
-    {
-        uregex_setRegion64(regexp, range.location, range.length, &error);
-    }
+            NSMatchingFlags flags = 0;
+            if (U_SUCCESS(error) && uregex_hitEnd(regexp, &error))
+            {
+                flags |= NSMatchingHitEnd;
+            }
+
+            if (U_SUCCESS(error) && uregex_requireEnd(regexp, &error))
+            {
+                flags |= NSMatchingRequiredEnd;
+            }
 
-    BOOL shouldStop = NO;
-    while (U_SUCCESS(error) && !shouldStop && uregex_findNext(regexp, &error))
-    {
-        NSUInteger rangeCount = captureGroups + 1;
-        NSRange ranges[rangeCount];
-        for (int i = 0; U_SUCCESS(error) && i < rangeCount; i++)
-        {
-            int64_t location = uregex_start64(regexp, i, &error);
             if (U_SUCCESS(error))
             {
-                ranges[i].location = location == -1 ? NSNotFound : location;
-                ranges[i].length = uregex_end64(regexp, i, &error) - location;
+                block(result, flags, &shouldStop);
             }
         }
 
-        NSTextCheckingResult *result = nil;
-        if (U_SUCCESS(error))
+        if (options & NSMatchingReportCompletion)
         {
-            result = [NSTextCheckingResult regularExpressionCheckingResultWithRanges:ranges count:rangeCount regularExpression:self];
+            NSMatchingFlags flags = 0;
+            if (U_SUCCESS(error) && uregex_hitEnd(regexp, &error))
+            {
+                flags |= NSMatchingHitEnd;
+            }
+
+            if (U_SUCCESS(error) && uregex_requireEnd(regexp, &error))
+            {
+                flags |= NSMatchingRequiredEnd;
+            }
+
+            if (U_SUCCESS(error))
+            {
+                block(nil, flags | NSMatchingCompleted, &shouldStop);
+            }
         }
 
-        NSMatchingFlags flags = 0;
-        if (U_SUCCESS(error) && uregex_hitEnd(regexp, &error))
+        if (U_FAILURE(error))
         {
-            flags |= NSMatchingHitEnd;
+            DEBUG_LOG("ICU failure %s (%d)", u_errorName(error), (int)error);
         }
+    }
+    @finally
+    {
+        NSRegularExpressionCheckinMatcher(self, matcher);
+    }
+}
 
-        if (U_SUCCESS(error) && uregex_requireEnd(regexp, &error))
-        {
-            flags |= NSMatchingRequiredEnd;
+- (NSArray *)matchesInString:(NSString *)string options:(NSMatchingOptions)options range:(NSRange)range
+{
+    NSMutableArray *matches = [[NSMutableArray alloc] init];
+    [self enumerateMatchesInString:string options:options range:range usingBlock:^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
+        [matches addObject:result];
+    }];
+    return [matches autorelease];
+}
+
+// Below this many characters, splitting the input costs more than it saves.
+#define NSRegularExpressionConcurrentThreshold (256 * 1024)
+#define NSRegularExpressionConcurrentChunk (64 * 1024)
+
+// Finds the matches a single pass would report that start in [from, limit),
+// assuming the pass resumes its search at from. The region runs on to the end
+// of the text, so matches may extend past limit and $ and lookahead see the
+// real end; the bounds are transparent and non-anchoring, so lookbehind and ^
+// see the text before from. Returns nil if ICU fails.
+static NSArray *NSRegularExpressionMatchesStartingInRange(NSRegularExpression *self, const UChar *text, int32_t len, NSUInteger from, NSUInteger limit)
+{
+    NSRegularExpressionMatcher *matcher = NSRegularExpressionCheckoutMatcher(self);
+    if (matcher == NULL)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate regular expression matcher"];
+        return nil;
+    }
+
+    NSMutableArray *matches = [[NSMutableArray alloc] init];
+    @try
+    {
+        URegularExpression *regexp = matcher->regex;
+        NSUInteger captureGroups = [self numberOfCaptureGroups];
+        UErrorCode error = U_ZERO_ERROR;
+        // Stop looking once every start position below limit has been tried.
+        findProgressBlock findProgress = ^UBool(int64_t matchIndex) {
+            return matchIndex < (int64_t)limit;
+        };
+
+        uregex_setText(regexp, text, len, &error);
+        uregex_useAnchoringBounds(regexp, NO, &error);
+        uregex_useTransparentBounds(regexp, YES, &error);
+        uregex_setFindProgressCallback(regexp, &enumerateFindProgressCallback, findProgress, &error);
+        matcher->hasCallbacks = YES;
+        uregex_setRegion64(regexp, from, len - from, &error);
+
+        while (U_SUCCESS(error) && uregex_findNext(regexp, &error))
+        {
+            if (uregex_start64(regexp, 0, &error) >= (int64_t)limit)
+            {
+                break;
+            }
+            NSTextCheckingResult *result = NSRegularExpressionCurrentResult(self, regexp, captureGroups, &error);
+            if (result != nil)
+            {
+                [matches addObject:result];
+            }
         }
 
-        if (U_SUCCESS(error))
+        if (U_FAILURE(error) && error != U_REGEX_STOPPED_BY_CALLER)
         {
-            block(result, flags, &shouldStop);
+            DEBUG_LOG("ICU failure %s (%d)", u_errorName(error), (int)error);
+            [matches release];
+            matches = nil;
         }
     }
+    @finally
+    {
+        NSRegularExpressionCheckinMatcher(self, matcher);
+    }
+    return [matches autorelease];
+}
+
+- (NSArray *)_concurrentMatchesInString:(NSString *)string options:(NSMatchingOptions)options range:(NSRange)range
+{
+    if (string == nil)
+    {
+        [NSException raise:NSInvalidArgumentException format:@"Nil string passed to NSRegularExpression API"];
+        return nil;
+    }
 
-    if (options & NSMatchingReportCompletion)
+    NSUInteger length = [string length];
+    // Chunks assume the search covers the entire string, unanchored. \G
+    // matches where the previous match ended, which a chunk cannot know.
+    if (length < NSRegularExpressionConcurrentThreshold || length > INT32_MAX ||
+        range.location != 0 || range.length != length ||
+        (options & NSMatchingAnchored) != 0 ||
+        [_pattern rangeOfString:@"\\G" options:NSLiteralSearch].location != NSNotFound)
     {
-        NSMatchingFlags flags = 0;
-        if (U_SUCCESS(error) && uregex_hitEnd(regexp, &error))
+        return [self matchesInString:string options:options range:range];
+    }
+
+    // Copy a non-contiguous string once up front, rather than once per chunk.
+    const UChar *text = CFStringGetCharactersPtr((CFStringRef)string);
+    UChar *buffer = NULL;
+    if (text == NULL)
+    {
+        buffer = malloc(sizeof(UChar) * length);
+        if (buffer == NULL)
         {
-            flags |= NSMatchingHitEnd;
+            [NSException raise:NSMallocException format:@"Unable to allocate regular expression text buffer"];
+            return nil;
         }
+        [string getCharacters:(unichar *)buffer range:NSMakeRange(0, length)];
+        text = buffer;
+    }
+    int32_t len = (int32_t)length;
 
-        if (U_SUCCESS(error) && uregex_requireEnd(regexp, &error))
+    NSUInteger maxChunks = length / NSRegularExpressionConcurrentChunk + 1;
+    NSUInteger *starts = malloc(sizeof(NSUInteger) * (maxChunks + 1));
+    NSArray **results = calloc(maxChunks, sizeof(NSArray *));
+    if (starts == NULL || results == NULL)
+    {
+        free(starts);
+        free(results);
+        free(buffer);
+        [NSException raise:NSMallocException format:@"Unable to allocate regular expression chunk table"];
+        return nil;
+    }
+
+    // Prefer to cut after a line break, where matches rarely straddle the cut.
+    NSUInteger chunks = 0;
+    NSUInteger start = 0;
+    while (start < length)
+    {
+        starts[chunks++] = start;
+        NSUInteger end = length;
+        if (length - start > NSRegularExpressionConcurrentChunk)
         {
-            flags |= NSMatchingRequiredEnd;
+            for (NSUInteger idx = start + NSRegularExpressionConcurrentChunk; idx < length; idx++)
+            {
+                if (text[idx] == '\n')
+                {
+                    end = idx + 1;
+                    break;
+                }
+            }
+        }
+        start = end;
+    }
+    starts[chunks] = length;
+
+    __block NSException *failure = nil;
+    __block BOOL icuFailed = NO;
+    dispatch_apply(chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+        @autoreleasepool {
+            @try {
+                results[chunk] = [NSRegularExpressionMatchesStartingInRange(self, text, len, starts[chunk], starts[chunk + 1]) retain];
+                if (results[chunk] == nil)
+                {
+                    icuFailed = YES;
+                }
+            }
+            @catch (NSException *exception) {
+                @synchronized (self) {
+                    if (failure == nil)
+                    {
+                        failure = [exception retain];
+                    }
+                }
+            }
         }
+    });
 
-        if (U_SUCCESS(error))
+    // Each chunk searched as if a single pass had reached its start with no
+    // match in progress. That holds unless the previous chunk's last match
+    // runs past the cut; then the single pass resumes where that match ends,
+    // so the chunk is searched again from there. A match that ends exactly at
+    // the cut leaves the next chunk's search unchanged, and an empty match
+    // always starts (and ends) before it, so nothing is reported twice.
+    NSMutableArray *matches = [[NSMutableArray alloc] init];
+    NSUInteger resumeAt = 0;
+    for (NSUInteger chunk = 0; chunk < chunks; chunk++)
+    {
+        NSArray *chunkMatches = results[chunk];
+        if (failure == nil && !icuFailed && resumeAt > starts[chunk])
+        {
+            [chunkMatches release];
+            chunkMatches = nil;
+            if (resumeAt < starts[chunk + 1])
+            {
+                @try {
+                    chunkMatches = [NSRegularExpressionMatchesStartingInRange(self, text, len, resumeAt, starts[chunk + 1]) retain];
+                    if (chunkMatches == nil)
+                    {
+                        icuFailed = YES;
+                    }
+                }
+                @catch (NSException *exception) {
+                    failure = [exception retain];
+                }
+            }
+        }
+        if (chunkMatches != nil)
         {
-            block(nil, flags | NSMatchingCompleted, &shouldStop);
+            [matches addObjectsFromArray:chunkMatches];
+            NSTextCheckingResult *last = [chunkMatches lastObject];
+            if (last != nil)
+            {
+                resumeAt = NSMaxRange([last range]);
+            }
+            [chunkMatches release];
         }
     }
-    
-    if (needsFree)
+    free(starts);
+    free(results);
+    free(buffer);
+
+    if (failure != nil)
     {
-        free((UChar *)text);
+        [matches release];
+        [failure autorelease];
+        @throw failure;
     }
-
-    if (U_FAILURE(error))
+    if (icuFailed)
     {
-        DEBUG_LOG("ICU failure %s (%d)", u_errorName(error), (int)error);
+        // Report whatever a single pass finds rather than a list with holes.
+        [matches release];
+        return [self matchesInString:string options:options range:range];
     }
-}
-
-- (NSArray *)matchesInString:(NSString *)string options:(NSMatchingOptions)options range:(NSRange)range
-{
-    NSMutableArray *matches = [[NSMutableArray alloc] init];
-    [self enumerateMatchesInString:string options:options range:range usingBlock:^(NSTextCheckingResult *result, NSMatchingFlags flags, BOOL *stop) {
-        [matches addObject:result];
-    }];
     return [matches autorelease];
 }
 
@@ -6,12 +6,16 @@
 //
 
 #import <Foundation/NSSortDescriptor.h>
+#import <Foundation/NSSortDescriptor_Private.h>
 #import <Foundation/NSArray.h>
 #import <Foundation/NSException.h>
 #import <Foundation/NSKeyValueCoding.h>
 #import <Foundation/NSSet.h>
+#import <dispatch/dispatch.h>
+#import <libkern/OSAtomic.h>
 #import <objc/runtime.h>
 #import <stdlib.h>
+#import <string.h>
 
 @interface NSSet (Internal)
 - (void)getObjects:(id *)objects count:(NSUInteger)count;
@@ -231,6 +235,308 @@ static NSComparisonResult NSSortDescriptorSortComparator(id *obj1, id *obj2, NSA
     return result;
 }
 
+// Sorting by descriptors extracts every key value once per object up front
+// (rather than twice per comparison) along with the comparison IMP for each
+// value, then sorts a permutation of indexes against those side arrays.
+typedef struct {
+    id *values; // NULL when the descriptor has no key
+    IMP *imps; // NULL when the descriptor uses a comparator
+    SEL selector;
+    NSComparator comparator;
+    BOOL ascending;
+} NSSortDescriptorSortKey;
+
+typedef struct {
+    id *objects;
+    NSUInteger keyCount;
+    NSSortDescriptorSortKey *keys;
+} NSSortDescriptorSortContext;
+
+static void NSSortDescriptorSortContextDestroy(NSSortDescriptorSortContext *context)
+{
+    for (NSUInteger idx = 0; idx < context->keyCount; idx++)
+    {
+        free(context->keys[idx].values);
+        free(context->keys[idx].imps);
+    }
+    free(context->keys);
+    context->keys = NULL;
+    context->keyCount = 0;
+}
+
+// Returns NO when the descriptors cannot be decorated (a subclass overriding
+// -compareObject:toObject:), in which case callers compare pairwise.
+static BOOL NSSortDescriptorSortContextCreate(NSSortDescriptorSortContext *context, id *objects, NSUInteger count, NSArray *descriptors)
+{
+    static IMP defaultCompare = NULL;
+    if (defaultCompare == NULL)
+    {
+        defaultCompare = [NSSortDescriptor instanceMethodForSelector:@selector(compareObject:toObject:)];
+    }
+
+    NSUInteger keyCount = [descriptors count];
+    for (NSSortDescriptor *desc in descriptors)
+    {
+        if (class_getMethodImplementation(object_getClass(desc), @selector(compareObject:toObject:)) != defaultCompare)
+        {
+            return NO;
+        }
+    }
+
+    context->objects = objects;
+    context->keyCount = 0;
+    context->keys = calloc(keyCount, sizeof(NSSortDescriptorSortKey));
+    if (context->keys == NULL && keyCount > 0)
+    {
+        [NSException raise:NSMallocException format:@"Unable to allocate buffer for sorting"];
+        return NO;
+    }
+
+    // Key paths may raise; release the buffers filled so far before passing
+    // the exception on.
+    @try
+    {
+        for (NSSortDescriptor *desc in descriptors)
+        {
+            NSSortDescriptorSortKey *key = &context->keys[context->keyCount++];
+            NSString *keyPath = [desc key];
+            key->selector = [desc selector];
+            key->comparator = key->selector == NULL ? [desc comparator] : nil;
+            key->ascending = [desc ascending];
+
+            if (keyPath != nil)
+            {
+                key->values = malloc(count * sizeof(id));
+            }
+            if (key->selector != NULL)
+            {
+                key->imps = malloc(count * sizeof(IMP));
+            }
+            if ((keyPath != nil && key->values == NULL) || (key->selector != NULL && key->imps == NULL))
+            {
+                [NSException raise:NSMallocException format:@"Unable to allocate buffer for sorting"];
+                return NO;
+            }
+
+            Class lastClass = Nil;
+            IMP lastImp = NULL;
+            for (NSUInteger idx = 0; idx < count; idx++)
+            {
+                id value = objects[idx];
+                if (keyPath != nil)
+                {
+                    value = [value valueForKeyPath:keyPath];
+                    key->values[idx] = value;
+                }
+                if (key->imps != NULL)
+                {
+                    Class cls = object_getClass(value);
+                    if (cls != lastClass)
+                    {
+                        lastClass = cls;
+                        lastImp = cls != Nil ? class_getMethodImplementation(cls, key->selector) : NULL;
+                    }
+                    key->imps[idx] = lastImp;
+                }
+            }
+        }
+    }
+    @catch (NSException *exception)
+    {
+        NSSortDescriptorSortContextDestroy(context);
+        @throw;
+    }
+    return YES;
+}
+
+// Mirrors -compareObject:toObject: for each key in turn.
+static NSComparisonResult NSSortDescriptorCompareIndexes(const NSUInteger *idx1, const NSUInteger *idx2, NSSortDescriptorSortContext *context)
+{
+    NSUInteger i1 = *idx1;
+    NSUInteger i2 = *idx2;
+    for (NSUInteger k = 0; k < context->keyCount; k++)
+    {
+        NSSortDescriptorSortKey *key = &context->keys[k];
+        id val1 = key->values != NULL ? key->values[i1] : context->objects[i1];
+        id val2 = key->values != NULL ? key->values[i2] : context->objects[i2];
+        NSComparisonResult result;
+
+        if (val1 == val2)
+        {
+            continue;
+        }
+        if (val2 == nil)
+        {
+            return key->ascending ? NSOrderedDescending : NSOrderedAscending;
+        }
+        if (val1 == nil)
+        {
+            return key->ascending ? NSOrderedAscending : NSOrderedDescending;
+        }
+
+        if (key->imps != NULL)
+        {
+            result = ((NSComparisonResult (*)(id, SEL, id))key->imps[i1])(val1, key->selector, val2);
+        }
+        else
+        {
+            result = key->comparator(val1, val2);
+        }
+
+        if (result != NSOrderedSame)
+        {
+            return key->ascending ? result : -result;
+        }
+    }
+    return NSOrderedSame;
+}
+
+// Below this many objects, a concurrent sort costs more than it saves.
+#define NSSortDescriptorConcurrentThreshold 16384
+#define NSSortDescriptorConcurrentRun 4096
+
+// Stable bottom-up merge sort: runs are sorted with CFMergeSortArray and
+// then merged pairwise, each pass spread over the global queue.
+static void NSSortDescriptorConcurrentSortIndexes(NSUInteger *indexes, NSUInteger count, NSSortDescriptorSortContext *context)
+{
+    NSUInteger *scratch = malloc(count * sizeof(NSUInteger));
+    if (scratch == NULL)
+    {
+        CFMergeSortArray(indexes, count, sizeof(NSUInteger), (CFComparatorFunction)&NSSortDescriptorCompareIndexes, context);
+        return;
+    }
+
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    __block NSException *failure = nil;
+    void (^recordFailure)(NSException *) = ^(NSException *exception) {
+        [exception retain];
+        if (!OSAtomicCompareAndSwapPtrBarrier(nil, exception, (void * volatile *)&failure))
+        {
+            [exception release];
+        }
+    };
+
+    size_t runs = (count + NSSortDescriptorConcurrentRun - 1) / NSSortDescriptorConcurrentRun;
+    dispatch_apply(runs, queue, ^(size_t run) {
+        NSUInteger start = run * NSSortDescriptorConcurrentRun;
+        NSUInteger length = MIN(NSSortDescriptorConcurrentRun, count - start);
+        @autoreleasepool {
+            @try {
+                CFMergeSortArray(indexes + start, length, sizeof(NSUInteger), (CFComparatorFunction)&NSSortDescriptorCompareIndexes, context);
+            }
+            @catch (NSException *exception) {
+                recordFailure(exception);
+            }
+        }
+    });
+
+    NSUInteger *src = indexes;
+    NSUInteger *dst = scratch;
+    for (NSUInteger width = NSSortDescriptorConcurrentRun; width < count && failure == nil; width *= 2)
+    {
+        size_t pairs = (count + 2 * width - 1) / (2 * width);
+        dispatch_apply(pairs, queue, ^(size_t pair) {
+            NSUInteger lo = pair * 2 * width;
+            NSUInteger mid = MIN(lo + width, count);
+            NSUInteger hi = MIN(lo + 2 * width, count);
+            NSUInteger left = lo;
+            NSUInteger right = mid;
+            NSUInteger out = lo;
+            @autoreleasepool {
+                @try {
+                    while (left < mid && right < hi)
+                    {
+                        if (NSSortDescriptorCompareIndexes(&src[right], &src[left], context) == NSOrderedAscending)
+                        {
+                            dst[out++] = src[right++];
+                        }
+                        else
+                        {
+                            dst[out++] = src[left++];
+                        }
+                    }
+                }
+                @catch (NSException *exception) {
+                    recordFailure(exception);
+                }
+            }
+            memcpy(&dst[out], &src[left], (mid - left) * sizeof(NSUInteger));
+            out += mid - left;
+            memcpy(&dst[out], &src[right], (hi - right) * sizeof(NSUInteger));
+        });
+        NSUInteger *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != indexes)
+    {
+        memcpy(indexes, src, count * sizeof(NSUInteger));
+    }
+    free(scratch);
+
+    if (failure != nil)
+    {
+        [failure autorelease];
+        @throw failure;
+    }
+}
+
+// Sorts objects in place by descriptors, keeping equal objects in order.
+static void NSSortDescriptorSortObjects(id *objects, NSUInteger count, NSArray *descriptors, NSSortOptions opts)
+{
+    if (count < 2)
+    {
+        return;
+    }
+
+    NSSortDescriptorSortContext context;
+    if (!NSSortDescriptorSortContextCreate(&context, objects, count, descriptors))
+    {
+        CFMergeSortArray(objects, count, sizeof(id), (CFComparatorFunction)&NSSortDescriptorSortComparator, descriptors);
+        return;
+    }
+
+    NSUInteger *indexes = malloc(count * sizeof(NSUInteger));
+    id *sorted = malloc(count * sizeof(id));
+    if (indexes == NULL || sorted == NULL)
+    {
+        free(indexes);
+        free(sorted);
+        NSSortDescriptorSortContextDestroy(&context);
+        [NSException raise:NSMallocException format:@"Unable to allocate buffer for sorting"];
+        return;
+    }
+    for (NSUInteger idx = 0; idx < count; idx++)
+    {
+        indexes[idx] = idx;
+    }
+
+    @try
+    {
+        if ((opts & NSSortConcurrent) != 0 && count >= NSSortDescriptorConcurrentThreshold)
+        {
+            NSSortDescriptorConcurrentSortIndexes(indexes, count, &context);
+        }
+        else
+        {
+            CFMergeSortArray(indexes, count, sizeof(NSUInteger), (CFComparatorFunction)&NSSortDescriptorCompareIndexes, &context);
+        }
+
+        for (NSUInteger idx = 0; idx < count; idx++)
+        {
+            sorted[idx] = objects[indexes[idx]];
+        }
+        memcpy(objects, sorted, count * sizeof(id));
+    }
+    @finally
+    {
+        free(indexes);
+        free(sorted);
+        NSSortDescriptorSortContextDestroy(&context);
+    }
+}
+
 @implementation NSSet (NSSortDescriptorSorting)
 
 - (NSArray *)sortedArrayUsingDescriptors:(NSArray *)sortDescriptors
@@ -250,7 +556,15 @@ static NSComparisonResult NSSortDescriptorSortComparator(id *obj1, id *obj2, NSA
 
     [self getObjects:objects count:count];
 
-    CFMergeSortArray(objects, count, sizeof(id), (CFComparatorFunction)&NSSortDescriptorSortComparator, sortDescriptors);
+    @try
+    {
+        NSSortDescriptorSortObjects(objects, count, sortDescriptors, 0);
+    }
+    @catch (NSException *exception)
+    {
+        free(objects);
+        @throw;
+    }
     NSArray *sorted = [[NSArray alloc] initWithObjects:objects count:count];
     free(objects);
     return [sorted autorelease];
@@ -261,6 +575,11 @@ static NSComparisonResult NSSortDescriptorSortComparator(id *obj1, id *obj2, NSA
 @implementation NSArray (NSSortDescriptorSorting)
 
 - (NSArray *)sortedArrayUsingDescriptors:(NSArray *)sortDescriptors
+{
+    return [self _sortedArrayUsingDescriptors:sortDescriptors options:0];
+}
+
+- (NSArray *)_sortedArrayUsingDescriptors:(NSArray *)sortDescriptors options:(NSSortOptions)opts
 {
     NSUInteger count = [self count];
     if (count == 0)
@@ -276,7 +595,15 @@ static NSComparisonResult NSSortDescriptorSortComparator(id *obj1, id *obj2, NSA
     }
     [self getObjects:objects range:NSMakeRange(0, count)];
 
-    CFMergeSortArray(objects, count, sizeof(id), (CFComparatorFunction)&NSSortDescriptorSortComparator, sortDescriptors);
+    @try
+    {
+        NSSortDescriptorSortObjects(objects, count, sortDescriptors, opts);
+    }
+    @catch (NSException *exception)
+    {
+        free(objects);
+        @throw;
+    }
     NSArray *sorted = [[NSArray alloc] initWithObjects:objects count:count];
     free(objects);
     return [sorted autorelease];
@@ -287,6 +614,11 @@ static NSComparisonResult NSSortDescriptorSortComparator(id *obj1, id *obj2, NSA
 @implementation NSMutableArray (NSSortDescriptorSorting)
 
 - (void)sortUsingDescriptors:(NSArray *)sortDescriptors
+{
+    [self _sortUsingDescriptors:sortDescriptors options:0];
+}
+
+- (void)_sortUsingDescriptors:(NSArray *)sortDescriptors options:(NSSortOptions)opts
 {
     NSUInteger count = [self count];
     if (count == 0)
@@ -303,7 +635,15 @@ static NSComparisonResult NSSortDescriptorSortComparator(id *obj1, id *obj2, NSA
     
     [self getObjects:objects range:NSMakeRange(0, count)];
 
-    CFMergeSortArray(objects, count, sizeof(id), (CFComparatorFunction)&NSSortDescriptorSortComparator, sortDescriptors);
+    @try
+    {
+        NSSortDescriptorSortObjects(objects, count, sortDescriptors, opts);
+    }
+    @catch (NSException *exception)
+    {
+        free(objects);
+        @throw;
+    }
     NSArray *sorted = [[NSArray alloc] initWithObjects:objects count:count];
     free(objects);
     [self setArray:sorted];
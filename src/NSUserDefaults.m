@@ -8,12 +8,16 @@
 #import <CoreFoundation/CFPreferences.h>
 #include "ForFoundationOnly.h"
 #import <Foundation/NSUserDefaults.h>
+#import <Foundation/NSUserDefaults_Private.h>
 #import <Foundation/NSPathUtilities.h>
 #import <Foundation/NSDictionary.h>
+#import <Foundation/NSNull.h>
+#import <Foundation/NSSet.h>
 #import <Foundation/NSNotification.h>
 #import <Foundation/NSURL.h>
 #import <Foundation/NSKeyedArchiver.h>
 #import "NSObjectInternal.h"
+#import <libkern/OSAtomic.h>
 #import <pthread.h>
 #include <stdlib.h>
 
@@ -28,7 +32,37 @@ static dispatch_queue_t notificationQueue;
 
 static pthread_mutex_t defaultsLock = PTHREAD_MUTEX_INITIALIZER;
 
+// Batches opened on the current thread, innermost first. Each record lives on
+// the stack of -_performBatchUpdates:.
+struct NSUserDefaultsBatch {
+    NSUserDefaults *defaults;
+    BOOL changed;
+    struct NSUserDefaultsBatch *outer;
+};
+static pthread_key_t batchKey;
+
+// Readers first look a key up in a per-instance cache of resolved values
+// (NSNull for keys that resolved to nothing). A miss resolves the key the
+// way CFPreferences sees it: argument domain, then CFPreferencesCopyAppValue
+// with its full search list, then the registration domain. Any change to one
+// of those sources bumps defaultsGeneration, which empties every cache on
+// its next use. valuesLock only guards the cache dictionaries.
+//
+// CoreFoundation does not report changes made directly through
+// CFPreferencesSetAppValue and friends, so those stay invisible to readers
+// of an already cached key until -synchronize or the periodic sync timer
+// bumps the generation.
+static volatile int32_t defaultsGeneration = 0;
+static OSSpinLock valuesLock = OS_SPINLOCK_INIT;
+
+// Suites added to the current application. CFPreferences applies them to
+// every instance reading kCFPreferencesCurrentApplication, whichever
+// instance added them. Only touched on synchronizeQueue.
+static NSMutableArray *applicationSuites = nil;
+
 #define SYNC_INTERVAL 30
+// Seconds between the first unsaved change and writing it out.
+#define SYNC_DELAY 1
 
 #define APP_NAME (self->_suiteName != nil ? (CFStringRef) self->_suiteName : kCFPreferencesCurrentApplication)
 
@@ -38,11 +72,175 @@ static void initQueues() {
     dispatch_once(&onceToken, ^{
         synchronizeQueue = dispatch_queue_create("com.apportable.synchronize.userdefaults", NULL);
         notificationQueue = dispatch_queue_create("com.apportable.notify.userdefaults", NULL);
+        pthread_key_create(&batchKey, NULL);
     });
 };
 
 @implementation NSUserDefaults (NSUserDefaults)
 
+static void NSUserDefaultsSourcesChanged(void)
+{
+    OSAtomicIncrement32Barrier(&defaultsGeneration);
+}
+
+// Returns the value for key retained, or nil.
+static id NSUserDefaultsCopyValue(NSUserDefaults *self, NSString *key)
+{
+    if (key == nil)
+    {
+        return nil;
+    }
+
+    int32_t generation = defaultsGeneration;
+    OSMemoryBarrier();
+
+    id value = nil;
+    OSSpinLockLock(&valuesLock);
+    if (self->_valuesGeneration == generation)
+    {
+        value = [[self->_values objectForKey:key] retain];
+    }
+    OSSpinLockUnlock(&valuesLock);
+    if (value != nil)
+    {
+        if (value == [NSNull null])
+        {
+            [value release];
+            return nil;
+        }
+        return value;
+    }
+
+    @synchronized (self->_volatileDomains) {
+        value = [self->_volatileDomains[NSArgumentDomain][key] retain];
+    }
+    if (value == nil)
+    {
+        __block id prefsValue = nil;
+        dispatch_sync(synchronizeQueue, ^{
+            prefsValue = (id)CFPreferencesCopyAppValue((CFStringRef)key, APP_NAME);
+        });
+        value = prefsValue;
+    }
+    if (value == nil)
+    {
+        @synchronized (self->_volatileDomains) {
+            value = [self->_volatileDomains[NSRegistrationDomain][key] retain];
+        }
+    }
+
+    // Only remember the value if nothing changed while it was looked up.
+    NSMutableDictionary *stale = nil;
+    OSSpinLockLock(&valuesLock);
+    if (defaultsGeneration == generation)
+    {
+        if (self->_valuesGeneration != generation)
+        {
+            stale = self->_values;
+            self->_values = nil;
+            self->_valuesGeneration = generation;
+        }
+        if (self->_values == nil)
+        {
+            self->_values = [[NSMutableDictionary alloc] init];
+        }
+        [self->_values setObject:value != nil ? value : [NSNull null] forKey:key];
+    }
+    OSSpinLockUnlock(&valuesLock);
+    [stale release];
+    return value;
+}
+
+static void NSUserDefaultsCollectKeys(NSMutableSet *keys, CFStringRef appName)
+{
+    CFStringRef users[] = { kCFPreferencesCurrentUser, kCFPreferencesAnyUser };
+    CFStringRef hosts[] = { kCFPreferencesCurrentHost, kCFPreferencesAnyHost };
+    for (int user = 0; user < 2; user++)
+    {
+        for (int host = 0; host < 2; host++)
+        {
+            NSArray *domainKeys = (NSArray *)CFPreferencesCopyKeyList(appName, users[user], hosts[host]);
+            if (domainKeys != nil)
+            {
+                [keys addObjectsFromArray:domainKeys];
+                [domainKeys release];
+            }
+        }
+    }
+}
+
+// One notification is posted on notificationQueue for everything that
+// changed before it runs.
+static void NSUserDefaultsPostDidChange(NSUserDefaults *self)
+{
+    if (!OSAtomicCompareAndSwap32Barrier(0, 1, &self->_notificationScheduled))
+    {
+        return;
+    }
+    dispatch_async(notificationQueue, ^{
+        OSAtomicCompareAndSwap32Barrier(1, 0, &self->_notificationScheduled);
+        if (OSAtomicCompareAndSwap32Barrier(1, 0, &self->_changesPending))
+        {
+            [[NSNotificationCenter defaultCenter] postNotificationName:NSUserDefaultsDidChangeNotification object:self userInfo:nil];
+        }
+    });
+}
+
+static struct NSUserDefaultsBatch *NSUserDefaultsCurrentBatch(NSUserDefaults *self)
+{
+    for (struct NSUserDefaultsBatch *batch = pthread_getspecific(batchKey); batch != NULL; batch = batch->outer)
+    {
+        if (batch->defaults == self)
+        {
+            return batch;
+        }
+    }
+    return NULL;
+}
+
+// Must be called on the thread that made the change. Changes made inside a
+// batch are held in the batch record, so a notification queued before the
+// batch opened cannot announce them early.
+static void NSUserDefaultsDidChange(NSUserDefaults *self)
+{
+    struct NSUserDefaultsBatch *batch = NSUserDefaultsCurrentBatch(self);
+    if (batch != NULL)
+    {
+        batch->changed = YES;
+        return;
+    }
+    OSAtomicCompareAndSwap32Barrier(0, 1, &self->_changesPending);
+    NSUserDefaultsPostDidChange(self);
+}
+
+// Must be called on synchronizeQueue. The first change after a write moves
+// the sync timer up to SYNC_DELAY from now; later changes ride along with
+// it until that deadline passes.
+static void NSUserDefaultsScheduleSync(NSUserDefaults *self)
+{
+    dispatch_time_t now = dispatch_time(DISPATCH_TIME_NOW, 0);
+    if (self->_syncDeadline > now)
+    {
+        return;
+    }
+    self->_syncDeadline = dispatch_time(now, SYNC_DELAY * NSEC_PER_SEC);
+    dispatch_source_set_timer(self->_synchronizeTimer, self->_syncDeadline, SYNC_INTERVAL * NSEC_PER_SEC, 0);
+}
+
+// The typed getters take the value without autoreleasing it, unless a
+// subclass overrides -objectForKey:. The value stays valid until *owner is
+// released.
+static id NSUserDefaultsBorrowValue(NSUserDefaults *self, NSString *key, id *owner)
+{
+    if (self->_overridesObjectForKey)
+    {
+        *owner = nil;
+        return [self objectForKey:key];
+    }
+    *owner = NSUserDefaultsCopyValue(self, key);
+    return *owner;
+}
+
 + (NSUserDefaults *)standardUserDefaults
 {
     pthread_mutex_lock(&defaultsLock);
@@ -74,6 +272,7 @@ static void initQueues() {
 
     _suiteName = [name copy];
     _volatileDomains = [[NSMutableDictionary alloc] init];
+    _overridesObjectForKey = [self methodForSelector:@selector(objectForKey:)] != [NSUserDefaults instanceMethodForSelector:@selector(objectForKey:)];
     _synchronizeTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, synchronizeQueue);
 
     // set interval
@@ -82,6 +281,7 @@ static void initQueues() {
     NSString* appName = APP_NAME;
     dispatch_source_set_event_handler(_synchronizeTimer, ^{
         CFPreferencesAppSynchronize(appName);
+        NSUserDefaultsSourcesChanged();
     });
 
     // now that the timer is set up, start it up
@@ -104,6 +304,7 @@ static void initQueues() {
 
     [_suiteName release];
     [_volatileDomains release];
+    [_values release];
     [super dealloc];
 }
 
@@ -139,22 +340,7 @@ static void initQueues() {
 
 - (id)objectForKey:(NSString *)key
 {
-    __block id value = nil;
-
-    value = [self volatileDomainForName: NSArgumentDomain][key];
-    if (value != nil) {
-        return value;
-    }
-
-    dispatch_sync(synchronizeQueue, ^{
-        value = [[(id)CFPreferencesCopyAppValue((CFStringRef)key, APP_NAME) retain] autorelease];
-    });
-    if (value != nil) {
-        return value;
-    }
-
-    value = [self volatileDomainForName: NSRegistrationDomain][key];
-    return value;
+    return [NSUserDefaultsCopyValue(self, key) autorelease];
 }
 
 - (void)setObject:(id)value forKey:(NSString *)key
@@ -179,10 +365,11 @@ static void initQueues() {
     [self willChangeValueForKey:key];
     dispatch_sync(synchronizeQueue, ^{
         CFPreferencesSetAppValue((CFStringRef)key, (CFTypeRef)value, APP_NAME);
-        dispatch_async(notificationQueue, ^{
-            [[NSNotificationCenter defaultCenter] postNotificationName:NSUserDefaultsDidChangeNotification object:self userInfo:nil];
-        });
+        // Cached values are dropped lazily on the next read.
+        NSUserDefaultsSourcesChanged();
+        NSUserDefaultsScheduleSync(self);
     });
+    NSUserDefaultsDidChange(self);
     [self didChangeValueForKey:key];
 }
 
@@ -282,42 +469,58 @@ static void initQueues() {
 
 - (NSInteger)integerForKey:(NSString *)key
 {
-    id value = [self objectForKey:key];
+    id owner = nil;
+    id value = NSUserDefaultsBorrowValue(self, key, &owner);
+    NSInteger result = 0;
     if ([value isNSString__] || [value isNSNumber__])
     {
-        return [value integerValue];
+        result = [value integerValue];
     }
-    return 0;
+    [owner release];
+    return result;
 }
 
 - (float)floatForKey:(NSString *)key
 {
-    id value = [self objectForKey:key];
+    id owner = nil;
+    id value = NSUserDefaultsBorrowValue(self, key, &owner);
+    float result = 0.0f;
     if ([value isNSString__] || [value isNSNumber__])
     {
-        return [value floatValue];
+        result = [value floatValue];
     }
-    return 0.0f;
+    [owner release];
+    return result;
 }
 
 - (double)doubleForKey:(NSString *)key
 {
-    id value = [self objectForKey:key];
+    id owner = nil;
+    id value = NSUserDefaultsBorrowValue(self, key, &owner);
+    double result = 0.0;
     if ([value isNSString__] || [value isNSNumber__])
     {
-        return [value doubleValue];
+        result = [value doubleValue];
     }
-    return 0.0f;
+    [owner release];
+    return result;
 }
 
 - (BOOL)boolForKey:(NSString *)key
 {
-    id value = [self objectForKey:key];
-    if ([value isNSString__] || [value isNSNumber__])
+    id owner = nil;
+    id value = NSUserDefaultsBorrowValue(self, key, &owner);
+    BOOL result = NO;
+    if (value == (id)kCFBooleanTrue)
+    {
+        result = YES;
+    }
+    else if (value != (id)kCFBooleanFalse && ([value isNSString__] || [value isNSNumber__]))
     {
-        return [value boolValue]; // this is not exactly correct, but should work ok
+        result = [value boolValue]; // this is not exactly correct, but should work ok
     }
-    return 0.0f;
+    [owner release];
+    return result;
 }
 
 - (NSURL *)URLForKey:(NSString *)key
@@ -375,40 +578,48 @@ static void initQueues() {
     __block BOOL synced = NO;
     dispatch_sync(synchronizeQueue, ^{
         synced = CFPreferencesAppSynchronize(APP_NAME);
+        NSUserDefaultsSourcesChanged();
     });
     return synced;
 }
 
 - (NSDictionary *)dictionaryRepresentation
 {
-    __block NSDictionary *cfPrefs = nil;
-
-    dispatch_sync(synchronizeQueue, ^{
-        cfPrefs = (NSDictionary *) CFPreferencesCopyMultiple(
-            /* fetch all keys */ nil,
-            APP_NAME,
-            kCFPreferencesCurrentUser,
-            kCFPreferencesAnyHost
-        );
-    });
-
-    NSMutableDictionary *res = [[cfPrefs autorelease] mutableCopy];
-
-    NSDictionary *domain = [self volatileDomainForName: NSArgumentDomain];
-    for (NSString *key in domain) {
-        if (res[key] == nil) {
-            res[key] = domain[key];
+    // Gather every key the search list can see, then resolve each one so
+    // precedence is exactly what -objectForKey: reports.
+    NSMutableSet *keys = [[NSMutableSet alloc] init];
+    @synchronized (_volatileDomains) {
+        for (NSString *domainName in _volatileDomains) {
+            [keys addObjectsFromArray:[_volatileDomains[domainName] allKeys]];
         }
     }
+    dispatch_sync(synchronizeQueue, ^{
+        NSUserDefaultsCollectKeys(keys, APP_NAME);
+        if (_suiteName == nil)
+        {
+            for (NSString *suiteName in applicationSuites)
+            {
+                NSUserDefaultsCollectKeys(keys, (CFStringRef)suiteName);
+            }
+        }
+        NSUserDefaultsCollectKeys(keys, kCFPreferencesAnyApplication);
+    });
 
-    domain = [self volatileDomainForName: NSRegistrationDomain];
-    for (NSString *key in domain) {
-        if (res[key] == nil) {
-            res[key] = domain[key];
+    NSMutableDictionary *res = [[NSMutableDictionary alloc] initWithCapacity:[keys count]];
+    for (NSString *key in keys)
+    {
+        id value = NSUserDefaultsCopyValue(self, key);
+        if (value != nil)
+        {
+            res[key] = value;
+            [value release];
         }
     }
+    [keys release];
 
-    return [res autorelease];
+    NSDictionary *representation = [res copy];
+    [res release];
+    return [representation autorelease];
 }
 
 - (NSArray *) volatileDomainNames {
@@ -447,12 +658,14 @@ static void initQueues() {
         }
         _volatileDomains[domainName] = existing;
     }
+    NSUserDefaultsSourcesChanged();
 }
 
 - (void) removeVolatileDomainForName: (NSString *) domainName {
     @synchronized (_volatileDomains) {
         [_volatileDomains removeObjectForKey: domainName];
     }
+    NSUserDefaultsSourcesChanged();
 }
 
 - (NSArray *) persistentDomainNames {
@@ -486,23 +699,60 @@ static void initQueues() {
 - (void) removePersistentDomainForName: (NSString *) domainName
 {
     NSDictionary *defaultsDictionary = [self dictionaryRepresentation];
-    for (NSString *key in [defaultsDictionary allKeys]) {
-        [self removeObjectForKey:key];
-    }
+    [self _performBatchUpdates: ^{
+        for (NSString *key in [defaultsDictionary allKeys]) {
+            [self removeObjectForKey:key];
+        }
+    }];
     [self synchronize];
 }
 
 - (void) addSuiteNamed: (NSString *) suiteName {
     CFPreferencesAddSuitePreferencesToApp(kCFPreferencesCurrentApplication, (CFStringRef) suiteName);
+    dispatch_sync(synchronizeQueue, ^{
+        if (applicationSuites == nil) {
+            applicationSuites = [[NSMutableArray alloc] init];
+        }
+        [applicationSuites removeObject: suiteName];
+        [applicationSuites addObject: suiteName];
+        NSUserDefaultsSourcesChanged();
+    });
 }
 
 - (void) removeSuiteNamed: (NSString *) suiteName {
     CFPreferencesRemoveSuitePreferencesFromApp(kCFPreferencesCurrentApplication, (CFStringRef) suiteName);
+    dispatch_sync(synchronizeQueue, ^{
+        [applicationSuites removeObject: suiteName];
+        NSUserDefaultsSourcesChanged();
+    });
 }
 
 @end
 
 
+@implementation NSUserDefaults (NSUserDefaultsPrivate)
+
+- (void)_performBatchUpdates:(void (^)(void))updates
+{
+    struct NSUserDefaultsBatch batch = { self, NO, pthread_getspecific(batchKey) };
+    pthread_setspecific(batchKey, &batch);
+    @try
+    {
+        updates();
+    }
+    @finally
+    {
+        pthread_setspecific(batchKey, batch.outer);
+        // Hands the changes to an enclosing batch on self, if there is one.
+        if (batch.changed)
+        {
+            NSUserDefaultsDidChange(self);
+        }
+    }
+}
+
+@end
+
 @implementation NSUserDefaults(NSKeyValueCoding)
 
 - (id)valueForKey:(NSString *)key
@@ -19,11 +19,16 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #import <Foundation/NSAutoreleasePool.h>
 #import <Foundation/NSData.h>
+#import <Foundation/NSStream.h>
 #import <Foundation/NSMutableArray.h>
 #import <Foundation/NSMutableDictionary.h>
 #import <Foundation/NSRaise.h>
 #import <Foundation/NSXMLParser.h>
+#import <stdlib.h>
 #import <string.h>
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#endif
 
 enum {
     STATE_content,
@@ -49,13 +54,140 @@ enum {
     STATE_CDATA
 };
 
-@implementation NSXMLParser
+// Streams are read through a window of this size. The window only grows
+// when a single name or attribute value does not fit in it; long character
+// data is reported in pieces instead.
+#define NSXMLParserStreamChunk (64 * 1024)
+// The longest look-ahead the tokenizer does ("![CDATA[") plus the current
+// byte.
+#define NSXMLParserStreamLookahead 9
+
+// Element and attribute names repeat throughout a document, so the parser
+// keeps one string per distinct name, looked up by its UTF-8 bytes. The
+// table stops growing past NSXMLParserNameLimit names, after which new
+// names are allocated per use as before.
+#define NSXMLParserNameLimit 4096
+
+typedef struct {
+    NSUInteger hash;
+    NSUInteger length;
+    uint8_t *bytes;
+    NSString *string;
+} NSXMLParserName;
+
+typedef struct {
+    NSUInteger count;
+    NSUInteger capacity;
+    NSXMLParserName *entries;
+} NSXMLParserNameTable;
+
+static NSUInteger NSXMLParserNameHash(const uint8_t *bytes, NSUInteger length) {
+    NSUInteger hash = 2166136261U;
+
+    for (NSUInteger i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619U;
+    return hash;
+}
+
+static void NSXMLParserNameTableDestroy(NSXMLParserNameTable *table) {
+    if (table == NULL)
+        return;
+
+    for (NSUInteger i = 0; i < table->capacity; i++) {
+        if (table->entries[i].string != nil) {
+            free(table->entries[i].bytes);
+            [table->entries[i].string release];
+        }
+    }
+    free(table->entries);
+    free(table);
+}
 
-- (instancetype) initWithData: (NSData *) data {
-    _data = [data retain];
+static BOOL NSXMLParserNameTableGrow(NSXMLParserNameTable *table) {
+    NSUInteger capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    NSXMLParserName *entries = calloc(capacity, sizeof(NSXMLParserName));
 
-    _bytes = [data bytes];
-    _length = [data length];
+    if (entries == NULL)
+        return NO;
+
+    for (NSUInteger i = 0; i < table->capacity; i++) {
+        NSXMLParserName *entry = &table->entries[i];
+
+        if (entry->string == nil)
+            continue;
+
+        NSUInteger slot = entry->hash & (capacity - 1);
+        while (entries[slot].string != nil)
+            slot = (slot + 1) & (capacity - 1);
+        entries[slot] = *entry;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    return YES;
+}
+
+// Returns the shared string for bytes, or NULL with *slot set to where it
+// belongs when it has not been seen yet.
+static NSXMLParserName *NSXMLParserNameTableFind(NSXMLParserNameTable *table,
+                                                 const uint8_t *bytes,
+                                                 NSUInteger length,
+                                                 NSUInteger hash,
+                                                 NSUInteger *slot) {
+    NSUInteger mask = table->capacity - 1;
+    NSUInteger idx = hash & mask;
+
+    while (table->entries[idx].string != nil) {
+        NSXMLParserName *entry = &table->entries[idx];
+
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->bytes, bytes, length) == 0)
+            return entry;
+        idx = (idx + 1) & mask;
+    }
+    *slot = idx;
+    return NULL;
+}
+
+// Number of leading bytes that cannot end a run of character data.
+static inline NSUInteger contentSpan(const uint8_t *bytes, NSUInteger length) {
+    NSUInteger i = 0;
+
+#if defined(__SSE2__)
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lf = _mm_set1_epi8(0x0A);
+    const __m128i cr = _mm_set1_epi8(0x0D);
+    const __m128i tab = _mm_set1_epi8(0x09);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, lt),
+                             _mm_cmpeq_epi8(chunk, amp)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, lf),
+                                          _mm_cmpeq_epi8(chunk, cr)),
+                             _mm_cmpeq_epi8(chunk, tab)));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < length; i++) {
+        uint8_t code = bytes[i];
+
+        if (code == '<' || code == '&' || code == 0x0A || code == 0x0D ||
+            code == 0x09)
+            break;
+    }
+    return i;
+}
+
+@implementation NSXMLParser
+
+- (void) setUpParsingState {
     _range = NSMakeRange(0, 0);
 
     _entityRefContents = [NSMutableDictionary new];
@@ -67,6 +199,30 @@ enum {
 
     _state = STATE_content;
     _elementNameStack = [[NSMutableArray alloc] init];
+}
+
+- (instancetype) initWithData: (NSData *) data {
+    _data = [data retain];
+
+    _bytes = [data bytes];
+    _length = [data length];
+    [self setUpParsingState];
+
+    return self;
+}
+
+- (instancetype) initWithStream: (NSInputStream *) stream {
+    _stream = [stream retain];
+
+    _capacity = NSXMLParserStreamChunk;
+    _buffer = malloc(_capacity);
+    if (_buffer == NULL) {
+        [self dealloc];
+        return nil;
+    }
+    _bytes = _buffer;
+    _length = 0;
+    [self setUpParsingState];
 
     return self;
 }
@@ -84,9 +240,18 @@ enum {
 
 - (void) dealloc {
     [_data release];
+    [_stream release];
+    free(_buffer);
     [_entityRefContents release];
     [_elementNameStack release];
-    [_currentAttributes release];
+    [_currentAttributeName release];
+    for (NSUInteger i = 0; i < _attributeCount; i++) {
+        [_attributeNames[i] release];
+        [_attributeValues[i] release];
+    }
+    free(_attributeNames);
+    free(_attributeValues);
+    NSXMLParserNameTableDestroy(_names);
     [super dealloc];
 }
 
@@ -106,8 +271,26 @@ enum {
     return _shouldResolveExternalEntities;
 }
 
+static IMP delegateMethod(id delegate, SEL selector) {
+    if ([delegate respondsToSelector: selector])
+        return [delegate methodForSelector: selector];
+    return NULL;
+}
+
 - (void) setDelegate: delegate {
     _delegate = delegate;
+
+    _foundCharacters =
+            delegateMethod(delegate, @selector(parser:foundCharacters:));
+    _foundIgnorableWhitespace = delegateMethod(
+            delegate, @selector(parser:foundIgnorableWhitespace:));
+    _didStartElement = delegateMethod(
+            delegate,
+            @selector(parser:
+                    didStartElement:namespaceURI:qualifiedName:attributes:));
+    _didEndElement = delegateMethod(
+            delegate,
+            @selector(parser:didEndElement:namespaceURI:qualifiedName:));
 }
 
 - (void) setShouldProcessNamespaces: (BOOL) flag {
@@ -128,33 +311,83 @@ enum {
                                   encoding: NSUTF8StringEncoding];
 }
 
+// Returns the shared string for the name in _range. It is owned by the
+// parser, so callers must retain it to keep it.
+- (NSString *) internedString {
+    NSXMLParserNameTable *table = _names;
+
+    if (table == NULL) {
+        table = calloc(1, sizeof(NSXMLParserNameTable));
+        if (table == NULL || !NSXMLParserNameTableGrow(table)) {
+            free(table);
+            return [self currentString];
+        }
+        _names = table;
+    }
+
+    const uint8_t *bytes = _bytes + _range.location;
+    NSUInteger length = _range.length;
+    NSUInteger hash = NSXMLParserNameHash(bytes, length);
+    NSUInteger slot;
+    NSXMLParserName *entry =
+            NSXMLParserNameTableFind(table, bytes, length, hash, &slot);
+
+    if (entry != NULL)
+        return entry->string;
+
+    if (table->count >= NSXMLParserNameLimit)
+        return [self currentString];
+
+    NSString *string = [self createCurrentString];
+    uint8_t *copy = malloc(length > 0 ? length : 1);
+
+    if (string == nil || copy == NULL) {
+        free(copy);
+        return [string autorelease];
+    }
+    memcpy(copy, bytes, length);
+
+    if ((table->count + 1) * 2 > table->capacity) {
+        if (!NSXMLParserNameTableGrow(table)) {
+            free(copy);
+            return [string autorelease];
+        }
+        NSXMLParserNameTableFind(table, bytes, length, hash, &slot);
+    }
+
+    table->entries[slot].hash = hash;
+    table->entries[slot].length = length;
+    table->entries[slot].bytes = copy;
+    table->entries[slot].string = string;
+    table->count++;
+    return string;
+}
+
 - (void) content: (NSString *) string {
-    if ([_delegate respondsToSelector: @selector(parser:foundCharacters:)])
-        [_delegate parser: self foundCharacters: string];
+    if (_foundCharacters != NULL)
+        ((void (*)(id, SEL, NSXMLParser *, NSString *)) _foundCharacters)(
+                _delegate, @selector(parser:foundCharacters:), self, string);
 }
 
 - (void) ignoreableWhitespace: (NSString *) string {
-    if ([_delegate respondsToSelector: @selector(parser:
-                                               foundIgnorableWhitespace:)])
-        [_delegate parser: self foundIgnorableWhitespace: string];
+    if (_foundIgnorableWhitespace != NULL)
+        ((void (*)(id, SEL, NSXMLParser *, NSString *))
+                 _foundIgnorableWhitespace)(
+                _delegate, @selector(parser:foundIgnorableWhitespace:), self,
+                string);
 }
 
 - (void) charRef: (NSString *) charRef {
-    if ([_delegate respondsToSelector: @selector(parser:foundCharacters:)])
-        [_delegate parser: self foundCharacters: charRef];
+    [self content: charRef];
 }
 
 - (void) entityRef: (NSString *) entityRef {
-    NSString *key = [self createCurrentString];
-    NSString *contents = [_entityRefContents objectForKey: key];
-
-    if (contents != nil) {
-        if ([_delegate respondsToSelector: @selector(parser:foundCharacters:)])
-            [_delegate parser: self foundCharacters: contents];
-    } else
-        NSLog(@"unknown entity=%@", key);
+    NSString *contents = [_entityRefContents objectForKey: entityRef];
 
-    [key release];
+    if (contents != nil)
+        [self content: contents];
+    else
+        NSLog(@"unknown entity=%@", entityRef);
 }
 
 - (void) sTag: (NSString *) sTag {
@@ -163,27 +396,39 @@ enum {
 
 - (void) didStartElement {
     NSString *elementName = [_elementNameStack lastObject];
-
-    if ([_delegate respondsToSelector: @selector
-                   (parser:
-                           didStartElement:namespaceURI:qualifiedName:attributes
-                                          :)])
-        [_delegate parser: self
-                didStartElement: elementName
-                   namespaceURI: nil
-                  qualifiedName: nil
-                     attributes: _currentAttributes];
-
-    [_currentAttributes release];
-    _currentAttributes = nil;
+    NSDictionary *attributes = nil;
+
+    if (_attributeCount > 0)
+        attributes = [[NSDictionary alloc] initWithObjects: _attributeValues
+                                                   forKeys: _attributeNames
+                                                     count: _attributeCount];
+
+    if (_didStartElement != NULL)
+        ((void (*)(id, SEL, NSXMLParser *, NSString *, NSString *, NSString *,
+                   NSDictionary *)) _didStartElement)(
+                _delegate,
+                @selector(parser:
+                        didStartElement:namespaceURI:qualifiedName:attributes
+                                       :),
+                self, elementName, nil, nil, attributes);
+
+    [attributes release];
+    for (NSUInteger i = 0; i < _attributeCount; i++) {
+        [_attributeNames[i] release];
+        [_attributeValues[i] release];
+    }
+    _attributeCount = 0;
 }
 
 - (void) didEndElement {
     NSString *elementName = [_elementNameStack lastObject];
-    [_delegate parser: self
-            didEndElement: elementName
-             namespaceURI: nil
-            qualifiedName: nil];
+
+    if (_didEndElement != NULL)
+        ((void (*)(id, SEL, NSXMLParser *, NSString *, NSString *,
+                   NSString *)) _didEndElement)(
+                _delegate,
+                @selector(parser:didEndElement:namespaceURI:qualifiedName:),
+                self, elementName, nil, nil);
     [_elementNameStack removeLastObject];
 }
 
@@ -193,16 +438,33 @@ enum {
 }
 
 - (void) attributeName: (NSString *) name {
-    _currentAttributeName = [name copy];
+    [_currentAttributeName release];
+    _currentAttributeName = [name retain];
 }
 
 - (void) attributeValue: (NSString *) value {
-    if (_currentAttributes == nil)
-        _currentAttributes = [[NSMutableDictionary alloc] init];
+    if (_attributeCount == _attributeCapacity) {
+        NSUInteger capacity =
+                _attributeCapacity == 0 ? 8 : _attributeCapacity * 2;
+        id *names = realloc(_attributeNames, capacity * sizeof(id));
 
-    [_currentAttributes setObject: value forKey: _currentAttributeName];
+        if (names != NULL)
+            _attributeNames = names;
 
-    [_currentAttributeName release];
+        id *values = realloc(_attributeValues, capacity * sizeof(id));
+
+        if (values != NULL)
+            _attributeValues = values;
+
+        if (names == NULL || values == NULL)
+            [NSException raise: NSMallocException
+                        format: @"Unable to grow XML attribute buffer"];
+        _attributeCapacity = capacity;
+    }
+
+    _attributeNames[_attributeCount] = _currentAttributeName;
+    _attributeValues[_attributeCount] = [value retain];
+    _attributeCount++;
     _currentAttributeName = nil;
 }
 
@@ -248,11 +510,117 @@ static inline BOOL codeIsNameContinue(uint8_t code) {
                         state, position];
 }
 
+// Length of the longest prefix of _range that ends on a UTF-8 character
+// boundary, so a piece of character data can be reported on its own.
+- (NSUInteger) completeUTF8Length {
+    NSUInteger end = NSMaxRange(_range);
+    NSUInteger start = end;
+
+    while (start > _range.location && end - start < 4 &&
+           (_bytes[start - 1] & 0xC0) == 0x80)
+        start--;
+
+    if (start > _range.location && _bytes[start - 1] >= 0xC0) {
+        uint8_t lead = _bytes[start - 1];
+        NSUInteger needed = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+
+        if (end - (start - 1) < needed)
+            return start - 1 - _range.location;
+    }
+    return _range.length;
+}
+
+// Reports the pending character data when it takes up at least half the
+// window, so that compacting the window frees enough room to keep reading.
+- (void) flushPartialContent {
+    if (_range.length < _capacity / 2)
+        return;
+    if (_state != STATE_content && _state != STATE_ignoreable_content &&
+        _state != STATE_CDATA)
+        return;
+
+    NSUInteger pending = _range.length;
+    NSUInteger length = [self completeUTF8Length];
+
+    if (length == 0)
+        return;
+
+    _range.length = length;
+    if (_state == STATE_ignoreable_content)
+        [self ignoreableWhitespace: [self currentString]];
+    else
+        [self content: [self currentString]];
+    _range.location += length;
+    _range.length = pending - length;
+}
+
+// Moves the unfinished token to the front of the window and reads from the
+// stream until there is enough look-ahead or the stream ends.
+- (BOOL) fillStreamBuffer {
+    [self flushPartialContent];
+
+    if (_range.location > 0) {
+        memmove(_buffer, _buffer + _range.location, _length - _range.location);
+        _length -= _range.location;
+        _range.location = 0;
+    }
+
+    while (!_streamAtEnd &&
+           NSMaxRange(_range) + NSXMLParserStreamLookahead > _length) {
+        if (_length == _capacity) {
+            uint8_t *buffer = realloc(_buffer, _capacity * 2);
+
+            if (buffer == NULL) {
+                [NSException raise: NSMallocException
+                            format: @"Unable to grow XML parser buffer"];
+                return NO;
+            }
+            _buffer = buffer;
+            _capacity *= 2;
+        }
+
+        NSInteger count = [_stream read: _buffer + _length
+                              maxLength: _capacity - _length];
+
+        if (count < 0) {
+            [_parserError release];
+            _parserError = [[_stream streamError] retain];
+            return NO;
+        }
+        if (count == 0)
+            _streamAtEnd = YES;
+        _length += count;
+    }
+
+    _bytes = _buffer;
+    return YES;
+}
+
 - (BOOL) parse {
     int createNewPool = 0;
     NSAutoreleasePool *pool = nil;
 
-    while (NSMaxRange(_range) < _length) {
+    if (_stream != nil && [_stream streamStatus] == NSStreamStatusNotOpen)
+        [_stream open];
+
+    while (YES) {
+        if (_stream != nil && !_streamAtEnd &&
+            NSMaxRange(_range) + NSXMLParserStreamLookahead > _length) {
+            if (![self fillStreamBuffer]) {
+                [pool release];
+                [_stream close];
+                return NO;
+            }
+        }
+        if (NSMaxRange(_range) >= _length)
+            break;
+
+        if (_state == STATE_content) {
+            _range.length += contentSpan(_bytes + NSMaxRange(_range),
+                                         _length - NSMaxRange(_range));
+            if (NSMaxRange(_range) >= _length)
+                continue;
+        }
 
         if (pool == nil)
             pool = [NSAutoreleasePool new];
@@ -364,7 +732,7 @@ static inline BOOL codeIsNameContinue(uint8_t code) {
             if (codeIsNameContinue(code))
                 _state = STATE_EntityRef_Name;
             else if (code == ';') {
-                [self entityRef: [self currentString]];
+                [self entityRef: [self internedString]];
                 _state = STATE_content;
                 rangeAction = advanceLocationToNext;
             } else {
@@ -425,7 +793,7 @@ static inline BOOL codeIsNameContinue(uint8_t code) {
             if (codeIsNameContinue(code))
                 _state = STATE_STag;
             else {
-                [self sTag: [self currentString]];
+                [self sTag: [self internedString]];
                 _state = STATE_Attributes;
                 rangeAction = advanceLocationToCurrent;
             }
@@ -435,7 +803,7 @@ static inline BOOL codeIsNameContinue(uint8_t code) {
             if (codeIsNameContinue(code))
                 _state = STATE_ETag;
             else {
-                [self eTag: [self currentString]];
+                [self eTag: [self internedString]];
                 _state = STATE_ETag_whitespace;
                 rangeAction = advanceLocationToCurrent;
             }
@@ -484,7 +852,7 @@ static inline BOOL codeIsNameContinue(uint8_t code) {
             if (codeIsNameContinue(code))
                 _state = STATE_Attribute_Name;
             else {
-                [self attributeName: [self currentString]];
+                [self attributeName: [self internedString]];
                 _state = STATE_Attribute_Name_whitespace;
                 rangeAction = advanceLocationToCurrent;
             }
@@ -558,6 +926,10 @@ static inline BOOL codeIsNameContinue(uint8_t code) {
             pool = nil;
         }
     }
+    [pool release];
+
+    if (_stream != nil)
+        [_stream close];
     return YES;
 }
 
@@ -37,6 +37,9 @@
 @implementation NSXPCDecoder
 
 - (void) _startReadingFromXPCObject: (xpc_object_t) object {
+    // Drop key indexes that refer to a previous message.
+    _NSXPCSerializationEndRead(&_deserializer);
+
     BOOL success = _NSXPCSerializationStartRead(
         object,
         &_deserializer,
@@ -58,6 +61,14 @@
     _collection = &_rootObject;
 }
 
+- (void) dealloc {
+    _NSXPCSerializationEndRead(&_deserializer);
+    if (_oolObjects != NULL) {
+        xpc_release(_oolObjects);
+    }
+    [super dealloc];
+}
+
 - (BOOL) allowsKeyedCoding {
     return YES;
 }
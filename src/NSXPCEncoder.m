@@ -91,6 +91,14 @@ static Class _XPCObjectClass = nil;
     return self;
 }
 
+- (void) dealloc {
+    _NSXPCSerializationDiscardWrite(&_serializer);
+    if (_oolObjects != NULL) {
+        xpc_release(_oolObjects);
+    }
+    [super dealloc];
+}
+
 - (BOOL) allowsKeyedCoding {
     return YES;
 }
@@ -1,5 +1,6 @@
 #include "NSXPCSerialization.h"
 #include <assert.h>
+#include <pthread.h>
 
 /**
  * An overview of NSXPC's serialization format
@@ -63,6 +64,73 @@ static CFIndex currentOffset(struct NSXPCSerializer *serializer) {
     return serializer->ptr - serializer->buffer;
 }
 
+/**
+ * Serializer buffer pool
+ * ----------------------
+ *
+ * Messages that outgrow the encoder's stack space get a heap buffer, which is
+ * then handed over to the xpc_data object without copying it. Once XPC is done
+ * with the data, its destructor runs on a global queue and puts the buffer back
+ * into a small process-wide pool, so the next large message, on whichever thread
+ * encodes it, starts out with a buffer that is already big enough instead of
+ * growing one from scratch.
+ */
+
+// Buffers larger than this are freed instead of being kept around.
+#define NSXPC_SERIALIZER_POOL_MAX_BUFFER_SIZE (1024 * 1024)
+#define NSXPC_SERIALIZER_POOL_SLOTS 4
+
+struct NSXPCSerializerPooledBuffer {
+    unsigned char *buffer;
+    CFIndex size;
+};
+
+static struct NSXPCSerializerPooledBuffer pooledBuffers[NSXPC_SERIALIZER_POOL_SLOTS];
+static pthread_mutex_t pooledBuffersLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Takes the smallest pooled buffer that is at least `size` bytes long.
+static unsigned char *takePooledBuffer(CFIndex size, CFIndex *outSize) {
+    unsigned char *buffer = NULL;
+    pthread_mutex_lock(&pooledBuffersLock);
+    struct NSXPCSerializerPooledBuffer *best = NULL;
+    for (int i = 0; i < NSXPC_SERIALIZER_POOL_SLOTS; i++) {
+        struct NSXPCSerializerPooledBuffer *pooled = &pooledBuffers[i];
+        if (pooled->buffer != NULL && pooled->size >= size && (best == NULL || pooled->size < best->size)) {
+            best = pooled;
+        }
+    }
+    if (best != NULL) {
+        buffer = best->buffer;
+        *outSize = best->size;
+        best->buffer = NULL;
+        best->size = 0;
+    }
+    pthread_mutex_unlock(&pooledBuffersLock);
+    return buffer;
+}
+
+static void returnPooledBuffer(unsigned char *buffer, CFIndex size) {
+    if (size <= NSXPC_SERIALIZER_POOL_MAX_BUFFER_SIZE) {
+        pthread_mutex_lock(&pooledBuffersLock);
+        // fill an empty slot, or else replace the smallest buffer if this one is larger
+        struct NSXPCSerializerPooledBuffer *slot = NULL;
+        for (int i = 0; i < NSXPC_SERIALIZER_POOL_SLOTS; i++) {
+            struct NSXPCSerializerPooledBuffer *pooled = &pooledBuffers[i];
+            if (slot == NULL || pooled->size < slot->size) {
+                slot = pooled;
+            }
+        }
+        if (slot->size < size) {
+            unsigned char *evicted = slot->buffer;
+            slot->buffer = buffer;
+            slot->size = size;
+            buffer = evicted;
+        }
+        pthread_mutex_unlock(&pooledBuffersLock);
+    }
+    free(buffer);
+}
+
 static void ensureSpace(
     struct NSXPCSerializer *serializer,
     size_t additionalSize
@@ -82,7 +150,13 @@ static void ensureSpace(
         serializer->buffer = realloc(serializer->buffer, newSize);
         assert(serializer->buffer);
     } else {
-        unsigned char *newBuffer = malloc(newSize);
+        CFIndex pooledSize;
+        unsigned char *newBuffer = takePooledBuffer(newSize, &pooledSize);
+        if (newBuffer != NULL) {
+            newSize = pooledSize;
+        } else {
+            newBuffer = malloc(newSize);
+        }
         assert(newBuffer);
         if (usedSize > 0) {
             memcpy(newBuffer, serializer->buffer, usedSize);
@@ -363,15 +437,27 @@ xpc_object_t _NSXPCSerializationCreateWriteData(
     // the data by going through the dispatch_data_t,
     // which does have such a constrctor. It will still copy
     // the data when we pass DISPATCH_DATA_DESTRUCTOR_DEFAULT,
-    // though.
-    dispatch_data_t dispatch_data = dispatch_data_create(
-        serializer->buffer,
-        currentOffset(serializer),
-        NULL, /* not used with any of the two destrctors we pass */
-        serializer->bufferIsMalloced
-            ? DISPATCH_DATA_DESTRUCTOR_FREE
-            : DISPATCH_DATA_DESTRUCTOR_DEFAULT
-    );
+    // though, which we only do for the encoder's stack space.
+    dispatch_data_t dispatch_data;
+    if (serializer->bufferIsMalloced) {
+        unsigned char *buffer = serializer->buffer;
+        CFIndex bufferSize = serializer->bufferSize;
+        dispatch_data = dispatch_data_create(
+            buffer,
+            currentOffset(serializer),
+            NULL, /* destructor runs on a default-priority global queue */
+            ^{
+                returnPooledBuffer(buffer, bufferSize);
+            }
+        );
+    } else {
+        dispatch_data = dispatch_data_create(
+            serializer->buffer,
+            currentOffset(serializer),
+            NULL, /* not used with the default destructor */
+            DISPATCH_DATA_DESTRUCTOR_DEFAULT
+        );
+    }
     xpc_object_t xpc_data = xpc_data_create_with_dispatch_data(dispatch_data);
     dispatch_release(dispatch_data);
 
@@ -381,6 +467,15 @@ xpc_object_t _NSXPCSerializationCreateWriteData(
     return xpc_data;
 }
 
+void _NSXPCSerializationDiscardWrite(
+    struct NSXPCSerializer *serializer
+) {
+    if (serializer->bufferIsMalloced) {
+        returnPooledBuffer(serializer->buffer, serializer->bufferSize);
+    }
+    memset(serializer, 0, sizeof(*serializer));
+}
+
 
 static Boolean validateRead(
     struct NSXPCDeserializer *deserializer,
@@ -429,6 +524,7 @@ Boolean _NSXPCSerializationStartRead(
 
     deserializer->buffer = (unsigned char *) data;
     deserializer->bufferSize = length;
+    deserializer->dictionaryIndexes = NULL;
 
     rootObject->offset = HEADER_LENGTH;
 
@@ -851,33 +947,301 @@ void _NSXPCSerializationIterateDictionaryObject(
     }
 }
 
-Boolean _NSXPCSerializationCreateObjectInDictionaryForKey(
+/**
+ * Dictionary key indexes
+ * ----------------------
+ *
+ * Finding a key in a serialized dictionary means walking every entry before it,
+ * so decoding an object with N keys used to take O(N^2). Instead, the first time
+ * a dictionary is probed for a string key we walk it once and build a small open
+ * addressing hash table mapping its keys to the offsets of their values. Later
+ * probes of the same dictionary are then answered from the table.
+ *
+ * Keys are hashed and compared as UTF-16 code units, so that ASCII and UTF-16
+ * encoded keys with the same contents are interchangeable.
+ */
+
+struct NSXPCDictionaryIndexEntry {
+    // Zero marks an empty slot; no object can start inside the header.
+    CFIndex keyOffset;
+    CFIndex valueOffset;
+    uint32_t hash;
+};
+
+struct NSXPCDictionaryIndex {
+    CFIndex mask;
+    struct NSXPCDictionaryIndexEntry entries[];
+};
+
+#define NSXPC_KEY_STACK_LENGTH 64
+
+static Boolean keyUnitsForObject(
     struct NSXPCDeserializer *deserializer,
-    const struct NSXPCObject *object,
-    CFStringRef key,
-    struct NSXPCObject *value
+    const struct NSXPCObject *key,
+    const unsigned char **units,
+    CFIndex *count,
+    Boolean *wide
 ) {
-    __block Boolean found = false;
+    unsigned char marker;
+    CFIndex dataOffset;
+    CFIndex length = decodeLength(deserializer, key, &marker, &dataOffset);
+    if (length < 0) {
+        return false;
+    }
+
+    switch (marker) {
+    case NSXPC_ASCII:
+        if (length == 0 || deserializer->buffer[dataOffset + length - 1] != 0) {
+            return false;
+        }
+        // Leave out the null terminator.
+        *count = length - 1;
+        *wide = false;
+        break;
+
+    case NSXPC_STRING:
+        if (!validateRead(deserializer, dataOffset, 2 * length)) {
+            return false;
+        }
+        *count = length;
+        *wide = true;
+        break;
+
+    default:
+        return false;
+    }
+
+    *units = &deserializer->buffer[dataOffset];
+    return true;
+}
+
+static inline UniChar keyUnitAtIndex(
+    const unsigned char *units,
+    CFIndex index,
+    Boolean wide
+) {
+    if (!wide) {
+        return units[index];
+    }
+    // UTF-16 keys are not necessarily aligned within the message.
+    UniChar unit;
+    memcpy(&unit, &units[2 * index], sizeof(unit));
+    return unit;
+}
+
+static uint32_t hashKeyUnits(
+    const unsigned char *units,
+    CFIndex count,
+    Boolean wide
+) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (CFIndex i = 0; i < count; i++) {
+        hash ^= keyUnitAtIndex(units, i, wide);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static Boolean keyUnitsEqual(
+    const unsigned char *units,
+    CFIndex count,
+    Boolean wide,
+    const UniChar *characters,
+    CFIndex length
+) {
+    if (count != length) {
+        return false;
+    }
+    for (CFIndex i = 0; i < count; i++) {
+        if (keyUnitAtIndex(units, i, wide) != characters[i]) {
+            return false;
+        }
+    }
+    return true;
+}
 
+static struct NSXPCDictionaryIndex *buildDictionaryIndex(
+    struct NSXPCDeserializer *deserializer,
+    const struct NSXPCObject *object
+) {
+    __block CFIndex count = 0;
+    Boolean isDictionary = false;
     _NSXPCSerializationIterateDictionaryObject(deserializer, object, ^Boolean(
         const struct NSXPCObject *aKey,
         const struct NSXPCObject *aValue
     ) {
-        CFStringRef thisKey = _NSXPCSerializationStringForObject(
-            deserializer,
-            aKey
+        ++count;
+        return true;
+    });
+    // An empty dictionary and a non-dictionary look the same above.
+    unsigned char marker;
+    if (validateAndRead(deserializer, object->offset, 1, &marker)) {
+        isDictionary = marker == NSXPC_DICT;
+    }
+    if (!isDictionary) {
+        return NULL;
+    }
+
+    // Keep the load factor at or below one half.
+    CFIndex capacity = 4;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+
+    struct NSXPCDictionaryIndex *index = calloc(
+        1,
+        sizeof(*index) + capacity * sizeof(struct NSXPCDictionaryIndexEntry)
+    );
+    if (index == NULL) {
+        return NULL;
+    }
+    index->mask = capacity - 1;
+
+    _NSXPCSerializationIterateDictionaryObject(deserializer, object, ^Boolean(
+        const struct NSXPCObject *aKey,
+        const struct NSXPCObject *aValue
+    ) {
+        const unsigned char *units;
+        CFIndex unitCount;
+        Boolean wide;
+        if (!keyUnitsForObject(deserializer, aKey, &units, &unitCount, &wide)) {
+            // Generic (null) keys and the like are not indexed.
+            return true;
+        }
+
+        uint32_t hash = hashKeyUnits(units, unitCount, wide);
+        CFIndex slot = hash & index->mask;
+        while (index->entries[slot].keyOffset != 0) {
+            struct NSXPCDictionaryIndexEntry *entry = &index->entries[slot];
+            if (entry->hash == hash) {
+                const unsigned char *otherUnits;
+                CFIndex otherCount;
+                Boolean otherWide;
+                struct NSXPCObject otherKey = { .offset = entry->keyOffset };
+                keyUnitsForObject(deserializer, &otherKey, &otherUnits, &otherCount, &otherWide);
+                Boolean same = otherCount == unitCount;
+                for (CFIndex i = 0; same && i < unitCount; i++) {
+                    same = keyUnitAtIndex(otherUnits, i, otherWide) == keyUnitAtIndex(units, i, wide);
+                }
+                if (same) {
+                    // Like a linear search, the first occurrence wins.
+                    return true;
+                }
+            }
+            slot = (slot + 1) & index->mask;
+        }
+
+        index->entries[slot].keyOffset = aKey->offset;
+        index->entries[slot].valueOffset = aValue->offset;
+        index->entries[slot].hash = hash;
+        return true;
+    });
+
+    return index;
+}
+
+static Boolean findIndexedValue(
+    struct NSXPCDeserializer *deserializer,
+    const struct NSXPCObject *object,
+    const UniChar *characters,
+    CFIndex length,
+    struct NSXPCObject *value
+) {
+    if (deserializer->dictionaryIndexes == NULL) {
+        deserializer->dictionaryIndexes = CFDictionaryCreateMutable(
+            NULL,
+            0,
+            NULL,
+            NULL
         );
-        if (thisKey != NULL && CFEqual(thisKey, key)) {
-            *value = *aValue;
-            found = true;
-            // Found, stop iteration.
+    }
+
+    struct NSXPCDictionaryIndex *index = (struct NSXPCDictionaryIndex *) CFDictionaryGetValue(
+        deserializer->dictionaryIndexes,
+        (const void *) object->offset
+    );
+    if (index == NULL) {
+        index = buildDictionaryIndex(deserializer, object);
+        if (index == NULL) {
             return false;
+        }
+        CFDictionarySetValue(
+            deserializer->dictionaryIndexes,
+            (const void *) object->offset,
+            index
+        );
+    }
+
+    uint32_t hash = hashKeyUnits((const unsigned char *) characters, length, true);
+    CFIndex slot = hash & index->mask;
+    while (index->entries[slot].keyOffset != 0) {
+        struct NSXPCDictionaryIndexEntry *entry = &index->entries[slot];
+        if (entry->hash == hash) {
+            const unsigned char *units;
+            CFIndex count;
+            Boolean wide;
+            struct NSXPCObject key = { .offset = entry->keyOffset };
+            if (
+                keyUnitsForObject(deserializer, &key, &units, &count, &wide)
+                && keyUnitsEqual(units, count, wide, characters, length)
+            ) {
+                value->offset = entry->valueOffset;
+                return true;
+            }
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return false;
+}
+
+static void freeDictionaryIndex(const void *key, const void *value, void *context) {
+    free((void *) value);
+}
+
+void _NSXPCSerializationEndRead(
+    struct NSXPCDeserializer *deserializer
+) {
+    if (deserializer->dictionaryIndexes != NULL) {
+        CFDictionaryApplyFunction(
+            deserializer->dictionaryIndexes,
+            freeDictionaryIndex,
+            NULL
+        );
+        CFRelease(deserializer->dictionaryIndexes);
+    }
+    memset(deserializer, 0, sizeof(*deserializer));
+}
+
+Boolean _NSXPCSerializationCreateObjectInDictionaryForKey(
+    struct NSXPCDeserializer *deserializer,
+    const struct NSXPCObject *object,
+    CFStringRef key,
+    struct NSXPCObject *value
+) {
+    CFIndex length = CFStringGetLength(key);
+    const UniChar *characters = CFStringGetCharactersPtr(key);
+    UniChar stackCharacters[NSXPC_KEY_STACK_LENGTH];
+    UniChar *copiedCharacters = NULL;
+
+    if (characters == NULL) {
+        if (length <= NSXPC_KEY_STACK_LENGTH) {
+            copiedCharacters = stackCharacters;
         } else {
-            // Not found, continue iteration.
-            return true;
+            copiedCharacters = malloc(length * sizeof(UniChar));
+            if (copiedCharacters == NULL) {
+                return false;
+            }
         }
-    });
+        CFStringGetCharacters(key, CFRangeMake(0, length), copiedCharacters);
+        characters = copiedCharacters;
+    }
 
+    Boolean found = findIndexedValue(deserializer, object, characters, length, value);
+
+    if (copiedCharacters != NULL && copiedCharacters != stackCharacters) {
+        free(copiedCharacters);
+    }
     return found;
 }
 
@@ -888,27 +1252,25 @@ Boolean _NSXPCSerializationCreateObjectInDictionaryForASCIIKey(
     const char* key,
     struct NSXPCObject *value
 ) {
-    __block Boolean found = false;
+    CFIndex length = strlen(key);
+    UniChar stackCharacters[NSXPC_KEY_STACK_LENGTH];
+    UniChar *characters = stackCharacters;
 
-    _NSXPCSerializationIterateDictionaryObject(deserializer, object, ^Boolean(
-        const struct NSXPCObject *aKey,
-        const struct NSXPCObject *aValue
-    ) {
-        const char* thisKey = _NSXPCSerializationASCIIStringForObject(
-            deserializer,
-            aKey
-        );
-        if (thisKey != NULL && strcmp(thisKey, key) == 0) {
-            *value = *aValue;
-            found = true;
-            // Found, stop iteration.
+    if (length > NSXPC_KEY_STACK_LENGTH) {
+        characters = malloc(length * sizeof(UniChar));
+        if (characters == NULL) {
             return false;
-        } else {
-            // Not found, continue iteration.
-            return true;
         }
-    });
+    }
+    for (CFIndex i = 0; i < length; i++) {
+        characters[i] = (unsigned char) key[i];
+    }
 
+    Boolean found = findIndexedValue(deserializer, object, characters, length, value);
+
+    if (characters != stackCharacters) {
+        free(characters);
+    }
     return found;
 }
 
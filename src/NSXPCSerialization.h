@@ -2,6 +2,7 @@
 #include <CoreFoundation/CFString.h>
 #include <CoreFoundation/CFData.h>
 #include <CoreFoundation/CFNumber.h>
+#include <CoreFoundation/CFDictionary.h>
 
 #define NSXPC_SERIALIZER_MAX_CONTAINER_DEPTH 1024
 
@@ -18,6 +19,8 @@ struct NSXPCSerializer {
 struct NSXPCDeserializer {
     unsigned char *buffer;
     CFIndex bufferSize;
+    // Key indexes of the dictionaries probed so far, keyed by their offsets.
+    CFMutableDictionaryRef dictionaryIndexes;
 };
 
 struct NSXPCObject {
@@ -144,6 +147,13 @@ xpc_object_t _NSXPCSerializationCreateWriteData(
     struct NSXPCSerializer *serializer
 );
 
+// Apple do not have this one either. Releases the buffer of a serializer
+// whose data was never taken by _NSXPCSerializationCreateWriteData.
+CF_PRIVATE
+void _NSXPCSerializationDiscardWrite(
+    struct NSXPCSerializer *serializer
+);
+
 // Decoding.
 
 CF_PRIVATE
@@ -153,6 +163,12 @@ Boolean _NSXPCSerializationStartRead(
     struct NSXPCObject *rootObject
 );
 
+// Apple do not have this one either. Frees the key indexes built while reading.
+CF_PRIVATE
+void _NSXPCSerializationEndRead(
+    struct NSXPCDeserializer *deserializer
+);
+
 // Apple do not have this one:
 CF_PRIVATE
 CFIndex _NSXPCSerializationEndOffsetForObject(
@@ -96,6 +96,33 @@ static void serve(id<Service> proxyService) {
 	[[NSRunLoop currentRunLoop] run];
 };
 
+static void benchmark(id<Service> proxyService) {
+	static const NSUInteger messageCount = 10000;
+	NSMutableDictionary<NSString*, id>* details = [NSMutableDictionary dictionary];
+	dispatch_group_t group = dispatch_group_create();
+
+	// large enough that every message outgrows the encoder's stack space
+	for (NSUInteger i = 0; i < 64; ++i) {
+		details[[NSString stringWithFormat: @"key %lu", (unsigned long)i]] = [NSString stringWithFormat: @"some moderately long value for key number %lu", (unsigned long)i];
+	}
+
+	NSDate* start = [NSDate date];
+
+	for (NSUInteger i = 0; i < messageCount; ++i) {
+		dispatch_group_enter(group);
+		[proxyService findAllWithDetails: details callback: ^(NSArray<id>* results) {
+			dispatch_group_leave(group);
+		}];
+	}
+
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+	NSTimeInterval elapsed = -[start timeIntervalSinceNow];
+	NSLog(@"Sent %lu messages with replies in %.3f seconds (%.0f messages per second)", (unsigned long)messageCount, elapsed, messageCount / elapsed);
+
+	dispatch_release(group);
+};
+
 int main(int argc, char** argv) {
 	dispatch_semaphore_t waiter = dispatch_semaphore_create(0);
 	dispatch_semaphore_t waiter2 = dispatch_semaphore_create(0);
@@ -143,6 +170,10 @@ int main(int argc, char** argv) {
 		// 's' for "serve"
 		serve(service);
 		return 0;
+	} else if (argc > 1 && tolower(argv[1][0]) == 'b') {
+		// 'b' for "benchmark"
+		benchmark(service);
+		return 0;
 	}
 
 	[service sayHello];